@@ -22,8 +22,57 @@
 #define B2FS_MED_GENERIC_BUFFER 1024
 #define B2FS_LARGE_GENERIC_BUFFER 4096
 #define B2FS_CHUNK_SIZE (1024 * 1024 * 4)
-
-#define FUSE_USE_VERSION 30
+#define B2FS_BLOCK_SIZE (1024 * 4)
+#define B2FS_CHUNK_BLOCKS (B2FS_CHUNK_SIZE / B2FS_BLOCK_SIZE)
+#define B2FS_UPLOAD_THREADS 4
+#define B2FS_MAX_UPLOAD_THREADS 64
+#define B2FS_UPLOAD_RETRIES 5
+#define B2FS_MUTATION_THREADS 4
+#define B2FS_MUTATION_RETRIES 5
+#define B2FS_LIST_SHARDS_PER_THREAD 4
+#define B2FS_LIST_SAMPLES 64
+#define B2FS_LIST_BACKLOG 2000
+#define B2FS_DENTRY_SLOTS 4096
+#define B2FS_NEGATIVE_TIMEOUT 1
+#define B2FS_PACK_SIZE (1024 * 1024 * 64)
+#define B2FS_MIN_PART_SIZE (1024 * 1024 * 5)
+#define B2FS_MAX_PART_SIZE (1024L * 1024 * 1024 * 5)
+#define B2FS_MAX_PARTS 10000
+#define B2FS_INGEST_PART_SIZE (1024 * 1024 * 100)
+#define B2FS_EXPORT_RANGE_SIZE (1024 * 1024 * 16)
+#define B2FS_PACK_WINDOW 5
+#define B2FS_JOURNAL_CHECKPOINT (1024 * 1024 * 64)
+#define B2FS_JOURNAL_MAGIC 0x4a463242
+#define B2FS_SNAPSHOT_MAGIC 0x53463242
+#define B2FS_SNAPSHOT_VERSION 1
+#define B2FS_SNAPSHOT_INTERVAL 300
+#define B2FS_RECONCILE_SLACK 60
+
+// Flags for the versions in a metadata snapshot.
+#define B2FS_SNAPSHOT_HIDDEN 0x01
+#define B2FS_SNAPSHOT_SYNCED 0x02
+#define B2FS_SNAPSHOT_PACKED 0x04
+#define B2FS_SNAPSHOT_MANIFEST 0x08
+
+// Virtual, read-only file at the root of the mount that reports runtime statistics.
+#define B2FS_STATS_PATH "/.b2fs_stats"
+
+// Directory in the bucket that pack and pack index objects are written under.
+#define B2FS_PACK_DIR ".b2fs_packs"
+
+// Directory in the bucket that deduplicated chunks, named by their SHA-1, and the manifests
+// describing each deduplicated file version are written under.
+#define B2FS_DEDUP_DIR ".b2fs_dedup"
+
+// Content-defined chunk sizes. Cut points are looked for with a stricter mask before
+// B2FS_DEDUP_AVG and a looser one after it, which keeps chunk sizes close to the average.
+#define B2FS_DEDUP_MIN (1024 * 256)
+#define B2FS_DEDUP_AVG (1024 * 1024)
+#define B2FS_DEDUP_MAX B2FS_CHUNK_SIZE
+#define B2FS_DEDUP_MASK_S (~0ULL << 42)
+#define B2FS_DEDUP_MASK_L (~0ULL << 46)
+
+#define FUSE_USE_VERSION 31
 
 #define ROOT_UID 0
 #define ROOT_GID 0
@@ -34,18 +83,26 @@
 #include <curl/curl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <dirent.h>
 
 /*----- Local Includes -----*/
 
 #include "b64/cencode.h"
 #include "jsmn/jsmn.h"
+#include "listing/listing.h"
+#include "sha1/sha1.h"
+#include "xxhash/xxhash.h"
 #include "structures/hash.h"
 #include "structures/array.h"
 #include "structures/bitmap.h"
@@ -84,6 +141,11 @@
 
 #endif
 
+// copy_file_range only made it into the high level API in FUSE 3.4.
+#if FUSE_VERSION < FUSE_MAKE_VERSION(3, 4)
+#error "b2fs needs FUSE 3.4 or later."
+#endif
+
 #define LOG_KEY(data, key, context)                                                                       \
   do {                                                                                                    \
     write_log(LEVEL_DEBUG, "B2FS: Encountered unexpected key in %s: %.*s\n",                              \
@@ -108,8 +170,9 @@
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_func);                                              \
   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &write_var);
 
-// Be careful using this macro as it will cause the larger argument to be evaluated twice.
+// Be careful using these macros as they will cause the chosen argument to be evaluated twice.
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 /*----- Type Declarations -----*/
 
@@ -131,6 +194,28 @@ typedef enum b2fs_entry_type {
   TYPE_FILE
 } b2fs_entry_type_t;
 
+// Remote durability means fsync waits for B2. Local durability means fsync only waits for the
+// journal to hit the local disk, and B2 catches up in the background.
+typedef enum b2fs_durability {
+  DURABILITY_INVAL,
+  DURABILITY_REMOTE,
+  DURABILITY_LOCAL
+} b2fs_durability_t;
+
+typedef enum b2fs_journal_type {
+  JOURNAL_CREATE = 1,
+  JOURNAL_WRITE,
+  JOURNAL_TRUNCATE,
+  JOURNAL_UNLINK,
+  JOURNAL_UPLOADED,
+  JOURNAL_DELETE
+} b2fs_journal_type_t;
+
+typedef enum b2fs_mutation_type {
+  MUTATION_DELETE,
+  MUTATION_HIDE
+} b2fs_mutation_type_t;
+
 typedef struct b2fs_string {
   char *str;
   unsigned int len, ptr;
@@ -141,20 +226,73 @@ typedef struct b2fs_config {
   char app_key[B2FS_APP_KEY_LEN];
   char bucket_id[B2FS_SMALL_GENERIC_BUFFER];
   char mount_point[B2FS_SMALL_GENERIC_BUFFER];
+  char journal_path[B2FS_SMALL_GENERIC_BUFFER];
+  char snapshot_path[B2FS_SMALL_GENERIC_BUFFER];
   b2fs_delete_policy_t policy;
+  b2fs_durability_t durability;
+  int upload_threads, pack_window, dedup, lazy, negative_timeout;
+  size_t pack_threshold;
 } b2fs_config_t;
 
+// One content-defined chunk of a deduplicated file, stored in B2 as its own object.
+typedef struct b2fs_manifest_chunk {
+  size_t offset, length;
+  char sha1[SHA1_HEX_LEN], *file_id;
+} b2fs_manifest_chunk_t;
+
+// The chunks a deduplicated file version is made of, in order. Shared by every copy of the
+// version that points at it.
+typedef struct b2fs_manifest {
+  b2fs_manifest_chunk_t *chunks;
+  int count, refs;
+} b2fs_manifest_t;
+
+// Packed versions live at pack_offset inside a shared pack object, and version_id is the
+// id of the pack rather than of the file. Deduplicated versions are read through manifest,
+// and version_id is the id of the manifest object.
 typedef struct b2fs_file_version {
   char version_id[B2FS_SMALL_GENERIC_BUFFER];
-  size_t size;
+  char content_sha1[SHA1_HEX_LEN];
+  size_t size, pack_offset;
+  int packed;
+  b2fs_manifest_t *manifest;
   int *should_delete, *hidden, *live, *synced;
 } b2fs_file_version_t;
 
+// The fingerprint is an XXH64 of the chunk as B2 last had it, and is only valid if
+// fingerprinted is set. Dirty chunks are checked against it before uploading.
+// Chunks that were written before their old contents were fetched only hold the blocks set
+// in resident. missing counts the blocks that still have to come from B2, and resident is
+// NULL for chunks that were complete from the start.
 typedef struct b2fs_file_chunk {
-  int chunk_num, size;
+  int chunk_num, size, dirty, fingerprinted, missing;
+  unsigned long long fingerprint;
+  bitmap_t *resident;
   char data[B2FS_CHUNK_SIZE];
 } b2fs_file_chunk_t;
 
+// Mutable state shared by every copy of a file entry. Hash entries are copied in and out
+// of the filesystem cache by value, so anything that has to be visible across copies
+// (sizes, dirty flags, open handle counts) lives behind this pointer.
+// refs counts the copies that have to outlive a lookup: the one in the filesystem cache,
+// every open handle, and every queued upload and pack member. The entry's chunks, versions
+// and buffer are only freed once the last of them lets go.
+// remote_size and remote_sha1 describe the head version in B2, and are only valid if
+// remote_known is set. The first head_limit bytes of the file that aren't dirty still match
+// the head version, and trimmed is the smallest size the file has been truncated to since
+// its last upload started.
+typedef struct b2fs_file_buffer {
+  size_t size, remote_size, head_limit, trimmed;
+  char remote_sha1[SHA1_HEX_LEN];
+  int loaded, dirty, pending, packing, error, readers, writers, remote_known, refs;
+
+  // Running digest of the file's first digest.length bytes, kept up to date as sequential
+  // writes land so uploads only have to hash whatever was written out of order.
+  sha1_state_t digest;
+  pthread_mutex_t lock;
+  pthread_cond_t flushed;
+} b2fs_file_buffer_t;
+
 // FIXME: File versions currently uses a keytree where a stack or queue would most
 // likely be more appropriate because I'm not sure I trust B2 to return file versions
 // in proper reverse-upload order. Or, rather, I don't want my code to crash if they
@@ -162,12 +300,20 @@ typedef struct b2fs_file_chunk {
 typedef struct b2fs_file_entry {
   bitmap_t *chunkmap;
   keytree_t *chunks, *versions;
-  int readers, writers;
+  b2fs_file_buffer_t *buffer;
 } b2fs_file_entry_t;
 
+// Whether a directory's contents have been listed from B2 yet. Only lazy mounts have
+// directories that haven't, and the lock keeps two lookups from listing one at the same time.
+typedef struct b2fs_dir_listing {
+  int listed;
+  pthread_mutex_t lock;
+} b2fs_dir_listing_t;
+
 typedef struct b2fs_dir_entry {
   hash_t *directory;
   int *hidden;
+  b2fs_dir_listing_t *listing;
 } b2fs_dir_entry_t;
 
 typedef struct b2fs_hash_entry {
@@ -183,35 +329,336 @@ typedef struct b2fs_version_sync_state {
   int pos;
 } b2fs_version_sync_state_t;
 
+typedef struct b2fs_upload_url {
+  char url[B2FS_SMALL_GENERIC_BUFFER], token[B2FS_TOKEN_LEN];
+} b2fs_upload_url_t;
+
+// What B2 reports about a file version it just created.
+typedef struct b2fs_file_info {
+  char file_id[B2FS_SMALL_GENERIC_BUFFER], sha1[SHA1_HEX_LEN];
+  size_t size, timestamp;
+} b2fs_file_info_t;
+
+// journal_seq is the last journal record that had made it into the buffers when the upload
+// took its snapshot.
+typedef struct b2fs_upload_job {
+  char *path;
+  b2fs_file_entry_t entry;
+  size_t journal_seq;
+} b2fs_upload_job_t;
+
+// Read position used by cURL while streaming an upload to B2. Uploads come either from a
+// file's chunks, starting at start, or, if entry is NULL, straight out of data.
+typedef struct b2fs_upload_stream {
+  b2fs_file_entry_t *entry;
+  char *data;
+  size_t start, offset, size;
+} b2fs_upload_stream_t;
+
+// A byte range of a file being uploaded as a large file. Copied parts are unchanged from the
+// head version, and B2 copies them across without us sending anything. A copied part can
+// instead name its own source object, and a sent part can carry its bytes in data rather
+// than coming out of the file's chunks.
+typedef struct b2fs_file_part {
+  size_t start, end;
+  int copy;
+  char *source, *data;
+} b2fs_file_part_t;
+
+// Background upload queue. Released files are enqueued here and uploaded by a fixed
+// pool of workers so that close() doesn't have to wait on B2.
+typedef struct b2fs_upload_queue {
+  queue_t *jobs;
+  pthread_t *workers;
+  int num_workers, queued, in_flight, shutdown;
+  pthread_mutex_t lock;
+  pthread_cond_t ready, drained;
+} b2fs_upload_queue_t;
+
+// A change to B2's metadata waiting to be made. Deletes remove the version file_id, and hides
+// hide whatever is newest at path, which was file_id when the file was unlinked. journal_seq
+// is the journal record that keeps the change alive across a restart, or 0 if there isn't one.
+typedef struct b2fs_mutation_job {
+  b2fs_mutation_type_t type;
+  char *path, *file_id;
+  size_t journal_seq;
+} b2fs_mutation_job_t;
+
+// Background queue for deletes and hides. Unlinking a file only has to update the cache and
+// enqueue its mutations, and a small pool of workers gets B2 to agree, so unlinking returns
+// right away however many versions the file has. hiding counts the hides still pending for
+// each path, since anything new written to the path has to land after them.
+typedef struct b2fs_mutation_queue {
+  queue_t *jobs;
+  hash_t *hiding;
+  pthread_t *workers;
+  int num_workers, queued, in_flight, shutdown;
+  pthread_mutex_t lock;
+  pthread_cond_t ready, drained, landed;
+} b2fs_mutation_queue_t;
+
+// A file waiting to go out in the next pack. Tombstones record that a packed file was
+// deleted, and superseded members were rewritten before the pack went out.
+typedef struct b2fs_pack_member {
+  char *path, sha1[SHA1_HEX_LEN];
+  b2fs_file_entry_t entry;
+  stack_t *dirty;
+  size_t offset, length, journal_seq;
+  int tombstone, superseded;
+} b2fs_pack_member_t;
+
+// Small files are batched up here and written to B2 as a single pack object, plus an index
+// object mapping each path to its range of the pack. The pack goes out once it fills up, or
+// once its oldest member has waited pack_window seconds.
+typedef struct b2fs_pack {
+  array_t *members;
+  hash_t *paths;
+  char *data;
+  size_t used, capacity, opened;
+  b2fs_upload_url_t upload_url;
+  pthread_t flusher;
+  int running, shutdown;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} b2fs_pack_t;
+
+// Every record in the journal is this header, followed by path_len bytes of path and data_len
+// bytes of data. The checksum covers all three, with the checksum itself zeroed.
+typedef struct b2fs_journal_header {
+  uint32_t magic, type, path_len, data_len;
+  uint64_t seq, offset, checksum;
+} b2fs_journal_header_t;
+
+// Records for a path are needed until an upload covers them. latest is the newest record for
+// the path, and uploaded is the newest one B2 has. bytes is how much of the journal the
+// path's records take up, counting records an upload has covered until the next checkpoint.
+typedef struct b2fs_journal_pending {
+  size_t latest, uploaded, bytes;
+} b2fs_journal_pending_t;
+
+// Append-only local log of everything acknowledged that isn't in B2 yet, so that a crash
+// doesn't lose it. live is the sum of bytes over the pending paths, which is about what a
+// checkpoint would have to keep, and once a checkpoint would reclaim more than
+// B2FS_JOURNAL_CHECKPOINT bytes, the journal is rewritten down to the records that are still
+// pending. fd is -1 if journaling is off.
+typedef struct b2fs_journal {
+  int fd;
+  size_t seq, length, live;
+  hash_t *pending;
+  pthread_mutex_t lock;
+} b2fs_journal_t;
+
+// Every chunk known to be in the bucket, by SHA-1, mapped to the id of its object.
+// gear holds the random values the rolling hash that finds cut points is built from.
+typedef struct b2fs_dedup {
+  hash_t *chunks;
+  uint64_t gear[256];
+  pthread_mutex_t lock;
+} b2fs_dedup_t;
+
+// A metadata snapshot is this header followed by length bytes of records, which the checksum
+// covers. Snapshots only load into a mount of the bucket they were taken from.
+typedef struct b2fs_snapshot_header {
+  uint32_t magic, version;
+  uint64_t length, checksum;
+  char bucket[B2FS_SMALL_GENERIC_BUFFER];
+} b2fs_snapshot_header_t;
+
+// Every record is one of these, followed by path_len bytes of path. Directory records only
+// carry the hidden flag, and file records are followed by their versions.
+typedef struct b2fs_snapshot_entry {
+  uint32_t type, path_len, hidden, versions;
+} b2fs_snapshot_entry_t;
+
+// A version is followed by id_len bytes of id, and then by its chunks if it was deduplicated.
+typedef struct b2fs_snapshot_version {
+  uint64_t timestamp, size, pack_offset;
+  uint32_t flags, id_len, chunks;
+  char sha1[SHA1_HEX_LEN];
+} b2fs_snapshot_version_t;
+
+// A chunk is followed by id_len bytes of id. Offsets follow from the lengths before it.
+typedef struct b2fs_snapshot_chunk {
+  uint64_t length;
+  uint32_t id_len;
+  char sha1[SHA1_HEX_LEN];
+} b2fs_snapshot_chunk_t;
+
+// Periodic writer for the metadata snapshot. If the mount started from a snapshot, the
+// writer first reconciles the cache with the bucket.
+typedef struct b2fs_snapshot {
+  pthread_t writer;
+  int running, shutdown, reconcile;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} b2fs_snapshot_t;
+
+// One remembered lookup, from a full path to the entry it resolved to, or to nothing at all if
+// negative is set. seq is odd while the slot is being written, so a reader that sees it change
+// knows its copy might be torn.
+typedef struct b2fs_dentry {
+  volatile unsigned int seq;
+  size_t generation;
+  unsigned long long hash;
+  size_t len;
+  int negative;
+  b2fs_hash_entry_t entry;
+  char path[B2FS_SMALL_GENERIC_BUFFER];
+} b2fs_dentry_t;
+
+// Direct mapped cache of recent lookups, indexed by the XXH64 of the path. Anything that takes
+// an entry out of the filesystem cache, or hides or unhides a directory, bumps generation, which
+// invalidates every slot at once. Adding an entry only drops the misses for its own path, and
+// bumps created so that a miss racing with it doesn't get remembered. Lazy listings that fail
+// bump unlisted, as a miss found without them isn't a real answer.
+typedef struct b2fs_dentry_cache {
+  b2fs_dentry_t *slots;
+  volatile size_t generation, created, unlisted;
+} b2fs_dentry_cache_t;
+
+typedef struct b2fs_stats {
+  unsigned long uploads_completed, uploads_failed, uploads_skipped, bytes_uploaded;
+  unsigned long bytes_copied, packs_uploaded, files_packed, journal_checkpoints;
+  unsigned long dedup_chunks_uploaded, dedup_chunks_reused, bytes_deduped, files_renamed;
+  unsigned long deletes_completed, deletes_failed, hides_completed, hides_failed, mutations_retried;
+  unsigned long snapshots_written, versions_reconciled, versions_pruned, dirs_listed;
+  unsigned long dentry_hits, dentry_misses, negative_hits;
+} b2fs_stats_t;
+
 typedef struct b2fs_state {
   char token[B2FS_TOKEN_LEN], api_url[B2FS_TOKEN_LEN];
   char down_url[B2FS_TOKEN_LEN];
   b2fs_config_t config;
   hash_t *fs_cache, *id_mappings;
+  b2fs_upload_queue_t uploads;
+  b2fs_mutation_queue_t mutations;
+  b2fs_pack_t pack;
+  b2fs_journal_t journal;
+  b2fs_dedup_t dedup;
+  b2fs_snapshot_t snapshot;
+  b2fs_dir_listing_t root_listing;
+  b2fs_dentry_cache_t dentries;
+  b2fs_stats_t stats;
   pthread_rwlock_t lock;
 } b2fs_state_t;
 
+// A local file being ingested. Files bigger than a part go up as large files, with their parts
+// handed out to workers separately. The file is mapped by whichever worker gets to it first
+// and unmapped once its last part is in.
+typedef struct b2fs_ingest_file {
+  char *local, *remote, *map;
+  char large_id[B2FS_SMALL_GENERIC_BUFFER];
+  char (*sha1s)[SHA1_HEX_LEN];
+  size_t size, part_size;
+  int parts, remaining, opened, failed;
+  pthread_mutex_t lock;
+} b2fs_ingest_file_t;
+
+// One unit of ingest work: a whole file, or a single part of a large one.
+typedef struct b2fs_ingest_task {
+  b2fs_ingest_file_t *file;
+  int part;
+} b2fs_ingest_task_t;
+
+typedef struct b2fs_ingest {
+  b2fs_state_t *state;
+  array_t *files, *tasks;
+  int next, failed, ingested;
+  pthread_mutex_t lock;
+} b2fs_ingest_t;
+
+// A file being exported. Its ranges are fetched by whichever workers claim them, and the
+// local file is opened by the first and closed by the last.
+typedef struct b2fs_export_file {
+  char *local;
+  b2fs_file_version_t version;
+  size_t timestamp;
+  int fd, ranges, remaining, failed;
+  pthread_mutex_t lock;
+} b2fs_export_file_t;
+
+typedef struct b2fs_export_task {
+  b2fs_export_file_t *file;
+  int range;
+} b2fs_export_task_t;
+
+typedef struct b2fs_export {
+  b2fs_state_t *state;
+  array_t *files, *tasks;
+  int next, failed, exported, skipped;
+  size_t bytes;
+  pthread_mutex_t lock;
+} b2fs_export_t;
+
+// One slice of the bucket's namespace, holding every file name from start up to, but not
+// including, end. An empty end runs to the end of the bucket.
+typedef struct b2fs_list_shard {
+  char start[B2FS_SMALL_GENERIC_BUFFER], end[B2FS_SMALL_GENERIC_BUFFER];
+} b2fs_list_shard_t;
+
+// Streaming parser state for b2_list_file_versions responses. Each object in the files array
+// is cut out into record as it arrives, and handled before the next one starts, so a page never
+// has to be held in memory all at once. Everything outside the files array goes into outer,
+// which is also where an error body ends up. done is set once the listing has run past what the
+// caller asked for. When pipelined, records are copied onto records for the builder thread
+// instead, and everything below lock is shared with it.
+typedef struct b2fs_list_stream {
+  b2fs_state_t *state;
+  hash_t *fs_cache;
+  const char *target_path;
+  keytree_t *synced;
+  b2fs_list_shard_t *shard;
+  b2fs_string_t record;
+  char outer[B2FS_LARGE_GENERIC_BUFFER];
+  size_t outer_len;
+  int depth, in_string, escaped, pipelined;
+  pthread_t builder;
+  pthread_mutex_t lock;
+  pthread_cond_t ready, drained;
+  queue_t *records;
+  int queued, finished, done, error;
+} b2fs_list_stream_t;
+
+// Shards of a bucket listing. Workers claim the next shard until none are left, and the
+// first failure is kept.
+typedef struct b2fs_list_batch {
+  b2fs_state_t *state;
+  hash_t *fs_cache;
+  b2fs_list_shard_t *shards;
+  int count, next, error;
+  pthread_mutex_t lock;
+} b2fs_list_batch_t;
+
+// Files being moved by a directory rename. Workers claim the next pair until none are left,
+// and the first failure is kept.
+typedef struct b2fs_rename_batch {
+  b2fs_state_t *state;
+  char **from, **to;
+  int count, next, error;
+  pthread_mutex_t lock;
+} b2fs_rename_batch_t;
+
 /*----- Local Function Declarations -----*/
 
 // Filesystem Functions.
-void *b2fs_init(struct fuse_conn_info *info);
+void *b2fs_init(struct fuse_conn_info *info, struct fuse_config *config);
 void b2fs_destroy(void *userdata);
-int b2fs_getattr(const char *path, struct stat *statbuf);
+int b2fs_getattr(const char *path, struct stat *statbuf, struct fuse_file_info *info);
 int b2fs_readlink(const char *path, char *buf, size_t size);
 int b2fs_opendir(const char *path, struct fuse_file_info *info);
-int b2fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info);
+int b2fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info, enum fuse_readdir_flags flags);
 int b2fs_releasedir(const char *path, struct fuse_file_info *info);
 int b2fs_mknod(const char *path, mode_t mode, dev_t rdev);
 int b2fs_mkdir(const char *path, mode_t mode);
 int b2fs_symlink(const char *from, const char *to);
 int b2fs_unlink(const char *path);
 int b2fs_rmdir(const char *path);
-int b2fs_rename(const char *from, const char *to);
+int b2fs_rename(const char *from, const char *to, unsigned int flags);
 int b2fs_link(const char *from, const char *to);
-int b2fs_chmod(const char *path, mode_t mode);
-int b2fs_chown(const char *path, uid_t uid, gid_t gid);
-int b2fs_truncate(const char *path, off_t size);
-int b2fs_utime(const char *path, struct utimbuf *buf);
+int b2fs_chmod(const char *path, mode_t mode, struct fuse_file_info *info);
+int b2fs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *info);
+int b2fs_truncate(const char *path, off_t size, struct fuse_file_info *info);
+int b2fs_utimens(const char *path, const struct timespec times[2], struct fuse_file_info *info);
 int b2fs_open(const char *path, struct fuse_file_info *info);
 int b2fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *info);
 int b2fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *info);
@@ -220,36 +667,219 @@ int b2fs_release(const char *path, struct fuse_file_info *info);
 int b2fs_fsync(const char *path, int crap, struct fuse_file_info *info);
 int b2fs_flush(const char *path, struct fuse_file_info *info);
 int b2fs_access(const char *path, int mode);
+ssize_t b2fs_copy_file_range(const char *path_in, struct fuse_file_info *info_in, off_t offset_in,
+    const char *path_out, struct fuse_file_info *info_out, off_t offset_out, size_t size, int flags);
 
 // Network Functions.
-int b2_list_versions(hash_t *fs_cache, const char *target_path, keytree_t *synced);
+int b2_list_versions(b2fs_state_t *state, hash_t *fs_cache, const char *target_path, keytree_t *synced, b2fs_list_shard_t *shard);
+size_t receive_listing(void *data, size_t size, size_t nmembers, void *voidarg);
+int hand_off_record(b2fs_list_stream_t *stream);
+int stop_listing(b2fs_list_stream_t *stream, int error);
+int list_stopped(b2fs_list_stream_t *stream);
+int start_list_builder(b2fs_list_stream_t *stream);
+void stop_list_builder(b2fs_list_stream_t *stream);
+void *list_builder(void *voidarg);
+int list_record(b2fs_list_stream_t *stream, char *json, size_t length);
+int b2_list_names(b2fs_state_t *state, const char *prefix, array_t *names, array_t *folders);
+int b2_list_folder(b2fs_state_t *state, const char *prefix, b2fs_dir_entry_t *dir);
+void add_listed_version(b2fs_state_t *state, b2fs_dir_entry_t *dir, const char *name, const char *leaf, b2fs_file_version_t *version, size_t timestamp);
 size_t receive_string(void *data, size_t size, size_t nmembers, void *voidarg);
-int b2_sync_versions(b2fs_file_entry_t *entry, const char *path, int force);
+size_t receive_range(void *data, size_t size, size_t nmembers, void *voidarg);
+size_t send_file_entry(char *data, size_t size, size_t nmembers, void *voidarg);
+size_t send_buffer(char *data, size_t size, size_t nmembers, void *voidarg);
+int b2_download_range(b2fs_state_t *state, char *file_id, size_t offset, size_t len, char *buf);
+int b2_get_upload_url(b2fs_state_t *state, b2fs_upload_url_t *upload_url);
+int b2_upload_file(b2fs_state_t *state, b2fs_upload_url_t *upload_url, const char *path, b2fs_upload_stream_t *stream, char *sha1, b2fs_file_info_t *info);
+int parse_file_info(const char *json, b2fs_file_info_t *info);
+int b2_upload_part(b2fs_state_t *state, b2fs_upload_url_t *upload_url, int part_num, b2fs_upload_stream_t *stream, char *sha1);
+int perform_upload(b2fs_upload_url_t *upload_url, struct curl_slist *headers, b2fs_upload_stream_t *stream, char *sha1, const char *what, b2fs_string_t *response);
+int b2_post_json(b2fs_state_t *state, const char *endpoint, const char *body, b2fs_string_t *response);
+int b2_start_large_file(b2fs_state_t *state, const char *path, char *file_id);
+int b2_get_upload_part_url(b2fs_state_t *state, char *file_id, b2fs_upload_url_t *upload_url);
+int b2_copy_part(b2fs_state_t *state, char *source_id, char *large_id, int part_num, size_t start, size_t end, char *sha1);
+int b2_copy_file(b2fs_state_t *state, char *source_id, const char *path, size_t start, size_t end, b2fs_file_info_t *info);
+int b2_finish_large_file(b2fs_state_t *state, char *file_id, char (*sha1s)[SHA1_HEX_LEN], int count, b2fs_file_info_t *info);
+void b2_cancel_large_file(b2fs_state_t *state, char *file_id);
+int b2_delete_file_version(b2fs_state_t *state, const char *name, const char *file_id);
+int b2_hide_file(b2fs_state_t *state, const char *name, b2fs_file_info_t *info);
+int b2_sync_versions(b2fs_state_t *state, b2fs_file_entry_t *entry, const char *path, int force);
 int handle_b2_error(b2fs_state_t *state, char *response, char *cached_token);
 int handle_authentication(b2fs_state_t *state, char *account_id, char *app_key);
 
+// Listing Functions.
+int list_bucket(b2fs_state_t *state, hash_t *fs_cache);
+int sample_shards(b2fs_state_t *state, int target, b2fs_list_shard_t **shards);
+void *list_worker(void *voidarg);
+int list_bookkeeping(b2fs_state_t *state);
+void list_directory(b2fs_state_t *state, b2fs_dir_entry_t *dir, const char *prefix);
+void list_root(b2fs_state_t *state);
+
+// Upload Queue Functions.
+int start_upload_queue(b2fs_state_t *state);
+void stop_upload_queue(b2fs_state_t *state);
+void enqueue_upload(b2fs_state_t *state, const char *path, b2fs_file_entry_t *entry);
+int wait_for_upload(b2fs_file_entry_t *entry);
+void *upload_worker(void *voidarg);
+int upload_file_entry(b2fs_state_t *state, b2fs_upload_url_t *upload_url, b2fs_upload_job_t *job);
+int upload_stream(b2fs_state_t *state, b2fs_upload_url_t *upload_url, const char *path, b2fs_upload_stream_t *stream, char *sha1, b2fs_file_info_t *info);
+void record_upload(b2fs_state_t *state, const char *path, b2fs_file_entry_t *entry, size_t size, b2fs_file_info_t *info);
+void record_version(b2fs_file_entry_t *entry, b2fs_file_version_t *version, size_t timestamp);
+void map_file_id(b2fs_state_t *state, const char *file_id, const char *path);
+stack_t *snapshot_dirty_chunks(b2fs_file_entry_t *entry);
+void restore_dirty_chunks(b2fs_file_entry_t *entry, stack_t *dirty);
+int unchanged_since_sync(b2fs_file_entry_t *entry, size_t size, stack_t *dirty);
+void mark_chunks_synced(b2fs_file_entry_t *entry, stack_t *dirty);
+void hash_file_entry(b2fs_file_entry_t *entry, size_t size, char *hex);
+void hash_file_range(b2fs_file_entry_t *entry, size_t start, size_t end, char *hex);
+void feed_file_range(b2fs_file_entry_t *entry, sha1_state_t *sha, size_t start, size_t end);
+array_t *plan_parts(b2fs_file_entry_t *entry, size_t size, stack_t *dirty);
+int upload_parts(b2fs_state_t *state, const char *path, b2fs_file_entry_t *entry, array_t *parts, b2fs_file_info_t *info);
+
+// Mutation Queue Functions.
+int start_mutation_queue(b2fs_state_t *state);
+void stop_mutation_queue(b2fs_state_t *state);
+void enqueue_delete(b2fs_state_t *state, const char *path, const char *file_id, size_t seq);
+void enqueue_hide(b2fs_state_t *state, const char *path, const char *file_id, size_t seq);
+void enqueue_mutation(b2fs_state_t *state, b2fs_mutation_type_t type, const char *path, const char *file_id, size_t seq);
+void wait_for_hide(b2fs_state_t *state, const char *path);
+void *mutation_worker(void *voidarg);
+int perform_mutation(b2fs_state_t *state, b2fs_mutation_job_t *job);
+void record_hide(b2fs_state_t *state, b2fs_mutation_job_t *job, b2fs_file_info_t *info);
+
+// Pack Functions.
+int start_pack_flusher(b2fs_state_t *state);
+void stop_pack_flusher(b2fs_state_t *state);
+void *pack_flusher(void *voidarg);
+int packable(b2fs_state_t *state, const char *path, size_t size);
+void add_to_pack(b2fs_state_t *state, b2fs_upload_job_t *job, size_t size, char *sha1, stack_t *dirty);
+int add_tombstone(b2fs_state_t *state, const char *path);
+void withdraw_from_pack(b2fs_state_t *state, const char *path, stack_t *dirty);
+int flush_pack(b2fs_state_t *state);
+int flush_pack_locked(b2fs_state_t *state);
+b2fs_pack_member_t *claim_pack_slot(b2fs_pack_t *pack, const char *path);
+int wait_for_durable(b2fs_state_t *state, b2fs_file_entry_t *entry);
+int expand_packs(b2fs_state_t *state);
+void apply_pack_index(b2fs_state_t *state, char *index, size_t timestamp);
+
+// Dedup Functions.
+int start_dedup(b2fs_state_t *state, int manifests);
+void stop_dedup(b2fs_state_t *state);
+void apply_manifest(b2fs_state_t *state, char *text, const char *manifest_id, size_t timestamp);
+void unescape_manifest_path(char *path);
+int upload_deduped(b2fs_state_t *state, b2fs_upload_url_t *upload_url, const char *path, b2fs_file_entry_t *entry, size_t size, char *sha1);
+int write_manifest(b2fs_state_t *state, b2fs_upload_url_t *upload_url, const char *path, b2fs_manifest_t *manifest, size_t size, char *sha1, b2fs_file_info_t *info, size_t *written);
+size_t find_cut_point(const uint64_t *gear, const unsigned char *data, size_t len);
+void read_file_range(b2fs_file_entry_t *entry, char *buf, size_t start, size_t len);
+int download_version_range(b2fs_state_t *state, b2fs_file_version_t *version, size_t offset, size_t len, char *buf);
+b2fs_manifest_t *retain_manifest(b2fs_manifest_t *manifest);
+void release_manifest(b2fs_manifest_t *manifest);
+
+// Journal Functions.
+int open_journal(b2fs_state_t *state);
+void close_journal(b2fs_state_t *state);
+int replay_journal(b2fs_state_t *state);
+void apply_journal_record(b2fs_state_t *state, b2fs_journal_header_t *header, char *path, char *data);
+int journal_append(b2fs_state_t *state, b2fs_journal_type_t type, const char *path, size_t offset, const char *data, size_t len, size_t *seq);
+int journal_append_locked(b2fs_state_t *state, b2fs_journal_type_t type, const char *path, size_t offset, const char *data, size_t len, size_t *seq);
+void journal_note(b2fs_state_t *state, const char *path, size_t seq, size_t bytes);
+void journal_uploaded(b2fs_state_t *state, const char *path, size_t seq);
+size_t journal_position(b2fs_state_t *state);
+int journal_commit(b2fs_state_t *state);
+int checkpoint_journal(b2fs_state_t *state);
+int write_journal_record(int fd, b2fs_journal_header_t *header, const char *path, const char *data);
+int read_journal_record(FILE *in, b2fs_journal_header_t *header, char **path, char **data);
+uint64_t journal_checksum(b2fs_journal_header_t *header, const char *path, const char *data);
+
+// Snapshot Functions.
+int start_snapshots(b2fs_state_t *state, int reconcile);
+void stop_snapshots(b2fs_state_t *state);
+void *snapshot_worker(void *voidarg);
+int write_snapshot(b2fs_state_t *state);
+int snapshot_dir(b2fs_string_t *out, hash_t *dir, char *path, size_t path_len);
+int snapshot_file(b2fs_string_t *out, b2fs_file_entry_t *entry, char *path, size_t path_len);
+int snapshot_append(b2fs_string_t *out, const void *data, size_t len);
+int load_snapshot(b2fs_state_t *state);
+int read_snapshot_entry(char **cursor, char *end, hash_t *fs_cache);
+int read_snapshot_version(char **cursor, char *end, b2fs_file_version_t *version, size_t *timestamp);
+void reconcile_cache(b2fs_state_t *state);
+void reconcile_additions(b2fs_state_t *state, hash_t *listing, char *path, size_t path_len);
+void reconcile_removals(b2fs_state_t *state, hash_t *dir, hash_t *listing, char *path, size_t path_len, size_t before);
+int has_version(keytree_t *versions, const char *version_id);
+
+// Ingest Functions.
+int ingest_tree(b2fs_state_t *state, const char *local, const char *prefix);
+void destroy_ingest(b2fs_ingest_t *ingest);
+int collect_ingest_files(b2fs_ingest_t *ingest, const char *local, const char *prefix);
+void *ingest_worker(void *voidarg);
+int ingest_task(b2fs_ingest_t *ingest, b2fs_ingest_task_t *task, b2fs_upload_url_t *upload_url, b2fs_upload_url_t *part_url, char *part_for);
+int open_ingest_file(b2fs_state_t *state, b2fs_ingest_file_t *file);
+void cache_ingested(b2fs_ingest_t *ingest, b2fs_ingest_file_t *file, b2fs_file_info_t *info);
+
+// Export Functions.
+int export_tree(b2fs_state_t *state, const char *prefix, const char *local);
+int collect_export_files(b2fs_export_t *export, b2fs_hash_entry_t *root, const char *local);
+void *export_worker(void *voidarg);
+int export_task(b2fs_export_t *export, b2fs_export_task_t *task, char *buf);
+int export_current(b2fs_export_file_t *file);
+
 // Struct Initializers.
 int init_file_entry(b2fs_file_entry_t *entry);
 int init_file_version(b2fs_file_version_t *version);
+int clone_file_version(b2fs_file_version_t *copy, b2fs_file_version_t *version);
 int init_dir_entry(b2fs_dir_entry_t *entry);
+b2fs_file_entry_t *retain_file_entry(b2fs_file_entry_t *entry);
 void destroy_file_entry(void *voidarg);
 void destroy_file_version(void *voidarg);
+void destroy_dir_entry(b2fs_dir_entry_t *entry);
 void destroy_hash_entry(void *voidarg);
 
 // Filesystem Helpers.
 char **split_path(char *path);
 hash_t *make_path(char **path_pieces, hash_t *base, b2fs_dir_entry_t *output);
 int find_path(char *path, hash_t *base, b2fs_hash_entry_t *buf, int honor_hidden);
+int lookup_path(b2fs_state_t *state, const char *path, b2fs_hash_entry_t *buf);
+int probe_dentry(b2fs_dentry_cache_t *dentries, const char *path, size_t len, unsigned long long hash, b2fs_hash_entry_t *buf);
+void remember_dentry(b2fs_dentry_cache_t *dentries, const char *path, size_t len, unsigned long long hash, size_t generation, b2fs_hash_entry_t *entry);
+void forget_dentry(b2fs_dentry_cache_t *dentries, const char *path, size_t len, unsigned long long hash);
+void invalidate_dentries(b2fs_state_t *state);
+void forget_missing(b2fs_state_t *state, const char *path);
 int internal_make(const char *path, hash_t *base, b2fs_entry_type_t type);
+int internal_unlink(b2fs_state_t *state, const char *path, size_t seq);
+void delete_versions(b2fs_state_t *state, b2fs_file_entry_t *entry, const char *path);
+int rename_file(b2fs_state_t *state, const char *from, const char *to);
+int replace_file(b2fs_state_t *state, const char *path, b2fs_file_entry_t *old, b2fs_file_version_t *copy);
+int rename_directory(b2fs_state_t *state, const char *from, const char *to);
+int count_visible(hash_t *directory);
+void *rename_worker(void *voidarg);
+int copy_version(b2fs_state_t *state, b2fs_file_entry_t *entry, b2fs_file_version_t *head, const char *to, b2fs_file_version_t *copy);
+void drop_cached_path(b2fs_state_t *state, const char *path);
+int copy_range_remote(b2fs_state_t *state, const char *path, b2fs_file_entry_t *source, size_t start, b2fs_file_entry_t *dest, size_t offset, size_t len);
+array_t *plan_copy_parts(b2fs_state_t *state, b2fs_file_part_t *segments, int count);
+int get_head_version(b2fs_file_entry_t *entry, size_t *timestamp, b2fs_file_version_t *version);
+size_t file_size(b2fs_file_entry_t *entry);
+void load_buffer_state(b2fs_file_entry_t *entry);
+void resize_file(b2fs_file_entry_t *entry, size_t size);
+int write_buffer(b2fs_state_t *state, b2fs_file_entry_t *entry, const char *buf, size_t size, off_t offset);
+b2fs_file_chunk_t *load_chunk(b2fs_state_t *state, b2fs_file_entry_t *entry, int chunk_num, int fetch);
+int fill_chunk(b2fs_state_t *state, b2fs_file_entry_t *entry, b2fs_file_chunk_t *chunk, int first, int last);
+void mark_blocks_resident(b2fs_file_chunk_t *chunk, int first, int last);
+void drop_chunks(b2fs_file_entry_t *entry);
+void destroy_chunk(void *destroyed);
+int render_stats(b2fs_state_t *state, char *buf, int len);
 
 // Generic Helper Functions.
 int jsmn_iskey(const char *json, jsmntok_t *tok, const char *s);
+int jsmn_find_string(const char *json, const char *key, char *out, int len);
 void cache_auth(b2fs_state_t *b2_info);
 int find_cached_auth(b2fs_state_t *b2_info);
 int parse_config(b2fs_config_t *config, char *config_filename);
 void find_tmpdir(char **out);
 int intcmp(void *int_one, void *int_two);
 int rev_intcmp(void *int_one, void *int_two);
+int rev_timecmp(void *time_one, void *time_two);
+int strcmp_indirect(const void *str_one, const void *str_two);
+size_t current_timestamp();
+int sync_parent(const char *path);
 void dereference_and_free(void *destroyed);
 void print_usage(int intentional);
 
@@ -259,25 +889,38 @@ int main(int argc, char **argv) {
   int c, index, retval;
   b2fs_config_t config;
   b2fs_state_t b2_info;
-  char *config_file = "b2fs.yml", *mount_point = NULL;
-  char *debug = "-d", *single_threaded = "-s";
+  char *config_file = "b2fs.yml", *mount_point = NULL, *ingest = NULL, *export = NULL, *prefix = NULL;
+  char *debug = "-d", *single_threaded = "-s", negative_option[B2FS_MICRO_GENERIC_BUFFER], *negative = negative_option;
   struct option long_options[] = {
     {"account-id", required_argument, 0, 'a'},
     {"bucket", required_argument, 0, 'b'},
     {"config", required_argument, 0, 'c'},
     {"debug", no_argument, 0, 'd'},
+    {"durability", required_argument, 0, 'D'},
+    {"journal", required_argument, 0, 'j'},
     {"app-key", required_argument, 0, 'k'},
     {"mount", required_argument, 0, 'm'},
+    {"lazy", no_argument, 0, 'L'},
+    {"negative-timeout", required_argument, 0, 'n'},
     {"delete-policy", required_argument, 0, 'p'},
     {"single-threaded", no_argument, 0, 's'},
+    {"snapshot", required_argument, 0, 'S'},
+    {"pack-threshold", required_argument, 0, 't'},
+    {"upload-threads", required_argument, 0, 'u'},
+    {"pack-window", required_argument, 0, 'w'},
+    {"dedup", no_argument, 0, 'x'},
+    {"ingest", required_argument, 0, 'i'},
+    {"export", required_argument, 0, 'E'},
     {0, 0, 0, 0}
   };
   array_t *fuse_options = create_array(sizeof(char *), NULL);
   memset(&config, 0, sizeof(b2fs_config_t));
+  config.negative_timeout = -1;
 
   // Create FUSE function mapping.
   struct fuse_operations mappings = {
     .init       = b2fs_init,
+    .destroy    = b2fs_destroy,
     .getattr    = b2fs_getattr,
     .readlink   = b2fs_readlink,
     .opendir    = b2fs_opendir,
@@ -292,7 +935,7 @@ int main(int argc, char **argv) {
     .chmod      = b2fs_chmod,
     .chown      = b2fs_chown,
     .truncate   = b2fs_truncate,
-    .utime      = b2fs_utime,
+    .utimens    = b2fs_utimens,
     .open       = b2fs_open,
     .read       = b2fs_read,
     .write      = b2fs_write,
@@ -300,11 +943,12 @@ int main(int argc, char **argv) {
     .release    = b2fs_release,
     .fsync      = b2fs_fsync,
     .flush      = b2fs_flush,
-    .access     = b2fs_access
+    .access     = b2fs_access,
+    .copy_file_range = b2fs_copy_file_range
   };
 
   // Get CLI options.
-  while ((c = getopt_long(argc, argv, "b:c:dem:p:s", long_options, &index)) != -1) {
+  while ((c = getopt_long(argc, argv, "b:c:dD:eE:i:j:Lm:n:p:sS:t:u:w:x", long_options, &index)) != -1) {
     switch (c) {
       case 'a':
         if (strlen(optarg) > B2FS_ACCOUNT_ID_LEN - 1) {
@@ -326,6 +970,18 @@ int main(int argc, char **argv) {
       case 'd':
         array_push(fuse_options, &debug);
         break;
+      case 'D':
+        if (!strcmp("remote", optarg)) config.durability = DURABILITY_REMOTE;
+        else if (!strcmp("local", optarg)) config.durability = DURABILITY_LOCAL;
+        else print_usage(0);
+        break;
+      case 'j':
+        if (strlen(optarg) > B2FS_SMALL_GENERIC_BUFFER - 1) {
+          write_log(LEVEL_ERROR, "B2FS: Journal path too long. Max length is %d.\n", B2FS_SMALL_GENERIC_BUFFER);
+          print_usage(0);
+        }
+        strcpy(config.journal_path, optarg);
+        break;
       case 'k':
         if (strlen(optarg) > B2FS_APP_KEY_LEN) {
           write_log(LEVEL_ERROR, "B2FS: App key too long. Max length is %d.\n", B2FS_APP_KEY_LEN);
@@ -336,6 +992,16 @@ int main(int argc, char **argv) {
       case 'm':
         mount_point = optarg;
         break;
+      case 'L':
+        config.lazy = 1;
+        break;
+      case 'n':
+        config.negative_timeout = atoi(optarg);
+        if (config.negative_timeout < 0) {
+          write_log(LEVEL_ERROR, "B2FS: Negative timeout can't be less than zero.\n");
+          print_usage(0);
+        }
+        break;
       case 'p':
         if (!strcmp("hide", optarg)) config.policy = POLICY_HIDE;
         else if (!strcmp("delete", optarg)) config.policy = POLICY_DELETE_ONE;
@@ -345,11 +1011,57 @@ int main(int argc, char **argv) {
       case 's':
         array_push(fuse_options, &single_threaded);
         break;
+      case 'S':
+        if (strlen(optarg) > B2FS_SMALL_GENERIC_BUFFER - 1) {
+          write_log(LEVEL_ERROR, "B2FS: Snapshot path too long. Max length is %d.\n", B2FS_SMALL_GENERIC_BUFFER);
+          print_usage(0);
+        }
+        strcpy(config.snapshot_path, optarg);
+        break;
+      case 't':
+        // Packing is off unless a threshold is given. Packed files have to fit in one chunk.
+        config.pack_threshold = strtoul(optarg, NULL, 10);
+        if (!config.pack_threshold || config.pack_threshold > B2FS_CHUNK_SIZE) {
+          write_log(LEVEL_ERROR, "B2FS: Pack threshold must be between 1 and %d bytes.\n", B2FS_CHUNK_SIZE);
+          print_usage(0);
+        }
+        break;
+      case 'u':
+        config.upload_threads = atoi(optarg);
+        if (config.upload_threads < 1 || config.upload_threads > B2FS_MAX_UPLOAD_THREADS) {
+          write_log(LEVEL_ERROR, "B2FS: Upload threads must be between 1 and %d.\n", B2FS_MAX_UPLOAD_THREADS);
+          print_usage(0);
+        }
+        break;
+      case 'w':
+        config.pack_window = atoi(optarg);
+        if (config.pack_window < 1) {
+          write_log(LEVEL_ERROR, "B2FS: Pack window must be at least one second.\n");
+          print_usage(0);
+        }
+        break;
+      case 'E':
+        export = optarg;
+        break;
+      case 'i':
+        ingest = optarg;
+        break;
+      case 'x':
+        config.dedup = 1;
+        break;
       default:
         print_usage(0);
     }
   }
 
+  // Ingesting takes the prefix to upload under as its one positional argument, and exporting
+  // takes the directory to download into.
+  if (ingest && export) print_usage(0);
+  if (ingest || export) {
+    if (optind != argc - 1) print_usage(0);
+    prefix = argv[optind];
+  }
+
   // Initialize cURL.
   curl_global_init(CURL_GLOBAL_DEFAULT);
 
@@ -364,7 +1076,21 @@ int main(int argc, char **argv) {
 
   // Validate given options.
   if (config.policy == POLICY_INVAL) config.policy = POLICY_HIDE;
-  if (!mount_point && !strlen(config.mount_point)) {
+  if (!config.upload_threads) config.upload_threads = B2FS_UPLOAD_THREADS;
+  if (!config.pack_window) config.pack_window = B2FS_PACK_WINDOW;
+  if (config.negative_timeout < 0) config.negative_timeout = B2FS_NEGATIVE_TIMEOUT;
+  if (config.durability == DURABILITY_INVAL) config.durability = DURABILITY_REMOTE;
+  if (config.durability == DURABILITY_LOCAL && !strlen(config.journal_path)) {
+    write_log(LEVEL_ERROR, "B2FS: Local durability needs a journal.\n");
+    print_usage(0);
+  }
+  if (config.lazy && strlen(config.snapshot_path) && !ingest && !export) {
+    // A snapshot of a partly listed cache would pass for all of it on the next mount.
+    write_log(LEVEL_ERROR, "B2FS: Lazy listing can't be combined with a snapshot.\n");
+    print_usage(0);
+  }
+  if (ingest || export) config.lazy = 0;
+  if (!ingest && !export && !mount_point && !strlen(config.mount_point)) {
     write_log(LEVEL_ERROR, "B2FS: You must specify a mount point.\n");
     print_usage(0);
   } else if (!mount_point) {
@@ -402,24 +1128,42 @@ int main(int argc, char **argv) {
 
   // We are authenticated and have a valid token. Finish state initialization.
   b2_info.config = config;
+  memset(&b2_info.stats, 0, sizeof(b2fs_stats_t));
   pthread_rwlock_init(&b2_info.lock, NULL);
 
-  // Get CLI arguments ready for FUSE.
-  argv[1] = mount_point;
+  // Ingesting talks to B2 directly and never mounts anything.
+  if (ingest) return ingest_tree(&b2_info, ingest, prefix) == B2FS_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+  else if (export) return export_tree(&b2_info, export, prefix) == B2FS_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  // Let the kernel remember misses for a little while too, so it stops asking. Anything created
+  // through the mount clears them, but files that show up in B2 from elsewhere take up to the
+  // timeout to appear.
+  if (config.negative_timeout) {
+    snprintf(negative_option, B2FS_MICRO_GENERIC_BUFFER, "-onegative_timeout=%d", config.negative_timeout);
+    array_push(fuse_options, &negative);
+  }
+
+  // Get CLI arguments ready for FUSE. There can be more of them than we were given.
+  int fuse_argc = array_count(fuse_options) + 2;
+  char **fuse_argv = malloc(sizeof(char *) * (fuse_argc + 1));
+  fuse_argv[0] = argv[0];
+  fuse_argv[1] = mount_point;
   for (int i = 0; i < array_count(fuse_options); i++) {
     char *option;
     array_retrieve(fuse_options, i, &option);
-    argv[i + 2] = option;
+    fuse_argv[i + 2] = option;
   }
+  fuse_argv[fuse_argc] = NULL;
 
   // Start FUSE.
-  return fuse_main(array_count(fuse_options) + 2, argv, &mappings, &b2_info);
+  return fuse_main(fuse_argc, fuse_argv, &mappings, &b2_info);
 }
 
 // TODO: This function is crazy long and out of control. Refactoring won't help a whole lot,
 // because most of what it does is necessary, but I could break it out into constituent functions.
-void *b2fs_init(struct fuse_conn_info *info) {
+void *b2fs_init(struct fuse_conn_info *info, struct fuse_config *config) {
   (void) info;
+  (void) config;
   b2fs_state_t *state = fuse_get_context()->private_data;
 
   // Initialize global data structures.
@@ -432,8 +1176,19 @@ void *b2fs_init(struct fuse_conn_info *info) {
     fuse_exit(fuse_get_context()->fuse);
   }
 
-  // Initialize filesystem cache.
-  int retval = b2_list_versions(state->fs_cache, NULL, NULL);
+  // Initialize filesystem cache. A snapshot from the last mount gets us going without waiting on
+  // the listing, and the cache is brought up to date with the bucket in the background. Lazy
+  // mounts only list the pack and dedup bookkeeping, and leave everything else until it's used.
+  int retval, warm = strlen(state->config.snapshot_path) && load_snapshot(state) == B2FS_SUCCESS;
+  state->root_listing.listed = !state->config.lazy;
+  pthread_mutex_init(&state->root_listing.lock, NULL);
+
+  // Lookups are still correct without the dentry cache, just slower.
+  state->dentries.slots = calloc(B2FS_DENTRY_SLOTS, sizeof(b2fs_dentry_t));
+  state->dentries.generation = 1;
+  if (warm) retval = B2FS_SUCCESS;
+  else if (state->config.lazy) retval = list_bookkeeping(state);
+  else retval = list_bucket(state, state->fs_cache);
   if (retval != B2FS_SUCCESS) {
     switch (retval) {
       case B2FS_NOMEM_ERROR:
@@ -457,6 +1212,19 @@ void *b2fs_init(struct fuse_conn_info *info) {
     fuse_exit(fuse_get_context()->fuse);
   }
 
+  // Files that went out in packs don't show up in the listing on their own. Pull in the pack
+  // indexes and fill them in. Snapshots already have them.
+  if (!warm && expand_packs(state) != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to read pack indexes during startup.\n");
+    fuse_exit(fuse_get_context()->fuse);
+  }
+
+  // Likewise for deduplicated files, which only exist as manifests.
+  if (start_dedup(state, !warm) != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to read dedup manifests during startup.\n");
+    fuse_exit(fuse_get_context()->fuse);
+  }
+
   // Filesystem is cached. Now need to create id->name mappings for files.
   // Create hash_entry for fs_cache to be able to use the general case.
   b2fs_hash_entry_t current_entry, start_entry;
@@ -487,6 +1255,8 @@ void *b2fs_init(struct fuse_conn_info *info) {
       // Iterate across versions and cache each id->path.
       int num_iterations = keytree_size(current_entry.file.versions);
       while (num_iterations-- && keytree_iterate_next(it, NULL, &version) == KEYTREE_SUCCESS) {
+        // Packed and deduplicated versions carry the id of another object.
+        if (version.packed || version.manifest) continue;
         char *path_copy = malloc(sizeof(char) * current_path.len);
         strcpy(path_copy, current_path.str);
         hash_put(state->id_mappings, version.version_id, &path_copy);
@@ -529,27 +1299,72 @@ void *b2fs_init(struct fuse_conn_info *info) {
   destroy_queue(dirs);
   destroy_queue(paths);
 
+  // Start the background upload workers.
+  if (start_upload_queue(state) != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to start upload workers.\n");
+    fuse_exit(fuse_get_context()->fuse);
+  }
+  if (start_pack_flusher(state) != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to start pack flusher.\n");
+    fuse_exit(fuse_get_context()->fuse);
+  }
+  if (start_mutation_queue(state) != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to start mutation workers.\n");
+    fuse_exit(fuse_get_context()->fuse);
+  }
+
+  // Anything acknowledged before a crash is still in the journal. Put it back in the buffers
+  // and send it on its way again.
+  if (open_journal(state) != B2FS_SUCCESS || replay_journal(state) != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to replay the journal at %s.\n", state->config.journal_path);
+    fuse_exit(fuse_get_context()->fuse);
+  }
+  if (start_snapshots(state, warm) != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to start the snapshot writer.\n");
+    fuse_exit(fuse_get_context()->fuse);
+  }
+
   // Boy, that was long and complicated, but now we're done.
   return state;
 }
 
-// TODO: Implement this function.
+// Function is called on unmount. Acts as a barrier for every outstanding upload so that
+// nothing written through the mount is lost.
 void b2fs_destroy(void *userdata) {
-  (void) userdata;
+  b2fs_state_t *state = userdata;
+
+  // Draining the upload queue can add files to the pack, so the pack goes last. Hides and
+  // deletes have to finish before the journal closes so that it can tell whether they're done.
+  // The final snapshot is taken once all of them have landed in the cache.
+  stop_upload_queue(state);
+  stop_pack_flusher(state);
+  stop_mutation_queue(state);
+  stop_snapshots(state);
+  close_journal(state);
+  stop_dedup(state);
+  free(state->dentries.slots);
 }
 
 // Function returns basic information for a given file path.
-int b2fs_getattr(const char *path, struct stat *statbuf) {
+int b2fs_getattr(const char *path, struct stat *statbuf, struct fuse_file_info *info) {
+  (void) info;
   b2fs_state_t *state = fuse_get_context()->private_data;
 
+  // The stats file doesn't exist in the cache, so handle it specially.
+  if (!strcmp(path, B2FS_STATS_PATH)) {
+    char stats[B2FS_LARGE_GENERIC_BUFFER];
+    memset(statbuf, 0, sizeof(struct stat));
+    statbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+    statbuf->st_nlink = 1;
+    statbuf->st_size = render_stats(state, stats, B2FS_LARGE_GENERIC_BUFFER);
+    return B2FS_SUCCESS;
+  }
+
   int retval;
   b2fs_hash_entry_t entry;
   b2fs_file_version_t version;
   if (strcmp(path, "/")) {
-    char *path_copy = malloc(sizeof(char) * (strlen(path) + 1));
-    strcpy(path_copy, path);
-    retval = find_path(path_copy, state->fs_cache, &entry, 1);
-    free(path_copy);
+    retval = lookup_path(state, path, &entry);
   } else {
     entry.type = TYPE_DIRECTORY;
     retval = B2FS_SUCCESS;
@@ -585,23 +1400,26 @@ int b2fs_getattr(const char *path, struct stat *statbuf) {
     statbuf->st_uid = ROOT_UID;
     statbuf->st_gid = ROOT_GID;
 
+    // Files with local writes report their buffered size rather than what B2 has.
+    size_t size = entry.type == TYPE_FILE ? file_size(&entry.file) : 0;
+
     // Set other unsupported fields to sane defaults.
     statbuf->st_nlink = 1;
     statbuf->st_blksize = 512;
-    statbuf->st_blocks = entry.type == TYPE_FILE ? ceil(version.size / (float) 512) : 1;
+    statbuf->st_blocks = entry.type == TYPE_FILE ? ceil(size / (float) 512) : 1;
 
     // Set file access dates.
-    // FIXME: I'm assuming these should be UNIX timestamps, but POSIX seems to be a little unsure.
-    // Should probably come up with a better default than 0 for directories. Maybe when I'm feeling
+    // Version timestamps are kept in milliseconds to match B2's uploadTimestamp.
+    // FIXME: Should probably come up with a better default than 0 for directories. Maybe when I'm feeling
     // less lazy I could scan across the contents to find the lowest timestamp.
     if (entry.type == TYPE_FILE) {
-      statbuf->st_atime = timestamp;
-      statbuf->st_mtime = timestamp;
-      statbuf->st_ctime = timestamp;
+      statbuf->st_atime = timestamp / 1000;
+      statbuf->st_mtime = timestamp / 1000;
+      statbuf->st_ctime = timestamp / 1000;
     }
 
     // FIXME: Should directories return size 0?
-    if (entry.type == TYPE_FILE) statbuf->st_size = version.size;
+    if (entry.type == TYPE_FILE) statbuf->st_size = size;
 
     return B2FS_SUCCESS;
   } else {
@@ -628,10 +1446,7 @@ int b2fs_opendir(const char *path, struct fuse_file_info *info) {
   if (strcmp(path, "/")) {
     // Get the entry from the cache.
     b2fs_hash_entry_t entry;
-    char *path_copy = malloc(sizeof(char) * (strlen(path) + 1));
-    strcpy(path_copy, path);
-    int retval = find_path(path_copy, state->fs_cache, &entry, 1);
-    free(path_copy);
+    int retval = lookup_path(state, path, &entry);
 
     // Perform validation and return.
     if (retval == B2FS_SUCCESS) return entry.type == TYPE_DIRECTORY ? B2FS_SUCCESS : -ENOTDIR;
@@ -641,9 +1456,10 @@ int b2fs_opendir(const char *path, struct fuse_file_info *info) {
   }
 }
 
-int b2fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info) {
+int b2fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info, enum fuse_readdir_flags flags) {
   (void) offset;
   (void) info;
+  (void) flags;
   b2fs_state_t *state = fuse_get_context()->private_data;
 
   hash_t *directory;
@@ -663,6 +1479,7 @@ int b2fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
     directory = entry.dir.directory;
   } else {
     // User is asking to open /. Just use fs_cache.
+    list_root(state);
     directory = state->fs_cache;
   }
 
@@ -682,9 +1499,9 @@ int b2fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
       keytree_iterate_stop(it);
 
       // Return the entry if it's not hidden.
-      if (!*version.hidden) filler(buf, keys[i], NULL, 0);
-    } else {
-      filler(buf, keys[i], NULL, 0);
+      if (!*version.hidden) filler(buf, keys[i], NULL, 0, 0);
+    } else if (!*entry.dir.hidden) {
+      filler(buf, keys[i], NULL, 0, 0);
     }
 
   }
@@ -711,7 +1528,9 @@ int b2fs_mknod(const char *path, mode_t mode, dev_t rdev) {
 
   if (S_ISREG(mode)) {
     // We're making a regular file.
-    return internal_make(path, state->fs_cache, TYPE_FILE);
+    int retval = internal_make(path, state->fs_cache, TYPE_FILE);
+    if (retval == B2FS_SUCCESS) retval = journal_append(state, JOURNAL_CREATE, path, TYPE_FILE, NULL, 0, NULL) ? -EIO : B2FS_SUCCESS;
+    return retval;
   } else {
     // We're being asked to create something other than a regular file. Not currently supported.
     return -ENOTSUP;
@@ -727,7 +1546,9 @@ int b2fs_mkdir(const char *path, mode_t mode) {
   b2fs_state_t *state = fuse_get_context()->private_data;
 
   // Make the directory.
-  return internal_make(path, state->fs_cache, TYPE_DIRECTORY);
+  int retval = internal_make(path, state->fs_cache, TYPE_DIRECTORY);
+  if (retval == B2FS_SUCCESS) retval = journal_append(state, JOURNAL_CREATE, path, TYPE_DIRECTORY, NULL, 0, NULL) ? -EIO : B2FS_SUCCESS;
+  return retval;
 }
 
 int b2fs_symlink(const char *from, const char *to) {
@@ -736,14 +1557,27 @@ int b2fs_symlink(const char *from, const char *to) {
   return -ENOTSUP;
 }
 
-// Function takes care of deleting a file. Performs (perhaps unnecessary) validation to make sure
-// the path isn't a directory, then removes the file from the local cache based on the deletion
-// policy. File is removed from B2 in the file version destructor.
-// FIXME: Function needs to be re-written to be threadsafe, and we also need to add some notion
-// of whether or not a particular file version is actually present in B2.
+// Function takes care of deleting a file. The unlink is journaled first so that, if we crash
+// before B2 has caught up, it gets finished when the journal is replayed.
 int b2fs_unlink(const char *path) {
   b2fs_state_t *state = fuse_get_context()->private_data;
 
+  size_t seq = 0;
+  if (journal_append(state, JOURNAL_UNLINK, path, 0, NULL, 0, &seq) != B2FS_SUCCESS) return -EIO;
+
+  int retval = internal_unlink(state, path, seq);
+  if (retval == -ENOENT) journal_uploaded(state, path, seq);
+  return retval;
+}
+
+// Function does the actual work of deleting a file. Performs (perhaps unnecessary) validation
+// to make sure the path isn't a directory, then removes the file from the local cache based on
+// the deletion policy. The cache changes right away, and B2 is brought in line behind our back:
+// versions are deleted by the file version destructor, and the hide is queued here. seq is the
+// journal record of the unlink, which is let go of once B2 has caught up.
+// FIXME: Function needs to be re-written to be threadsafe, and we also need to add some notion
+// of whether or not a particular file version is actually present in B2.
+int internal_unlink(b2fs_state_t *state, const char *path, size_t seq) {
   // Locate the file to make sure it exists.
   if (strcmp(path, "/")) {
     // Find requested directory.
@@ -753,32 +1587,30 @@ int b2fs_unlink(const char *path) {
     int retval = find_path(path_copy, state->fs_cache, &entry, 1);
     free(path_copy);
 
-    if (retval == B2FS_SUCCESS) {
+    if (retval == B2FS_SUCCESS && entry.type == TYPE_DIRECTORY) {
+      // Directories go through rmdir.
+      return -EISDIR;
+    } else if (retval == B2FS_SUCCESS) {
       // File exists. Time to do the hard work.
       int synced = 0;
 
-      if (state->config.policy != POLICY_HIDE) {
-        // Figure out how many files we need to delete.
-        int num_iterations = state->config.policy == POLICY_DELETE_ONE ? 1 : keytree_size(entry.file.versions);
+      // Uploads in the queue, and the pending pack, hold a copy of this entry. Let them finish
+      // before we start tearing versions down.
+      wait_for_durable(state, &entry.file);
 
-        // Make sure that our file versions have their corresponding ids.
-        b2_sync_versions(&entry.file, path, 0);
+      if (state->config.policy != POLICY_HIDE) {
+        delete_versions(state, &entry.file, path);
         synced = 1;
+      }
 
-        // Iterate over versions and mark for deletion.
-        size_t key;
-        b2fs_file_version_t version;
-        stack_t *deletions = create_stack(NULL, sizeof(size_t));
-        keytree_iterator_t *it = keytree_iterate_start(entry.file.versions, NULL);
-        while (num_iterations-- && keytree_iterate_next(it, &key, &version) == KEYTREE_SUCCESS) {
-          *version.should_delete = 1;
-          stack_push(deletions, &key);
-        }
-        keytree_iterate_stop(it);
-
-        // Remove versions from the version tree (will call destructor to delete from B2).
-        while (stack_pop(deletions, &key) == STACK_SUCCESS) keytree_remove(entry.file.versions, &key, NULL);
-        destroy_stack(deletions);
+      // Packed and deduplicated files are hidden by a tombstone in the next pack index rather
+      // than through B2, since there's nothing at their path to hide.
+      b2fs_file_version_t head;
+      if (get_head_version(&entry.file, NULL, &head) == KEYTREE_SUCCESS && (head.packed || head.manifest)) {
+        if (add_tombstone(state, path) != B2FS_SUCCESS) return -EIO;
+        *head.hidden = 1;
+        journal_uploaded(state, path, seq);
+        return B2FS_SUCCESS;
       }
 
       // Hide the earliest remaining file if there is one.
@@ -786,98 +1618,29 @@ int b2fs_unlink(const char *path) {
         // Perform version sync if we didn't already do it.
         // Operation is idempotent, so check is superfluous, but no reason to do
         // extra work.
-        if (!synced) b2_sync_versions(&entry.file, path, 0);
-
-        // Do-while loop works as a conditional retry-loop if our auth token is expired.
-        int do_again;
-        do {
-          CURL *curl = curl_easy_init();
-          CURLcode res;
-          char body[B2FS_SMALL_GENERIC_BUFFER], *filename;
-          b2fs_string_t response;
-          do_again = 0;
-          memset(&response, 0, sizeof(b2fs_string_t));
-
-          // Big, dirty, macro to handle all of the boilerplate cURL initialization stuff.
-          // Acquire read-lock to make sure we're using the right auth token and stuff.
-          pthread_rwlock_rdlock(&state->lock);
-          INITIALIZE_LIBCURL(
-              curl,
-              state->api_url,
-              "b2api/v1/b2_hide_file",
-              state->token,
-              state->lock,
-              "Authorization: %s",
-              response,
-              receive_string,
-              1);
-          pthread_rwlock_unlock(&state->lock);
-
-          // Get the most recent remaining version.
-          b2fs_file_version_t version;
-          keytree_iterator_t *it = keytree_iterate_start(entry.file.versions, NULL);
-          assert(keytree_iterate_next(it, NULL, &version) == KEYTREE_SUCCESS);
-          keytree_iterate_stop(it);
-
-          // Get the name of the file exactly as B2 expects it and create the request body.
-          assert(hash_get(state->id_mappings, version.version_id, &filename) == HASH_SUCCESS);
-          sprintf(body, "{\"bucketId\":\"%s\",\"fileName\":\"%s\"}", state->config.bucket_id, filename + 1);
-          curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
-
-          // Perform the request.
-          if ((res = curl_easy_perform(curl)) == CURLE_OK) {
-            long code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-
-            if (code == 200) {
-              // No need to check response. Hide API just returns info on the file that we already have, and the API docs state that
-              // a 200 is sufficient to know that the file has been hidden.
-              *version.hidden = 1;
-              free(response.str);
-            } else {
-              write_log(LEVEL_DEBUG, "B2FS: B2 returned error code %ld with message: %s\n", code, response.str);
-
-              // Attempt to handle the returned error.
-              int retval = handle_b2_error(state, response.str, tok);
-
-              // Regardless of what happens, this stuff needs to be cleaned up.
-              free(response.str);
-              memset(&response, 0, sizeof(b2fs_string_t));
-
-              // Check the reason the error was generated, and if it was handled.
-              // TODO: Currently only one supported reason, so I may need to add more clauses here eventually.
-              if (retval == B2FS_NETWORK_TOKEN_ERROR) {
-                // Do the request again.
-                do_again = 1;
-              } else {
-                // The error wasn't handled, and we don't know what went wrong. Return a generic IO error.
-                curl_slist_free_all(headers);
-                curl_easy_cleanup(curl);
-                return -EIO;
-              }
-            }
-          } else {
-            // FIXME: At the moment, this currently just reports a generic IO error if cURL fails to perform the request.
-            // Perhaps add more detailed error handling here eventually.
-            write_log(LEVEL_DEBUG, "B2FS: cURL returned error code %s while hiding the file %s.\n", curl_easy_strerror(res), filename);
-            return -EIO;
-          }
+        if (!synced) b2_sync_versions(state, &entry.file, path, 0);
 
-          // Clean up cURL resources.
-          curl_slist_free_all(headers);
-          curl_easy_cleanup(curl);
-        } while (do_again);
+        // Hide the most recent remaining version. Until B2 catches up, it's only hidden here.
+        b2fs_file_version_t version;
+        char *filename;
+        keytree_iterator_t *it = keytree_iterate_start(entry.file.versions, NULL);
+        assert(keytree_iterate_next(it, NULL, &version) == KEYTREE_SUCCESS);
+        keytree_iterate_stop(it);
+        assert(hash_get(state->id_mappings, version.version_id, &filename) == HASH_SUCCESS);
+        *version.hidden = 1;
+        enqueue_hide(state, filename, version.version_id, seq);
+        return B2FS_SUCCESS;
       }
 
-      // Remove the file from the filesystem cache if all versions have been removed.
-      if (!keytree_size(entry.file.versions)) {
-        path_copy = malloc(sizeof(char) * strlen(path) + 1);
-        strcpy(path_copy, path);
-        char **path_pieces = split_path(path_copy);
-        hash_t *parent = make_path(path_pieces, state->fs_cache, NULL);
-        assert(hash_drop(parent, path_pieces[0]) == HASH_SUCCESS);
-        free(path_copy);
-      }
+      // Every version has been removed, so remove the file from the filesystem cache.
+      path_copy = malloc(sizeof(char) * strlen(path) + 1);
+      strcpy(path_copy, path);
+      char **path_pieces = split_path(path_copy);
+      hash_t *parent = make_path(path_pieces, state->fs_cache, NULL);
+      assert(hash_drop(parent, path_pieces[0]) == HASH_SUCCESS);
+      invalidate_dentries(state);
+      free(path_copy);
+      journal_uploaded(state, path, seq);
 
       return B2FS_SUCCESS;
     } else if (retval == B2FS_FS_NOENT_ERROR) {
@@ -895,93 +1658,786 @@ int b2fs_unlink(const char *path) {
   }
 }
 
+// Function deletes as many of a file's versions as the delete policy calls for, newest first.
+void delete_versions(b2fs_state_t *state, b2fs_file_entry_t *entry, const char *path) {
+  // Figure out how many files we need to delete.
+  int num_iterations = state->config.policy == POLICY_DELETE_ONE ? 1 : keytree_size(entry->versions);
+
+  // Make sure that our file versions have their corresponding ids.
+  b2_sync_versions(state, entry, path, 0);
+
+  // Iterate over versions and mark for deletion.
+  size_t key;
+  b2fs_file_version_t version;
+  stack_t *deletions = create_stack(NULL, sizeof(size_t));
+  keytree_iterator_t *it = keytree_iterate_start(entry->versions, NULL);
+  while (num_iterations-- && keytree_iterate_next(it, &key, &version) == KEYTREE_SUCCESS) {
+    // Packed versions share their B2 object with other files, and deduplicated ones share
+    // their chunks, so they can only be hidden.
+    if (version.packed || version.manifest) break;
+    *version.should_delete = 1;
+    stack_push(deletions, &key);
+  }
+  keytree_iterate_stop(it);
+
+  // Remove versions from the version tree (will call destructor to delete from B2).
+  while (stack_pop(deletions, &key) == STACK_SUCCESS) keytree_remove(entry->versions, &key, NULL);
+  destroy_stack(deletions);
+}
+
 // TODO: Implement this function.
 int b2fs_rmdir(const char *path) {
   return -ENOTSUP;
 }
 
-// TODO: Implement this function.
-int b2fs_rename(const char *from, const char *to) {
-  return -ENOTSUP;
+// Function moves a file or directory. B2 has no rename, so every file is copied server-side to
+// its new name, and the original is then hidden or deleted according to the delete policy.
+// Neither RENAME_NOREPLACE nor RENAME_EXCHANGE can be done atomically against B2.
+int b2fs_rename(const char *from, const char *to, unsigned int flags) {
+  b2fs_state_t *state = fuse_get_context()->private_data;
+  b2fs_hash_entry_t entry;
+
+  if (flags) return -EINVAL;
+  else if (!strcmp(from, "/") || !strcmp(to, "/")) return -EBUSY;
+  else if (!strcmp(from, B2FS_STATS_PATH) || !strcmp(to, B2FS_STATS_PATH)) return -EPERM;
+  else if (!strcmp(from, to)) return B2FS_SUCCESS;
+
+  char *path_copy = malloc(sizeof(char) * (strlen(from) + 1));
+  strcpy(path_copy, from);
+  int retval = find_path(path_copy, state->fs_cache, &entry, 1);
+  free(path_copy);
+  if (retval == B2FS_FS_NOENT_ERROR) return -ENOENT;
+  else if (retval != B2FS_SUCCESS) return -ENOTDIR;
+
+  if (entry.type == TYPE_FILE) return rename_file(state, from, to);
+
+  // A directory can't be moved inside itself.
+  size_t len = strlen(from);
+  if (!strncmp(from, to, len) && to[len] == '/') return -EINVAL;
+  return rename_directory(state, from, to);
 }
 
-int b2fs_link(const char *from, const char *to) {
-  (void) from;
-  (void) to;
-  return -ENOTSUP;
+// Function moves a single file. Nothing at the destination is touched until the copy is in
+// B2, so a failed rename leaves it as it was. The new entry starts out with nothing buffered,
+// and reads come from the copy.
+int rename_file(b2fs_state_t *state, const char *from, const char *to) {
+  b2fs_hash_entry_t source, dest;
+  b2fs_file_version_t head, copy;
+
+  char *path_copy = malloc(sizeof(char) * (MAX(strlen(from), strlen(to)) + 1));
+  strcpy(path_copy, from);
+  int retval = find_path(path_copy, state->fs_cache, &source, 1);
+  if (retval != B2FS_SUCCESS || source.type != TYPE_FILE) {
+    free(path_copy);
+    return retval == B2FS_FS_NOENT_ERROR ? -ENOENT : -EISDIR;
+  }
+
+  // Whatever was written has to be in B2 before B2 can copy it, including writes to a file
+  // that's still open and hasn't been queued for upload yet.
+  pthread_mutex_lock(&source.file.buffer->lock);
+  int dirty = source.file.buffer->dirty;
+  pthread_mutex_unlock(&source.file.buffer->lock);
+  if (dirty) enqueue_upload(state, from, &source.file);
+  if (wait_for_durable(state, &source.file) != B2FS_SUCCESS) {
+    free(path_copy);
+    return -EIO;
+  }
+  assert(get_head_version(&source.file, NULL, &head) == KEYTREE_SUCCESS);
+  int remote = *head.live && !*head.hidden && strlen(head.version_id);
+
+  strcpy(path_copy, to);
+  retval = find_path(path_copy, state->fs_cache, &dest, 1);
+  free(path_copy);
+  if (retval == B2FS_SUCCESS && dest.type == TYPE_DIRECTORY) return -EISDIR;
+  else if (retval == B2FS_FS_NOTDIR_ERROR) return -ENOTDIR;
+  int replacing = retval == B2FS_SUCCESS;
+
+  // Anything still on its way to the destination would land on top of the copy.
+  if (replacing) wait_for_durable(state, &dest.file);
+  if (remote && copy_version(state, &source.file, &head, to, &copy) != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to copy %s to %s.\n", from, to);
+    return -EIO;
+  }
+
+  // Put the copy in place of whatever was at the destination. With nothing to copy, the
+  // destination is unlinked just as if the source had been an empty file written over it.
+  if (replacing && remote) {
+    retval = replace_file(state, to, &dest.file, &copy);
+  } else {
+    if (replacing && (retval = internal_unlink(state, to, 0)) != B2FS_SUCCESS) return retval;
+    retval = internal_make(to, state->fs_cache, TYPE_FILE);
+    if (retval == B2FS_SUCCESS && remote) {
+      path_copy = malloc(sizeof(char) * (strlen(to) + 1));
+      strcpy(path_copy, to);
+      assert(find_path(path_copy, state->fs_cache, &dest, 1) == B2FS_SUCCESS);
+      free(path_copy);
+      if (!copy.packed && !copy.manifest) map_file_id(state, copy.version_id, to);
+      record_version(&dest.file, &copy, 0);
+    } else if (remote) {
+      destroy_file_version(&copy);
+    }
+  }
+  if (retval != B2FS_SUCCESS) return retval;
+
+  // Files that never made it to B2 have nothing there to hide.
+  if (remote) retval = internal_unlink(state, from, 0);
+  else drop_cached_path(state, from);
+  if (retval == B2FS_SUCCESS) __sync_fetch_and_add(&state->stats.files_renamed, 1);
+
+  return retval;
 }
 
-int b2fs_chmod(const char *path, mode_t mode) {
-  (void) path;
-  (void) mode;
-  return -ENOTSUP;
+// Function swaps a fresh entry, with copy as its head, in for the file at path. The copy
+// shadows the old versions, so they stay on as its history unless the delete policy says
+// they go. Open handles keep the old entry, buffers and all, until they're closed.
+// The fresh entry takes ownership of copy, even if the swap fails.
+int replace_file(b2fs_state_t *state, const char *path, b2fs_file_entry_t *old, b2fs_file_version_t *copy) {
+  b2fs_hash_entry_t fresh;
+  b2fs_file_version_t version, kept;
+  size_t timestamp;
+
+  fresh.type = TYPE_FILE;
+  if (init_file_entry(&fresh.file) != B2FS_SUCCESS) {
+    destroy_file_version(copy);
+    return -ENOMEM;
+  }
+  if (state->config.policy != POLICY_HIDE) delete_versions(state, old, path);
+
+  int num_iterations = keytree_size(old->versions);
+  keytree_iterator_t *it = keytree_iterate_start(old->versions, NULL);
+  while (num_iterations-- && keytree_iterate_next(it, &timestamp, &version) == KEYTREE_SUCCESS) {
+    if (clone_file_version(&kept, &version) == B2FS_SUCCESS) keytree_insert(fresh.file.versions, &timestamp, &kept);
+  }
+  keytree_iterate_stop(it);
+  if (!copy->packed && !copy->manifest) map_file_id(state, copy->version_id, path);
+  record_version(&fresh.file, copy, 0);
+
+  char *path_copy = malloc(sizeof(char) * (strlen(path) + 1));
+  strcpy(path_copy, path);
+  char **path_pieces = split_path(path_copy);
+  hash_t *parent = make_path(path_pieces, state->fs_cache, NULL);
+  int retval = B2FS_SUCCESS;
+  if (parent) hash_drop(parent, path_pieces[0]);
+  if (!parent || hash_put(parent, path_pieces[0], &fresh) != HASH_SUCCESS) {
+    destroy_file_entry(&fresh.file);
+    retval = -EIO;
+  }
+  invalidate_dentries(state);
+  free(path_pieces);
+  free(path_copy);
+
+  return retval;
 }
 
-int b2fs_chown(const char *path, uid_t uid, gid_t gid) {
-  (void) path;
-  (void) uid;
-  (void) gid;
-  return -ENOTSUP;
+// Function counts the entries of a directory that readdir would show, leaving out hidden
+// files and directories.
+int count_visible(hash_t *directory) {
+  int count, visible = 0;
+  char **names = hash_keys(directory, &count);
+  for (int i = 0; i < count; i++) {
+    b2fs_hash_entry_t entry;
+    b2fs_file_version_t version;
+    if (hash_get(directory, names[i], &entry) != HASH_SUCCESS) continue;
+
+    if (entry.type == TYPE_FILE) {
+      if (get_head_version(&entry.file, NULL, &version) == KEYTREE_SUCCESS && !*version.hidden) visible++;
+    } else if (!*entry.dir.hidden) {
+      visible++;
+    }
+  }
+  free(names);
+
+  return visible;
 }
 
-// TODO: Implement this function.
-int b2fs_truncate(const char *path, off_t size) {
-  return -ENOTSUP;
+// Function moves every file under a directory, several at a time. The directory tree is
+// recreated at the destination first, so the files only ever land in directories that exist.
+int rename_directory(b2fs_state_t *state, const char *from, const char *to) {
+  b2fs_hash_entry_t entry, child;
+  b2fs_file_version_t version;
+  b2fs_rename_batch_t batch;
+
+  // Directories can only replace empty directories.
+  char *path_copy = malloc(sizeof(char) * (strlen(to) + 1));
+  strcpy(path_copy, to);
+  int retval = find_path(path_copy, state->fs_cache, &entry, 1);
+  free(path_copy);
+  if (retval == B2FS_SUCCESS && entry.type == TYPE_FILE) return -ENOTDIR;
+  else if (retval == B2FS_SUCCESS && count_visible(entry.dir.directory)) return -ENOTEMPTY;
+  else if (retval == B2FS_FS_NOTDIR_ERROR) return -ENOTDIR;
+  else if (retval != B2FS_SUCCESS && (retval = internal_make(to, state->fs_cache, TYPE_DIRECTORY)) != B2FS_SUCCESS) return retval;
+
+  // Walk the source tree, making directories as we find them and collecting files to move.
+  array_t *sources = create_array(sizeof(char *), NULL), *dirs = create_array(sizeof(char *), NULL);
+  char *root = malloc(sizeof(char) * (strlen(from) + 1));
+  strcpy(root, from);
+  array_push(dirs, &root);
+  for (int i = 0; i < array_count(dirs); i++) {
+    char *dir_path;
+    array_retrieve(dirs, i, &dir_path);
+    path_copy = malloc(sizeof(char) * (strlen(dir_path) + 1));
+    strcpy(path_copy, dir_path);
+    retval = find_path(path_copy, state->fs_cache, &entry, 1);
+    free(path_copy);
+    if (retval != B2FS_SUCCESS || entry.type != TYPE_DIRECTORY) continue;
+
+    int count;
+    char **names = hash_keys(entry.dir.directory, &count);
+    for (int j = 0; j < count; j++) {
+      if (hash_get(entry.dir.directory, names[j], &child) != HASH_SUCCESS) continue;
+      char *child_path = malloc(sizeof(char) * (strlen(dir_path) + strlen(names[j]) + 2));
+      sprintf(child_path, "%s/%s", dir_path, names[j]);
+
+      if (child.type == TYPE_DIRECTORY && !*child.dir.hidden) {
+        array_push(dirs, &child_path);
+      } else if (child.type == TYPE_FILE && get_head_version(&child.file, NULL, &version) == KEYTREE_SUCCESS && !*version.hidden) {
+        array_push(sources, &child_path);
+      } else {
+        free(child_path);
+      }
+    }
+    free(names);
+  }
+
+  // Paths at the destination just swap the prefix.
+  memset(&batch, 0, sizeof(b2fs_rename_batch_t));
+  batch.state = state;
+  batch.count = array_count(sources);
+  batch.from = malloc(sizeof(char *) * (batch.count + 1));
+  batch.to = malloc(sizeof(char *) * (batch.count + 1));
+  size_t prefix = strlen(from);
+  for (int i = 1; i < array_count(dirs); i++) {
+    char *dir_path, dest_path[B2FS_LARGE_GENERIC_BUFFER];
+    array_retrieve(dirs, i, &dir_path);
+    snprintf(dest_path, B2FS_LARGE_GENERIC_BUFFER, "%s%s", to, dir_path + prefix);
+    internal_make(dest_path, state->fs_cache, TYPE_DIRECTORY);
+  }
+  for (int i = 0; i < batch.count; i++) {
+    array_retrieve(sources, i, &batch.from[i]);
+    batch.to[i] = malloc(sizeof(char) * (strlen(to) + strlen(batch.from[i] + prefix) + 1));
+    sprintf(batch.to[i], "%s%s", to, batch.from[i] + prefix);
+  }
+
+  // Each file is a copy and a hide, and both are just waiting on B2, so run as many at once
+  // as we're allowed uploads.
+  int workers = MIN(state->config.upload_threads, batch.count);
+  pthread_t *threads = malloc(sizeof(pthread_t) * (workers + 1));
+  pthread_mutex_init(&batch.lock, NULL);
+  for (int i = 0; i < workers; i++) {
+    if (pthread_create(&threads[i], NULL, rename_worker, &batch)) workers = i;
+  }
+  if (!workers) rename_worker(&batch);
+  for (int i = 0; i < workers; i++) pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&batch.lock);
+  free(threads);
+
+  // Only once everything is across does the source tree go.
+  if (!batch.error) drop_cached_path(state, from);
+
+  for (int i = 0; i < batch.count; i++) {
+    free(batch.from[i]);
+    free(batch.to[i]);
+  }
+  for (int i = 0; i < array_count(dirs); i++) {
+    char *dir_path;
+    array_retrieve(dirs, i, &dir_path);
+    free(dir_path);
+  }
+  free(batch.from);
+  free(batch.to);
+  array_destroy(sources);
+  array_destroy(dirs);
+
+  return batch.error;
 }
 
-int b2fs_utime(const char *path, struct utimbuf *buf) {
-  (void) path;
-  (void) buf;
-  return -ENOTSUP;
+void *rename_worker(void *voidarg) {
+  b2fs_rename_batch_t *batch = voidarg;
+
+  // Helpers find the state through the FUSE context, which is per thread, and empty on any
+  // thread FUSE didn't start.
+  fuse_get_context()->private_data = batch->state;
+
+  while (1) {
+    pthread_mutex_lock(&batch->lock);
+    int index = batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+    if (index >= batch->count) break;
+
+    int retval = rename_file(batch->state, batch->from[index], batch->to[index]);
+    if (retval != B2FS_SUCCESS) {
+      pthread_mutex_lock(&batch->lock);
+      if (!batch->error) batch->error = retval;
+      pthread_mutex_unlock(&batch->lock);
+    }
+  }
+
+  return NULL;
 }
 
-// TODO: Implement this function.
-int b2fs_open(const char *path, struct fuse_file_info *info) {
-  return -ENOTSUP;
+// Function has B2 copy the head version of a file to a new name, and fills in copy with the
+// version that results. Packed files copy their range of the pack, deduplicated files get a
+// new manifest pointing at the same chunks, and files too big for a single copy are copied a
+// part at a time.
+int copy_version(b2fs_state_t *state, b2fs_file_entry_t *entry, b2fs_file_version_t *head, const char *to, b2fs_file_version_t *copy) {
+  b2fs_upload_url_t upload_url;
+  b2fs_file_info_t info;
+  int retval = B2FS_ERROR;
+  memset(&upload_url, 0, sizeof(b2fs_upload_url_t));
+  wait_for_hide(state, to);
+
+  if (!head->size) {
+    // B2 can't copy an empty range, but an empty upload costs the same.
+    b2fs_upload_stream_t stream = {NULL, "", 0, 0, 0};
+    char sha1[SHA1_HEX_LEN] = "da39a3ee5e6b4b0d3255bfef95601890afd80709";
+    retval = upload_stream(state, &upload_url, to, &stream, sha1, &info);
+  } else if (head->manifest) {
+    retval = write_manifest(state, &upload_url, to, head->manifest, head->size, head->content_sha1, &info, NULL);
+  } else if (head->packed || head->size <= B2FS_MAX_PART_SIZE) {
+    size_t start = head->packed ? head->pack_offset : 0;
+    for (int i = 0; i < B2FS_UPLOAD_RETRIES; i++) {
+      retval = b2_copy_file(state, head->version_id, to, start, start + head->size, &info);
+      if (retval != B2FS_NETWORK_ERROR) break;
+    }
+  } else {
+    // Every part but the last has to be at least B2FS_MIN_PART_SIZE.
+    array_t *parts = create_array(sizeof(b2fs_file_part_t), NULL);
+    for (size_t pos = 0; pos < head->size;) {
+      size_t len = MIN(head->size - pos, (size_t) B2FS_MAX_PART_SIZE);
+      if (head->size - pos - len && head->size - pos - len < B2FS_MIN_PART_SIZE) len -= B2FS_MIN_PART_SIZE;
+      b2fs_file_part_t part = {pos, pos + len, 1, NULL, NULL};
+      array_push(parts, &part);
+      pos += len;
+    }
+    retval = upload_parts(state, to, entry, parts, &info);
+    array_destroy(parts);
+  }
+  if (retval != B2FS_SUCCESS) return retval;
+
+  // B2 doesn't always know the SHA-1 of a copied large file, but we do.
+  init_file_version(copy);
+  strcpy(copy->version_id, info.file_id);
+  strcpy(copy->content_sha1, strcmp(info.sha1, "none") ? info.sha1 : head->content_sha1);
+  copy->size = head->size;
+  copy->manifest = head->manifest ? retain_manifest(head->manifest) : NULL;
+  *copy->live = 1;
+  *copy->synced = 1;
+
+  return B2FS_SUCCESS;
 }
 
-// TODO: Implement this function.
-int b2fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *info) {
-  return -ENOTSUP;
+// Function has B2 write bytes [start, start + len) of source over dest at offset, keeping the
+// rest of dest as it was. Both files have to be fully in B2 and not deduplicated, and dest
+// can't grow a hole. On success, dest's buffers are dropped and the result becomes its head.
+int copy_range_remote(b2fs_state_t *state, const char *path, b2fs_file_entry_t *source, size_t start, b2fs_file_entry_t *dest, size_t offset, size_t len) {
+  b2fs_file_version_t from, to, version;
+  b2fs_file_part_t segments[3];
+  b2fs_file_info_t info;
+  int count = 0;
+
+  if (!len) return B2FS_ERROR;
+  else if (wait_for_durable(state, source) != B2FS_SUCCESS || wait_for_durable(state, dest) != B2FS_SUCCESS) return B2FS_ERROR;
+  pthread_mutex_lock(&source->buffer->lock);
+  int dirty = source->buffer->dirty;
+  pthread_mutex_unlock(&source->buffer->lock);
+  pthread_mutex_lock(&dest->buffer->lock);
+  dirty |= dest->buffer->dirty;
+  pthread_mutex_unlock(&dest->buffer->lock);
+  if (dirty) return B2FS_ERROR;
+  wait_for_hide(state, path);
+
+  // Packed versions are copied out of their pack, so offsets are shifted by where they sit.
+  size_t size = file_size(dest);
+  assert(get_head_version(source, NULL, &from) == KEYTREE_SUCCESS);
+  assert(get_head_version(dest, NULL, &to) == KEYTREE_SUCCESS);
+  if (!*from.live || *from.hidden || from.manifest || !strlen(from.version_id)) return B2FS_ERROR;
+  else if (offset > size) return B2FS_ERROR;
+  else if (size > 0 && (!*to.live || *to.hidden || to.manifest || !strlen(to.version_id))) return B2FS_ERROR;
+
+  size_t from_base = from.packed ? from.pack_offset : 0, to_base = to.packed ? to.pack_offset : 0;
+  if (offset) {
+    b2fs_file_part_t head = {to_base, to_base + offset, 1, to.version_id, NULL};
+    segments[count++] = head;
+  }
+  b2fs_file_part_t middle = {from_base + start, from_base + start + len, 1, from.version_id, NULL};
+  segments[count++] = middle;
+  if (offset + len < size) {
+    b2fs_file_part_t tail = {to_base + offset + len, to_base + size, 1, to.version_id, NULL};
+    segments[count++] = tail;
+  }
+
+  array_t *parts = plan_copy_parts(state, segments, count);
+  if (!parts) return B2FS_ERROR;
+  int retval = upload_parts(state, path, dest, parts, &info);
+  for (int i = 0; i < array_count(parts); i++) {
+    b2fs_file_part_t part;
+    array_retrieve(parts, i, &part);
+    free(part.data);
+  }
+  array_destroy(parts);
+  if (retval != B2FS_SUCCESS) return B2FS_ERROR;
+
+  // Whatever dest had buffered describes the version we just replaced.
+  init_file_version(&version);
+  strcpy(version.version_id, info.file_id);
+  strcpy(version.content_sha1, info.sha1);
+  version.size = MAX(size, offset + len);
+  *version.live = 1;
+  *version.synced = 1;
+  pthread_mutex_lock(&dest->buffer->lock);
+  drop_chunks(dest);
+  dest->buffer->size = version.size;
+  dest->buffer->trimmed = SIZE_MAX;
+  dest->buffer->loaded = 1;
+  pthread_mutex_unlock(&dest->buffer->lock);
+  map_file_id(state, info.file_id, path);
+  record_version(dest, &version, info.timestamp);
+
+  return B2FS_SUCCESS;
 }
 
-// TODO: Implement this function.
-int b2fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *info) {
-  return -ENOTSUP;
+// Function lays out the parts of a file made by joining segments of existing objects. Segments
+// long enough to be parts are copied by B2. Shorter ones are downloaded and sent, along with
+// as much of the next segment as it takes to make a whole part. Returns NULL if nothing would
+// be copied, or if a download fails.
+array_t *plan_copy_parts(b2fs_state_t *state, b2fs_file_part_t *segments, int count) {
+  array_t *parts = create_array(sizeof(b2fs_file_part_t), NULL);
+  b2fs_file_part_t pending = {0, 0, 0, NULL, NULL};
+  int copies = 0, retval = B2FS_SUCCESS;
+
+  for (int i = 0; i < count && retval == B2FS_SUCCESS; i++) {
+    b2fs_file_part_t segment = segments[i];
+    size_t take = 0;
+
+    // Top up a short part, or take all of a segment too short to be copied itself.
+    if (pending.end && pending.end < B2FS_MIN_PART_SIZE) {
+      take = MIN(B2FS_MIN_PART_SIZE - pending.end, segment.end - segment.start);
+    }
+    if (segment.end - segment.start - take < B2FS_MIN_PART_SIZE && i < count - 1) {
+      take = segment.end - segment.start;
+    }
+    if (take) {
+      char *data = realloc(pending.data, pending.end + take);
+      if (!data) {
+        retval = B2FS_NOMEM_ERROR;
+        break;
+      }
+      pending.data = data;
+      retval = b2_download_range(state, segment.source, segment.start, take, pending.data + pending.end);
+      pending.end += take;
+      segment.start += take;
+    }
+    if (retval != B2FS_SUCCESS || segment.start == segment.end) continue;
+
+    if (pending.end) {
+      array_push(parts, &pending);
+      pending.data = NULL;
+      pending.end = 0;
+    }
+
+    // Anything over the part limit is split, and a short remainder takes some back.
+    while (segment.start < segment.end) {
+      size_t len = MIN(segment.end - segment.start, (size_t) B2FS_MAX_PART_SIZE);
+      size_t rest = segment.end - segment.start - len;
+      if (rest && rest < B2FS_MIN_PART_SIZE) len -= B2FS_MIN_PART_SIZE;
+      b2fs_file_part_t part = {segment.start, segment.start + len, 1, segment.source, NULL};
+      array_push(parts, &part);
+      segment.start += len;
+      copies++;
+    }
+  }
+  if (pending.end && retval == B2FS_SUCCESS) {
+    array_push(parts, &pending);
+    pending.data = NULL;
+  }
+  free(pending.data);
+
+  if (retval != B2FS_SUCCESS || !copies || array_count(parts) > B2FS_MAX_PARTS) {
+    for (int i = 0; i < array_count(parts); i++) {
+      b2fs_file_part_t part;
+      array_retrieve(parts, i, &part);
+      free(part.data);
+    }
+    array_destroy(parts);
+    return NULL;
+  }
+  return parts;
 }
 
-// TODO: Implement this function.
-int b2fs_statfs(const char *path, struct statvfs *buf) {
-  return -ENOTSUP;
+// Function removes a path, and anything under it, from the filesystem cache without touching B2.
+void drop_cached_path(b2fs_state_t *state, const char *path) {
+  char *path_copy = malloc(sizeof(char) * (strlen(path) + 1));
+  strcpy(path_copy, path);
+  char **path_pieces = split_path(path_copy);
+  hash_t *parent = make_path(path_pieces, state->fs_cache, NULL);
+  if (parent) hash_drop(parent, path_pieces[0]);
+  invalidate_dentries(state);
+  free(path_pieces);
+  free(path_copy);
 }
 
-// TODO: Implement this function.
-int b2fs_release(const char *path, struct fuse_file_info *info) {
+int b2fs_link(const char *from, const char *to) {
+  (void) from;
+  (void) to;
   return -ENOTSUP;
 }
 
-// TODO: Implement this function.
-int b2fs_fsync(const char *path, int crap, struct fuse_file_info *info) {
+int b2fs_chmod(const char *path, mode_t mode, struct fuse_file_info *info) {
+  (void) path;
+  (void) mode;
+  (void) info;
   return -ENOTSUP;
 }
 
-// TODO: Implement this function.
-int b2fs_flush(const char *path, struct fuse_file_info *info) {
+int b2fs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *info) {
+  (void) path;
+  (void) uid;
+  (void) gid;
+  (void) info;
   return -ENOTSUP;
 }
 
-// B2FS doesn't currently support permissions, so this just checks that the
-// entry in question actually exists and returns success.
-int b2fs_access(const char *path, int mode) {
-  (void) mode;
+// Function changes the size of a file. Nothing is fetched from B2 to do it, and when the
+// file is uploaded, whatever is left of the old contents is copied across server side.
+int b2fs_truncate(const char *path, off_t size, struct fuse_file_info *info) {
+  (void) info;
   b2fs_state_t *state = fuse_get_context()->private_data;
 
+  if (!strcmp(path, B2FS_STATS_PATH)) return -EACCES;
+  else if (!strcmp(path, "/")) return -EISDIR;
+  else if (size < 0) return -EINVAL;
+
+  b2fs_hash_entry_t entry;
+  char *path_copy = malloc(sizeof(char) * (strlen(path) + 1));
+  strcpy(path_copy, path);
+  int retval = find_path(path_copy, state->fs_cache, &entry, 1);
+  free(path_copy);
+
+  if (retval == B2FS_FS_NOENT_ERROR) return -ENOENT;
+  else if (retval == B2FS_FS_NOTDIR_ERROR) return -ENOTDIR;
+  else if (entry.type == TYPE_DIRECTORY) return -EISDIR;
+
+  b2fs_file_version_t version;
+  assert(get_head_version(&entry.file, NULL, &version) == KEYTREE_SUCCESS);
+  if (*version.hidden) return -ENOENT;
+
+  resize_file(&entry.file, size);
+  if (journal_append(state, JOURNAL_TRUNCATE, path, size, NULL, 0, NULL) != B2FS_SUCCESS) return -EIO;
+
+  // With no writers around, nobody else is going to hand the file to the upload queue.
+  pthread_mutex_lock(&entry.file.buffer->lock);
+  int should_upload = entry.file.buffer->dirty && !entry.file.buffer->writers;
+  pthread_mutex_unlock(&entry.file.buffer->lock);
+  if (should_upload) enqueue_upload(state, path, &entry.file);
+
+  return B2FS_SUCCESS;
+}
+
+int b2fs_utimens(const char *path, const struct timespec times[2], struct fuse_file_info *info) {
+  (void) path;
+  (void) times;
+  (void) info;
+  return -ENOTSUP;
+}
+
+// Function opens a file for reading and/or writing. The file entry is copied into the file
+// handle so that reads and writes don't need to walk the filesystem cache again, and the
+// handle holds a reference so that an unlink or rename can't free it out from under us.
+int b2fs_open(const char *path, struct fuse_file_info *info) {
+  b2fs_state_t *state = fuse_get_context()->private_data;
+
+  // The stats file is virtual, and can only be read.
+  if (!strcmp(path, B2FS_STATS_PATH)) {
+    if ((info->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+    info->fh = 0;
+    info->direct_io = 1;
+    return B2FS_SUCCESS;
+  } else if (!strcmp(path, "/")) {
+    return -EISDIR;
+  }
+
+  b2fs_hash_entry_t entry;
+  char *path_copy = malloc(sizeof(char) * (strlen(path) + 1));
+  strcpy(path_copy, path);
+  int retval = find_path(path_copy, state->fs_cache, &entry, 1);
+  free(path_copy);
+
+  if (retval == B2FS_FS_NOENT_ERROR) return -ENOENT;
+  else if (retval == B2FS_FS_NOTDIR_ERROR) return -ENOTDIR;
+  else if (entry.type == TYPE_DIRECTORY) return -EISDIR;
+
+  // Make sure the file hasn't been hidden.
+  b2fs_file_version_t version;
+  assert(get_head_version(&entry.file, NULL, &version) == KEYTREE_SUCCESS);
+  if (*version.hidden) return -ENOENT;
+
+  b2fs_file_entry_t *handle = malloc(sizeof(b2fs_file_entry_t));
+  if (!handle) return -ENOMEM;
+  memcpy(handle, retain_file_entry(&entry.file), sizeof(b2fs_file_entry_t));
+
+  // Keep track of open handles so that release knows when the last writer goes away.
+  pthread_mutex_lock(&handle->buffer->lock);
+  if ((info->flags & O_ACCMODE) == O_RDONLY) handle->buffer->readers++;
+  else handle->buffer->writers++;
+  pthread_mutex_unlock(&handle->buffer->lock);
+
+  info->fh = (uintptr_t) handle;
+  return B2FS_SUCCESS;
+}
+
+// Function reads from the local chunk buffers, pulling any chunks that aren't resident down
+// from B2 first. Files waiting in the upload queue are always served from their buffers.
+int b2fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *info) {
+  b2fs_state_t *state = fuse_get_context()->private_data;
+  b2fs_file_entry_t *handle = (b2fs_file_entry_t *) (uintptr_t) info->fh;
+
+  // Render the stats file on every read so that it's always current.
+  if (!strcmp(path, B2FS_STATS_PATH)) {
+    char stats[B2FS_LARGE_GENERIC_BUFFER];
+    int len = render_stats(state, stats, B2FS_LARGE_GENERIC_BUFFER);
+    if (offset >= len) return 0;
+    size = MIN(size, (size_t) (len - offset));
+    memcpy(buf, stats + offset, size);
+    return size;
+  } else if (!handle) {
+    return -EBADF;
+  }
+
+  // Clamp the read to the end of the file.
+  size_t total = file_size(handle);
+  if ((size_t) offset >= total) return 0;
+  size = MIN(size, total - offset);
+
+  for (size_t pos = offset; pos < offset + size;) {
+    int chunk_num = pos / B2FS_CHUNK_SIZE, chunk_offset = pos % B2FS_CHUNK_SIZE;
+    size_t len = MIN((size_t) (B2FS_CHUNK_SIZE - chunk_offset), offset + size - pos);
+
+    b2fs_file_chunk_t *chunk = load_chunk(state, handle, chunk_num, 1);
+    if (!chunk) return pos > (size_t) offset ? (int) (pos - offset) : -EIO;
+
+    pthread_mutex_lock(&handle->buffer->lock);
+    memcpy(buf + (pos - offset), chunk->data + chunk_offset, len);
+    pthread_mutex_unlock(&handle->buffer->lock);
+    pos += len;
+  }
+
+  return size;
+}
+
+// Function writes into the local chunk buffers. Nothing is sent to B2 until the file is
+// released or fsync'd.
+int b2fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *info) {
+  b2fs_state_t *state = fuse_get_context()->private_data;
+  b2fs_file_entry_t *handle = (b2fs_file_entry_t *) (uintptr_t) info->fh;
+  if (!handle) return -EBADF;
+
+  // The write is acknowledged once we return, so it has to be in the journal by then. It goes
+  // in after the buffers so that an upload never claims to cover a write it missed.
+  int written = write_buffer(state, handle, buf, size, offset);
+  if (written > 0 && journal_append(state, JOURNAL_WRITE, path, offset, buf, written, NULL) != B2FS_SUCCESS) return -EIO;
+  return written;
+}
+
+// Function copies a write into the chunk buffers of a file and marks them dirty. Returns the
+// number of bytes written, or -EIO if nothing could be.
+int write_buffer(b2fs_state_t *state, b2fs_file_entry_t *handle, const char *buf, size_t size, off_t offset) {
+  load_buffer_state(handle);
+  for (size_t pos = offset; pos < offset + size;) {
+    int chunk_num = pos / B2FS_CHUNK_SIZE, chunk_offset = pos % B2FS_CHUNK_SIZE;
+    size_t len = MIN((size_t) (B2FS_CHUNK_SIZE - chunk_offset), offset + size - pos);
+
+    // The old contents aren't fetched up front. Only blocks this write leaves partly in place
+    // have to be filled in now, and everything else waits until somebody reads it.
+    int first = chunk_offset / B2FS_BLOCK_SIZE, last = (chunk_offset + len - 1) / B2FS_BLOCK_SIZE;
+    b2fs_file_chunk_t *chunk = load_chunk(state, handle, chunk_num, 0);
+    int retval = chunk ? B2FS_SUCCESS : B2FS_NETWORK_ERROR;
+    if (retval == B2FS_SUCCESS && chunk_offset % B2FS_BLOCK_SIZE) {
+      retval = fill_chunk(state, handle, chunk, first, first + 1);
+    }
+    if (retval == B2FS_SUCCESS && (chunk_offset + len) % B2FS_BLOCK_SIZE) {
+      retval = fill_chunk(state, handle, chunk, last, last + 1);
+    }
+    if (retval != B2FS_SUCCESS) return pos > (size_t) offset ? (int) (pos - offset) : -EIO;
+
+    pthread_mutex_lock(&handle->buffer->lock);
+    memcpy(chunk->data + chunk_offset, buf + (pos - offset), len);
+    mark_blocks_resident(chunk, first, last + 1);
+    if (pos == handle->buffer->digest.length) sha1_update(&handle->buffer->digest, chunk->data + chunk_offset, len);
+    else if (pos < handle->buffer->digest.length) sha1_init(&handle->buffer->digest);
+    chunk->size = MAX(chunk->size, (int) (chunk_offset + len));
+    chunk->dirty = 1;
+    if (pos + len > handle->buffer->size) handle->buffer->size = pos + len;
+    handle->buffer->dirty = 1;
+    pthread_mutex_unlock(&handle->buffer->lock);
+    pos += len;
+  }
+
+  return size;
+}
+
+// TODO: Implement this function.
+int b2fs_statfs(const char *path, struct statvfs *buf) {
+  return -ENOTSUP;
+}
+
+// Function is called once the last reference to an open file goes away. If the file was
+// written, it's handed off to the upload queue and the function returns immediately.
+int b2fs_release(const char *path, struct fuse_file_info *info) {
+  b2fs_state_t *state = fuse_get_context()->private_data;
+  b2fs_file_entry_t *handle = (b2fs_file_entry_t *) (uintptr_t) info->fh;
+  if (!handle) return B2FS_SUCCESS;
+
+  pthread_mutex_lock(&handle->buffer->lock);
+  if ((info->flags & O_ACCMODE) == O_RDONLY) handle->buffer->readers--;
+  else handle->buffer->writers--;
+  int should_upload = handle->buffer->dirty && !handle->buffer->writers;
+  pthread_mutex_unlock(&handle->buffer->lock);
+
+  if (should_upload) enqueue_upload(state, path, handle);
+  destroy_file_entry(handle);
+  free(handle);
+  return B2FS_SUCCESS;
+}
+
+// Function acts as a barrier for a single file. Any buffered writes are queued for upload,
+// and then we wait for the file's uploads, and only the file's uploads, to finish.
+int b2fs_fsync(const char *path, int crap, struct fuse_file_info *info) {
+  (void) crap;
+  b2fs_state_t *state = fuse_get_context()->private_data;
+  b2fs_file_entry_t *handle = (b2fs_file_entry_t *) (uintptr_t) info->fh;
+  if (!handle) return B2FS_SUCCESS;
+
+  pthread_mutex_lock(&handle->buffer->lock);
+  int dirty = handle->buffer->dirty;
+  pthread_mutex_unlock(&handle->buffer->lock);
+
+  if (dirty) enqueue_upload(state, path, handle);
+
+  // With local durability, everything acknowledged is already in the journal, which only has
+  // to reach the disk. B2 catches up in the background.
+  if (state->config.durability == DURABILITY_LOCAL) return journal_commit(state) == B2FS_SUCCESS ? B2FS_SUCCESS : -EIO;
+  return wait_for_durable(state, handle) == B2FS_SUCCESS ? B2FS_SUCCESS : -EIO;
+}
+
+// Called on every close(). Uploads happen on release, and blocking here would defeat the
+// point of the upload queue, so there's nothing to do.
+int b2fs_flush(const char *path, struct fuse_file_info *info) {
+  (void) path;
+  (void) info;
+  return B2FS_SUCCESS;
+}
+
+// B2FS doesn't currently support permissions, so this just checks that the
+// entry in question actually exists and returns success.
+int b2fs_access(const char *path, int mode) {
+  (void) mode;
+  b2fs_state_t *state = fuse_get_context()->private_data;
+
+  if (!strcmp(path, B2FS_STATS_PATH)) return B2FS_SUCCESS;
+
   if (strcmp(path, "/")) {
     b2fs_hash_entry_t entry;
-    char *path_copy = malloc(sizeof(char) * (strlen(path) + 1));
-    strcpy(path_copy, path);
-    int retval = find_path(path_copy, state->fs_cache, &entry, 1);
-    free(path_copy);
+    int retval = lookup_path(state, path, &entry);
 
     // Error handling and return.
     if (retval == B2FS_FS_NOENT_ERROR) return -ENOENT;
@@ -993,26 +2449,79 @@ int b2fs_access(const char *path, int mode) {
   }
 }
 
-// 
-int b2_list_versions(hash_t *fs_cache, const char *target_path, keytree_t *synced) {
+// Function copies a range of one file into another. Whenever the result can be assembled
+// from objects already in B2, B2 does the copying and only the short edges that can't stand
+// as parts on their own pass through here. Anything else is copied through the buffers.
+ssize_t b2fs_copy_file_range(const char *path_in, struct fuse_file_info *info_in, off_t offset_in,
+    const char *path_out, struct fuse_file_info *info_out, off_t offset_out, size_t size, int flags) {
   b2fs_state_t *state = fuse_get_context()->private_data;
+  b2fs_file_entry_t *source = (b2fs_file_entry_t *) (uintptr_t) info_in->fh;
+  b2fs_file_entry_t *dest = (b2fs_file_entry_t *) (uintptr_t) info_out->fh;
+
+  // The kernel falls back to reading and writing if we can't help.
+  if (flags) return -EINVAL;
+  else if (!source || !dest) return -EOPNOTSUPP;
+  else if (offset_in < 0 || offset_out < 0) return -EINVAL;
+
+  size_t total = file_size(source);
+  if ((size_t) offset_in >= total) return 0;
+  size = MIN(size, total - offset_in);
+
+  if (copy_range_remote(state, path_out, source, offset_in, dest, offset_out, size) == B2FS_SUCCESS) {
+    return size;
+  }
+
+  char *buf = malloc(sizeof(char) * B2FS_CHUNK_SIZE);
+  if (!buf) return -ENOMEM;
+  size_t copied = 0;
+  while (copied < size) {
+    int len = MIN((size_t) B2FS_CHUNK_SIZE, size - copied);
+    int read = b2fs_read(path_in, buf, len, offset_in + copied, info_in);
+    if (read <= 0) break;
+
+    int written = b2fs_write(path_out, buf, read, offset_out + copied, info_out);
+    if (written > 0) copied += written;
+    if (written != read) break;
+  }
+  free(buf);
+
+  return copied ? (ssize_t) copied : -EIO;
+}
+
+// Function lists file versions from B2. Given a cache, every version in the bucket goes into
+// it, or only those inside shard if one is given. Otherwise the versions of target_path are
+// put in synced.
+// Responses are parsed as they arrive, a record at a time, by receive_listing. Once the listing
+// has run past what the caller asked for, the transfer is cut short. Whole bucket listings hand
+// their records to a builder thread, and the next page is requested the moment the cursor for
+// it arrives, so the network never waits on the cache.
+int b2_list_versions(b2fs_state_t *state, hash_t *fs_cache, const char *target_path, keytree_t *synced, b2fs_list_shard_t *shard) {
+  b2fs_list_stream_t stream;
+
+  // The record buffer is reused by every page, and only ever grows to the largest record.
+  memset(&stream, 0, sizeof(b2fs_list_stream_t));
+  stream.state = state;
+  stream.fs_cache = fs_cache;
+  stream.target_path = target_path;
+  stream.synced = synced;
+  stream.shard = shard;
+  if (fs_cache && start_list_builder(&stream) != B2FS_SUCCESS) return B2FS_NOMEM_ERROR;
 
   // Do-While loop works as a conditional retry-loop if our auth token is expired.
-  int do_again;
+  int do_again, retval = B2FS_SUCCESS;
   do {
     CURL *curl = curl_easy_init();
     CURLcode res;
     char start_fileid[B2FS_SMALL_GENERIC_BUFFER], start_filename[B2FS_SMALL_GENERIC_BUFFER];
     char body[B2FS_SMALL_GENERIC_BUFFER];
-    b2fs_string_t response;
     do_again = 0;
-    memset(&response, 0, sizeof(b2fs_string_t));
     memset(start_fileid, 0, sizeof(char) * B2FS_SMALL_GENERIC_BUFFER);
     memset(start_filename, 0, sizeof(char) * B2FS_SMALL_GENERIC_BUFFER);
 
-    // If the caller is requesting a specific file, request to start listing file versions
-    // from there.
+    // If the caller is requesting a specific file, or a shard, request to start listing file
+    // versions from there.
     if (target_path) strcpy(start_filename, target_path);
+    else if (shard) strcpy(start_filename, shard->start);
 
     // Big, dirty, macro to handle all of the boilerplate cURL initialization stuff.
     // Acquire read-lock to ensure we're using the most recent auth tokens and everything.
@@ -1024,16 +2533,14 @@ int b2_list_versions(hash_t *fs_cache, const char *target_path, keytree_t *synce
         state->token,
         state->lock,
         "Authorization: %s",
-        response,
-        receive_string,
+        stream,
+        receive_listing,
         1);
     pthread_rwlock_unlock(&state->lock);
 
-    // Loop until all files have been loaded.
-    // Declare found_file flag to jump out early when searching for a particular
-    // file.
-    int found_file = 0;
-    while (!found_file && strcmp(start_filename, "null") && strcmp(start_fileid, "null")) {
+    // Loop until all files have been loaded, or until the listing has gone past the target file
+    // or the end of the shard.
+    while (!list_stopped(&stream) && strcmp(start_filename, "null") && strcmp(start_fileid, "null")) {
       // Set POST body.
       if (strlen(start_filename) && strlen(start_fileid)) {
         // I hate putting single calls on multiple lines, but this is otherwise too long.
@@ -1041,420 +2548,4543 @@ int b2_list_versions(hash_t *fs_cache, const char *target_path, keytree_t *synce
             "{\"bucketId\":\"%s\",\"startFileName\":\"%s\",\"startFileId\":\"%s\",\"maxFileCount\":1000}",
             state->config.bucket_id, start_filename, start_fileid);
       } else if (strlen(start_filename)) {
-        sprintf(body, "{\"bucketId\":\"%s\",\"startFileName\":\"%s\"}", state->config.bucket_id, start_filename);
+        sprintf(body, "{\"bucketId\":\"%s\",\"startFileName\":\"%s\"%s}",
+            state->config.bucket_id, start_filename, shard ? ",\"maxFileCount\":1000" : "");
       } else {
         sprintf(body, "{\"bucketId\":\"%s\",\"maxFileCount\":1000}", state->config.bucket_id);
       }
       curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
 
-      // Perform request.
-      if ((res = curl_easy_perform(curl)) == CURLE_OK) {
+      // Perform request. Stopping early shows up as a write error.
+      stream.depth = stream.in_string = stream.escaped = 0;
+      stream.record.ptr = 0;
+      stream.outer_len = 0;
+      *stream.outer = '\0';
+      res = curl_easy_perform(curl);
+      int stopped = list_stopped(&stream);
+      if (res == CURLE_WRITE_ERROR && stopped && !stream.error) res = CURLE_OK;
+
+      if (res == CURLE_OK) {
         long code;
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
 
         if (code == 200) {
-          // Our request was accepted! Get ready to parse json response.
-          int token_count = JSMN_ERROR_NOMEM;
+          // Every record has already been handled. All that's left is where the next page
+          // starts, which is outside of the files array.
+          jsmntok_t tokens[B2FS_MICRO_GENERIC_BUFFER];
           jsmn_parser parser;
-          jsmntok_t *tokens = malloc(sizeof(jsmntok_t) * B2FS_MED_GENERIC_BUFFER);
-
-          // Make sure enough memory is available, and parse response.
-          for (int i = 1; token_count == JSMN_ERROR_NOMEM; i++) {
-            jsmn_init(&parser);
-            token_count = jsmn_parse(&parser, response.str, strlen(response.str), tokens, B2FS_MED_GENERIC_BUFFER * i);
-            if (token_count == JSMN_ERROR_NOMEM) {
-              void *tmp = realloc(tokens, sizeof(jsmntok_t) * (B2FS_MED_GENERIC_BUFFER * (i + 1)));
-              if (!tmp) {
-                if (tokens) free(tokens);
-                curl_slist_free_all(headers);
-                curl_easy_cleanup(curl);
-                return B2FS_NOMEM_ERROR;
-              }
-              tokens = tmp;
-            } else if (token_count == JSMN_ERROR_INVAL || token_count == JSMN_ERROR_PART) {
-              write_log(LEVEL_DEBUG, "B2FS: B2 returned invalid JSON during list_file_versions: %s...\n", response.str);
-              if (tokens) free(tokens);
-              curl_slist_free_all(headers);
-              curl_easy_cleanup(curl);
-              return B2FS_NETWORK_API_ERROR;
-            }
+          jsmn_init(&parser);
+          int token_count = stopped ? 0 : jsmn_parse(&parser, stream.outer, stream.outer_len, tokens, B2FS_MICRO_GENERIC_BUFFER);
+          if (token_count < 0) {
+            write_log(LEVEL_DEBUG, "B2FS: B2 returned invalid JSON during list_file_versions: %s...\n", stream.outer);
+            retval = B2FS_NETWORK_API_ERROR;
+            break;
           }
 
           // Zero start_filename and start_fileid to ensure null termination.
           memset(start_filename, 0, sizeof(char) * B2FS_SMALL_GENERIC_BUFFER);
           memset(start_fileid, 0, sizeof(char) * B2FS_SMALL_GENERIC_BUFFER);
-          for (int i = 1; !found_file && i < token_count; i++) {
-            jsmntok_t *key = &tokens[i++], *value = &tokens[i++];
-            int len = value->end - value->start, token_index = i;
-
-            if (jsmn_iskey(response.str, key, "files")) {
-              for (int j = 0; j < value->size; j++) {
-                jsmntok_t *file = &tokens[token_index++];
-                b2fs_hash_entry_t entry;
-                b2fs_file_version_t version;
-                char **path_pieces, filename[B2FS_MED_GENERIC_BUFFER];
-                long timestamp;
-
-                // Initialize this file version.
-                init_file_version(&version);
-
-                // Parse out file path pieces and file size.
-                for (int k = 0; k < file->size; k++) {
-                  jsmntok_t *obj_key = &tokens[token_index++], *obj_value = &tokens[token_index++];
-                  int obj_len = obj_value->end - obj_value->start;
-
-                  if (jsmn_iskey(response.str, obj_key, "fileName")) {
-                    // Copy filename into local buffer to split into pieces.
-                    memset(filename, 0, sizeof(char) * B2FS_MED_GENERIC_BUFFER);
-                    memcpy(filename, response.str + obj_value->start, obj_len);
-
-                    // If the caller specified an exact file that we're looking for,
-                    // skip any that aren't the target.
-                    if (target_path && strcmp(target_path, filename) && found_file) break;
-                    else if (target_path && strcmp(target_path, filename)) continue;
-
-                    // Split path.
-                    path_pieces = split_path(filename);
-                  } else if (jsmn_iskey(response.str, obj_key, "size")) {
-                    version.size = strtol(response.str + obj_value->start, NULL, 10);
-                  } else if (jsmn_iskey(response.str, obj_key, "uploadTimestamp")) {
-                    timestamp = strtol(response.str + obj_value->start, NULL, 10);
-                  } else if (jsmn_iskey(response.str, obj_key, "fileId")) {
-                    memset(version.version_id, 0, sizeof(char) * B2FS_SMALL_GENERIC_BUFFER);
-                    memcpy(version.version_id, response.str + obj_value->start, obj_len);
-                  } else if (jsmn_iskey(response.str, obj_key, "action")) {
-                    // Set the  hidden flag if the action is set to hide.
-                    if (!strncmp(response.str + obj_value->start, "hide", obj_len)) {
-                      *version.hidden = 1;
-                    }
-                  } else {
-                    // Unknown key returned from B2. Not necessarily a problem, but we need
-                    // to make sure it doesn't screw up our parsing.
-                    switch (obj_value->type) {
-                      case JSMN_OBJECT:
-                        token_index += obj_value->size * 2;
-                        break;
-                      case JSMN_ARRAY:
-                        token_index += obj_value->size;
-                      default:
-                        break;
-                    }
-                  }
-                }
-
-                // Continue to propagate breaking if we've found our target file.
-                if (target_path && strcmp(target_path, filename) && found_file) {
-                  free(path_pieces);
-                  break;
-                }
-
-                // Validate and add liveness flags.
-                assert(strlen(version.version_id) > 0);
-                *version.live = 1;
-                *version.synced = 1;
-                if (fs_cache) {
-                  // Make all intermediate directories and grab parent.
-                  b2fs_dir_entry_t directory;
-                  hash_t *dir = make_path(path_pieces, fs_cache, &directory);
-
-                  if (hash_get(dir, path_pieces[0], &entry) != HASH_SUCCESS) {
-                    // Hash entry does not exist. This is the first time we've seen this file.
-                    entry.type = TYPE_FILE;
-                    init_file_entry(&entry.file);
-                    hash_put(dir, path_pieces[0], &entry);
-                  }
-                  keytree_insert(entry.file.versions, &timestamp, &version);
-
-                  // Highly inelegant way of persisting directory deletions across restarts when B2FS is
-                  // configured to only hide deleted files. B2 doesn't support hiding directories, so there's
-                  // no way to disambiguate between a directory that exists, but has had all of its contents
-                  // hidden, and a directory that has been explicitly deleted. Thus, in the latter case, we
-                  // insert a .b2fs_hidefile entry to assert that the directory should, in fact, be hidden.
-                  // Pretty not great, but it works.
-                  if (!strcmp(path_pieces[0], ".b2fs_hidefile")) *directory.hidden = 1;
-                } else if (target_path && synced) {
-                  found_file = 1;
-                  keytree_insert(synced, &timestamp, &version);
-                } else {
-                  write_log(LEVEL_DEBUG, "B2FS: Got into invalid branch for b2_list_versions...\n");
-                  return B2FS_ERROR;
-                }
-
-                // Clean up and prepare for next iteration.
-                free(path_pieces);
-              }
-
-              // Back up the token index for the outer loop.
-            } else if (jsmn_iskey(response.str, key, "nextFileName")) {
-              memcpy(start_filename, response.str + value->start, len);
-            } else if (jsmn_iskey(response.str, key, "nextFileId")) {
-              memcpy(start_fileid, response.str + value->start, len);
-            } else {
-              // We received an unknown key from B2. Log it, but try to keep going.
-              LOG_KEY(response.str, key, "b2fs_init");
+          for (int i = 1; i < token_count - 1; i++) {
+            jsmntok_t *key = &tokens[i], *value = &tokens[i + 1];
+            int len = value->end - value->start;
+            if (key->parent != 0 || key->type != JSMN_STRING || len >= B2FS_SMALL_GENERIC_BUFFER) continue;
+
+            if (jsmn_iskey(stream.outer, key, "nextFileName")) {
+              memcpy(start_filename, stream.outer + value->start, len);
+            } else if (jsmn_iskey(stream.outer, key, "nextFileId")) {
+              memcpy(start_fileid, stream.outer + value->start, len);
             }
-
-            // Prepare for next iteration.
-            i = --token_index;
           }
 
-          // Clear the response string to prepare for the next iteration.
-          free(response.str);
-          memset(&response, 0, sizeof(b2fs_string_t));
+          // Names come back in order, so if the next page starts past the end of the shard, or
+          // past the target file, there's no point asking for it.
+          if (shard && strlen(shard->end) && strcmp(start_filename, "null") && strcmp(start_filename, shard->end) >= 0) break;
+          else if (target_path && strcmp(start_filename, target_path)) break;
         } else {
-          // B2 returned an error.
-          write_log(LEVEL_DEBUG, "B2FS: B2 returned error code %ld with message: %s\n", code, response.str);
+          // B2 returned an error, and all of it ended up in outer.
+          write_log(LEVEL_DEBUG, "B2FS: B2 returned error code %ld with message: %s\n", code, stream.outer);
 
           // Attempt to handle the returned error.
-          int retval = handle_b2_error(state, response.str, tok);
-
-          // Check the reason the error was generated.
           // TODO: Currently only one supported reason, so I may need to add more clauses here eventually.
-          if (retval == B2FS_NETWORK_TOKEN_ERROR) {
+          if (handle_b2_error(state, stream.outer, tok) == B2FS_NETWORK_TOKEN_ERROR) {
             do_again = 1;
-            free(response.str);
-            memset(&response, 0, sizeof(b2fs_string_t));
-            break;
           } else {
             // Error couldn't be handled. We're in the process of starting up, so just shutdown.
-            curl_slist_free_all(headers);
-            curl_easy_cleanup(curl);
-            free(response.str);
-            return B2FS_NETWORK_API_ERROR;
+            retval = B2FS_NETWORK_API_ERROR;
           }
+          break;
         }
+      } else if (stopped && stream.error) {
+        break;
       } else {
         write_log(LEVEL_DEBUG, "B2FS: cURL failed with error %s during list_file_versions.\n", curl_easy_strerror(res));
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
-        return B2FS_NETWORK_ERROR;
+        retval = B2FS_NETWORK_ERROR;
+        break;
       }
     }
     curl_slist_free_all(headers);
     curl_easy_cleanup(curl);
   } while (do_again);
+  free(stream.record.str);
 
-  return B2FS_SUCCESS;
+  // Whatever the builder is still working through has to be in the cache before we return.
+  if (stream.pipelined) stop_list_builder(&stream);
+  if (stream.error) retval = stream.error;
+
+  return retval;
 }
 
-size_t receive_string(void *data, size_t size, size_t nmembers, void *voidarg) {
-  b2fs_string_t *output = voidarg;
+// Write callback for b2_list_versions. Tracks how deeply nested the response is, so that each
+// object in the files array can be cut out and handed to list_record the moment its closing
+// brace arrives. The only objects nested that deeply are the ones in the files array. Anything
+// outside of the array goes into outer, and returning short stops the transfer once we're done.
+size_t receive_listing(void *data, size_t size, size_t nmembers, void *voidarg) {
+  b2fs_list_stream_t *stream = voidarg;
+  const char *bytes = data;
+  size_t total = size * nmembers;
+
+  int stopped = list_stopped(stream);
+  for (size_t i = 0; i < total && !stopped; i++) {
+    char c = bytes[i];
+    int before = stream->depth;
+    if (stream->in_string) {
+      if (stream->escaped) stream->escaped = 0;
+      else if (c == '\\') stream->escaped = 1;
+      else if (c == '"') stream->in_string = 0;
+    } else if (c == '"') {
+      stream->in_string = 1;
+    } else if (c == '{' || c == '[') {
+      stream->depth++;
+    } else if (c == '}' || c == ']') {
+      stream->depth--;
+    }
 
-  // Check for resize.
-  if (output->len < (size * nmembers) + output->ptr + 1) {
-    unsigned int power = 1;
-    while (power <= (size * nmembers) + output->ptr + 1) power <<= 1;
-    void *tmp = realloc(output->str, power);
-    if (!tmp) return 0;
-    output->str = tmp;
+    if (MAX(before, stream->depth) >= 3) {
+      // Part of a record.
+      b2fs_string_t *record = &stream->record;
+      if (record->ptr + 2 > record->len) {
+        unsigned int len = record->len ? record->len * 2 : B2FS_MED_GENERIC_BUFFER;
+        void *tmp = realloc(record->str, len);
+        if (!tmp) {
+          stopped = stop_listing(stream, B2FS_NOMEM_ERROR);
+          break;
+        }
+        record->str = tmp;
+        record->len = len;
+      }
+      record->str[record->ptr++] = c;
+      record->str[record->ptr] = '\0';
+
+      if (stream->depth == 2) {
+        stopped = hand_off_record(stream);
+        record->ptr = 0;
+      }
+    } else if (MAX(before, stream->depth) < 2 || before != stream->depth) {
+      // Outside of the files array, or one of its brackets. Separators between records are
+      // dropped, which keeps outer valid JSON.
+      if (stream->outer_len + 1 >= B2FS_LARGE_GENERIC_BUFFER) {
+        stopped = stop_listing(stream, B2FS_NETWORK_API_ERROR);
+        break;
+      }
+      stream->outer[stream->outer_len++] = c;
+      stream->outer[stream->outer_len] = '\0';
+    }
   }
 
-  memcpy(output->str + output->ptr, data, size * nmembers);
-  output->str[output->ptr + (size * nmembers)] = '\0';
-  output->ptr += size *nmembers;
-  return size * nmembers;
+  return stopped ? 0 : total;
 }
 
-// Given a file entry, iterates across the file versions and checks for an incomplete
-// entry. If it finds any, replaced them all with B2 version.
-int b2_sync_versions(b2fs_file_entry_t *entry, const char *path, int force) {
-  int should_sync = force;
+// Function passes a finished record on to the builder, waiting for it to catch up if it's more
+// than B2FS_LIST_BACKLOG records behind, or handles it right here if there's no builder.
+// Returns whether the listing should stop.
+int hand_off_record(b2fs_list_stream_t *stream) {
+  b2fs_string_t *record = &stream->record;
+  if (!stream->pipelined) {
+    int retval = list_record(stream, record->str, record->ptr);
+    return retval != B2FS_SUCCESS ? stop_listing(stream, retval) : stream->done;
+  }
 
-  // Iterate across cached file versions.
+  char *copy = malloc(sizeof(char) * (record->ptr + 1));
+  if (!copy) return stop_listing(stream, B2FS_NOMEM_ERROR);
+  memcpy(copy, record->str, record->ptr + 1);
+
+  pthread_mutex_lock(&stream->lock);
+  while (stream->queued >= B2FS_LIST_BACKLOG && !stream->done && !stream->error) {
+    pthread_cond_wait(&stream->drained, &stream->lock);
+  }
+  int stopped = stream->done || stream->error;
+  if (!stopped) {
+    queue_enqueue(stream->records, &copy);
+    stream->queued++;
+    pthread_cond_signal(&stream->ready);
+  }
+  pthread_mutex_unlock(&stream->lock);
+  if (stopped) free(copy);
+
+  return stopped;
+}
+
+// Function ends a listing early, either because it's done, or with an error, keeping the first
+// one. Returns true, for convenience.
+int stop_listing(b2fs_list_stream_t *stream, int error) {
+  if (stream->pipelined) pthread_mutex_lock(&stream->lock);
+  if (error == B2FS_SUCCESS) stream->done = 1;
+  else if (!stream->error) stream->error = error;
+  if (stream->pipelined) {
+    pthread_cond_broadcast(&stream->drained);
+    pthread_mutex_unlock(&stream->lock);
+  }
+  return 1;
+}
+
+int list_stopped(b2fs_list_stream_t *stream) {
+  if (!stream->pipelined) return stream->done || stream->error;
+
+  pthread_mutex_lock(&stream->lock);
+  int stopped = stream->done || stream->error;
+  pthread_mutex_unlock(&stream->lock);
+  return stopped;
+}
+
+int start_list_builder(b2fs_list_stream_t *stream) {
+  stream->records = create_queue(NULL, sizeof(char *));
+  if (!stream->records) return B2FS_NOMEM_ERROR;
+  pthread_mutex_init(&stream->lock, NULL);
+  pthread_cond_init(&stream->ready, NULL);
+  pthread_cond_init(&stream->drained, NULL);
+
+  // Without a builder, records are just handled as they arrive.
+  stream->pipelined = !pthread_create(&stream->builder, NULL, list_builder, stream);
+  if (!stream->pipelined) {
+    destroy_queue(stream->records);
+    pthread_cond_destroy(&stream->drained);
+    pthread_cond_destroy(&stream->ready);
+    pthread_mutex_destroy(&stream->lock);
+  }
+  return B2FS_SUCCESS;
+}
+
+// Function waits for the builder to finish off the records it has, and stops it.
+void stop_list_builder(b2fs_list_stream_t *stream) {
+  pthread_mutex_lock(&stream->lock);
+  stream->finished = 1;
+  pthread_cond_signal(&stream->ready);
+  pthread_mutex_unlock(&stream->lock);
+  pthread_join(stream->builder, NULL);
+
+  // Anything left over was cut off by an error.
+  char *json;
+  while (queue_dequeue(stream->records, &json) == QUEUE_SUCCESS) free(json);
+  destroy_queue(stream->records);
+  pthread_cond_destroy(&stream->drained);
+  pthread_cond_destroy(&stream->ready);
+  pthread_mutex_destroy(&stream->lock);
+  stream->pipelined = 0;
+}
+
+// Function puts queued records into the cache until the listing is finished, or fails.
+void *list_builder(void *voidarg) {
+  b2fs_list_stream_t *stream = voidarg;
+  char *json;
+
+  // Helpers find the state through the FUSE context, which is per thread, and empty on any
+  // thread FUSE didn't start.
+  fuse_get_context()->private_data = stream->state;
+
+  pthread_mutex_lock(&stream->lock);
+  while (!stream->error) {
+    if (queue_dequeue(stream->records, &json) != QUEUE_SUCCESS) {
+      if (stream->finished) break;
+      pthread_cond_wait(&stream->ready, &stream->lock);
+      continue;
+    }
+    stream->queued--;
+    pthread_cond_signal(&stream->drained);
+    pthread_mutex_unlock(&stream->lock);
+
+    int retval = list_record(stream, json, strlen(json));
+    free(json);
+
+    pthread_mutex_lock(&stream->lock);
+    if (retval != B2FS_SUCCESS && !stream->error) stream->error = retval;
+    if (stream->done || stream->error) pthread_cond_broadcast(&stream->drained);
+  }
+  pthread_mutex_unlock(&stream->lock);
+
+  return NULL;
+}
+
+// Function handles a single file version from a listing, given as its JSON object. Once the
+// listing has run past what the caller asked for, done is set and the rest are ignored.
+int list_record(b2fs_list_stream_t *stream, char *json, size_t length) {
   b2fs_file_version_t version;
-  int num_iterations = keytree_size(entry->versions);
-  keytree_iterator_t *it = keytree_iterate_start(entry->versions, NULL);
-  while (num_iterations-- && !should_sync && keytree_iterate_next(it, NULL, &version) == KEYTREE_SUCCESS) {
-    if (*version.live && !*version.synced) should_sync = 1;
+  b2fs_hash_entry_t entry;
+  listing_record_t fields;
+  char filename[B2FS_MED_GENERIC_BUFFER];
+
+  // Records all have the same shape, so rather than tokenizing the whole thing, only the fields
+  // we need are pulled out.
+  if (extract_listing_record(json, length, &fields) != LISTING_SUCCESS) {
+    write_log(LEVEL_DEBUG, "B2FS: B2 returned invalid JSON during list_file_versions: %s...\n", json);
+    return B2FS_NETWORK_API_ERROR;
   }
-  keytree_iterate_stop(it);
 
-  // Sync any entries needing it.
-  if (should_sync) {
-    // First get file history from B2.
-    keytree_t *versions = create_keytree(NULL, destroy_file_version, rev_intcmp, sizeof(size_t), sizeof(b2fs_file_version_t));
+  // Initialize this file version, and copy the fields over.
+  init_file_version(&version);
+  memset(filename, 0, sizeof(char) * B2FS_MED_GENERIC_BUFFER);
+  size_t timestamp = fields.upload_timestamp;
+  version.size = fields.size;
+  if (fields.file_name_len < B2FS_MED_GENERIC_BUFFER) memcpy(filename, fields.file_name, fields.file_name_len);
+  if (fields.file_id_len < B2FS_SMALL_GENERIC_BUFFER) memcpy(version.version_id, fields.file_id, fields.file_id_len);
+
+  // Large files report "none" for their digest, which simply never matches one.
+  if (fields.content_sha1_len < SHA1_HEX_LEN) memcpy(version.content_sha1, fields.content_sha1, fields.content_sha1_len);
+
+  // Set the  hidden flag if the action is set to hide.
+  if (fields.action_len == 4 && !memcmp(fields.action, "hide", 4)) *version.hidden = 1;
+
+  // The listing starts at the target file, so anything else means we're past it. Likewise for
+  // the end of the shard, where the next shard picks up.
+  int past_target = stream->target_path && strcmp(stream->target_path, filename);
+  int past_end = stream->shard && strlen(stream->shard->end) && strcmp(filename, stream->shard->end) >= 0;
+  if (past_target || past_end) {
+    destroy_file_version(&version);
+    stop_listing(stream, B2FS_SUCCESS);
+    return B2FS_SUCCESS;
+  } else if (!strlen(filename) || !strlen(version.version_id)) {
+    destroy_file_version(&version);
+    return B2FS_NETWORK_API_ERROR;
+  }
 
-    // Call list_versions with a given path. Should hopefully only require one call.
-    int retval = b2_list_versions(NULL, path, versions);
+  // Validate and add liveness flags.
+  *version.live = 1;
+  *version.synced = 1;
+  if (stream->fs_cache) {
+    // Make all intermediate directories and grab parent.
+    b2fs_dir_entry_t directory = {NULL, NULL, NULL};
+    char **path_pieces = split_path(filename);
+    hash_t *dir = path_pieces[0] ? make_path(path_pieces, stream->fs_cache, &directory) : NULL;
+    if (!dir) {
+      destroy_file_version(&version);
+      free(path_pieces);
+      return B2FS_SUCCESS;
+    }
 
-    // Check if our sync was a success, and if so, destroy and overwrite the old history.
-    if (retval == B2FS_SUCCESS) {
-      keytree_destroy(entry->versions);
-      entry->versions = versions;
-    } else {
-      keytree_destroy(versions);
+    if (hash_get(dir, path_pieces[0], &entry) != HASH_SUCCESS) {
+      // Hash entry does not exist. This is the first time we've seen this file.
+      entry.type = TYPE_FILE;
+      init_file_entry(&entry.file);
+      hash_put(dir, path_pieces[0], &entry);
+    }
+    if (entry.type != TYPE_FILE || keytree_insert(entry.file.versions, &timestamp, &version) != KEYTREE_SUCCESS) {
+      destroy_file_version(&version);
     }
 
-    return retval;
+    // Highly inelegant way of persisting directory deletions across restarts when B2FS is
+    // configured to only hide deleted files. B2 doesn't support hiding directories, so there's
+    // no way to disambiguate between a directory that exists, but has had all of its contents
+    // hidden, and a directory that has been explicitly deleted. Thus, in the latter case, we
+    // insert a .b2fs_hidefile entry to assert that the directory should, in fact, be hidden.
+    // Pretty not great, but it works.
+    if (!strcmp(path_pieces[0], ".b2fs_hidefile") && directory.hidden) {
+      *directory.hidden = 1;
+      invalidate_dentries(stream->state);
+    }
+    free(path_pieces);
+  } else if (stream->target_path && stream->synced) {
+    keytree_insert(stream->synced, &timestamp, &version);
   } else {
-    return B2FS_SUCCESS;
+    write_log(LEVEL_DEBUG, "B2FS: Got into invalid branch for b2_list_versions...\n");
+    destroy_file_version(&version);
+    return B2FS_ERROR;
   }
+
+  return B2FS_SUCCESS;
 }
 
-// As the name suggests, this function is responsible for attempting to fix an error returned
-// from B2. Currently only supports re-authentication.
-// Contrary to the semantics of the other functions, this function actually returns the type of
-// error that occured on success, and a generic network error on failure.
-int handle_b2_error(b2fs_state_t *state, char *response, char *cached_token) {
-  // Need to figure out what went wrong. Time to parse JSON.
-  int token_count = JSMN_ERROR_NOMEM;
+// Function lists the names directly inside prefix, one page of them, using B2's delimiter
+// support. Folders come back as their prefix, slash included, and are added to folders as well
+// as names. If there's more than a page, where the next page would start is added to names.
+int b2_list_names(b2fs_state_t *state, const char *prefix, array_t *names, array_t *folders) {
+  char body[B2FS_LARGE_GENERIC_BUFFER];
+  b2fs_string_t response;
   jsmn_parser parser;
-  jsmntok_t *tokens = malloc(sizeof(jsmntok_t) * B2FS_SMALL_GENERIC_BUFFER);
 
-  // Make sure enough memory is available and parse response.
+  sprintf(body, "{\"bucketId\":\"%s\",\"prefix\":\"%s\",\"delimiter\":\"/\",\"maxFileCount\":1000}",
+      state->config.bucket_id, prefix);
+  int retval = b2_post_json(state, "b2api/v1/b2_list_file_names", body, &response);
+  if (retval != B2FS_SUCCESS) return retval;
+
+  // Make sure enough memory is available, and parse response.
+  int token_count = JSMN_ERROR_NOMEM;
+  jsmntok_t *tokens = NULL;
   for (int i = 1; token_count == JSMN_ERROR_NOMEM; i++) {
+    void *tmp = realloc(tokens, sizeof(jsmntok_t) * B2FS_MED_GENERIC_BUFFER * i);
+    if (!tmp) {
+      free(tokens);
+      free(response.str);
+      return B2FS_NOMEM_ERROR;
+    }
+    tokens = tmp;
     jsmn_init(&parser);
-    token_count = jsmn_parse(&parser, response, strlen(response), tokens, B2FS_SMALL_GENERIC_BUFFER * i);
-    if (token_count == JSMN_ERROR_NOMEM) {
-      void *tmp = realloc(tokens, sizeof(jsmntok_t) * (B2FS_SMALL_GENERIC_BUFFER * (i + 1)));
+    token_count = jsmn_parse(&parser, response.str, strlen(response.str), tokens, B2FS_MED_GENERIC_BUFFER * i);
+  }
+
+  // Keys are the only strings with a value hanging off of them.
+  for (int i = 0; i < token_count - 1; i++) {
+    jsmntok_t *key = &tokens[i], *value = &tokens[i + 1];
+    int len = value->end - value->start;
+    if (key->type != JSMN_STRING || key->size != 1 || value->type != JSMN_STRING) continue;
+    else if (len >= B2FS_SMALL_GENERIC_BUFFER) continue;
+
+    int is_file = jsmn_iskey(response.str, key, "fileName");
+    if (!is_file && !jsmn_iskey(response.str, key, "nextFileName")) continue;
+    char *name = malloc(sizeof(char) * (len + 1));
+    memcpy(name, response.str + value->start, len);
+    name[len] = '\0';
+    array_push(names, &name);
+
+    if (is_file && len && name[len - 1] == '/') {
+      char *folder = malloc(sizeof(char) * (len + 1));
+      strcpy(folder, name);
+      array_push(folders, &folder);
+    }
+  }
+  free(tokens);
+  free(response.str);
+
+  return token_count < 0 ? B2FS_NETWORK_API_ERROR : B2FS_SUCCESS;
+}
+
+// Function lists every version directly inside prefix into dir, using B2's delimiter support,
+// and following the listing across as many pages as it takes. Folders become directories that
+// haven't been listed yet. Versions dir already has are left alone, so anything created locally
+// before the listing keeps its place.
+int b2_list_folder(b2fs_state_t *state, const char *prefix, b2fs_dir_entry_t *dir) {
+  char body[B2FS_LARGE_GENERIC_BUFFER], start_name[B2FS_MED_GENERIC_BUFFER], start_id[B2FS_SMALL_GENERIC_BUFFER];
+  size_t prefix_len = strlen(prefix);
+  b2fs_string_t response;
+  jsmn_parser parser;
+  int retval;
+
+  *start_name = '\0';
+  *start_id = '\0';
+  do {
+    if (strlen(start_id)) {
+      snprintf(body, B2FS_LARGE_GENERIC_BUFFER,
+          "{\"bucketId\":\"%s\",\"prefix\":\"%s\",\"delimiter\":\"/\",\"startFileName\":\"%s\",\"startFileId\":\"%s\",\"maxFileCount\":1000}",
+          state->config.bucket_id, prefix, start_name, start_id);
+    } else if (strlen(start_name)) {
+      snprintf(body, B2FS_LARGE_GENERIC_BUFFER,
+          "{\"bucketId\":\"%s\",\"prefix\":\"%s\",\"delimiter\":\"/\",\"startFileName\":\"%s\",\"maxFileCount\":1000}",
+          state->config.bucket_id, prefix, start_name);
+    } else {
+      snprintf(body, B2FS_LARGE_GENERIC_BUFFER, "{\"bucketId\":\"%s\",\"prefix\":\"%s\",\"delimiter\":\"/\",\"maxFileCount\":1000}",
+          state->config.bucket_id, prefix);
+    }
+    retval = b2_post_json(state, "b2api/v1/b2_list_file_versions", body, &response);
+    if (retval != B2FS_SUCCESS) return retval;
+
+    // Make sure enough memory is available, and parse response.
+    int token_count = JSMN_ERROR_NOMEM;
+    jsmntok_t *tokens = NULL;
+    for (int i = 1; token_count == JSMN_ERROR_NOMEM; i++) {
+      void *tmp = realloc(tokens, sizeof(jsmntok_t) * B2FS_MED_GENERIC_BUFFER * i);
       if (!tmp) {
-        write_log(LEVEL_DEBUG, "B2FS: Failed to allocate enough memory to parse B2 error message...\n");
         free(tokens);
+        free(response.str);
         return B2FS_NOMEM_ERROR;
       }
       tokens = tmp;
-    } else if (token_count == JSMN_ERROR_INVAL || token_count == JSMN_ERROR_PART) {
-      write_log(LEVEL_DEBUG, "B2FS: B2 returned an invalid error message.\n");
+      jsmn_init(&parser);
+      token_count = jsmn_parse(&parser, response.str, strlen(response.str), tokens, B2FS_MED_GENERIC_BUFFER * i);
+    }
+    if (token_count < 1 || tokens[0].type != JSMN_OBJECT) {
       free(tokens);
-      return B2FS_INVAL_ERROR;
+      free(response.str);
+      return B2FS_NETWORK_API_ERROR;
     }
-  }
-
-  for (int i = 1; i < token_count; i++) {
-    jsmntok_t *key = &tokens[i++], *value = &tokens[i];
-    int len = value->end - value->start;
 
-    if (jsmn_iskey(response, key, "code")) {
-      char reason[B2FS_SMALL_GENERIC_BUFFER];
-      memset(reason, 0, sizeof(char) * B2FS_SMALL_GENERIC_BUFFER);
-      memcpy(reason, response + value->start, len);
-      free(tokens);
+    // Top level keys say where the next page starts. A null leaves it empty, ending the listing.
+    int files = -1;
+    *start_name = '\0';
+    *start_id = '\0';
+    for (int i = 1; i < token_count - 1; i++) {
+      jsmntok_t *key = &tokens[i], *value = &tokens[i + 1];
+      int len = value->end - value->start;
+      if (key->parent != 0 || key->type != JSMN_STRING) continue;
+
+      if (jsmn_iskey(response.str, key, "files") && value->type == JSMN_ARRAY) {
+        files = i + 1;
+      } else if (value->type == JSMN_STRING && jsmn_iskey(response.str, key, "nextFileName") && len < B2FS_MED_GENERIC_BUFFER) {
+        memcpy(start_name, response.str + value->start, len);
+        start_name[len] = '\0';
+      } else if (value->type == JSMN_STRING && jsmn_iskey(response.str, key, "nextFileId") && len < B2FS_SMALL_GENERIC_BUFFER) {
+        memcpy(start_id, response.str + value->start, len);
+        start_id[len] = '\0';
+      }
+    }
 
-      // TODO: The ultimate point to this function is to be able to handle many different potential error conditions from
-      // B2, so I'll need to add more clauses here.
-      if (!strcmp(reason, "expired_auth_token")) {
-        // We received an error from B2 because our authentication token has expired. Acquire the write-lock to ensure nobody
-        // tries using the tokens while we're updating them.
-        pthread_rwlock_wrlock(&state->lock);
+    // Every object in the files array is one version, or one folder.
+    for (int i = files + 1; files > 0 && i < token_count; i++) {
+      jsmntok_t *file = &tokens[i];
+      if (file->parent != files || file->type != JSMN_OBJECT) continue;
 
-        // Now that we hold the write-lock, double check that the expired token that we used is still the one in the state
-        // struct. If so, update it, if not, somebody else got here first.
-        if (!strcmp(state->token, cached_token)) {
-          int retval = handle_authentication(state, state->config.account_id, state->config.app_key);
-          cache_auth(state);
-          pthread_rwlock_unlock(&state->lock);
-          return retval == B2FS_SUCCESS ? B2FS_NETWORK_TOKEN_ERROR : B2FS_NETWORK_ERROR;
-        } else {
-          pthread_rwlock_unlock(&state->lock);
-          return B2FS_NETWORK_TOKEN_ERROR;
+      b2fs_file_version_t version;
+      char name[B2FS_MED_GENERIC_BUFFER], action[B2FS_MICRO_GENERIC_BUFFER];
+      size_t timestamp = 0;
+      init_file_version(&version);
+      *name = '\0';
+      *action = '\0';
+      for (int k = i + 1; k < token_count - 1 && tokens[k].start < file->end; k++) {
+        jsmntok_t *key = &tokens[k], *value = &tokens[k + 1];
+        int len = value->end - value->start;
+        if (key->parent != i || key->type != JSMN_STRING) continue;
+
+        if (jsmn_iskey(response.str, key, "fileName") && len < B2FS_MED_GENERIC_BUFFER) {
+          memcpy(name, response.str + value->start, len);
+          name[len] = '\0';
+        } else if (jsmn_iskey(response.str, key, "fileId") && value->type == JSMN_STRING && len < B2FS_SMALL_GENERIC_BUFFER) {
+          memcpy(version.version_id, response.str + value->start, len);
+        } else if (jsmn_iskey(response.str, key, "contentSha1") && len < SHA1_HEX_LEN) {
+          // Large files report "none" here, which simply never matches a digest.
+          memcpy(version.content_sha1, response.str + value->start, len);
+        } else if (jsmn_iskey(response.str, key, "size")) {
+          version.size = strtoul(response.str + value->start, NULL, 10);
+        } else if (jsmn_iskey(response.str, key, "uploadTimestamp")) {
+          timestamp = strtoul(response.str + value->start, NULL, 10);
+        } else if (jsmn_iskey(response.str, key, "action") && len < B2FS_MICRO_GENERIC_BUFFER) {
+          memcpy(action, response.str + value->start, len);
+          action[len] = '\0';
         }
-      } else {
-        return B2FS_NETWORK_ERROR;
+      }
+
+      const char *leaf = name + prefix_len;
+      if (strncmp(name, prefix, prefix_len) || !*leaf) {
+        destroy_file_version(&version);
+      } else if (!strcmp(action, "folder")) {
+        destroy_file_version(&version);
+        add_listed_version(state, dir, name, leaf, NULL, 0);
+      } else {
+        *version.hidden = !strcmp(action, "hide");
+        add_listed_version(state, dir, name, leaf, &version, timestamp);
       }
     }
+    free(tokens);
+    free(response.str);
+  } while (strlen(start_name));
+  __sync_fetch_and_add(&state->stats.dirs_listed, 1);
+
+  return B2FS_SUCCESS;
+}
+
+// Function puts one entry from a folder listing into dir. Folders, which come without a
+// version, become directories of their own, and anything else is a version of the file leaf.
+// The version is either inserted or destroyed.
+void add_listed_version(b2fs_state_t *state, b2fs_dir_entry_t *dir, const char *name, const char *leaf, b2fs_file_version_t *version, size_t timestamp) {
+  b2fs_hash_entry_t entry;
+  char child[B2FS_MED_GENERIC_BUFFER], path[B2FS_MED_GENERIC_BUFFER + 1];
+
+  // Folder names keep their trailing slash.
+  strcpy(child, leaf);
+  if (!version && strlen(child) && child[strlen(child) - 1] == '/') child[strlen(child) - 1] = '\0';
+  if (!*child || strchr(child, '/') || (version && !strlen(version->version_id))) {
+    if (version) destroy_file_version(version);
+    return;
   }
 
-  // We shouldn't be able to get here if B2 returns a JSON object that fits the API docs, but the compiler doesn't
-  // know that.
-  return B2FS_NETWORK_ERROR;
+  // Put it in the directory. If someone beat us to it, use theirs.
+  if (hash_get(dir->directory, child, &entry) != HASH_SUCCESS) {
+    entry.type = version ? TYPE_FILE : TYPE_DIRECTORY;
+    if (version) init_file_entry(&entry.file);
+    else init_dir_entry(&entry.dir);
+    if (hash_put(dir->directory, child, &entry) != HASH_SUCCESS) {
+      if (version) destroy_file_entry(&entry.file);
+      else destroy_dir_entry(&entry.dir);
+      hash_get(dir->directory, child, &entry);
+    } else {
+      forget_missing(state, name);
+    }
+  }
+  if (!version) {
+    return;
+  } else if (entry.type != TYPE_FILE || has_version(entry.file.versions, version->version_id)) {
+    destroy_file_version(version);
+    return;
+  }
+
+  // Hidefiles hide the directory they're in, just like in a full listing.
+  if (!strcmp(child, ".b2fs_hidefile") && dir->hidden) {
+    *dir->hidden = 1;
+    invalidate_dentries(state);
+  }
+  *version->live = 1;
+  *version->synced = 1;
+  if (keytree_insert(entry.file.versions, &timestamp, version) == KEYTREE_DUPLICATE) {
+    destroy_file_version(version);
+    return;
+  }
+  snprintf(path, B2FS_MED_GENERIC_BUFFER + 1, "/%s", name);
+  map_file_id(state, version->version_id, path);
 }
 
-int handle_authentication(b2fs_state_t *state, char *account_id, char *app_key) {
+size_t receive_string(void *data, size_t size, size_t nmembers, void *voidarg) {
+  b2fs_string_t *output = voidarg;
+
+  // Check for resize.
+  if (output->len < (size * nmembers) + output->ptr + 1) {
+    unsigned int power = 1;
+    while (power <= (size * nmembers) + output->ptr + 1) power <<= 1;
+    void *tmp = realloc(output->str, power);
+    if (!tmp) return 0;
+    output->str = tmp;
+  }
+
+  memcpy(output->str + output->ptr, data, size * nmembers);
+  output->str[output->ptr + (size * nmembers)] = '\0';
+  output->ptr += size *nmembers;
+  return size * nmembers;
+}
+
+// Write callback for ranged downloads. Unlike receive_string, the output buffer is
+// caller-owned and fixed in size, so anything that doesn't fit aborts the transfer.
+size_t receive_range(void *data, size_t size, size_t nmembers, void *voidarg) {
+  b2fs_string_t *output = voidarg;
+
+  if (output->ptr + (size * nmembers) > output->len) return 0;
+  memcpy(output->str + output->ptr, data, size * nmembers);
+  output->ptr += size * nmembers;
+  return size * nmembers;
+}
+
+// Read callback for uploads. Streams the file's resident chunks to cURL in order.
+size_t send_file_entry(char *data, size_t size, size_t nmembers, void *voidarg) {
+  b2fs_upload_stream_t *stream = voidarg;
+  size_t wanted = size * nmembers, sent = 0;
+
+  while (sent < wanted && stream->offset < stream->size) {
+    size_t pos = stream->start + stream->offset;
+    int chunk_num = pos / B2FS_CHUNK_SIZE, chunk_offset = pos % B2FS_CHUNK_SIZE;
+    size_t len = MIN((size_t) (B2FS_CHUNK_SIZE - chunk_offset), MIN(wanted - sent, stream->size - stream->offset));
+
+    // Every chunk is loaded before the upload starts, so a missing chunk means the file was
+    // torn down out from under us.
+    b2fs_file_chunk_t *chunk;
+    if (keytree_find(stream->entry->chunks, &chunk_num, &chunk) != KEYTREE_SUCCESS) return CURL_READFUNC_ABORT;
+
+    pthread_mutex_lock(&stream->entry->buffer->lock);
+    memcpy(data + sent, chunk->data + chunk_offset, len);
+    pthread_mutex_unlock(&stream->entry->buffer->lock);
+    sent += len;
+    stream->offset += len;
+  }
+
+  return sent;
+}
+
+// Read callback for uploads that are already sitting in memory, like packs.
+size_t send_buffer(char *data, size_t size, size_t nmembers, void *voidarg) {
+  b2fs_upload_stream_t *stream = voidarg;
+  size_t len = MIN(size * nmembers, stream->size - stream->offset);
+
+  memcpy(data, stream->data + stream->offset, len);
+  stream->offset += len;
+  return len;
+}
+
+// Function downloads len bytes, starting at offset, of the given file version into buf.
+int b2_download_range(b2fs_state_t *state, char *file_id, size_t offset, size_t len, char *buf) {
+  // Do-While loop works as a conditional retry-loop if our auth token is expired.
+  int do_again;
+  do {
+    CURL *curl = curl_easy_init();
+    CURLcode res;
+    char uri[B2FS_SMALL_GENERIC_BUFFER], range[B2FS_MICRO_GENERIC_BUFFER];
+    b2fs_string_t response;
+    do_again = 0;
+    response.str = buf;
+    response.len = len;
+    response.ptr = 0;
+
+    // Big, dirty, macro to handle all of the boilerplate cURL initialization stuff.
+    // Acquire read-lock to make sure we're using the right auth token and stuff.
+    sprintf(uri, "b2api/v1/b2_download_file_by_id?fileId=%s", file_id);
+    pthread_rwlock_rdlock(&state->lock);
+    INITIALIZE_LIBCURL(
+        curl,
+        state->down_url,
+        uri,
+        state->token,
+        state->lock,
+        "Authorization: %s",
+        response,
+        receive_range,
+        0);
+    pthread_rwlock_unlock(&state->lock);
+
+    // Only ask for the bytes we actually need.
+    sprintf(range, "Range: bytes=%zu-%zu", offset, offset + len - 1);
+    headers = curl_slist_append(headers, range);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    if ((res = curl_easy_perform(curl)) == CURLE_OK) {
+      long code;
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+      curl_slist_free_all(headers);
+      curl_easy_cleanup(curl);
+
+      if ((code == 200 || code == 206) && response.ptr == len) {
+        return B2FS_SUCCESS;
+      } else if (code == 200 || code == 206) {
+        write_log(LEVEL_DEBUG, "B2FS: B2 returned %u bytes when %zu were requested.\n", response.ptr, len);
+        return B2FS_NETWORK_API_ERROR;
+      }
+
+      // The error body landed in the caller's buffer. Copy it out so it can be terminated.
+      char *message = malloc(sizeof(char) * (response.ptr + 1));
+      memcpy(message, buf, response.ptr);
+      message[response.ptr] = '\0';
+      write_log(LEVEL_DEBUG, "B2FS: B2 returned error code %ld with message: %s\n", code, message);
+
+      int retval = handle_b2_error(state, message, tok);
+      free(message);
+      if (retval == B2FS_NETWORK_TOKEN_ERROR) do_again = 1;
+      else return B2FS_NETWORK_API_ERROR;
+    } else {
+      write_log(LEVEL_DEBUG, "B2FS: cURL failed with error %s while downloading %s.\n", curl_easy_strerror(res), file_id);
+      curl_slist_free_all(headers);
+      curl_easy_cleanup(curl);
+      return B2FS_NETWORK_ERROR;
+    }
+  } while (do_again);
+
+  return B2FS_SUCCESS;
+}
+
+// Function asks B2 for a URL to upload files to. Upload URLs can't be shared across threads,
+// so each upload worker keeps its own.
+int b2_get_upload_url(b2fs_state_t *state, b2fs_upload_url_t *upload_url) {
+  // Do-While loop works as a conditional retry-loop if our auth token is expired.
+  int do_again;
+  do {
+    CURL *curl = curl_easy_init();
+    CURLcode res;
+    char body[B2FS_SMALL_GENERIC_BUFFER];
+    b2fs_string_t response;
+    do_again = 0;
+    memset(&response, 0, sizeof(b2fs_string_t));
+
+    // Big, dirty, macro to handle all of the boilerplate cURL initialization stuff.
+    // Acquire read-lock to make sure we're using the right auth token and stuff.
+    pthread_rwlock_rdlock(&state->lock);
+    INITIALIZE_LIBCURL(
+        curl,
+        state->api_url,
+        "b2api/v1/b2_get_upload_url",
+        state->token,
+        state->lock,
+        "Authorization: %s",
+        response,
+        receive_string,
+        1);
+    pthread_rwlock_unlock(&state->lock);
+
+    sprintf(body, "{\"bucketId\":\"%s\"}", state->config.bucket_id);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+
+    if ((res = curl_easy_perform(curl)) == CURLE_OK) {
+      long code;
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+      curl_slist_free_all(headers);
+      curl_easy_cleanup(curl);
+
+      if (code == 200) {
+        int token_count = 0;
+        jsmn_parser parser;
+        jsmntok_t tokens[B2FS_MICRO_GENERIC_BUFFER];
+
+        jsmn_init(&parser);
+        token_count = jsmn_parse(&parser, response.str, strlen(response.str), tokens, B2FS_MICRO_GENERIC_BUFFER);
+        if (token_count < 1 || tokens[0].type != JSMN_OBJECT) {
+          free(response.str);
+          return B2FS_NETWORK_API_ERROR;
+        }
+
+        // Pull out the URL and the token that goes with it.
+        memset(upload_url, 0, sizeof(b2fs_upload_url_t));
+        for (int i = 1; i < token_count; i++) {
+          jsmntok_t *key = &tokens[i++], *value = &tokens[i];
+          int len = value->end - value->start;
+
+          if (jsmn_iskey(response.str, key, "uploadUrl") && len < B2FS_SMALL_GENERIC_BUFFER) {
+            memcpy(upload_url->url, response.str + value->start, len);
+          } else if (jsmn_iskey(response.str, key, "authorizationToken") && len < B2FS_TOKEN_LEN) {
+            memcpy(upload_url->token, response.str + value->start, len);
+          } else if (!jsmn_iskey(response.str, key, "bucketId")) {
+            LOG_KEY(response.str, key, "get_upload_url");
+          }
+        }
+        free(response.str);
+
+        return strlen(upload_url->url) && strlen(upload_url->token) ? B2FS_SUCCESS : B2FS_NETWORK_API_ERROR;
+      } else {
+        write_log(LEVEL_DEBUG, "B2FS: B2 returned error code %ld with message: %s\n", code, response.str);
+
+        int retval = handle_b2_error(state, response.str, tok);
+        free(response.str);
+        if (retval == B2FS_NETWORK_TOKEN_ERROR) do_again = 1;
+        else return B2FS_NETWORK_API_ERROR;
+      }
+    } else {
+      write_log(LEVEL_DEBUG, "B2FS: cURL failed with error %s during get_upload_url.\n", curl_easy_strerror(res));
+      curl_slist_free_all(headers);
+      curl_easy_cleanup(curl);
+      return B2FS_NETWORK_ERROR;
+    }
+  } while (do_again);
+
+  return B2FS_SUCCESS;
+}
+
+// Function uploads the contents of the given stream as a new version of path. If the stream
+// reads from a file entry, every chunk it covers must already be resident. sha1 must be the
+// digest of the stream, and if info is given, what B2 says about the new version goes in it.
+int b2_upload_file(b2fs_state_t *state, b2fs_upload_url_t *upload_url, const char *path, b2fs_upload_stream_t *stream, char *sha1, b2fs_file_info_t *info) {
+  (void) state;
+  char name[B2FS_LARGE_GENERIC_BUFFER];
+  struct curl_slist *headers = NULL;
+  b2fs_string_t response;
+
+  // B2 wants the file name percent-encoded, and without our leading slash.
+  char *escaped = curl_easy_escape(NULL, path + 1, 0);
+  snprintf(name, B2FS_LARGE_GENERIC_BUFFER, "X-Bz-File-Name: %s", escaped);
+  curl_free(escaped);
+  headers = curl_slist_append(headers, name);
+  headers = curl_slist_append(headers, "Content-Type: b2/x-auto");
+
+  int retval = perform_upload(upload_url, headers, stream, sha1, path, &response);
+  if (retval == B2FS_SUCCESS && info) retval = parse_file_info(response.str, info);
+  if (response.str) free(response.str);
+
+  return retval;
+}
+
+// Function pulls the id, digest, size, and upload timestamp out of the file info that B2
+// returns for uploads, copies, hides, and finished large files.
+int parse_file_info(const char *json, b2fs_file_info_t *info) {
+  char number[B2FS_MICRO_GENERIC_BUFFER];
+  memset(info, 0, sizeof(b2fs_file_info_t));
+
+  if (jsmn_find_string(json, "fileId", info->file_id, B2FS_SMALL_GENERIC_BUFFER) != B2FS_SUCCESS) {
+    write_log(LEVEL_DEBUG, "B2FS: B2 returned unexpected file info: %s\n", json ? json : "");
+    return B2FS_NETWORK_API_ERROR;
+  }
+
+  // Large files and hide markers report "none" here, which simply never matches a digest.
+  if (jsmn_find_string(json, "contentSha1", info->sha1, SHA1_HEX_LEN) != B2FS_SUCCESS) strcpy(info->sha1, "none");
+  if (jsmn_find_string(json, "contentLength", number, B2FS_MICRO_GENERIC_BUFFER) == B2FS_SUCCESS) {
+    info->size = strtoull(number, NULL, 10);
+  } else if (jsmn_find_string(json, "size", number, B2FS_MICRO_GENERIC_BUFFER) == B2FS_SUCCESS) {
+    info->size = strtoull(number, NULL, 10);
+  }
+  if (jsmn_find_string(json, "uploadTimestamp", number, B2FS_MICRO_GENERIC_BUFFER) == B2FS_SUCCESS) {
+    info->timestamp = strtoull(number, NULL, 10);
+  }
+
+  return B2FS_SUCCESS;
+}
+
+// Function uploads the contents of the given stream as part part_num of a large file.
+int b2_upload_part(b2fs_state_t *state, b2fs_upload_url_t *upload_url, int part_num, b2fs_upload_stream_t *stream, char *sha1) {
+  (void) state;
+  char part[B2FS_MICRO_GENERIC_BUFFER];
+  struct curl_slist *headers = NULL;
+  b2fs_string_t response;
+
+  sprintf(part, "X-Bz-Part-Number: %d", part_num);
+  headers = curl_slist_append(headers, part);
+
+  int retval = perform_upload(upload_url, headers, stream, sha1, "a large file part", &response);
+  if (response.str) free(response.str);
+
+  return retval;
+}
+
+// Function performs the actual POST shared by file and part uploads. Takes ownership of the
+// given headers. On success, the response is left for the caller to parse and free.
+// Returns B2FS_NETWORK_ERROR for failures that B2 says should be retried with a fresh upload
+// URL, and B2FS_NETWORK_API_ERROR for everything else.
+int perform_upload(b2fs_upload_url_t *upload_url, struct curl_slist *headers, b2fs_upload_stream_t *stream, char *sha1, const char *what, b2fs_string_t *response) {
   CURL *curl = curl_easy_init();
   CURLcode res;
-  char buf[B2FS_SMALL_GENERIC_BUFFER], based[B2FS_SMALL_GENERIC_BUFFER], final[B2FS_SMALL_GENERIC_BUFFER], *tmp = based;
-  b2fs_string_t data;
-  memset(&data, 0, sizeof(b2fs_string_t));
+  char auth[B2FS_SMALL_GENERIC_BUFFER], digest[B2FS_MICRO_GENERIC_BUFFER];
+  memset(response, 0, sizeof(b2fs_string_t));
+  stream->offset = 0;
+
+  // Upload URLs come back fully formed, so INITIALIZE_LIBCURL doesn't fit here.
+  sprintf(auth, "Authorization: %s", upload_url->token);
+  sprintf(digest, "X-Bz-Content-Sha1: %s", sha1);
+  headers = curl_slist_append(headers, auth);
+  headers = curl_slist_append(headers, digest);
+  curl_easy_setopt(curl, CURLOPT_URL, upload_url->url);
+  curl_easy_setopt(curl, CURLOPT_POST, 1L);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) stream->size);
+  curl_easy_setopt(curl, CURLOPT_READFUNCTION, stream->entry ? send_file_entry : send_buffer);
+  curl_easy_setopt(curl, CURLOPT_READDATA, stream);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, receive_string);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
 
-  // Create token to send for authentication.
-  base64_encodestate encoder;
-  base64_init_encodestate(&encoder);
-  sprintf(buf, "%s:%s", account_id, app_key);
-  tmp += base64_encode_block(buf, strlen(buf), tmp, &encoder);
-  tmp += base64_encode_blockend(tmp, &encoder);
-  *(--tmp) = '\0';
-  sprintf(final, "Authorization: Basic %s", based);
+  int retval;
+  if ((res = curl_easy_perform(curl)) == CURLE_OK) {
+    long code;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+
+    if (code == 200) {
+      retval = B2FS_SUCCESS;
+    } else {
+      // B2 asks that expired upload tokens and busy pods be handled by grabbing a new upload URL.
+      write_log(LEVEL_DEBUG, "B2FS: B2 returned error code %ld while uploading %s: %s\n", code, what, response->str);
+      if (code == 401 || code == 408 || code == 429 || code >= 500) retval = B2FS_NETWORK_ERROR;
+      else retval = B2FS_NETWORK_API_ERROR;
+    }
+  } else {
+    write_log(LEVEL_DEBUG, "B2FS: cURL failed with error %s while uploading %s.\n", curl_easy_strerror(res), what);
+    retval = B2FS_NETWORK_ERROR;
+  }
+
+  if (retval != B2FS_SUCCESS && response->str) {
+    free(response->str);
+    memset(response, 0, sizeof(b2fs_string_t));
+  }
+  curl_slist_free_all(headers);
+  curl_easy_cleanup(curl);
+  return retval;
+}
+
+// Function POSTs a JSON body to one of B2's API endpoints. Expired auth tokens are refreshed
+// and the request retried. On success, the response is left for the caller to parse and free.
+// Returns B2FS_NETWORK_ERROR for failures that are worth retrying, and B2FS_NETWORK_API_ERROR
+// for everything else.
+int b2_post_json(b2fs_state_t *state, const char *endpoint, const char *body, b2fs_string_t *response) {
+  // Do-While loop works as a conditional retry-loop if our auth token is expired.
+  int do_again;
+  do {
+    CURL *curl = curl_easy_init();
+    CURLcode res;
+    long code = 0;
+    do_again = 0;
+    memset(response, 0, sizeof(b2fs_string_t));
+
+    // Big, dirty, macro to handle all of the boilerplate cURL initialization stuff.
+    // Acquire read-lock to make sure we're using the right auth token and stuff.
+    pthread_rwlock_rdlock(&state->lock);
+    INITIALIZE_LIBCURL(
+        curl,
+        state->api_url,
+        endpoint,
+        state->token,
+        state->lock,
+        "Authorization: %s",
+        *response,
+        receive_string,
+        1);
+    pthread_rwlock_unlock(&state->lock);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+
+    res = curl_easy_perform(curl);
+    if (res == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+
+    if (res != CURLE_OK) {
+      write_log(LEVEL_DEBUG, "B2FS: cURL failed with error %s during %s.\n", curl_easy_strerror(res), endpoint);
+      if (response->str) free(response->str);
+      memset(response, 0, sizeof(b2fs_string_t));
+      return B2FS_NETWORK_ERROR;
+    } else if (code == 200) {
+      return B2FS_SUCCESS;
+    }
+
+    // B2 returned an error. See if it's one we know how to handle.
+    write_log(LEVEL_DEBUG, "B2FS: B2 returned error code %ld during %s: %s\n", code, endpoint, response->str);
+    int retval = response->str ? handle_b2_error(state, response->str, tok) : B2FS_NETWORK_ERROR;
+    if (response->str) free(response->str);
+    memset(response, 0, sizeof(b2fs_string_t));
+
+    if (retval == B2FS_NETWORK_TOKEN_ERROR) do_again = 1;
+    else return code == 408 || code == 429 || code >= 500 ? B2FS_NETWORK_ERROR : B2FS_NETWORK_API_ERROR;
+  } while (do_again);
+
+  return B2FS_SUCCESS;
+}
+
+// Function starts a large file upload for path, and copies its id into file_id.
+int b2_start_large_file(b2fs_state_t *state, const char *path, char *file_id) {
+  char body[B2FS_LARGE_GENERIC_BUFFER];
+  b2fs_string_t response;
+
+  snprintf(body, B2FS_LARGE_GENERIC_BUFFER, "{\"bucketId\":\"%s\",\"fileName\":\"%s\",\"contentType\":\"b2/x-auto\"}",
+      state->config.bucket_id, path + 1);
+  int retval = b2_post_json(state, "b2api/v1/b2_start_large_file", body, &response);
+  if (retval == B2FS_SUCCESS) {
+    retval = jsmn_find_string(response.str, "fileId", file_id, B2FS_SMALL_GENERIC_BUFFER);
+    free(response.str);
+  }
+
+  return retval;
+}
+
+// Function asks B2 for a URL to upload parts of the given large file to.
+int b2_get_upload_part_url(b2fs_state_t *state, char *file_id, b2fs_upload_url_t *upload_url) {
+  char body[B2FS_SMALL_GENERIC_BUFFER * 2];
+  b2fs_string_t response;
+
+  sprintf(body, "{\"fileId\":\"%s\"}", file_id);
+  memset(upload_url, 0, sizeof(b2fs_upload_url_t));
+  int retval = b2_post_json(state, "b2api/v1/b2_get_upload_part_url", body, &response);
+  if (retval == B2FS_SUCCESS) {
+    if (jsmn_find_string(response.str, "uploadUrl", upload_url->url, B2FS_SMALL_GENERIC_BUFFER) != B2FS_SUCCESS) {
+      retval = B2FS_NETWORK_API_ERROR;
+    } else if (jsmn_find_string(response.str, "authorizationToken", upload_url->token, B2FS_TOKEN_LEN) != B2FS_SUCCESS) {
+      retval = B2FS_NETWORK_API_ERROR;
+    }
+    free(response.str);
+  }
+
+  return retval;
+}
+
+// Function has B2 copy bytes [start, end) of an existing file into part part_num of a large
+// file, without the data ever leaving B2. The digest of the part is copied into sha1.
+int b2_copy_part(b2fs_state_t *state, char *source_id, char *large_id, int part_num, size_t start, size_t end, char *sha1) {
+  char body[B2FS_MED_GENERIC_BUFFER];
+  b2fs_string_t response;
+
+  sprintf(body, "{\"sourceFileId\":\"%s\",\"largeFileId\":\"%s\",\"partNumber\":%d,\"range\":\"bytes=%zu-%zu\"}",
+      source_id, large_id, part_num, start, end - 1);
+  int retval = b2_post_json(state, "b2api/v2/b2_copy_part", body, &response);
+  if (retval == B2FS_SUCCESS) {
+    retval = jsmn_find_string(response.str, "contentSha1", sha1, SHA1_HEX_LEN);
+    free(response.str);
+  }
+
+  return retval;
+}
+
+// Function has B2 copy bytes [start, end) of an existing file into a new version of path.
+// What B2 says about the new version goes in info.
+int b2_copy_file(b2fs_state_t *state, char *source_id, const char *path, size_t start, size_t end, b2fs_file_info_t *info) {
+  char body[B2FS_LARGE_GENERIC_BUFFER];
+  b2fs_string_t response;
+
+  snprintf(body, B2FS_LARGE_GENERIC_BUFFER, "{\"sourceFileId\":\"%s\",\"fileName\":\"%s\",\"range\":\"bytes=%zu-%zu\"}",
+      source_id, path + 1, start, end - 1);
+  int retval = b2_post_json(state, "b2api/v2/b2_copy_file", body, &response);
+  if (retval == B2FS_SUCCESS) {
+    retval = parse_file_info(response.str, info);
+    free(response.str);
+  }
+
+  return retval;
+}
+
+// Function stitches the uploaded parts of a large file together into a single version.
+// What B2 says about the new version goes in info.
+int b2_finish_large_file(b2fs_state_t *state, char *file_id, char (*sha1s)[SHA1_HEX_LEN], int count, b2fs_file_info_t *info) {
+  b2fs_string_t body, response;
+  char piece[B2FS_SMALL_GENERIC_BUFFER * 2];
+  memset(&body, 0, sizeof(b2fs_string_t));
+
+  sprintf(piece, "{\"fileId\":\"%s\",\"partSha1Array\":[", file_id);
+  receive_string(piece, 1, strlen(piece), &body);
+  for (int i = 0; i < count; i++) {
+    sprintf(piece, "%s\"%s\"", i ? "," : "", sha1s[i]);
+    receive_string(piece, 1, strlen(piece), &body);
+  }
+  receive_string("]}", 1, 2, &body);
+
+  int retval = b2_post_json(state, "b2api/v1/b2_finish_large_file", body.str, &response);
+  if (retval == B2FS_SUCCESS) {
+    retval = parse_file_info(response.str, info);
+    free(response.str);
+  }
+  free(body.str);
+
+  return retval;
+}
+
+// Function throws away the parts of a large file that will never be finished.
+void b2_cancel_large_file(b2fs_state_t *state, char *file_id) {
+  char body[B2FS_SMALL_GENERIC_BUFFER * 2];
+  b2fs_string_t response;
+
+  sprintf(body, "{\"fileId\":\"%s\"}", file_id);
+  if (b2_post_json(state, "b2api/v1/b2_cancel_large_file", body, &response) == B2FS_SUCCESS) free(response.str);
+  else write_log(LEVEL_DEBUG, "B2FS: Failed to cancel large file %s.\n", file_id);
+}
+
+// Function deletes a single file version. name is the path it was uploaded under, without
+// the leading slash.
+int b2_delete_file_version(b2fs_state_t *state, const char *name, const char *file_id) {
+  char body[B2FS_LARGE_GENERIC_BUFFER];
+  b2fs_string_t response;
+
+  // No need to check the response. The delete API just echoes the request back, and a 200 is
+  // enough to know the version is gone.
+  sprintf(body, "{\"fileName\":\"%s\",\"fileId\":\"%s\"}", name, file_id);
+  int retval = b2_post_json(state, "b2api/v1/b2_delete_file_version", body, &response);
+  if (retval == B2FS_SUCCESS) free(response.str);
+
+  return retval;
+}
+
+// Function hides the newest version of a file, and fills in info with the hide marker B2
+// created for it. name is the path of the file, without the leading slash.
+int b2_hide_file(b2fs_state_t *state, const char *name, b2fs_file_info_t *info) {
+  char body[B2FS_LARGE_GENERIC_BUFFER];
+  b2fs_string_t response;
+
+  sprintf(body, "{\"bucketId\":\"%s\",\"fileName\":\"%s\"}", state->config.bucket_id, name);
+  int retval = b2_post_json(state, "b2api/v1/b2_hide_file", body, &response);
+  if (retval != B2FS_SUCCESS) return retval;
+
+  if (parse_file_info(response.str, info) != B2FS_SUCCESS) memset(info, 0, sizeof(b2fs_file_info_t));
+  free(response.str);
+
+  return B2FS_SUCCESS;
+}
+
+// Given a file entry, iterates across the file versions and checks for an incomplete
+// entry. If it finds any, replaced them all with B2 version.
+// Versions we created ourselves are recorded from B2's responses, so this only has work to
+// do for versions that came from somewhere else.
+int b2_sync_versions(b2fs_state_t *state, b2fs_file_entry_t *entry, const char *path, int force) {
+  int should_sync = force;
+
+  // Iterate across cached file versions.
+  b2fs_file_version_t version;
+  int num_iterations = keytree_size(entry->versions);
+  keytree_iterator_t *it = keytree_iterate_start(entry->versions, NULL);
+  while (num_iterations-- && !should_sync && keytree_iterate_next(it, NULL, &version) == KEYTREE_SUCCESS) {
+    if (*version.live && !*version.synced) should_sync = 1;
+  }
+  keytree_iterate_stop(it);
+
+  // Sync any entries needing it.
+  if (should_sync) {
+    // First get file history from B2. The listing only holds the versions until they're moved
+    // across, so it doesn't own them.
+    keytree_t *versions = create_keytree(NULL, NULL, rev_timecmp, sizeof(size_t), sizeof(b2fs_file_version_t));
+
+    // Call list_versions with a given path. Should hopefully only require one call.
+    int retval = b2_list_versions(state, NULL, path, versions, NULL);
+
+    // Check if our sync was a success, and if so, destroy and overwrite the old history.
+    if (retval == B2FS_SUCCESS) {
+      // Packed and deduplicated versions never show up in a listing, so they have to be carried
+      // across.
+      size_t timestamp;
+      num_iterations = keytree_size(entry->versions);
+      it = keytree_iterate_start(entry->versions, NULL);
+      while (num_iterations-- && keytree_iterate_next(it, &timestamp, &version) == KEYTREE_SUCCESS) {
+        if (!version.packed && !version.manifest) continue;
+        b2fs_file_version_t copy;
+        if (clone_file_version(&copy, &version) != B2FS_SUCCESS) continue;
+        if (keytree_insert(versions, &timestamp, &copy) == KEYTREE_DUPLICATE) destroy_file_version(&copy);
+      }
+      keytree_iterate_stop(it);
+
+      // Every copy of this entry shares its version tree, so the tree has to be refilled in
+      // place rather than swapped out from under the others.
+      stack_t *stale = create_stack(NULL, sizeof(size_t));
+      num_iterations = keytree_size(entry->versions);
+      it = keytree_iterate_start(entry->versions, NULL);
+      while (num_iterations-- && keytree_iterate_next(it, &timestamp, NULL) == KEYTREE_SUCCESS) {
+        stack_push(stale, &timestamp);
+      }
+      keytree_iterate_stop(it);
+      while (stack_pop(stale, &timestamp) == STACK_SUCCESS) keytree_remove(entry->versions, &timestamp, NULL);
+      destroy_stack(stale);
+
+      num_iterations = keytree_size(versions);
+      it = keytree_iterate_start(versions, NULL);
+      while (num_iterations-- && keytree_iterate_next(it, &timestamp, &version) == KEYTREE_SUCCESS) {
+        if (!version.packed && !version.manifest) map_file_id(state, version.version_id, path);
+        keytree_insert(entry->versions, &timestamp, &version);
+      }
+      keytree_iterate_stop(it);
+    } else {
+      num_iterations = keytree_size(versions);
+      it = keytree_iterate_start(versions, NULL);
+      while (num_iterations-- && keytree_iterate_next(it, NULL, &version) == KEYTREE_SUCCESS) {
+        destroy_file_version(&version);
+      }
+      keytree_iterate_stop(it);
+    }
+    keytree_destroy(versions);
+
+    return retval;
+  } else {
+    return B2FS_SUCCESS;
+  }
+}
+
+// As the name suggests, this function is responsible for attempting to fix an error returned
+// from B2. Currently only supports re-authentication.
+// Contrary to the semantics of the other functions, this function actually returns the type of
+// error that occured on success, and a generic network error on failure.
+int handle_b2_error(b2fs_state_t *state, char *response, char *cached_token) {
+  // Need to figure out what went wrong. Time to parse JSON.
+  int token_count = JSMN_ERROR_NOMEM;
+  jsmn_parser parser;
+  jsmntok_t *tokens = malloc(sizeof(jsmntok_t) * B2FS_SMALL_GENERIC_BUFFER);
+
+  // Make sure enough memory is available and parse response.
+  for (int i = 1; token_count == JSMN_ERROR_NOMEM; i++) {
+    jsmn_init(&parser);
+    token_count = jsmn_parse(&parser, response, strlen(response), tokens, B2FS_SMALL_GENERIC_BUFFER * i);
+    if (token_count == JSMN_ERROR_NOMEM) {
+      void *tmp = realloc(tokens, sizeof(jsmntok_t) * (B2FS_SMALL_GENERIC_BUFFER * (i + 1)));
+      if (!tmp) {
+        write_log(LEVEL_DEBUG, "B2FS: Failed to allocate enough memory to parse B2 error message...\n");
+        free(tokens);
+        return B2FS_NOMEM_ERROR;
+      }
+      tokens = tmp;
+    } else if (token_count == JSMN_ERROR_INVAL || token_count == JSMN_ERROR_PART) {
+      write_log(LEVEL_DEBUG, "B2FS: B2 returned an invalid error message.\n");
+      free(tokens);
+      return B2FS_INVAL_ERROR;
+    }
+  }
+
+  for (int i = 1; i < token_count; i++) {
+    jsmntok_t *key = &tokens[i++], *value = &tokens[i];
+    int len = value->end - value->start;
+
+    if (jsmn_iskey(response, key, "code")) {
+      char reason[B2FS_SMALL_GENERIC_BUFFER];
+      memset(reason, 0, sizeof(char) * B2FS_SMALL_GENERIC_BUFFER);
+      memcpy(reason, response + value->start, len);
+      free(tokens);
+
+      // TODO: The ultimate point to this function is to be able to handle many different potential error conditions from
+      // B2, so I'll need to add more clauses here.
+      if (!strcmp(reason, "expired_auth_token")) {
+        // We received an error from B2 because our authentication token has expired. Acquire the write-lock to ensure nobody
+        // tries using the tokens while we're updating them.
+        pthread_rwlock_wrlock(&state->lock);
+
+        // Now that we hold the write-lock, double check that the expired token that we used is still the one in the state
+        // struct. If so, update it, if not, somebody else got here first.
+        if (!strcmp(state->token, cached_token)) {
+          int retval = handle_authentication(state, state->config.account_id, state->config.app_key);
+          cache_auth(state);
+          pthread_rwlock_unlock(&state->lock);
+          return retval == B2FS_SUCCESS ? B2FS_NETWORK_TOKEN_ERROR : B2FS_NETWORK_ERROR;
+        } else {
+          pthread_rwlock_unlock(&state->lock);
+          return B2FS_NETWORK_TOKEN_ERROR;
+        }
+      } else {
+        return B2FS_NETWORK_ERROR;
+      }
+    }
+  }
+
+  // We shouldn't be able to get here if B2 returns a JSON object that fits the API docs, but the compiler doesn't
+  // know that.
+  return B2FS_NETWORK_ERROR;
+}
+
+int handle_authentication(b2fs_state_t *state, char *account_id, char *app_key) {
+  CURL *curl = curl_easy_init();
+  CURLcode res;
+  char buf[B2FS_SMALL_GENERIC_BUFFER], based[B2FS_SMALL_GENERIC_BUFFER], final[B2FS_SMALL_GENERIC_BUFFER], *tmp = based;
+  b2fs_string_t data;
+  memset(&data, 0, sizeof(b2fs_string_t));
+
+  // Create token to send for authentication.
+  base64_encodestate encoder;
+  base64_init_encodestate(&encoder);
+  sprintf(buf, "%s:%s", account_id, app_key);
+  tmp += base64_encode_block(buf, strlen(buf), tmp, &encoder);
+  tmp += base64_encode_blockend(tmp, &encoder);
+  *(--tmp) = '\0';
+  sprintf(final, "Authorization: Basic %s", based);
+
+  // Big, dirty, macro to handle all of the boilerplate cURL initialization stuff.
+  // Note that we do not acquire the read-lock here, because this function will always either be
+  // called with the write-lock held, or in a context where contention is impossible.
+  INITIALIZE_LIBCURL(
+      curl,
+      "https://api.backblaze.com",
+      "b2api/v1/b2_authorize_account",
+      based,
+      state->lock,
+      "Authorization: Basic %s",
+      data,
+      receive_string,
+      0);
+
+  // Attempt authentication.
+  if ((res = curl_easy_perform(curl)) == CURLE_OK) {
+    // No cURL errors occured, time to check for HTTP errors...
+    long code;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_cleanup(curl);
+
+    if (code == 200) {
+      int token_count = 0;
+      jsmn_parser parser;
+      jsmntok_t tokens[B2FS_SMALL_GENERIC_BUFFER];
+
+      // Our authentication request went through. Time to JSON parse.
+      jsmn_init(&parser);
+      token_count = jsmn_parse(&parser, data.str, strlen(data.str), tokens, B2FS_SMALL_GENERIC_BUFFER);
+      if (token_count == JSMN_ERROR_NOMEM || tokens[0].type != JSMN_OBJECT) {
+        free(data.str);
+        return B2FS_NETWORK_API_ERROR;
+      }
+
+      // Iterate over returned tokens and extract the needed info.
+      for (int i = 1; i < token_count; i++) {
+        jsmntok_t *key = &tokens[i++], *value = &tokens[i];
+        int len = value->end - value->start;
+
+        if (jsmn_iskey(data.str, key, "authorizationToken")) {
+          memset(state->token, 0, sizeof(char) * B2FS_TOKEN_LEN);
+          memcpy(state->token, data.str + value->start, len);
+        } else if (jsmn_iskey(data.str, key, "apiUrl")) {
+          memset(state->api_url, 0, sizeof(char) * B2FS_TOKEN_LEN);
+          memcpy(state->api_url, data.str + value->start, len);
+        } else if (jsmn_iskey(data.str, key, "downloadUrl")) {
+          memset(state->down_url, 0, sizeof(char) * B2FS_TOKEN_LEN);
+          memcpy(state->down_url, data.str + value->start, len);
+        } else if (!jsmn_iskey(data.str, key, "accountId")) {
+          LOG_KEY(data.str, key, "authentication");
+        }
+      }
+      free(data.str);
+
+      // Validate and return!
+      if (strlen(state->token) && strlen(state->api_url) && strlen(state->down_url)) {
+        return B2FS_SUCCESS;
+      } else {
+        return B2FS_NETWORK_API_ERROR;
+      }
+    } else if (code == 401) {
+      // Our authentication request was rejected due to bad auth info.
+      free(data.str);
+      return B2FS_NETWORK_ACCESS_ERROR;
+    } else {
+      // Request was badly formatted. Denotes an internal error.
+      strncpy(state->token, data.str, B2FS_TOKEN_LEN - 1);
+      state->token[B2FS_TOKEN_LEN - 1] = '\0';
+      free(data.str);
+      return B2FS_NETWORK_INTERN_ERROR;
+    }
+    return B2FS_SUCCESS;
+  } else {
+    // cURL error encountered. Don't know enough about this to predict why.
+    // FIXME: Maybe add more detailed error handling here.
+    strncpy(state->token, curl_easy_strerror(res), B2FS_TOKEN_LEN - 1);
+    state->token[B2FS_TOKEN_LEN - 1] = '\0';
+    curl_easy_cleanup(curl);
+    return B2FS_NETWORK_ERROR;
+  }
+}
+
+// Function lists the whole bucket into fs_cache. The namespace is split into shards that are
+// listed concurrently, as many at once as we're allowed uploads, so that mounting a big bucket
+// isn't stuck paging through it a thousand names at a time on a single connection.
+int list_bucket(b2fs_state_t *state, hash_t *fs_cache) {
+  b2fs_list_batch_t batch;
+
+  memset(&batch, 0, sizeof(b2fs_list_batch_t));
+  batch.state = state;
+  batch.fs_cache = fs_cache;
+  batch.count = sample_shards(state, state->config.upload_threads * B2FS_LIST_SHARDS_PER_THREAD, &batch.shards);
+  if (batch.count == B2FS_NOMEM_ERROR) return B2FS_NOMEM_ERROR;
+  else if (batch.count < 0) return b2_list_versions(state, fs_cache, NULL, NULL, NULL);
+  write_log(LEVEL_DEBUG, "B2FS: Listing bucket in %d shards.\n", batch.count);
+
+  int workers = MIN(state->config.upload_threads, batch.count);
+  pthread_t *threads = malloc(sizeof(pthread_t) * (workers + 1));
+  pthread_mutex_init(&batch.lock, NULL);
+  for (int i = 0; i < workers; i++) {
+    if (pthread_create(&threads[i], NULL, list_worker, &batch)) workers = i;
+  }
+  if (!workers) list_worker(&batch);
+  for (int i = 0; i < workers; i++) pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&batch.lock);
+  free(threads);
+  free(batch.shards);
+
+  return batch.error;
+}
+
+// Function works out where to split the bucket listing, aiming for about target shards. Names
+// from a delimiter listing of the root are natural split points, and folders are opened up,
+// widest first, until there are enough of them or we've spent B2FS_LIST_SAMPLES requests
+// looking. Returns the number of shards, or a negative error if nothing could be sampled.
+int sample_shards(b2fs_state_t *state, int target, b2fs_list_shard_t **shards) {
+  array_t *names = create_array(sizeof(char *), dereference_and_free);
+  array_t *folders = create_array(sizeof(char *), dereference_and_free);
+  int retval = B2FS_SUCCESS, samples = 0;
+  if (!names || !folders) {
+    if (names) array_destroy(names);
+    if (folders) array_destroy(folders);
+    return B2FS_NOMEM_ERROR;
+  }
+
+  char *root = malloc(sizeof(char));
+  *root = '\0';
+  array_push(folders, &root);
+  for (int i = 0; i < array_count(folders) && samples < B2FS_LIST_SAMPLES && array_count(names) < target; i++) {
+    char *prefix;
+    array_retrieve(folders, i, &prefix);
+    retval = b2_list_names(state, prefix, names, folders);
+    if (retval != B2FS_SUCCESS) break;
+    samples++;
+  }
+  if (!samples) {
+    array_destroy(names);
+    array_destroy(folders);
+    return retval == B2FS_SUCCESS ? B2FS_ERROR : retval;
+  }
+
+  // Listings of different folders interleave, so put the split points in order.
+  int count = array_count(names);
+  char **sorted = malloc(sizeof(char *) * (count + 1));
+  for (int i = 0; i < count; i++) array_retrieve(names, i, &sorted[i]);
+  qsort(sorted, count, sizeof(char *), strcmp_indirect);
+
+  // Keep evenly spaced split points if there are too many. The first shard always starts at
+  // the beginning of the bucket, and each shard ends where the next starts.
+  int shard_count = MIN(count, target) + 1;
+  *shards = calloc(shard_count, sizeof(b2fs_list_shard_t));
+  int used = 1;
+  for (int i = 1; i < shard_count; i++) {
+    char *start = sorted[(long) (i - 1) * count / (shard_count - 1)];
+    if (!strlen(start) || !strcmp(start, (*shards)[used - 1].start)) continue;
+    strcpy((*shards)[used - 1].end, start);
+    strcpy((*shards)[used++].start, start);
+  }
+  free(sorted);
+  array_destroy(names);
+  array_destroy(folders);
+
+  return used;
+}
+
+void *list_worker(void *voidarg) {
+  b2fs_list_batch_t *batch = voidarg;
+
+  // Helpers find the state through the FUSE context, which is per thread, and empty on any
+  // thread FUSE didn't start.
+  fuse_get_context()->private_data = batch->state;
+
+  while (1) {
+    pthread_mutex_lock(&batch->lock);
+    int index = batch->next++;
+    int error = batch->error;
+    pthread_mutex_unlock(&batch->lock);
+    if (index >= batch->count || error) break;
+
+    int retval = b2_list_versions(batch->state, batch->fs_cache, NULL, NULL, &batch->shards[index]);
+    if (retval != B2FS_SUCCESS) {
+      pthread_mutex_lock(&batch->lock);
+      if (!batch->error) batch->error = retval;
+      pthread_mutex_unlock(&batch->lock);
+    }
+  }
+
+  return NULL;
+}
+
+// Function lists everything under the pack and dedup directories, which a lazy mount still has
+// to read the pack indexes and manifests out of up front.
+int list_bookkeeping(b2fs_state_t *state) {
+  const char *dirs[] = {B2FS_PACK_DIR, B2FS_DEDUP_DIR};
+  b2fs_list_shard_t shard;
+
+  // Everything under a directory sorts between its name plus a slash, and its name plus the
+  // character after the slash.
+  for (int i = 0; i < 2; i++) {
+    snprintf(shard.start, B2FS_SMALL_GENERIC_BUFFER, "%s/", dirs[i]);
+    snprintf(shard.end, B2FS_SMALL_GENERIC_BUFFER, "%s%c", dirs[i], '/' + 1);
+    int retval = b2_list_versions(state, state->fs_cache, NULL, NULL, &shard);
+    if (retval != B2FS_SUCCESS) return retval;
+  }
+
+  return B2FS_SUCCESS;
+}
+
+// Function fills in a directory of a lazy mount from B2 the first time it's needed. prefix is
+// the directory's name in the bucket, with its trailing slash, or empty for the root. If the
+// listing fails, the directory is left as it is and tried again next time.
+void list_directory(b2fs_state_t *state, b2fs_dir_entry_t *dir, const char *prefix) {
+  b2fs_dir_listing_t *listing = dir->listing;
+  if (!listing || listing->listed) return;
+
+  pthread_mutex_lock(&listing->lock);
+  if (!listing->listed) {
+    if (b2_list_folder(state, prefix, dir) == B2FS_SUCCESS) {
+      listing->listed = 1;
+    } else {
+      __sync_fetch_and_add(&state->dentries.unlisted, 1);
+      write_log(LEVEL_ERROR, "B2FS: Failed to list /%s from B2.\n", prefix);
+    }
+  }
+  pthread_mutex_unlock(&listing->lock);
+}
+
+void list_root(b2fs_state_t *state) {
+  b2fs_dir_entry_t root = {state->fs_cache, NULL, &state->root_listing};
+  list_directory(state, &root, "");
+}
+
+// Function initializes the upload queue and starts its worker pool.
+int start_upload_queue(b2fs_state_t *state) {
+  b2fs_upload_queue_t *uploads = &state->uploads;
+
+  memset(uploads, 0, sizeof(b2fs_upload_queue_t));
+  uploads->jobs = create_queue(NULL, sizeof(b2fs_upload_job_t));
+  uploads->workers = malloc(sizeof(pthread_t) * state->config.upload_threads);
+  if (!uploads->jobs || !uploads->workers) {
+    if (uploads->jobs) destroy_queue(uploads->jobs);
+    if (uploads->workers) free(uploads->workers);
+    return B2FS_NOMEM_ERROR;
+  }
+  pthread_mutex_init(&uploads->lock, NULL);
+  pthread_cond_init(&uploads->ready, NULL);
+  pthread_cond_init(&uploads->drained, NULL);
+
+  for (int i = 0; i < state->config.upload_threads; i++) {
+    if (pthread_create(&uploads->workers[i], NULL, upload_worker, state)) break;
+    uploads->num_workers++;
+  }
+
+  return uploads->num_workers ? B2FS_SUCCESS : B2FS_ERROR;
+}
+
+// Function waits for every queued and in-flight upload to finish, then shuts the workers down.
+void stop_upload_queue(b2fs_state_t *state) {
+  b2fs_upload_queue_t *uploads = &state->uploads;
+  if (!uploads->workers) return;
+
+  pthread_mutex_lock(&uploads->lock);
+  while (uploads->queued || uploads->in_flight) pthread_cond_wait(&uploads->drained, &uploads->lock);
+  uploads->shutdown = 1;
+  pthread_cond_broadcast(&uploads->ready);
+  pthread_mutex_unlock(&uploads->lock);
+
+  for (int i = 0; i < uploads->num_workers; i++) pthread_join(uploads->workers[i], NULL);
+  destroy_queue(uploads->jobs);
+  free(uploads->workers);
+  uploads->workers = NULL;
+  pthread_cond_destroy(&uploads->ready);
+  pthread_cond_destroy(&uploads->drained);
+  pthread_mutex_destroy(&uploads->lock);
+}
+
+// Function hands a file off to the upload workers. The file's pending count is raised before
+// the job becomes visible so that a concurrent fsync can't miss it.
+void enqueue_upload(b2fs_state_t *state, const char *path, b2fs_file_entry_t *entry) {
+  b2fs_upload_queue_t *uploads = &state->uploads;
+  b2fs_upload_job_t job;
+
+  job.path = malloc(sizeof(char) * (strlen(path) + 1));
+  strcpy(job.path, path);
+  memcpy(&job.entry, retain_file_entry(entry), sizeof(b2fs_file_entry_t));
+
+  pthread_mutex_lock(&entry->buffer->lock);
+  entry->buffer->pending++;
+  pthread_mutex_unlock(&entry->buffer->lock);
+
+  pthread_mutex_lock(&uploads->lock);
+  queue_enqueue(uploads->jobs, &job);
+  uploads->queued++;
+  write_log(LEVEL_DEBUG, "B2FS: Queued upload of %s, queue depth is %d.\n", path, uploads->queued + uploads->in_flight);
+  pthread_cond_signal(&uploads->ready);
+  pthread_mutex_unlock(&uploads->lock);
+}
+
+// Function blocks until every upload queued for the given file has finished.
+// Returns the result of the most recent upload.
+int wait_for_upload(b2fs_file_entry_t *entry) {
+  pthread_mutex_lock(&entry->buffer->lock);
+  while (entry->buffer->pending) pthread_cond_wait(&entry->buffer->flushed, &entry->buffer->lock);
+  int retval = entry->buffer->error;
+  pthread_mutex_unlock(&entry->buffer->lock);
+  return retval;
+}
+
+void *upload_worker(void *voidarg) {
+  b2fs_state_t *state = voidarg;
+  b2fs_upload_queue_t *uploads = &state->uploads;
+  b2fs_upload_url_t upload_url;
+  b2fs_upload_job_t job;
+  memset(&upload_url, 0, sizeof(b2fs_upload_url_t));
+
+  while (1) {
+    // Wait for work, or to be told to shut down.
+    pthread_mutex_lock(&uploads->lock);
+    while (!uploads->queued && !uploads->shutdown) pthread_cond_wait(&uploads->ready, &uploads->lock);
+    if (queue_dequeue(uploads->jobs, &job) != QUEUE_SUCCESS) {
+      pthread_mutex_unlock(&uploads->lock);
+      break;
+    }
+    uploads->queued--;
+    uploads->in_flight++;
+    pthread_mutex_unlock(&uploads->lock);
+
+    int retval = upload_file_entry(state, &upload_url, &job);
+
+    // Release anyone waiting on this file.
+    pthread_mutex_lock(&job.entry.buffer->lock);
+    job.entry.buffer->error = retval;
+    job.entry.buffer->pending--;
+    pthread_cond_broadcast(&job.entry.buffer->flushed);
+    pthread_mutex_unlock(&job.entry.buffer->lock);
+
+    // Release anyone waiting on the queue as a whole.
+    pthread_mutex_lock(&uploads->lock);
+    uploads->in_flight--;
+    if (retval == B2FS_SUCCESS) state->stats.uploads_completed++;
+    else state->stats.uploads_failed++;
+    if (!uploads->queued && !uploads->in_flight) pthread_cond_broadcast(&uploads->drained);
+    pthread_mutex_unlock(&uploads->lock);
+    destroy_file_entry(&job.entry);
+    free(job.path);
+  }
+
+  return NULL;
+}
+
+// Function performs a single queued upload, retrying with a fresh upload URL when B2 asks
+// us to.
+int upload_file_entry(b2fs_state_t *state, b2fs_upload_url_t *upload_url, b2fs_upload_job_t *job) {
+  b2fs_file_entry_t *entry = &job->entry;
+
+  // Anything uploaded before the path's last hide lands would be hidden along with it.
+  wait_for_hide(state, job->path);
+
+  // Every journal record up to here made it into the buffers before this snapshot.
+  job->journal_seq = journal_position(state);
+
+  // A file can be queued more than once before a worker gets to it. Whoever gets there first
+  // uploads the current contents, and everybody else has nothing to do.
+  pthread_mutex_lock(&entry->buffer->lock);
+  if (!entry->buffer->dirty) {
+    pthread_mutex_unlock(&entry->buffer->lock);
+    return B2FS_SUCCESS;
+  }
+  size_t size = entry->buffer->size;
+  entry->buffer->dirty = 0;
+  entry->buffer->trimmed = SIZE_MAX;
+  stack_t *dirty = snapshot_dirty_chunks(entry);
+  pthread_mutex_unlock(&entry->buffer->lock);
+
+  // Cheap check first. If every chunk written since we last agreed with B2 still hashes the
+  // same, the write was a no-op as far as B2 is concerned.
+  if (unchanged_since_sync(entry, size, dirty)) {
+    __sync_fetch_and_add(&state->stats.uploads_skipped, 1);
+    mark_chunks_synced(entry, dirty);
+    journal_uploaded(state, job->path, job->journal_seq);
+    destroy_stack(dirty);
+    return B2FS_SUCCESS;
+  }
+
+  char sha1[SHA1_HEX_LEN];
+  b2fs_file_info_t info;
+  int retval = B2FS_SUCCESS;
+  int deduped = 0;
+  array_t *parts = packable(state, job->path, size) || state->config.dedup ? NULL : plan_parts(entry, size, dirty);
+  if (parts) {
+    // Large files that are mostly unchanged only send what changed, and B2 copies the rest.
+    if (state->config.pack_threshold) withdraw_from_pack(state, job->path, dirty);
+    retval = upload_parts(state, job->path, entry, parts, &info);
+    array_destroy(parts);
+  } else {
+    // Everything we send has to be resident, so pull down any chunks that were never touched.
+    for (size_t pos = 0; pos < size && retval == B2FS_SUCCESS; pos += B2FS_CHUNK_SIZE) {
+      if (!load_chunk(state, entry, pos / B2FS_CHUNK_SIZE, 1)) retval = B2FS_NETWORK_ERROR;
+    }
+
+    // B2 needs the digest anyway, and comparing it against the head version catches rewrites
+    // of chunks we never had a fingerprint for.
+    if (retval == B2FS_SUCCESS) {
+      hash_file_entry(entry, size, sha1);
+
+      pthread_mutex_lock(&entry->buffer->lock);
+      int same = entry->buffer->remote_known && entry->buffer->remote_size == size && !strcmp(entry->buffer->remote_sha1, sha1);
+      pthread_mutex_unlock(&entry->buffer->lock);
+
+      if (same) {
+        __sync_fetch_and_add(&state->stats.uploads_skipped, 1);
+        mark_chunks_synced(entry, dirty);
+        journal_uploaded(state, job->path, job->journal_seq);
+        destroy_stack(dirty);
+        return B2FS_SUCCESS;
+      }
+    }
+
+    // Small files ride along in the next pack rather than costing an upload of their own.
+    if (retval == B2FS_SUCCESS && packable(state, job->path, size)) {
+      add_to_pack(state, job, size, sha1, dirty);
+      return B2FS_SUCCESS;
+    }
+
+    // The file may have been packed before it grew. That copy is stale now.
+    if (state->config.pack_threshold) withdraw_from_pack(state, job->path, dirty);
+
+    // Deduplicated files only send the chunks B2 doesn't have yet, and record their own version.
+    if (retval == B2FS_SUCCESS && state->config.dedup) {
+      retval = upload_deduped(state, upload_url, job->path, entry, size, sha1);
+      deduped = 1;
+    } else if (retval == B2FS_SUCCESS) {
+      b2fs_upload_stream_t stream = {entry, NULL, 0, 0, size};
+      retval = upload_stream(state, upload_url, job->path, &stream, sha1, &info);
+      if (retval == B2FS_SUCCESS) __sync_fetch_and_add(&state->stats.bytes_uploaded, size);
+    }
+  }
+
+  if (retval == B2FS_SUCCESS) {
+    if (!deduped) record_upload(state, job->path, entry, size, &info);
+    mark_chunks_synced(entry, dirty);
+    journal_uploaded(state, job->path, job->journal_seq);
+  } else {
+    // Leave the file dirty so a later fsync or release will try again.
+    write_log(LEVEL_ERROR, "B2FS: Failed to upload %s.\n", job->path);
+    restore_dirty_chunks(entry, dirty);
+    pthread_mutex_lock(&entry->buffer->lock);
+    entry->buffer->dirty = 1;
+    pthread_mutex_unlock(&entry->buffer->lock);
+  }
+  destroy_stack(dirty);
+
+  return retval;
+}
+
+// Function uploads a stream, retrying with a fresh upload URL whenever B2 asks us to.
+int upload_stream(b2fs_state_t *state, b2fs_upload_url_t *upload_url, const char *path, b2fs_upload_stream_t *stream, char *sha1, b2fs_file_info_t *info) {
+  int retval = B2FS_SUCCESS;
+
+  for (int i = 0; i < B2FS_UPLOAD_RETRIES; i++) {
+    if (!strlen(upload_url->url)) retval = b2_get_upload_url(state, upload_url);
+    if (retval != B2FS_SUCCESS) break;
+
+    retval = b2_upload_file(state, upload_url, path, stream, sha1, info);
+    if (retval == B2FS_SUCCESS) break;
+
+    // Upload URLs go bad for all sorts of reasons. Grab a new one and try again.
+    memset(upload_url, 0, sizeof(b2fs_upload_url_t));
+    if (retval != B2FS_NETWORK_ERROR) break;
+    else if (i < B2FS_UPLOAD_RETRIES - 1) retval = B2FS_SUCCESS;
+  }
+
+  return retval;
+}
+
+// Function records a successful upload in the file's version history. B2 told us everything
+// a listing would, so the new version is synced from the start.
+void record_upload(b2fs_state_t *state, const char *path, b2fs_file_entry_t *entry, size_t size, b2fs_file_info_t *info) {
+  b2fs_file_version_t version;
+
+  init_file_version(&version);
+  strcpy(version.version_id, info->file_id);
+  strcpy(version.content_sha1, info->sha1);
+  version.size = size;
+  *version.live = 1;
+  *version.synced = 1;
+  map_file_id(state, info->file_id, path);
+  record_version(entry, &version, info->timestamp);
+}
+
+// Function installs a version we just wrote as the head of a file's history, keyed by the
+// timestamp B2 gave it if there is one. If the head is the placeholder left by internal_make,
+// the new version takes its place.
+void record_version(b2fs_file_entry_t *entry, b2fs_file_version_t *version, size_t timestamp) {
+  size_t head;
+  b2fs_file_version_t current;
+
+  // Hide markers leave nothing in B2 for later uploads to match against.
+  pthread_mutex_lock(&entry->buffer->lock);
+  entry->buffer->remote_size = version->size;
+  strcpy(entry->buffer->remote_sha1, version->content_sha1);
+  entry->buffer->remote_known = !*version->hidden;
+  entry->buffer->head_limit = *version->hidden ? 0 : MIN(version->size, entry->buffer->trimmed);
+  pthread_mutex_unlock(&entry->buffer->lock);
+
+  // Make sure the new version sorts ahead of the current head, even if the clocks disagree.
+  if (!timestamp) timestamp = current_timestamp();
+  if (get_head_version(entry, &head, &current) == KEYTREE_SUCCESS) {
+    if (!*current.live) {
+      keytree_remove(entry->versions, &head, NULL);
+      timestamp = MAX(timestamp, head);
+    } else {
+      timestamp = MAX(timestamp, head + 1);
+    }
+  }
+  keytree_insert(entry->versions, &timestamp, version);
+}
+
+// Function remembers which path a B2 file id belongs to.
+void map_file_id(b2fs_state_t *state, const char *file_id, const char *path) {
+  char *path_copy = malloc(sizeof(char) * (strlen(path) + 1));
+  strcpy(path_copy, path);
+  if (hash_put(state->id_mappings, (char *) file_id, &path_copy) != HASH_SUCCESS) free(path_copy);
+}
+
+// Function collects, and clears, the dirty flags of every buffered chunk.
+// Expects to be called with the buffer lock held.
+stack_t *snapshot_dirty_chunks(b2fs_file_entry_t *entry) {
+  b2fs_file_chunk_t *chunk;
+  stack_t *dirty = create_stack(NULL, sizeof(int));
+
+  int num_iterations = keytree_size(entry->chunks);
+  keytree_iterator_t *it = keytree_iterate_start(entry->chunks, NULL);
+  while (num_iterations-- && keytree_iterate_next(it, NULL, &chunk) == KEYTREE_SUCCESS) {
+    if (!chunk->dirty) continue;
+    chunk->dirty = 0;
+    stack_push(dirty, &chunk->chunk_num);
+  }
+  keytree_iterate_stop(it);
+
+  return dirty;
+}
+
+// Function puts back the dirty flags taken by snapshot_dirty_chunks after a failed upload.
+void restore_dirty_chunks(b2fs_file_entry_t *entry, stack_t *dirty) {
+  int chunk_num;
+  b2fs_file_chunk_t *chunk;
+  stack_t *copy = stack_dup(dirty, NULL);
+
+  pthread_mutex_lock(&entry->buffer->lock);
+  while (stack_pop(copy, &chunk_num) == STACK_SUCCESS) {
+    if (keytree_find(entry->chunks, &chunk_num, &chunk) == KEYTREE_SUCCESS) chunk->dirty = 1;
+  }
+  pthread_mutex_unlock(&entry->buffer->lock);
+  destroy_stack(copy);
+}
+
+// Function checks whether the given dirty chunks all still match what B2 has. Chunks that
+// were never written are unchanged by definition, unless the file was truncated below size
+// since its last sync, in which case the bytes past head_limit read back as zeroes.
+int unchanged_since_sync(b2fs_file_entry_t *entry, size_t size, stack_t *dirty) {
+  int chunk_num, unchanged;
+  b2fs_file_chunk_t *chunk;
+  stack_t *copy = stack_dup(dirty, NULL);
+
+  pthread_mutex_lock(&entry->buffer->lock);
+  unchanged = entry->buffer->remote_known && entry->buffer->remote_size == size && entry->buffer->head_limit >= size;
+  while (unchanged && stack_pop(copy, &chunk_num) == STACK_SUCCESS) {
+    if (keytree_find(entry->chunks, &chunk_num, &chunk) != KEYTREE_SUCCESS) continue;
+    unchanged = chunk->fingerprinted && XXH64(chunk->data, B2FS_CHUNK_SIZE, 0) == chunk->fingerprint;
+  }
+  pthread_mutex_unlock(&entry->buffer->lock);
+  destroy_stack(copy);
+
+  return unchanged;
+}
+
+// Function records that B2 now holds the current contents of the given chunks. Chunks that
+// were written again while we were uploading stay dirty, and keep their old fingerprint.
+void mark_chunks_synced(b2fs_file_entry_t *entry, stack_t *dirty) {
+  int chunk_num;
+  b2fs_file_chunk_t *chunk;
+  stack_t *copy = stack_dup(dirty, NULL);
+
+  pthread_mutex_lock(&entry->buffer->lock);
+  while (stack_pop(copy, &chunk_num) == STACK_SUCCESS) {
+    if (keytree_find(entry->chunks, &chunk_num, &chunk) != KEYTREE_SUCCESS || chunk->dirty) continue;
+    chunk->fingerprint = XXH64(chunk->data, B2FS_CHUNK_SIZE, 0);
+    chunk->fingerprinted = 1;
+  }
+  pthread_mutex_unlock(&entry->buffer->lock);
+  destroy_stack(copy);
+}
+
+// Function computes the hex SHA-1 of the first size bytes of a file. Picks up wherever the
+// running digest left off, so every chunk past that point must be resident.
+void hash_file_entry(b2fs_file_entry_t *entry, size_t size, char *hex) {
+  sha1_state_t sha;
+  unsigned char digest[SHA1_DIGEST_LEN];
+
+  pthread_mutex_lock(&entry->buffer->lock);
+  sha = entry->buffer->digest;
+  pthread_mutex_unlock(&entry->buffer->lock);
+
+  // The running digest may have moved past our snapshot if writes landed since.
+  if (sha.length > size) sha1_init(&sha);
+  feed_file_range(entry, &sha, sha.length, size);
+  sha1_final(&sha, digest);
+  sha1_hex(digest, hex);
+}
+
+// Function computes the hex SHA-1 of bytes [start, end) of a file. Every chunk in the range
+// must be resident.
+void hash_file_range(b2fs_file_entry_t *entry, size_t start, size_t end, char *hex) {
+  sha1_state_t sha;
+  unsigned char digest[SHA1_DIGEST_LEN];
+
+  sha1_init(&sha);
+  feed_file_range(entry, &sha, start, end);
+  sha1_final(&sha, digest);
+  sha1_hex(digest, hex);
+}
+
+// Function feeds bytes [start, end) of a file into a digest.
+void feed_file_range(b2fs_file_entry_t *entry, sha1_state_t *sha, size_t start, size_t end) {
+  b2fs_file_chunk_t *chunk;
+
+  for (size_t pos = start; pos < end;) {
+    int chunk_num = pos / B2FS_CHUNK_SIZE, chunk_offset = pos % B2FS_CHUNK_SIZE;
+    size_t len = MIN((size_t) (B2FS_CHUNK_SIZE - chunk_offset), end - pos);
+    assert(keytree_find(entry->chunks, &chunk_num, &chunk) == KEYTREE_SUCCESS);
+
+    pthread_mutex_lock(&entry->buffer->lock);
+    sha1_update(sha, chunk->data + chunk_offset, len);
+    pthread_mutex_unlock(&entry->buffer->lock);
+    pos += len;
+  }
+}
+
+// Function works out how to upload a file as a large file whose unchanged ranges are copied
+// from its head version in B2. Every part but the last has to be at least B2FS_MIN_PART_SIZE,
+// so short changed ranges grow into their neighbours, and short unchanged ranges are sent.
+// Returns NULL if there's nothing worth copying.
+array_t *plan_parts(b2fs_file_entry_t *entry, size_t size, stack_t *dirty) {
+  b2fs_file_version_t version;
+  b2fs_file_chunk_t *chunk;
+  size_t limit;
+  int chunk_num, num_chunks = (size + B2FS_CHUNK_SIZE - 1) / B2FS_CHUNK_SIZE, count = 0;
+
+  // Copies need a complete version in B2 to copy from.
+  if (size <= B2FS_MIN_PART_SIZE) return NULL;
+  else if (get_head_version(entry, NULL, &version) != KEYTREE_SUCCESS) return NULL;
+  else if (!*version.live || *version.hidden || version.packed || version.manifest || !strlen(version.version_id)) return NULL;
+
+  // Work out which chunks no longer match the head version.
+  char *changed = calloc(num_chunks, sizeof(char));
+  stack_t *copy = stack_dup(dirty, NULL);
+  while (stack_pop(copy, &chunk_num) == STACK_SUCCESS) {
+    if (chunk_num < num_chunks) changed[chunk_num] = 1;
+  }
+  destroy_stack(copy);
+
+  pthread_mutex_lock(&entry->buffer->lock);
+  limit = MIN(version.size, entry->buffer->head_limit);
+  int num_iterations = keytree_size(entry->chunks);
+  keytree_iterator_t *it = keytree_iterate_start(entry->chunks, NULL);
+  while (num_iterations-- && keytree_iterate_next(it, &chunk_num, &chunk) == KEYTREE_SUCCESS) {
+    if (chunk->dirty && chunk_num < num_chunks) changed[chunk_num] = 1;
+  }
+  keytree_iterate_stop(it);
+  pthread_mutex_unlock(&entry->buffer->lock);
+
+  // Group chunks into runs. Unchanged runs too short to be a part get sent along with the
+  // changed runs around them.
+  b2fs_file_part_t *runs = calloc(num_chunks, sizeof(b2fs_file_part_t));
+  for (int i = 0; i < num_chunks; i++) {
+    size_t start = (size_t) i * B2FS_CHUNK_SIZE, end = MIN(start + B2FS_CHUNK_SIZE, size);
+    int unchanged = !changed[i] && end <= limit;
+
+    if (count && runs[count - 1].copy == unchanged) {
+      runs[count - 1].end = end;
+    } else {
+      runs[count].start = start;
+      runs[count].end = end;
+      runs[count++].copy = unchanged;
+    }
+  }
+  free(changed);
+  for (int i = 0; i < count; i++) {
+    if (runs[i].copy && runs[i].end - runs[i].start < B2FS_MIN_PART_SIZE) runs[i].copy = 0;
+    if (i && runs[i - 1].copy == runs[i].copy) {
+      runs[i - 1].end = runs[i].end;
+      memmove(&runs[i], &runs[i + 1], sizeof(b2fs_file_part_t) * (--count - i));
+      i--;
+    }
+  }
+
+  // Changed runs too short to be a part borrow from the unchanged run after them, or swallow
+  // it entirely if there isn't enough to go around.
+  for (int i = 0; i < count - 1; i++) {
+    size_t len = runs[i].end - runs[i].start;
+    if (runs[i].copy || len >= B2FS_MIN_PART_SIZE) continue;
+
+    size_t need = B2FS_MIN_PART_SIZE - len;
+    need = ((need + B2FS_CHUNK_SIZE - 1) / B2FS_CHUNK_SIZE) * B2FS_CHUNK_SIZE;
+    if (runs[i + 1].end - runs[i + 1].start >= need + B2FS_MIN_PART_SIZE) {
+      runs[i].end += need;
+      runs[i + 1].start += need;
+    } else {
+      int swallowed = i + 2 < count ? 2 : 1;
+      runs[i].end = runs[i + swallowed].end;
+      count -= swallowed;
+      memmove(&runs[i + 1], &runs[i + 1 + swallowed], sizeof(b2fs_file_part_t) * (count - i - 1));
+      i--;
+    }
+  }
+
+  // Split anything too big to be a single part. A short remainder takes a chunk back from the
+  // piece before it.
+  array_t *parts = create_array(sizeof(b2fs_file_part_t), NULL);
+  int copies = 0;
+  for (int i = 0; i < count; i++) {
+    b2fs_file_part_t piece = runs[i];
+    copies += piece.copy;
+    while (piece.end - piece.start > B2FS_MAX_PART_SIZE) {
+      size_t len = B2FS_MAX_PART_SIZE;
+      if (piece.end - piece.start - len < B2FS_MIN_PART_SIZE) len -= B2FS_CHUNK_SIZE;
+
+      b2fs_file_part_t head = {piece.start, piece.start + len, piece.copy, NULL, NULL};
+      array_push(parts, &head);
+      piece.start += len;
+    }
+    array_push(parts, &piece);
+  }
+  free(runs);
+
+  if (!copies || array_count(parts) > B2FS_MAX_PARTS) {
+    array_destroy(parts);
+    return NULL;
+  }
+  return parts;
+}
+
+// Function uploads a file according to a plan from plan_parts. Changed ranges are sent, and
+// everything else is copied from the head version by B2. B2 doesn't compute a digest for
+// large files, so the digest in info is "none" unless a single copy did the whole job.
+int upload_parts(b2fs_state_t *state, const char *path, b2fs_file_entry_t *entry, array_t *parts, b2fs_file_info_t *info) {
+  b2fs_file_version_t version;
+  b2fs_file_part_t part;
+  b2fs_upload_url_t part_url;
+  char large_id[B2FS_SMALL_GENERIC_BUFFER];
+  int count = array_count(parts), retval = B2FS_SUCCESS;
+  size_t sent = 0, copied = 0;
+  assert(get_head_version(entry, NULL, &version) == KEYTREE_SUCCESS);
+  memset(&part_url, 0, sizeof(b2fs_upload_url_t));
+
+  // A single copied range, like a truncation, doesn't need a large file at all.
+  if (count == 1) {
+    array_retrieve(parts, 0, &part);
+    for (int i = 0; i < B2FS_UPLOAD_RETRIES; i++) {
+      retval = b2_copy_file(state, part.source ? part.source : version.version_id, path, part.start, part.end, info);
+      if (retval != B2FS_NETWORK_ERROR) break;
+    }
+    if (retval == B2FS_SUCCESS) __sync_fetch_and_add(&state->stats.bytes_copied, part.end - part.start);
+    return retval;
+  }
+
+  retval = b2_start_large_file(state, path, large_id);
+  if (retval != B2FS_SUCCESS) return retval;
+
+  char (*sha1s)[SHA1_HEX_LEN] = malloc(sizeof(*sha1s) * count);
+  for (int i = 0; i < count && retval == B2FS_SUCCESS; i++) {
+    array_retrieve(parts, i, &part);
+
+    // Only the chunks we're actually sending need to be resident.
+    if (!part.copy && part.data) {
+      sha1_state_t sha;
+      unsigned char digest[SHA1_DIGEST_LEN];
+      sha1_init(&sha);
+      sha1_update(&sha, part.data, part.end - part.start);
+      sha1_final(&sha, digest);
+      sha1_hex(digest, sha1s[i]);
+    } else if (!part.copy) {
+      for (size_t pos = part.start; pos < part.end && retval == B2FS_SUCCESS; pos += B2FS_CHUNK_SIZE) {
+        if (!load_chunk(state, entry, pos / B2FS_CHUNK_SIZE, 1)) retval = B2FS_NETWORK_ERROR;
+      }
+      if (retval != B2FS_SUCCESS) break;
+      hash_file_range(entry, part.start, part.end, sha1s[i]);
+    }
+
+    for (int attempt = 0; attempt < B2FS_UPLOAD_RETRIES; attempt++) {
+      if (part.copy) {
+        retval = b2_copy_part(state, part.source ? part.source : version.version_id, large_id, i + 1, part.start, part.end, sha1s[i]);
+      } else {
+        if (!strlen(part_url.url)) retval = b2_get_upload_part_url(state, large_id, &part_url);
+        if (retval == B2FS_SUCCESS) {
+          b2fs_upload_stream_t stream = {part.data ? NULL : entry, part.data, part.data ? 0 : part.start, 0, part.end - part.start};
+          retval = b2_upload_part(state, &part_url, i + 1, &stream, sha1s[i]);
+          if (retval != B2FS_SUCCESS) memset(&part_url, 0, sizeof(b2fs_upload_url_t));
+        }
+      }
+      if (retval != B2FS_NETWORK_ERROR) break;
+    }
+
+    if (part.copy) copied += part.end - part.start;
+    else sent += part.end - part.start;
+  }
+
+  if (retval == B2FS_SUCCESS) retval = b2_finish_large_file(state, large_id, sha1s, count, info);
+  if (retval == B2FS_SUCCESS) {
+    __sync_fetch_and_add(&state->stats.bytes_uploaded, sent);
+    __sync_fetch_and_add(&state->stats.bytes_copied, copied);
+  } else {
+    b2_cancel_large_file(state, large_id);
+  }
+  free(sha1s);
+
+  return retval;
+}
+
+// Function initializes the mutation queue and starts its worker pool.
+int start_mutation_queue(b2fs_state_t *state) {
+  b2fs_mutation_queue_t *mutations = &state->mutations;
+
+  memset(mutations, 0, sizeof(b2fs_mutation_queue_t));
+  mutations->jobs = create_queue(NULL, sizeof(b2fs_mutation_job_t));
+  mutations->hiding = create_hash(sizeof(int), NULL);
+  mutations->workers = malloc(sizeof(pthread_t) * B2FS_MUTATION_THREADS);
+  if (!mutations->jobs || !mutations->hiding || !mutations->workers) {
+    if (mutations->jobs) destroy_queue(mutations->jobs);
+    if (mutations->hiding) hash_destroy(mutations->hiding);
+    if (mutations->workers) free(mutations->workers);
+    mutations->workers = NULL;
+    return B2FS_NOMEM_ERROR;
+  }
+  pthread_mutex_init(&mutations->lock, NULL);
+  pthread_cond_init(&mutations->ready, NULL);
+  pthread_cond_init(&mutations->drained, NULL);
+  pthread_cond_init(&mutations->landed, NULL);
+
+  for (int i = 0; i < B2FS_MUTATION_THREADS; i++) {
+    if (pthread_create(&mutations->workers[i], NULL, mutation_worker, state)) break;
+    mutations->num_workers++;
+  }
+
+  return mutations->num_workers ? B2FS_SUCCESS : B2FS_ERROR;
+}
+
+// Function waits for every queued and in-flight mutation to finish, then shuts the workers
+// down. Mutations queued after this happen synchronously.
+void stop_mutation_queue(b2fs_state_t *state) {
+  b2fs_mutation_queue_t *mutations = &state->mutations;
+  if (!mutations->workers) return;
+
+  pthread_mutex_lock(&mutations->lock);
+  while (mutations->queued || mutations->in_flight) pthread_cond_wait(&mutations->drained, &mutations->lock);
+  mutations->shutdown = 1;
+  pthread_cond_broadcast(&mutations->ready);
+  pthread_mutex_unlock(&mutations->lock);
+
+  for (int i = 0; i < mutations->num_workers; i++) pthread_join(mutations->workers[i], NULL);
+  destroy_queue(mutations->jobs);
+  hash_destroy(mutations->hiding);
+  free(mutations->workers);
+  mutations->workers = NULL;
+  pthread_cond_destroy(&mutations->ready);
+  pthread_cond_destroy(&mutations->drained);
+  pthread_cond_destroy(&mutations->landed);
+  pthread_mutex_destroy(&mutations->lock);
+}
+
+// Function queues a file version to be deleted. Unless it's being replayed, the delete is
+// journaled first, keyed by file id, so a crash before B2 hears about it doesn't leave the
+// version behind for good.
+void enqueue_delete(b2fs_state_t *state, const char *path, const char *file_id, size_t seq) {
+  if (!seq) journal_append(state, JOURNAL_DELETE, file_id, 0, path, strlen(path), &seq);
+  enqueue_mutation(state, MUTATION_DELETE, path, file_id, seq);
+}
+
+// Function queues the hide of an unlinked file. The unlink itself is already journaled, and
+// seq is its record.
+void enqueue_hide(b2fs_state_t *state, const char *path, const char *file_id, size_t seq) {
+  enqueue_mutation(state, MUTATION_HIDE, path, file_id, seq);
+}
+
+// Function hands a mutation off to the workers. A hide is counted against its path before the
+// job becomes visible so that nothing written to the path afterwards can get ahead of it.
+void enqueue_mutation(b2fs_state_t *state, b2fs_mutation_type_t type, const char *path, const char *file_id, size_t seq) {
+  b2fs_mutation_queue_t *mutations = &state->mutations;
+  b2fs_mutation_job_t job = {type, NULL, NULL, seq};
+
+  job.path = malloc(sizeof(char) * (strlen(path) + 1));
+  job.file_id = malloc(sizeof(char) * (strlen(file_id) + 1));
+  strcpy(job.path, path);
+  strcpy(job.file_id, file_id);
+
+  // Nobody to hand it to, so do it ourselves.
+  if (!mutations->workers) {
+    perform_mutation(state, &job);
+    free(job.path);
+    free(job.file_id);
+    return;
+  }
+
+  pthread_mutex_lock(&mutations->lock);
+  if (type == MUTATION_HIDE) {
+    int count = 0;
+    if (hash_get(mutations->hiding, job.path, &count) == HASH_SUCCESS) hash_drop(mutations->hiding, job.path);
+    count++;
+    hash_put(mutations->hiding, job.path, &count);
+  }
+  queue_enqueue(mutations->jobs, &job);
+  mutations->queued++;
+  write_log(LEVEL_DEBUG, "B2FS: Queued %s of %s, queue depth is %d.\n", type == MUTATION_HIDE ? "hide" : "delete",
+      path, mutations->queued + mutations->in_flight);
+  pthread_cond_signal(&mutations->ready);
+  pthread_mutex_unlock(&mutations->lock);
+}
+
+// Function blocks until every hide queued for path has landed, so that whatever is about to be
+// written there isn't hidden by a hide that was meant for what came before it.
+void wait_for_hide(b2fs_state_t *state, const char *path) {
+  b2fs_mutation_queue_t *mutations = &state->mutations;
+  int count;
+  if (!mutations->workers) return;
+
+  pthread_mutex_lock(&mutations->lock);
+  while (hash_get(mutations->hiding, (char *) path, &count) == HASH_SUCCESS) {
+    pthread_cond_wait(&mutations->landed, &mutations->lock);
+  }
+  pthread_mutex_unlock(&mutations->lock);
+}
+
+void *mutation_worker(void *voidarg) {
+  b2fs_state_t *state = voidarg;
+  b2fs_mutation_queue_t *mutations = &state->mutations;
+  b2fs_mutation_job_t job;
+
+  while (1) {
+    // Wait for work, or to be told to shut down.
+    pthread_mutex_lock(&mutations->lock);
+    while (!mutations->queued && !mutations->shutdown) pthread_cond_wait(&mutations->ready, &mutations->lock);
+    if (queue_dequeue(mutations->jobs, &job) != QUEUE_SUCCESS) {
+      pthread_mutex_unlock(&mutations->lock);
+      break;
+    }
+    mutations->queued--;
+    mutations->in_flight++;
+    pthread_mutex_unlock(&mutations->lock);
+
+    perform_mutation(state, &job);
+
+    // Release anyone waiting to write to the path, and anyone waiting on the queue as a whole.
+    pthread_mutex_lock(&mutations->lock);
+    mutations->in_flight--;
+    if (job.type == MUTATION_HIDE) {
+      int count;
+      assert(hash_get(mutations->hiding, job.path, &count) == HASH_SUCCESS);
+      hash_drop(mutations->hiding, job.path);
+      if (--count) hash_put(mutations->hiding, job.path, &count);
+      else pthread_cond_broadcast(&mutations->landed);
+    }
+    if (!mutations->queued && !mutations->in_flight) pthread_cond_broadcast(&mutations->drained);
+    pthread_mutex_unlock(&mutations->lock);
+    free(job.path);
+    free(job.file_id);
+  }
+
+  return NULL;
+}
+
+// Function makes a single mutation, backing off between attempts while B2 is unreachable or
+// busy. Any other answer means B2 has made up its mind, usually because the version is
+// already gone, so the journal can let go of it. Mutations that never got through stay
+// journaled and are tried again on the next mount.
+int perform_mutation(b2fs_state_t *state, b2fs_mutation_job_t *job) {
+  b2fs_file_info_t info;
+  int retval = B2FS_SUCCESS;
+
+  for (int i = 0; i < B2FS_MUTATION_RETRIES; i++) {
+    if (i) {
+      __sync_fetch_and_add(&state->stats.mutations_retried, 1);
+      usleep(100000 << i);
+    }
+    if (job->type == MUTATION_HIDE) retval = b2_hide_file(state, job->path + 1, &info);
+    else retval = b2_delete_file_version(state, job->path + 1, job->file_id);
+    if (retval != B2FS_NETWORK_ERROR) break;
+  }
+
+  if (job->type == MUTATION_HIDE) {
+    if (retval == B2FS_SUCCESS) record_hide(state, job, &info);
+    __sync_fetch_and_add(retval == B2FS_SUCCESS ? &state->stats.hides_completed : &state->stats.hides_failed, 1);
+  } else {
+    __sync_fetch_and_add(retval == B2FS_SUCCESS ? &state->stats.deletes_completed : &state->stats.deletes_failed, 1);
+  }
+
+  if (retval == B2FS_NETWORK_ERROR) {
+    write_log(LEVEL_ERROR, "B2FS: An unexpected network error was encountered while updating file %s.\n", job->path);
+  } else {
+    if (retval != B2FS_SUCCESS) write_log(LEVEL_DEBUG, "B2FS: B2 refused to update version %s of %s.\n", job->file_id, job->path);
+    journal_uploaded(state, job->type == MUTATION_HIDE ? job->path : job->file_id, job->journal_seq);
+  }
+
+  return retval;
+}
+
+// Function records the marker of a hide that just landed exactly as a listing would show it,
+// so the next unlink doesn't have to relist the file. If the file has been written since it
+// was unlinked, the marker is already buried under newer versions and is left for the next
+// listing to find.
+void record_hide(b2fs_state_t *state, b2fs_mutation_job_t *job, b2fs_file_info_t *info) {
+  b2fs_hash_entry_t entry;
+  b2fs_file_version_t head, marker;
+  if (!strlen(info->file_id)) return;
+
+  char *path_copy = malloc(sizeof(char) * (strlen(job->path) + 1));
+  strcpy(path_copy, job->path);
+  int retval = find_path(path_copy, state->fs_cache, &entry, 0);
+  free(path_copy);
+  if (retval != B2FS_SUCCESS || entry.type != TYPE_FILE) return;
+  if (get_head_version(&entry.file, NULL, &head) != KEYTREE_SUCCESS || strcmp(head.version_id, job->file_id)) return;
+
+  init_file_version(&marker);
+  strcpy(marker.version_id, info->file_id);
+  strcpy(marker.content_sha1, info->sha1);
+  *marker.hidden = 1;
+  *marker.live = 1;
+  *marker.synced = 1;
+  map_file_id(state, info->file_id, job->path);
+  record_version(&entry.file, &marker, info->timestamp);
+}
+
+// Function sets up the pending pack and, if packing is enabled, starts the thread that flushes
+// it on a timer. Packs from earlier mounts can still need tombstones with packing disabled.
+int start_pack_flusher(b2fs_state_t *state) {
+  b2fs_pack_t *pack = &state->pack;
+
+  memset(pack, 0, sizeof(b2fs_pack_t));
+  pack->members = create_array(sizeof(b2fs_pack_member_t *), NULL);
+  pack->paths = create_hash(sizeof(int *), dereference_and_free);
+  if (!pack->members || !pack->paths) {
+    if (pack->members) array_destroy(pack->members);
+    if (pack->paths) hash_destroy(pack->paths);
+    return B2FS_NOMEM_ERROR;
+  }
+  pthread_mutex_init(&pack->lock, NULL);
+  pthread_cond_init(&pack->wake, NULL);
+  if (!state->config.pack_threshold) return B2FS_SUCCESS;
+
+  if (pthread_create(&pack->flusher, NULL, pack_flusher, state)) return B2FS_ERROR;
+  pack->running = 1;
+  return B2FS_SUCCESS;
+}
+
+// Function flushes whatever is left in the pending pack and stops the flusher.
+void stop_pack_flusher(b2fs_state_t *state) {
+  b2fs_pack_t *pack = &state->pack;
+  if (!pack->members) return;
+
+  if (pack->running) {
+    pthread_mutex_lock(&pack->lock);
+    pack->shutdown = 1;
+    pthread_cond_signal(&pack->wake);
+    pthread_mutex_unlock(&pack->lock);
+
+    pthread_join(pack->flusher, NULL);
+    pack->running = 0;
+  } else {
+    flush_pack(state);
+  }
+  array_destroy(pack->members);
+  pack->members = NULL;
+  hash_destroy(pack->paths);
+  free(pack->data);
+  pthread_cond_destroy(&pack->wake);
+  pthread_mutex_destroy(&pack->lock);
+}
+
+void *pack_flusher(void *voidarg) {
+  b2fs_state_t *state = voidarg;
+  b2fs_pack_t *pack = &state->pack;
+
+  pthread_mutex_lock(&pack->lock);
+  while (!pack->shutdown) {
+    if (!array_count(pack->members)) {
+      pthread_cond_wait(&pack->wake, &pack->lock);
+      continue;
+    }
+
+    // Flush once the oldest member has waited out the window.
+    size_t deadline = pack->opened + state->config.pack_window * 1000;
+    if (current_timestamp() >= deadline) {
+      flush_pack_locked(state);
+    } else {
+      struct timespec until = {deadline / 1000, (deadline % 1000) * 1000000};
+      pthread_cond_timedwait(&pack->wake, &pack->lock, &until);
+    }
+  }
+  flush_pack_locked(state);
+  pthread_mutex_unlock(&pack->lock);
+
+  return NULL;
+}
+
+// Function decides whether a file should go out in a pack. Paths are stored one per line in
+// the pack index, so names with newlines always get their own upload.
+int packable(b2fs_state_t *state, const char *path, size_t size) {
+  return state->config.pack_threshold && size <= state->config.pack_threshold && !strchr(path, '\n');
+}
+
+// Function copies a small file into the pending pack. The pack takes ownership of dirty, and
+// the chunks in it are marked synced once the pack is safely in B2.
+void add_to_pack(b2fs_state_t *state, b2fs_upload_job_t *job, size_t size, char *sha1, stack_t *dirty) {
+  b2fs_pack_t *pack = &state->pack;
+  b2fs_file_chunk_t *chunk;
+  int chunk_num = 0;
+
+  pthread_mutex_lock(&pack->lock);
+  if (pack->used + size > B2FS_PACK_SIZE) flush_pack_locked(state);
+
+  // Make room for the contents.
+  if (pack->used + size > pack->capacity) {
+    size_t capacity = MAX(pack->capacity * 2, (size_t) B2FS_CHUNK_SIZE);
+    while (capacity < pack->used + size) capacity *= 2;
+    pack->data = realloc(pack->data, MIN(capacity, (size_t) B2FS_PACK_SIZE));
+    pack->capacity = MIN(capacity, (size_t) B2FS_PACK_SIZE);
+  }
+
+  b2fs_pack_member_t *member = claim_pack_slot(pack, job->path);
+  memcpy(&member->entry, retain_file_entry(&job->entry), sizeof(b2fs_file_entry_t));
+  strcpy(member->sha1, sha1);
+  member->offset = pack->used;
+  member->length = size;
+  member->journal_seq = job->journal_seq;
+
+  // Anything the superseded copy would have marked synced is covered by this one now.
+  if (member->dirty) {
+    int leftover;
+    while (stack_pop(member->dirty, &leftover) == STACK_SUCCESS) stack_push(dirty, &leftover);
+    destroy_stack(member->dirty);
+  }
+  member->dirty = dirty;
+
+  // Packed files fit in a single chunk, which upload_file_entry has already loaded.
+  pthread_mutex_lock(&job->entry.buffer->lock);
+  if (size) {
+    assert(keytree_find(job->entry.chunks, &chunk_num, &chunk) == KEYTREE_SUCCESS);
+    memcpy(pack->data + pack->used, chunk->data, size);
+  }
+  job->entry.buffer->packing++;
+  pthread_mutex_unlock(&job->entry.buffer->lock);
+  pack->used += size;
+
+  if (!pack->opened) pack->opened = current_timestamp();
+  pthread_cond_signal(&pack->wake);
+  pthread_mutex_unlock(&pack->lock);
+}
+
+// Function records in the next pack index that a packed file has been deleted. Without a
+// flusher to pick it up, the index goes out immediately.
+int add_tombstone(b2fs_state_t *state, const char *path) {
+  b2fs_pack_t *pack = &state->pack;
+  int retval = B2FS_SUCCESS;
+
+  pthread_mutex_lock(&pack->lock);
+  b2fs_pack_member_t *member = claim_pack_slot(pack, path);
+  member->tombstone = 1;
+  if (!pack->opened) pack->opened = current_timestamp();
+  if (pack->running) pthread_cond_signal(&pack->wake);
+  else retval = flush_pack_locked(state);
+  pthread_mutex_unlock(&pack->lock);
+
+  return retval;
+}
+
+// Function pulls a file back out of the pending pack because it's being uploaded on its own.
+// Dirty chunks the pack was holding onto are handed over to the caller.
+void withdraw_from_pack(b2fs_state_t *state, const char *path, stack_t *dirty) {
+  b2fs_pack_t *pack = &state->pack;
+  b2fs_pack_member_t *member;
+  int *index, chunk_num;
+  if (!pack->members) return;
+
+  pthread_mutex_lock(&pack->lock);
+  if (hash_get(pack->paths, (char *) path, &index) == HASH_SUCCESS) {
+    array_retrieve(pack->members, *index, &member);
+    member->superseded = 1;
+    if (member->dirty) {
+      while (stack_pop(member->dirty, &chunk_num) == STACK_SUCCESS) stack_push(dirty, &chunk_num);
+    }
+    hash_drop(pack->paths, (char *) path);
+  }
+  pthread_mutex_unlock(&pack->lock);
+}
+
+// Function returns a fresh member for the given path, superseding any earlier member for the
+// same path. The caller owns the previous member's dirty stack, if there was one.
+// Expects to be called with the pack lock held.
+b2fs_pack_member_t *claim_pack_slot(b2fs_pack_t *pack, const char *path) {
+  b2fs_pack_member_t *member = calloc(1, sizeof(b2fs_pack_member_t)), *previous;
+  int *index;
+
+  member->path = malloc(sizeof(char) * (strlen(path) + 1));
+  strcpy(member->path, path);
+
+  if (hash_get(pack->paths, member->path, &index) == HASH_SUCCESS) {
+    array_retrieve(pack->members, *index, &previous);
+    previous->superseded = 1;
+    member->dirty = previous->dirty;
+    previous->dirty = NULL;
+    *index = array_count(pack->members);
+  } else {
+    index = malloc(sizeof(int));
+    *index = array_count(pack->members);
+    hash_put(pack->paths, member->path, &index);
+  }
+  array_push(pack->members, &member);
+
+  return member;
+}
+
+int flush_pack(b2fs_state_t *state) {
+  b2fs_pack_t *pack = &state->pack;
+  if (!pack->members) return B2FS_SUCCESS;
+
+  pthread_mutex_lock(&pack->lock);
+  int retval = flush_pack_locked(state);
+  pthread_mutex_unlock(&pack->lock);
+  return retval;
+}
+
+// Function writes the pending pack, and then its index, to B2, and points every member at
+// its range of the new pack. The lock is held throughout so that packs land in B2 in order.
+// Expects to be called with the pack lock held.
+int flush_pack_locked(b2fs_state_t *state) {
+  b2fs_pack_t *pack = &state->pack;
+  b2fs_pack_member_t *member;
+  char name[B2FS_SMALL_GENERIC_BUFFER], sha1[SHA1_HEX_LEN];
+  b2fs_file_info_t info = {"none", "", 0, 0};
+  sha1_state_t sha;
+  unsigned char digest[SHA1_DIGEST_LEN];
+  int count = array_count(pack->members), packed = 0, retval = B2FS_SUCCESS;
+  if (!count) return B2FS_SUCCESS;
+
+  // A pack of nothing but tombstones only needs an index.
+  if (pack->used) {
+    sha1_init(&sha);
+    sha1_update(&sha, pack->data, pack->used);
+    sha1_final(&sha, digest);
+    sha1_hex(digest, sha1);
+
+    b2fs_upload_stream_t stream = {NULL, pack->data, 0, 0, pack->used};
+    sprintf(name, "/%s/%zu.pack", B2FS_PACK_DIR, pack->opened);
+    retval = upload_stream(state, &pack->upload_url, name, &stream, sha1, &info);
+  }
+
+  // Paths go last on each line so that they can contain spaces.
+  b2fs_string_t index;
+  memset(&index, 0, sizeof(b2fs_string_t));
+  if (retval == B2FS_SUCCESS) {
+    char line[B2FS_LARGE_GENERIC_BUFFER];
+    snprintf(line, B2FS_LARGE_GENERIC_BUFFER, "b2fs-pack 1 %s\n", info.file_id);
+    receive_string(line, 1, strlen(line), &index);
+
+    for (int i = 0; i < count; i++) {
+      array_retrieve(pack->members, i, &member);
+      if (member->superseded) continue;
+      else if (member->tombstone) snprintf(line, B2FS_LARGE_GENERIC_BUFFER, "- %s\n", member->path);
+      else snprintf(line, B2FS_LARGE_GENERIC_BUFFER, "+ %zu %zu %s\n", member->offset, member->length, member->path);
+      receive_string(line, 1, strlen(line), &index);
+    }
+
+    sha1_init(&sha);
+    sha1_update(&sha, index.str, index.ptr);
+    sha1_final(&sha, digest);
+    sha1_hex(digest, sha1);
+
+    b2fs_upload_stream_t stream = {NULL, index.str, 0, 0, index.ptr};
+    sprintf(name, "/%s/%zu.index", B2FS_PACK_DIR, pack->opened);
+    retval = upload_stream(state, &pack->upload_url, name, &stream, sha1, NULL);
+    free(index.str);
+  }
+
+  if (retval != B2FS_SUCCESS) write_log(LEVEL_ERROR, "B2FS: Failed to upload pack %zu.\n", pack->opened);
+
+  for (int i = 0; i < count; i++) {
+    array_retrieve(pack->members, i, &member);
+
+    if (!member->tombstone) {
+      if (!member->superseded && retval == B2FS_SUCCESS) {
+        b2fs_file_version_t version;
+        init_file_version(&version);
+        strcpy(version.version_id, info.file_id);
+        strcpy(version.content_sha1, member->sha1);
+        version.size = member->length;
+        version.pack_offset = member->offset;
+        version.packed = 1;
+        *version.live = 1;
+        *version.synced = 1;
+        record_version(&member->entry, &version, 0);
+        mark_chunks_synced(&member->entry, member->dirty);
+        journal_uploaded(state, member->path, member->journal_seq);
+        packed++;
+      } else if (!member->superseded) {
+        // Leave the file dirty so a later fsync or release will try again.
+        restore_dirty_chunks(&member->entry, member->dirty);
+        pthread_mutex_lock(&member->entry.buffer->lock);
+        member->entry.buffer->dirty = 1;
+        pthread_mutex_unlock(&member->entry.buffer->lock);
+      }
+
+      // Release anyone waiting for this file to be packed.
+      pthread_mutex_lock(&member->entry.buffer->lock);
+      member->entry.buffer->packing--;
+      if (!member->superseded) member->entry.buffer->error = retval;
+      pthread_cond_broadcast(&member->entry.buffer->flushed);
+      pthread_mutex_unlock(&member->entry.buffer->lock);
+      destroy_file_entry(&member->entry);
+    }
+
+    if (member->dirty) destroy_stack(member->dirty);
+    free(member->path);
+    free(member);
+  }
+
+  if (retval == B2FS_SUCCESS) {
+    state->stats.packs_uploaded++;
+    __sync_fetch_and_add(&state->stats.files_packed, packed);
+    __sync_fetch_and_add(&state->stats.bytes_uploaded, pack->used);
+  }
+
+  // Start the next pack from scratch.
+  array_destroy(pack->members);
+  hash_destroy(pack->paths);
+  pack->members = create_array(sizeof(b2fs_pack_member_t *), NULL);
+  pack->paths = create_hash(sizeof(int *), dereference_and_free);
+  pack->used = 0;
+  pack->opened = 0;
+
+  return retval;
+}
+
+// Function blocks until everything written to a file is in B2, whether it went out on its
+// own or in a pack. Returns the result of the most recent upload.
+int wait_for_durable(b2fs_state_t *state, b2fs_file_entry_t *entry) {
+  int retval = wait_for_upload(entry);
+
+  pthread_mutex_lock(&entry->buffer->lock);
+  int packing = entry->buffer->packing;
+  pthread_mutex_unlock(&entry->buffer->lock);
+  if (!packing) return retval;
+
+  flush_pack(state);
+  return wait_for_upload(entry);
+}
+
+// Function reads every pack index in the bucket, in the order they were written, and adds
+// the files they describe to the filesystem cache. The pack directory itself is hidden.
+int expand_packs(b2fs_state_t *state) {
+  b2fs_hash_entry_t packs, entry;
+  b2fs_file_version_t version;
+  size_t timestamp;
+  if (hash_get(state->fs_cache, B2FS_PACK_DIR, &packs) != HASH_SUCCESS || packs.type != TYPE_DIRECTORY) {
+    return B2FS_SUCCESS;
+  }
+  *packs.dir.hidden = 1;
+
+  // Index names start with the time their pack was opened, which all have the same width.
+  int count;
+  char **names = hash_keys(packs.dir.directory, &count);
+  qsort(names, count, sizeof(char *), strcmp_indirect);
+
+  int retval = B2FS_SUCCESS;
+  for (int i = 0; i < count && retval == B2FS_SUCCESS; i++) {
+    char *suffix = strrchr(names[i], '.');
+    if (!suffix || strcmp(suffix, ".index")) continue;
+
+    assert(hash_get(packs.dir.directory, names[i], &entry) == HASH_SUCCESS);
+    if (entry.type != TYPE_FILE || get_head_version(&entry.file, &timestamp, &version) != KEYTREE_SUCCESS) continue;
+    else if (*version.hidden || !version.size) continue;
+
+    char *index = malloc(sizeof(char) * (version.size + 1));
+    retval = b2_download_range(state, version.version_id, 0, version.size, index);
+    if (retval == B2FS_SUCCESS) {
+      index[version.size] = '\0';
+      apply_pack_index(state, index, timestamp);
+    }
+    free(index);
+  }
+  free(names);
+
+  return retval;
+}
+
+// Function adds a packed version for every file listed in a pack index, and a hidden one for
+// every tombstone. All of them take the timestamp of the index itself.
+void apply_pack_index(b2fs_state_t *state, char *index, size_t timestamp) {
+  char *line, *strtok_ptr, pack_id[B2FS_SMALL_GENERIC_BUFFER];
+  int version_num;
+
+  line = strtok_r(index, "\n", &strtok_ptr);
+  if (!line || sscanf(line, "b2fs-pack %d %255s", &version_num, pack_id) != 2 || version_num != 1) {
+    write_log(LEVEL_ERROR, "B2FS: Skipping unreadable pack index.\n");
+    return;
+  }
+
+  while ((line = strtok_r(NULL, "\n", &strtok_ptr))) {
+    b2fs_file_version_t version;
+    b2fs_hash_entry_t entry;
+    char *path;
+    int consumed = 0;
+
+    init_file_version(&version);
+    strcpy(version.version_id, pack_id);
+    version.packed = 1;
+    *version.live = 1;
+    *version.synced = 1;
+    if (*line == '+' && sscanf(line, "+ %zu %zu %n", &version.pack_offset, &version.size, &consumed) == 2 && consumed) {
+      path = line + consumed;
+    } else if (*line == '-' && line[1] == ' ') {
+      *version.hidden = 1;
+      path = line + 2;
+    } else {
+      destroy_file_version(&version);
+      continue;
+    }
+
+    // Make all intermediate directories and grab the parent.
+    char **path_pieces = split_path(path);
+    hash_t *dir = path_pieces[0] ? make_path(path_pieces, state->fs_cache, NULL) : NULL;
+    if (!dir) {
+      destroy_file_version(&version);
+      free(path_pieces);
+      continue;
+    }
+
+    if (hash_get(dir, path_pieces[0], &entry) != HASH_SUCCESS) {
+      entry.type = TYPE_FILE;
+      init_file_entry(&entry.file);
+      hash_put(dir, path_pieces[0], &entry);
+    }
+    if (entry.type == TYPE_FILE) keytree_insert(entry.file.versions, &timestamp, &version);
+    else destroy_file_version(&version);
+    free(path_pieces);
+  }
+}
+
+// Function sets up the chunk index and reads everything deduplicated in earlier mounts into the
+// filesystem cache. Manifests from earlier mounts are read whether or not dedup is enabled now,
+// unless manifests is zero because the cache already has them.
+int start_dedup(b2fs_state_t *state, int manifests) {
+  b2fs_dedup_t *dedup = &state->dedup;
+  b2fs_hash_entry_t dir, chunks, listed, entry;
+  b2fs_file_version_t version;
+  size_t timestamp;
+
+  dedup->chunks = create_hash(sizeof(char *), dereference_and_free);
+  if (!dedup->chunks) return B2FS_NOMEM_ERROR;
+  pthread_mutex_init(&dedup->lock, NULL);
+
+  // Cut points have to land in the same places on every mount, so the table comes from a
+  // fixed seed, expanded with splitmix64.
+  uint64_t seed = 0x62326673;
+  for (int i = 0; i < 256; i++) {
+    uint64_t mixed = (seed += 0x9E3779B97F4A7C15ULL);
+    mixed = (mixed ^ (mixed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    mixed = (mixed ^ (mixed >> 27)) * 0x94D049BB133111EBULL;
+    dedup->gear[i] = mixed ^ (mixed >> 31);
+  }
+  if (hash_get(state->fs_cache, B2FS_DEDUP_DIR, &dir) != HASH_SUCCESS || dir.type != TYPE_DIRECTORY) {
+    return B2FS_SUCCESS;
+  }
+  *dir.dir.hidden = 1;
+
+  // Chunks are named by their SHA-1, so the listing already tells us which ones B2 has.
+  int count;
+  if (hash_get(dir.dir.directory, "chunks", &chunks) == HASH_SUCCESS && chunks.type == TYPE_DIRECTORY) {
+    char **names = hash_keys(chunks.dir.directory, &count);
+    for (int i = 0; i < count; i++) {
+      assert(hash_get(chunks.dir.directory, names[i], &entry) == HASH_SUCCESS);
+      if (entry.type != TYPE_FILE || get_head_version(&entry.file, NULL, &version) != KEYTREE_SUCCESS) continue;
+      else if (*version.hidden || strlen(names[i]) != SHA1_HEX_LEN - 1) continue;
+
+      char *file_id = malloc(sizeof(char) * (strlen(version.version_id) + 1));
+      strcpy(file_id, version.version_id);
+      if (hash_put(dedup->chunks, names[i], &file_id) != HASH_SUCCESS) free(file_id);
+    }
+    free(names);
+  }
+
+  if (!manifests) return B2FS_SUCCESS;
+  else if (hash_get(dir.dir.directory, "manifests", &listed) != HASH_SUCCESS || listed.type != TYPE_DIRECTORY) {
+    return B2FS_SUCCESS;
+  }
+
+  int retval = B2FS_SUCCESS;
+  char **names = hash_keys(listed.dir.directory, &count);
+  for (int i = 0; i < count && retval == B2FS_SUCCESS; i++) {
+    assert(hash_get(listed.dir.directory, names[i], &entry) == HASH_SUCCESS);
+    if (entry.type != TYPE_FILE || get_head_version(&entry.file, &timestamp, &version) != KEYTREE_SUCCESS) continue;
+    else if (*version.hidden || !version.size) continue;
+
+    char *text = malloc(sizeof(char) * (version.size + 1));
+    retval = b2_download_range(state, version.version_id, 0, version.size, text);
+    if (retval == B2FS_SUCCESS) {
+      text[version.size] = '\0';
+      apply_manifest(state, text, version.version_id, timestamp);
+    }
+    free(text);
+  }
+  free(names);
+
+  return retval;
+}
+
+void stop_dedup(b2fs_state_t *state) {
+  b2fs_dedup_t *dedup = &state->dedup;
+  if (!dedup->chunks) return;
+
+  hash_destroy(dedup->chunks);
+  dedup->chunks = NULL;
+  pthread_mutex_destroy(&dedup->lock);
+}
+
+// Function adds the deduplicated version a manifest describes to the filesystem cache. The
+// first line holds the file's size, SHA-1 and path, and every line after it is one chunk.
+void apply_manifest(b2fs_state_t *state, char *text, const char *manifest_id, size_t timestamp) {
+  char *line, *strtok_ptr, sha1[SHA1_HEX_LEN], file_id[B2FS_SMALL_GENERIC_BUFFER];
+  b2fs_file_version_t version;
+  b2fs_hash_entry_t entry;
+  int version_num, consumed = 0;
+
+  init_file_version(&version);
+  line = strtok_r(text, "\n", &strtok_ptr);
+  if (!line || sscanf(line, "b2fs-manifest %d %zu %40s %n", &version_num, &version.size, version.content_sha1, &consumed) != 3 || version_num < 1 || version_num > 2 || !consumed) {
+    write_log(LEVEL_ERROR, "B2FS: Skipping unreadable dedup manifest.\n");
+    destroy_file_version(&version);
+    return;
+  }
+  char *path = line + consumed;
+  if (version_num == 2) unescape_manifest_path(path);
+
+  // Chunks are listed in order, and have to add up to the size of the file.
+  array_t *chunks = create_array(sizeof(b2fs_manifest_chunk_t), NULL);
+  size_t offset = 0;
+  while ((line = strtok_r(NULL, "\n", &strtok_ptr))) {
+    b2fs_manifest_chunk_t chunk;
+    if (sscanf(line, "%40s %zu %255s", sha1, &chunk.length, file_id) != 3) break;
+    chunk.offset = offset;
+    strcpy(chunk.sha1, sha1);
+    chunk.file_id = malloc(sizeof(char) * (strlen(file_id) + 1));
+    strcpy(chunk.file_id, file_id);
+    array_push(chunks, &chunk);
+    offset += chunk.length;
+  }
+
+  b2fs_manifest_t *manifest = calloc(1, sizeof(b2fs_manifest_t));
+  manifest->count = array_count(chunks);
+  manifest->chunks = malloc(sizeof(b2fs_manifest_chunk_t) * (manifest->count + 1));
+  manifest->refs = 1;
+  for (int i = 0; i < manifest->count; i++) array_retrieve(chunks, i, &manifest->chunks[i]);
+  array_destroy(chunks);
+  version.manifest = manifest;
+  if (offset != version.size) {
+    write_log(LEVEL_ERROR, "B2FS: Skipping truncated dedup manifest for %s.\n", path);
+    destroy_file_version(&version);
+    return;
+  }
+  strcpy(version.version_id, manifest_id);
+  *version.live = 1;
+  *version.synced = 1;
+
+  // Make all intermediate directories and grab the parent.
+  char **path_pieces = split_path(path);
+  hash_t *dir = path_pieces[0] ? make_path(path_pieces, state->fs_cache, NULL) : NULL;
+  if (!dir) {
+    destroy_file_version(&version);
+    free(path_pieces);
+    return;
+  }
+
+  if (hash_get(dir, path_pieces[0], &entry) != HASH_SUCCESS) {
+    entry.type = TYPE_FILE;
+    init_file_entry(&entry.file);
+    hash_put(dir, path_pieces[0], &entry);
+  }
+  if (entry.type == TYPE_FILE) keytree_insert(entry.file.versions, &timestamp, &version);
+  else destroy_file_version(&version);
+  free(path_pieces);
+}
+
+// Function uploads a file as content-defined chunks, sending only the chunks B2 doesn't have
+// yet, followed by a manifest listing them. Every chunk in the file must be resident.
+int upload_deduped(b2fs_state_t *state, b2fs_upload_url_t *upload_url, const char *path, b2fs_file_entry_t *entry, size_t size, char *sha1) {
+  b2fs_dedup_t *dedup = &state->dedup;
+  char name[B2FS_SMALL_GENERIC_BUFFER], *file_id;
+  unsigned char digest[SHA1_DIGEST_LEN];
+  sha1_state_t sha;
+  int retval = B2FS_SUCCESS;
+
+  // Cut points depend on what follows them, so the window always holds as much as a chunk
+  // could need, unless the file runs out first.
+  char *window = malloc(sizeof(char) * B2FS_DEDUP_MAX);
+  array_t *chunks = create_array(sizeof(b2fs_manifest_chunk_t), NULL);
+  size_t pos = 0, filled = 0, sent = 0;
+  while (pos < size && retval == B2FS_SUCCESS) {
+    size_t wanted = MIN((size_t) B2FS_DEDUP_MAX, size - pos);
+    if (filled < wanted) {
+      read_file_range(entry, window + filled, pos + filled, wanted - filled);
+      filled = wanted;
+    }
+
+    b2fs_manifest_chunk_t chunk;
+    chunk.offset = pos;
+    chunk.length = find_cut_point(dedup->gear, (unsigned char *) window, filled);
+    sha1_init(&sha);
+    sha1_update(&sha, window, chunk.length);
+    sha1_final(&sha, digest);
+    sha1_hex(digest, chunk.sha1);
+
+    pthread_mutex_lock(&dedup->lock);
+    int known = hash_get(dedup->chunks, chunk.sha1, &file_id) == HASH_SUCCESS;
+    if (known) {
+      chunk.file_id = malloc(sizeof(char) * (strlen(file_id) + 1));
+      strcpy(chunk.file_id, file_id);
+    }
+    pthread_mutex_unlock(&dedup->lock);
+
+    if (known) {
+      __sync_fetch_and_add(&state->stats.dedup_chunks_reused, 1);
+      __sync_fetch_and_add(&state->stats.bytes_deduped, chunk.length);
+    } else {
+      // Two workers can race to send the same chunk. B2 just keeps both, and either will do.
+      b2fs_file_info_t info;
+      b2fs_upload_stream_t stream = {NULL, window, 0, 0, chunk.length};
+      sprintf(name, "/%s/chunks/%s", B2FS_DEDUP_DIR, chunk.sha1);
+      retval = upload_stream(state, upload_url, name, &stream, chunk.sha1, &info);
+      if (retval != B2FS_SUCCESS) break;
+
+      chunk.file_id = malloc(sizeof(char) * (strlen(info.file_id) + 1));
+      strcpy(chunk.file_id, info.file_id);
+      file_id = malloc(sizeof(char) * (strlen(info.file_id) + 1));
+      strcpy(file_id, info.file_id);
+      pthread_mutex_lock(&dedup->lock);
+      if (hash_put(dedup->chunks, chunk.sha1, &file_id) != HASH_SUCCESS) free(file_id);
+      pthread_mutex_unlock(&dedup->lock);
+      __sync_fetch_and_add(&state->stats.dedup_chunks_uploaded, 1);
+      sent += chunk.length;
+    }
+    array_push(chunks, &chunk);
+
+    // Slide whatever follows the cut to the front of the window.
+    memmove(window, window + chunk.length, filled - chunk.length);
+    filled -= chunk.length;
+    pos += chunk.length;
+  }
+  free(window);
+
+  // Whatever happens, the chunk ids end up owned by the manifest.
+  int count = array_count(chunks);
+  b2fs_manifest_t *manifest = calloc(1, sizeof(b2fs_manifest_t));
+  manifest->count = count;
+  manifest->chunks = malloc(sizeof(b2fs_manifest_chunk_t) * (count + 1));
+  manifest->refs = 1;
+  for (int i = 0; i < count; i++) array_retrieve(chunks, i, &manifest->chunks[i]);
+  array_destroy(chunks);
+
+  b2fs_file_info_t info;
+  size_t written = 0;
+  if (retval == B2FS_SUCCESS) retval = write_manifest(state, upload_url, path, manifest, size, sha1, &info, &written);
+  if (retval == B2FS_SUCCESS) {
+    b2fs_file_version_t version;
+    init_file_version(&version);
+    strcpy(version.version_id, info.file_id);
+    strcpy(version.content_sha1, sha1);
+    version.size = size;
+    version.manifest = manifest;
+    *version.live = 1;
+    *version.synced = 1;
+    record_version(entry, &version, info.timestamp);
+    __sync_fetch_and_add(&state->stats.bytes_uploaded, sent + written);
+  } else {
+    release_manifest(manifest);
+  }
+
+  return retval;
+}
+
+// Function undoes the escaping write_manifest applies to paths containing a newline, in place.
+void unescape_manifest_path(char *path) {
+  char *out = path;
+  for (char *in = path; *in; in++) {
+    if (*in == '\\' && in[1]) *out++ = *++in == 'n' ? '\n' : *in;
+    else *out++ = *in;
+  }
+  *out = '\0';
+}
+
+// Function uploads the manifest describing a deduplicated version of path. Manifests have a
+// name of their own, so that versions of the same path never collide.
+int write_manifest(b2fs_state_t *state, b2fs_upload_url_t *upload_url, const char *path, b2fs_manifest_t *manifest, size_t size, char *sha1, b2fs_file_info_t *info, size_t *written) {
+  char name[B2FS_SMALL_GENERIC_BUFFER], line[B2FS_LARGE_GENERIC_BUFFER], text_sha1[SHA1_HEX_LEN];
+  unsigned char digest[SHA1_DIGEST_LEN];
+  sha1_state_t sha;
+  b2fs_string_t text;
+  memset(&text, 0, sizeof(b2fs_string_t));
+
+  // The path ends the first line, so a path containing a newline is escaped instead, and the
+  // manifest is marked version 2 so that it isn't read literally.
+  int escape = strchr(path, '\n') != NULL;
+  snprintf(line, B2FS_LARGE_GENERIC_BUFFER, "b2fs-manifest %d %zu %s ", escape ? 2 : 1, size, sha1);
+  receive_string(line, 1, strlen(line), &text);
+  for (const char *c = path; *c; c++) {
+    if (escape && *c == '\n') receive_string("\\n", 1, 2, &text);
+    else if (escape && *c == '\\') receive_string("\\\\", 1, 2, &text);
+    else receive_string((char *) c, 1, 1, &text);
+  }
+  receive_string("\n", 1, 1, &text);
+  for (int i = 0; i < manifest->count; i++) {
+    b2fs_manifest_chunk_t *chunk = &manifest->chunks[i];
+    snprintf(line, B2FS_LARGE_GENERIC_BUFFER, "%s %zu %s\n", chunk->sha1, chunk->length, chunk->file_id);
+    receive_string(line, 1, strlen(line), &text);
+  }
+
+  sha1_init(&sha);
+  sha1_update(&sha, text.str, text.ptr);
+  sha1_final(&sha, digest);
+  sha1_hex(digest, text_sha1);
+
+  b2fs_upload_stream_t stream = {NULL, text.str, 0, 0, text.ptr};
+  sprintf(name, "/%s/manifests/%zu-%016llx", B2FS_DEDUP_DIR, current_timestamp(), XXH64(path, strlen(path), 0));
+  int retval = upload_stream(state, upload_url, name, &stream, text_sha1, info);
+  if (written) *written = text.ptr;
+  free(text.str);
+
+  return retval;
+}
+
+// Function returns the length of the next content-defined chunk at the front of data. Past
+// the minimum size, a Gear hash is rolled over the data, and the chunk ends wherever the hash
+// matches the mask. len must only be short of B2FS_DEDUP_MAX at the end of the file.
+size_t find_cut_point(const uint64_t *gear, const unsigned char *data, size_t len) {
+  if (len <= B2FS_DEDUP_MIN) return len;
+
+  uint64_t hash = 0;
+  size_t pos = B2FS_DEDUP_MIN, normal = MIN(len, (size_t) B2FS_DEDUP_AVG), end = MIN(len, (size_t) B2FS_DEDUP_MAX);
+  for (; pos < normal; pos++) {
+    hash = (hash << 1) + gear[data[pos]];
+    if (!(hash & B2FS_DEDUP_MASK_S)) return pos + 1;
+  }
+  for (; pos < end; pos++) {
+    hash = (hash << 1) + gear[data[pos]];
+    if (!(hash & B2FS_DEDUP_MASK_L)) return pos + 1;
+  }
+  return end;
+}
+
+// Function copies bytes [start, start + len) of a file out of its chunks. Every chunk in the
+// range must be resident.
+void read_file_range(b2fs_file_entry_t *entry, char *buf, size_t start, size_t len) {
+  b2fs_file_chunk_t *chunk;
+
+  for (size_t pos = start; pos < start + len;) {
+    int chunk_num = pos / B2FS_CHUNK_SIZE, chunk_offset = pos % B2FS_CHUNK_SIZE;
+    size_t piece = MIN((size_t) (B2FS_CHUNK_SIZE - chunk_offset), start + len - pos);
+    assert(keytree_find(entry->chunks, &chunk_num, &chunk) == KEYTREE_SUCCESS);
+
+    pthread_mutex_lock(&entry->buffer->lock);
+    memcpy(buf + (pos - start), chunk->data + chunk_offset, piece);
+    pthread_mutex_unlock(&entry->buffer->lock);
+    pos += piece;
+  }
+}
+
+// Function downloads bytes [offset, offset + len) of a file version, wherever they live. Packed
+// versions are a range of their pack, and deduplicated ones are spread across their chunks.
+int download_version_range(b2fs_state_t *state, b2fs_file_version_t *version, size_t offset, size_t len, char *buf) {
+  if (!version->manifest) {
+    if (version->packed) offset += version->pack_offset;
+    return b2_download_range(state, version->version_id, offset, len, buf);
+  }
+
+  // Find the first chunk the range touches.
+  b2fs_manifest_t *manifest = version->manifest;
+  int low = 0, high = manifest->count - 1;
+  while (low < high) {
+    int mid = (low + high + 1) / 2;
+    if (manifest->chunks[mid].offset <= offset) low = mid;
+    else high = mid - 1;
+  }
+
+  for (int i = low; i < manifest->count && len; i++) {
+    b2fs_manifest_chunk_t *chunk = &manifest->chunks[i];
+    size_t skip = offset - chunk->offset, piece = MIN(chunk->length - skip, len);
+    int retval = b2_download_range(state, chunk->file_id, skip, piece, buf);
+    if (retval != B2FS_SUCCESS) return retval;
+    buf += piece;
+    offset += piece;
+    len -= piece;
+  }
+
+  return len ? B2FS_ERROR : B2FS_SUCCESS;
+}
+
+b2fs_manifest_t *retain_manifest(b2fs_manifest_t *manifest) {
+  __sync_fetch_and_add(&manifest->refs, 1);
+  return manifest;
+}
+
+void release_manifest(b2fs_manifest_t *manifest) {
+  if (__sync_sub_and_fetch(&manifest->refs, 1)) return;
+  for (int i = 0; i < manifest->count; i++) free(manifest->chunks[i].file_id);
+  free(manifest->chunks);
+  free(manifest);
+}
+
+// Function opens the journal, if there is one, leaving replay to replay_journal.
+int open_journal(b2fs_state_t *state) {
+  b2fs_journal_t *journal = &state->journal;
+
+  memset(journal, 0, sizeof(b2fs_journal_t));
+  journal->fd = -1;
+  if (!strlen(state->config.journal_path)) return B2FS_SUCCESS;
+
+  journal->fd = open(state->config.journal_path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+  if (journal->fd < 0) return B2FS_ERROR;
+  journal->pending = create_hash(sizeof(b2fs_journal_pending_t), NULL);
+  pthread_mutex_init(&journal->lock, NULL);
+
+  return journal->pending ? B2FS_SUCCESS : B2FS_NOMEM_ERROR;
+}
+
+// Function is called once every upload has drained. If B2 has everything, the journal has
+// nothing left to say and is emptied.
+void close_journal(b2fs_state_t *state) {
+  b2fs_journal_t *journal = &state->journal;
+  if (journal->fd < 0) return;
+
+  pthread_mutex_lock(&journal->lock);
+  if (!hash_count(journal->pending) && ftruncate(journal->fd, 0)) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to empty the journal.\n");
+  }
+  fsync(journal->fd);
+  close(journal->fd);
+  journal->fd = -1;
+  pthread_mutex_unlock(&journal->lock);
+
+  hash_destroy(journal->pending);
+  pthread_mutex_destroy(&journal->lock);
+}
+
+// Function puts everything in the journal that never made it to B2 back into the buffers, and
+// queues it for upload. A torn record at the end was never acknowledged, so it's cut off.
+int replay_journal(b2fs_state_t *state) {
+  b2fs_journal_t *journal = &state->journal;
+  b2fs_journal_header_t header;
+  char *path, *data;
+  size_t valid = 0, done;
+  if (journal->fd < 0) return B2FS_SUCCESS;
+
+  FILE *in = fopen(state->config.journal_path, "r");
+  if (!in) return B2FS_ERROR;
+
+  // First pass works out how much of each path's history is already in B2.
+  hash_t *uploaded = create_hash(sizeof(size_t), NULL);
+  while (read_journal_record(in, &header, &path, &data) == B2FS_SUCCESS) {
+    valid = ftell(in);
+    journal->seq = MAX(journal->seq, header.seq);
+    if (header.type == JOURNAL_UPLOADED) {
+      hash_drop(uploaded, path);
+      hash_put(uploaded, path, &header.offset);
+    }
+    free(path);
+    free(data);
+  }
+  if (ftruncate(journal->fd, valid)) {
+    fclose(in);
+    hash_destroy(uploaded);
+    return B2FS_ERROR;
+  }
+  journal->length = valid;
+
+  // Second pass applies everything newer than that, in order.
+  rewind(in);
+  while ((size_t) ftell(in) < valid && read_journal_record(in, &header, &path, &data) == B2FS_SUCCESS) {
+    if (hash_get(uploaded, path, &done) != HASH_SUCCESS) done = 0;
+    if (header.type != JOURNAL_UPLOADED && header.seq > done) apply_journal_record(state, &header, path, data);
+    free(path);
+    free(data);
+  }
+  fclose(in);
+  hash_destroy(uploaded);
+
+  // Hand whatever came back to the upload queue. Keys are copied so that uploads finishing
+  // underneath us can't free them.
+  pthread_mutex_lock(&journal->lock);
+  int count;
+  char **keys = hash_keys(journal->pending, &count);
+  for (int i = 0; i < count; i++) {
+    char *key = malloc(sizeof(char) * (strlen(keys[i]) + 1));
+    strcpy(key, keys[i]);
+    keys[i] = key;
+  }
+  pthread_mutex_unlock(&journal->lock);
+
+  for (int i = 0; i < count; i++) {
+    b2fs_hash_entry_t entry;
+    b2fs_file_version_t version;
+
+    // Pending deletes are keyed by file id, and are already queued.
+    if (*keys[i] != '/') {
+      free(keys[i]);
+      continue;
+    }
+    char *path_copy = malloc(sizeof(char) * (strlen(keys[i]) + 1));
+    strcpy(path_copy, keys[i]);
+    int retval = find_path(path_copy, state->fs_cache, &entry, 1);
+    free(path_copy);
+
+    if (retval == B2FS_SUCCESS && entry.type == TYPE_FILE && get_head_version(&entry.file, NULL, &version) == KEYTREE_SUCCESS) {
+      if (!*version.hidden && entry.file.buffer->dirty) enqueue_upload(state, keys[i], &entry.file);
+    }
+    free(keys[i]);
+  }
+  free(keys);
+
+  return B2FS_SUCCESS;
+}
+
+// Function redoes a single journal record against the filesystem cache. Creates and unlinks
+// that already happened are harmless to redo.
+void apply_journal_record(b2fs_state_t *state, b2fs_journal_header_t *header, char *path, char *data) {
+  b2fs_hash_entry_t entry;
+  b2fs_file_version_t version;
+
+  if (header->type == JOURNAL_UNLINK) {
+    b2fs_unlink(path);
+    return;
+  } else if (header->type == JOURNAL_DELETE) {
+    // Deletes are keyed by file id, and carry the path the version was uploaded under.
+    data[header->data_len] = '\0';
+    journal_note(state, path, header->seq, sizeof(b2fs_journal_header_t) + header->path_len + header->data_len);
+    enqueue_delete(state, data, path, header->seq);
+    return;
+  }
+
+  // Creates are only journaled for the sake of the directories a file's writes need, and
+  // those directories may be gone from the journal since, so make them as we go.
+  for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    internal_make(path, state->fs_cache, TYPE_DIRECTORY);
+    *slash = '/';
+  }
+  if (header->type == JOURNAL_CREATE) {
+    internal_make(path, state->fs_cache, header->offset == TYPE_FILE ? TYPE_FILE : TYPE_DIRECTORY);
+    return;
+  }
+
+  char *path_copy = malloc(sizeof(char) * (strlen(path) + 1));
+  strcpy(path_copy, path);
+  int retval = find_path(path_copy, state->fs_cache, &entry, 1);
+  if (retval == B2FS_SUCCESS && entry.type == TYPE_FILE) {
+    assert(get_head_version(&entry.file, NULL, &version) == KEYTREE_SUCCESS);
+    if (*version.hidden) retval = B2FS_FS_NOENT_ERROR;
+  }
+  if (retval == B2FS_FS_NOENT_ERROR && internal_make(path, state->fs_cache, TYPE_FILE) == B2FS_SUCCESS) {
+    strcpy(path_copy, path);
+    retval = find_path(path_copy, state->fs_cache, &entry, 1);
+  }
+  free(path_copy);
+
+  if (retval != B2FS_SUCCESS || entry.type != TYPE_FILE) {
+    write_log(LEVEL_ERROR, "B2FS: Could not replay journaled changes to %s.\n", path);
+    return;
+  }
+
+  if (header->type == JOURNAL_WRITE) {
+    if (write_buffer(state, &entry.file, data, header->data_len, header->offset) != (int) header->data_len) {
+      write_log(LEVEL_ERROR, "B2FS: Could not replay a journaled write to %s.\n", path);
+      return;
+    }
+  } else if (header->type == JOURNAL_TRUNCATE) {
+    resize_file(&entry.file, header->offset);
+  }
+  journal_note(state, path, header->seq, sizeof(b2fs_journal_header_t) + header->path_len + header->data_len);
+}
+
+// Function appends a record to the journal. If seq is given, the record's sequence number is
+// copied into it. Succeeds trivially if journaling is off.
+int journal_append(b2fs_state_t *state, b2fs_journal_type_t type, const char *path, size_t offset, const char *data, size_t len, size_t *seq) {
+  b2fs_journal_t *journal = &state->journal;
+  if (journal->fd < 0) return B2FS_SUCCESS;
+
+  pthread_mutex_lock(&journal->lock);
+  int retval = journal_append_locked(state, type, path, offset, data, len, seq);
+  pthread_mutex_unlock(&journal->lock);
+
+  return retval;
+}
+
+// Function appends a record to the journal. Everything but a create leaves its path pending
+// until an upload covers it. Expects to be called with the journal lock held.
+int journal_append_locked(b2fs_state_t *state, b2fs_journal_type_t type, const char *path, size_t offset, const char *data, size_t len, size_t *seq) {
+  b2fs_journal_t *journal = &state->journal;
+  b2fs_journal_header_t header = {B2FS_JOURNAL_MAGIC, type, strlen(path), len, journal->seq + 1, offset, 0};
+
+  header.checksum = journal_checksum(&header, path, data);
+  if (write_journal_record(journal->fd, &header, path, data) != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to write to the journal.\n");
+    return B2FS_ERROR;
+  }
+  size_t bytes = sizeof(b2fs_journal_header_t) + header.path_len + header.data_len;
+  journal->seq++;
+  journal->length += bytes;
+  if (seq) *seq = journal->seq;
+
+  if (type == JOURNAL_CREATE || type == JOURNAL_UPLOADED) return B2FS_SUCCESS;
+
+  b2fs_journal_pending_t pending = {journal->seq, 0, 0};
+  if (hash_get(journal->pending, (char *) path, &pending) == HASH_SUCCESS) {
+    hash_drop(journal->pending, (char *) path);
+    pending.latest = journal->seq;
+  }
+  pending.bytes += bytes;
+  journal->live += bytes;
+  hash_put(journal->pending, (char *) path, &pending);
+
+  return B2FS_SUCCESS;
+}
+
+// Function marks a path pending as of a record that was just replayed, which takes up bytes
+// of the journal.
+void journal_note(b2fs_state_t *state, const char *path, size_t seq, size_t bytes) {
+  b2fs_journal_t *journal = &state->journal;
+  b2fs_journal_pending_t pending = {seq, 0, 0};
+
+  pthread_mutex_lock(&journal->lock);
+  if (hash_get(journal->pending, (char *) path, &pending) == HASH_SUCCESS) {
+    hash_drop(journal->pending, (char *) path);
+    pending.latest = MAX(pending.latest, seq);
+  }
+  pending.bytes += bytes;
+  journal->live += bytes;
+  hash_put(journal->pending, (char *) path, &pending);
+  pthread_mutex_unlock(&journal->lock);
+}
+
+// Function records that B2 now has every record for path up to seq. Once nothing newer is
+// left, the path stops holding the journal back from a checkpoint. A checkpoint only runs
+// once it would reclaim B2FS_JOURNAL_CHECKPOINT bytes, so that a journal that's mostly
+// pending isn't rewritten on every upload.
+void journal_uploaded(b2fs_state_t *state, const char *path, size_t seq) {
+  b2fs_journal_t *journal = &state->journal;
+  b2fs_journal_pending_t pending;
+  if (journal->fd < 0) return;
+
+  pthread_mutex_lock(&journal->lock);
+  if (hash_get(journal->pending, (char *) path, &pending) == HASH_SUCCESS && pending.uploaded < seq) {
+    hash_drop(journal->pending, (char *) path);
+    if (pending.latest > seq) {
+      pending.uploaded = seq;
+      hash_put(journal->pending, (char *) path, &pending);
+    } else {
+      journal->live -= pending.bytes;
+    }
+    journal_append_locked(state, JOURNAL_UPLOADED, path, seq, NULL, 0, NULL);
+  }
+  if (journal->length - journal->live >= B2FS_JOURNAL_CHECKPOINT && checkpoint_journal(state) != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to checkpoint the journal.\n");
+  }
+  pthread_mutex_unlock(&journal->lock);
+}
+
+// Function returns the sequence number of the newest journal record.
+size_t journal_position(b2fs_state_t *state) {
+  b2fs_journal_t *journal = &state->journal;
+  if (journal->fd < 0) return 0;
+
+  pthread_mutex_lock(&journal->lock);
+  size_t seq = journal->seq;
+  pthread_mutex_unlock(&journal->lock);
+
+  return seq;
+}
+
+// Function makes everything journaled so far durable on the local disk.
+int journal_commit(b2fs_state_t *state) {
+  b2fs_journal_t *journal = &state->journal;
+  if (journal->fd < 0) return B2FS_SUCCESS;
+
+  pthread_mutex_lock(&journal->lock);
+  int retval = fdatasync(journal->fd) ? B2FS_ERROR : B2FS_SUCCESS;
+  pthread_mutex_unlock(&journal->lock);
+
+  return retval;
+}
+
+// Function rewrites the journal down to the records still needed, which are the ones for
+// pending paths that are newer than their last upload. The new journal is made durable before
+// it replaces the old one, and the rename is made durable before anything is appended to it,
+// so that a crash can't bring back the old journal without those records.
+// Expects to be called with the journal lock held.
+int checkpoint_journal(b2fs_state_t *state) {
+  b2fs_journal_t *journal = &state->journal;
+  b2fs_journal_header_t header;
+  b2fs_journal_pending_t pending;
+  char tmp_path[B2FS_SMALL_GENERIC_BUFFER + 8], *path, *data;
+  size_t length = 0, bytes;
+  int retval = B2FS_SUCCESS;
+
+  // Nothing pending means nothing to copy.
+  if (!hash_count(journal->pending)) {
+    if (ftruncate(journal->fd, 0) || fdatasync(journal->fd)) return B2FS_ERROR;
+    journal->length = journal->live = 0;
+    __sync_fetch_and_add(&state->stats.journal_checkpoints, 1);
+    return B2FS_SUCCESS;
+  }
+
+  sprintf(tmp_path, "%s.tmp", state->config.journal_path);
+  FILE *in = fopen(state->config.journal_path, "r");
+  int out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  hash_t *kept = create_hash(sizeof(size_t), NULL);
+  if (!in || out < 0 || !kept) {
+    if (in) fclose(in);
+    if (out >= 0) close(out);
+    if (kept) hash_destroy(kept);
+    return B2FS_ERROR;
+  }
+
+  // Tally what each path keeps as we go, so that what's live can start over exact.
+  while (retval == B2FS_SUCCESS && read_journal_record(in, &header, &path, &data) == B2FS_SUCCESS) {
+    int keep = header.type != JOURNAL_UPLOADED && hash_get(journal->pending, path, &pending) == HASH_SUCCESS && header.seq > pending.uploaded;
+    if (keep) {
+      retval = write_journal_record(out, &header, path, data);
+      length += sizeof(b2fs_journal_header_t) + header.path_len + header.data_len;
+      if (hash_get(kept, path, &bytes) == HASH_SUCCESS) hash_drop(kept, path);
+      else bytes = 0;
+      bytes += sizeof(b2fs_journal_header_t) + header.path_len + header.data_len;
+      hash_put(kept, path, &bytes);
+    }
+    free(path);
+    free(data);
+  }
+  fclose(in);
+
+  if (retval == B2FS_SUCCESS && !fsync(out) && !rename(tmp_path, state->config.journal_path)) {
+    close(out);
+    close(journal->fd);
+    journal->fd = open(state->config.journal_path, O_WRONLY | O_APPEND);
+    journal->length = journal->live = length;
+    retval = sync_parent(state->config.journal_path);
+
+    int count;
+    char **keys = hash_keys(journal->pending, &count), key[B2FS_LARGE_GENERIC_BUFFER];
+    for (int i = 0; i < count; i++) {
+      strcpy(key, keys[i]);
+      if (hash_get(journal->pending, key, &pending) != HASH_SUCCESS) continue;
+      if (hash_get(kept, key, &pending.bytes) != HASH_SUCCESS) pending.bytes = 0;
+      hash_drop(journal->pending, key);
+      hash_put(journal->pending, key, &pending);
+    }
+    free(keys);
+    hash_destroy(kept);
+
+    __sync_fetch_and_add(&state->stats.journal_checkpoints, 1);
+    return journal->fd < 0 ? B2FS_ERROR : retval;
+  }
+  close(out);
+  unlink(tmp_path);
+  hash_destroy(kept);
+
+  return B2FS_ERROR;
+}
+
+// Function writes a single record in one go, so that a crash leaves at most a torn record at
+// the end of the journal.
+int write_journal_record(int fd, b2fs_journal_header_t *header, const char *path, const char *data) {
+  struct iovec pieces[3] = {
+    {header, sizeof(b2fs_journal_header_t)},
+    {(void *) path, header->path_len},
+    {(void *) data, header->data_len}
+  };
+  size_t total = sizeof(b2fs_journal_header_t) + header->path_len + header->data_len;
+
+  return writev(fd, pieces, header->data_len ? 3 : 2) == (ssize_t) total ? B2FS_SUCCESS : B2FS_ERROR;
+}
+
+// Function reads the next record from the journal into freshly allocated path and data
+// buffers. Fails on the end of the journal, or on a record that was only partly written.
+int read_journal_record(FILE *in, b2fs_journal_header_t *header, char **path, char **data) {
+  if (fread(header, sizeof(b2fs_journal_header_t), 1, in) != 1) return B2FS_ERROR;
+  else if (header->magic != B2FS_JOURNAL_MAGIC || header->path_len >= B2FS_LARGE_GENERIC_BUFFER) return B2FS_ERROR;
+  else if (header->data_len > B2FS_JOURNAL_CHECKPOINT) return B2FS_ERROR;
+
+  *path = malloc(sizeof(char) * (header->path_len + 1));
+  *data = malloc(sizeof(char) * (header->data_len + 1));
+  if (*path && *data && fread(*path, 1, header->path_len, in) == header->path_len) {
+    (*path)[header->path_len] = '\0';
+    if (fread(*data, 1, header->data_len, in) == header->data_len) {
+      if (journal_checksum(header, *path, *data) == header->checksum) return B2FS_SUCCESS;
+    }
+  }
+
+  free(*path);
+  free(*data);
+  return B2FS_ERROR;
+}
+
+// Function computes the checksum of a journal record.
+uint64_t journal_checksum(b2fs_journal_header_t *header, const char *path, const char *data) {
+  b2fs_journal_header_t copy = *header;
+  copy.checksum = 0;
+
+  uint64_t sum = XXH64(data ? data : "", header->data_len, 0);
+  sum = XXH64(path, header->path_len, sum);
+  return XXH64(&copy, sizeof(b2fs_journal_header_t), sum);
+}
+
+// Function starts the periodic snapshot writer, if a snapshot path is configured. If the cache
+// came from a snapshot, the writer reconciles it with the bucket before anything else.
+int start_snapshots(b2fs_state_t *state, int reconcile) {
+  b2fs_snapshot_t *snapshot = &state->snapshot;
+
+  memset(snapshot, 0, sizeof(b2fs_snapshot_t));
+  if (!strlen(state->config.snapshot_path)) return B2FS_SUCCESS;
+  pthread_mutex_init(&snapshot->lock, NULL);
+  pthread_cond_init(&snapshot->wake, NULL);
+  snapshot->reconcile = reconcile;
+
+  if (pthread_create(&snapshot->writer, NULL, snapshot_worker, state)) return B2FS_ERROR;
+  snapshot->running = 1;
+  return B2FS_SUCCESS;
+}
+
+// Function stops the snapshot writer and takes a final snapshot for the next mount.
+void stop_snapshots(b2fs_state_t *state) {
+  b2fs_snapshot_t *snapshot = &state->snapshot;
+  if (!snapshot->running) return;
+
+  pthread_mutex_lock(&snapshot->lock);
+  snapshot->shutdown = 1;
+  pthread_cond_signal(&snapshot->wake);
+  pthread_mutex_unlock(&snapshot->lock);
+
+  pthread_join(snapshot->writer, NULL);
+  snapshot->running = 0;
+  if (write_snapshot(state) != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to write a snapshot to %s.\n", state->config.snapshot_path);
+  }
+  pthread_cond_destroy(&snapshot->wake);
+  pthread_mutex_destroy(&snapshot->lock);
+}
+
+void *snapshot_worker(void *voidarg) {
+  b2fs_state_t *state = voidarg;
+  b2fs_snapshot_t *snapshot = &state->snapshot;
+
+  // Helpers find the state through the FUSE context, which is per thread, and empty on any
+  // thread FUSE didn't start.
+  fuse_get_context()->private_data = state;
+  if (snapshot->reconcile) {
+    reconcile_cache(state);
+    write_snapshot(state);
+  }
+
+  pthread_mutex_lock(&snapshot->lock);
+  while (!snapshot->shutdown) {
+    size_t deadline = current_timestamp() + B2FS_SNAPSHOT_INTERVAL * 1000;
+    struct timespec until = {deadline / 1000, (deadline % 1000) * 1000000};
+    while (!snapshot->shutdown && current_timestamp() < deadline) {
+      pthread_cond_timedwait(&snapshot->wake, &snapshot->lock, &until);
+    }
+    if (snapshot->shutdown) break;
+
+    pthread_mutex_unlock(&snapshot->lock);
+    if (write_snapshot(state) != B2FS_SUCCESS) {
+      write_log(LEVEL_ERROR, "B2FS: Failed to write a snapshot to %s.\n", state->config.snapshot_path);
+    }
+    pthread_mutex_lock(&snapshot->lock);
+  }
+  pthread_mutex_unlock(&snapshot->lock);
+
+  return NULL;
+}
+
+// Function writes everything B2 is known to have to the snapshot file. The records are built up
+// in memory and go out in a single write to a temporary file, which replaces the old snapshot
+// once it's on disk, so a crash leaves either snapshot intact. The write only counts once the
+// directory has been synced too, since until then the rename can be lost.
+int write_snapshot(b2fs_state_t *state) {
+  b2fs_snapshot_header_t header;
+  b2fs_string_t body;
+  char path[B2FS_LARGE_GENERIC_BUFFER], tmp_path[B2FS_SMALL_GENERIC_BUFFER + 8];
+
+  memset(&body, 0, sizeof(b2fs_string_t));
+  *path = '\0';
+  int retval = snapshot_dir(&body, state->fs_cache, path, 0);
+  if (retval != B2FS_SUCCESS) {
+    free(body.str);
+    return retval;
+  }
+
+  memset(&header, 0, sizeof(b2fs_snapshot_header_t));
+  header.magic = B2FS_SNAPSHOT_MAGIC;
+  header.version = B2FS_SNAPSHOT_VERSION;
+  header.length = body.ptr;
+  header.checksum = XXH64(body.str ? body.str : "", body.ptr, 0);
+  strcpy(header.bucket, state->config.bucket_id);
+
+  sprintf(tmp_path, "%s.tmp", state->config.snapshot_path);
+  int out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (out < 0) {
+    free(body.str);
+    return B2FS_ERROR;
+  }
+  struct iovec pieces[2] = {
+    {&header, sizeof(b2fs_snapshot_header_t)},
+    {body.str, body.ptr}
+  };
+  size_t total = sizeof(b2fs_snapshot_header_t) + body.ptr;
+  int written = writev(out, pieces, body.ptr ? 2 : 1) == (ssize_t) total;
+  free(body.str);
+
+  if (written && !fsync(out) && !rename(tmp_path, state->config.snapshot_path)) {
+    close(out);
+    if (sync_parent(state->config.snapshot_path) != B2FS_SUCCESS) return B2FS_ERROR;
+    __sync_fetch_and_add(&state->stats.snapshots_written, 1);
+    return B2FS_SUCCESS;
+  }
+  close(out);
+  unlink(tmp_path);
+
+  return B2FS_ERROR;
+}
+
+// Function appends a record for everything under dir to the snapshot. path holds the path of
+// dir, and is extended in place for each entry. Directories only get a record of their own if
+// they're hidden, since any other directory comes back with the files in it.
+int snapshot_dir(b2fs_string_t *out, hash_t *dir, char *path, size_t path_len) {
+  b2fs_hash_entry_t entry;
+  int count, retval = B2FS_SUCCESS;
+
+  char **names = hash_keys(dir, &count);
+  for (int i = 0; i < count && retval == B2FS_SUCCESS; i++) {
+    size_t len = path_len + strlen(names[i]) + 1;
+    if (len >= B2FS_LARGE_GENERIC_BUFFER || hash_get(dir, names[i], &entry) != HASH_SUCCESS) continue;
+    path[path_len] = '/';
+    strcpy(path + path_len + 1, names[i]);
+
+    if (entry.type == TYPE_DIRECTORY) {
+      if (*entry.dir.hidden) {
+        b2fs_snapshot_entry_t record = {TYPE_DIRECTORY, len, 1, 0};
+        retval = snapshot_append(out, &record, sizeof(b2fs_snapshot_entry_t));
+        if (retval == B2FS_SUCCESS) retval = snapshot_append(out, path, len);
+      }
+      if (retval == B2FS_SUCCESS) retval = snapshot_dir(out, entry.dir.directory, path, len);
+    } else {
+      retval = snapshot_file(out, &entry.file, path, len);
+    }
+    path[path_len] = '\0';
+  }
+  free(names);
+
+  return retval;
+}
+
+// Function appends a record for a file and each of its versions that B2 has. Files that have
+// never made it to B2 are left out, as they would be from a listing.
+int snapshot_file(b2fs_string_t *out, b2fs_file_entry_t *entry, char *path, size_t path_len) {
+  b2fs_snapshot_entry_t record = {TYPE_FILE, path_len, 0, 0};
+  b2fs_file_version_t version;
+  size_t timestamp, start = out->ptr;
+
+  // The record goes in first, and its version count is filled in once we know it.
+  int retval = snapshot_append(out, &record, sizeof(b2fs_snapshot_entry_t));
+  if (retval == B2FS_SUCCESS) retval = snapshot_append(out, path, path_len);
+
+  int num_iterations = keytree_size(entry->versions);
+  keytree_iterator_t *it = keytree_iterate_start(entry->versions, NULL);
+  while (retval == B2FS_SUCCESS && num_iterations-- && keytree_iterate_next(it, &timestamp, &version) == KEYTREE_SUCCESS) {
+    if (!*version.live || !strlen(version.version_id)) continue;
+
+    // Zeroed first so that padding doesn't change the checksum from one snapshot to the next.
+    b2fs_snapshot_version_t snap;
+    memset(&snap, 0, sizeof(b2fs_snapshot_version_t));
+    snap.timestamp = timestamp;
+    snap.size = version.size;
+    snap.pack_offset = version.pack_offset;
+    snap.id_len = strlen(version.version_id);
+    snap.chunks = version.manifest ? version.manifest->count : 0;
+    strcpy(snap.sha1, version.content_sha1);
+    if (*version.hidden) snap.flags |= B2FS_SNAPSHOT_HIDDEN;
+    if (*version.synced) snap.flags |= B2FS_SNAPSHOT_SYNCED;
+    if (version.packed) snap.flags |= B2FS_SNAPSHOT_PACKED;
+    if (version.manifest) snap.flags |= B2FS_SNAPSHOT_MANIFEST;
+    retval = snapshot_append(out, &snap, sizeof(b2fs_snapshot_version_t));
+    if (retval == B2FS_SUCCESS) retval = snapshot_append(out, version.version_id, snap.id_len);
+
+    for (uint32_t i = 0; i < snap.chunks && retval == B2FS_SUCCESS; i++) {
+      b2fs_manifest_chunk_t *chunk = &version.manifest->chunks[i];
+      b2fs_snapshot_chunk_t snap_chunk;
+      memset(&snap_chunk, 0, sizeof(b2fs_snapshot_chunk_t));
+      snap_chunk.length = chunk->length;
+      snap_chunk.id_len = strlen(chunk->file_id);
+      strcpy(snap_chunk.sha1, chunk->sha1);
+      retval = snapshot_append(out, &snap_chunk, sizeof(b2fs_snapshot_chunk_t));
+      if (retval == B2FS_SUCCESS) retval = snapshot_append(out, chunk->file_id, snap_chunk.id_len);
+    }
+    record.versions++;
+  }
+  keytree_iterate_stop(it);
+
+  if (retval != B2FS_SUCCESS) return retval;
+  else if (!record.versions) out->ptr = start;
+  else memcpy(out->str + start, &record, sizeof(b2fs_snapshot_entry_t));
+
+  return B2FS_SUCCESS;
+}
+
+int snapshot_append(b2fs_string_t *out, const void *data, size_t len) {
+  if (out->len < out->ptr + len) {
+    size_t capacity = out->len ? out->len : B2FS_LARGE_GENERIC_BUFFER;
+    while (capacity < out->ptr + len) capacity <<= 1;
+    void *tmp = realloc(out->str, capacity);
+    if (!tmp) return B2FS_NOMEM_ERROR;
+    out->str = tmp;
+    out->len = capacity;
+  }
+
+  memcpy(out->str + out->ptr, data, len);
+  out->ptr += len;
+  return B2FS_SUCCESS;
+}
+
+// Function fills the filesystem cache from the snapshot, which is read in one go and checked
+// in full before any of it is used. The cache is only replaced if every record loads, so on
+// failure the mount can fall back to listing the bucket.
+int load_snapshot(b2fs_state_t *state) {
+  b2fs_snapshot_header_t header;
+  struct stat info;
+
+  int in = open(state->config.snapshot_path, O_RDONLY);
+  if (in < 0) return B2FS_ERROR;
+  if (fstat(in, &info) || (size_t) info.st_size < sizeof(b2fs_snapshot_header_t)) {
+    close(in);
+    return B2FS_ERROR;
+  }
+
+  char *data = malloc(info.st_size);
+  size_t have = 0;
+  while (data && have < (size_t) info.st_size) {
+    ssize_t got = read(in, data + have, info.st_size - have);
+    if (got <= 0) break;
+    have += got;
+  }
+  close(in);
+  if (!data || have != (size_t) info.st_size) {
+    free(data);
+    return B2FS_ERROR;
+  }
+
+  memcpy(&header, data, sizeof(b2fs_snapshot_header_t));
+  char *cursor = data + sizeof(b2fs_snapshot_header_t), *end = data + have;
+  int valid = header.magic == B2FS_SNAPSHOT_MAGIC && header.version == B2FS_SNAPSHOT_VERSION;
+  valid = valid && header.length == (uint64_t) (end - cursor) && XXH64(cursor, header.length, 0) == header.checksum;
+  valid = valid && !strncmp(header.bucket, state->config.bucket_id, B2FS_SMALL_GENERIC_BUFFER);
+  if (!valid) {
+    write_log(LEVEL_ERROR, "B2FS: Ignoring stale or damaged snapshot at %s.\n", state->config.snapshot_path);
+    free(data);
+    return B2FS_ERROR;
+  }
+
+  hash_t *fs_cache = create_hash(sizeof(b2fs_hash_entry_t), destroy_hash_entry);
+  int retval = fs_cache ? B2FS_SUCCESS : B2FS_NOMEM_ERROR;
+  while (retval == B2FS_SUCCESS && cursor < end) retval = read_snapshot_entry(&cursor, end, fs_cache);
+  free(data);
+
+  if (retval != B2FS_SUCCESS) {
+    if (fs_cache) hash_destroy(fs_cache);
+    return retval;
+  }
+  hash_destroy(state->fs_cache);
+  state->fs_cache = fs_cache;
+  return B2FS_SUCCESS;
+}
+
+// Function reads the record at cursor into fs_cache, and moves cursor past it.
+int read_snapshot_entry(char **cursor, char *end, hash_t *fs_cache) {
+  b2fs_snapshot_entry_t record;
+  b2fs_hash_entry_t entry;
+  char path[B2FS_LARGE_GENERIC_BUFFER];
+
+  if ((size_t) (end - *cursor) < sizeof(b2fs_snapshot_entry_t)) return B2FS_ERROR;
+  memcpy(&record, *cursor, sizeof(b2fs_snapshot_entry_t));
+  *cursor += sizeof(b2fs_snapshot_entry_t);
+  if (record.path_len >= B2FS_LARGE_GENERIC_BUFFER || (size_t) (end - *cursor) < record.path_len) return B2FS_ERROR;
+  else if (record.type != TYPE_DIRECTORY && record.type != TYPE_FILE) return B2FS_ERROR;
+  memcpy(path, *cursor, record.path_len);
+  path[record.path_len] = '\0';
+  *cursor += record.path_len;
+
+  // Make all intermediate directories and grab the parent.
+  char **path_pieces = split_path(path);
+  hash_t *dir = path_pieces[0] ? make_path(path_pieces, fs_cache, NULL) : NULL;
+  if (!dir) {
+    free(path_pieces);
+    return B2FS_ERROR;
+  }
+  if (hash_get(dir, path_pieces[0], &entry) != HASH_SUCCESS) {
+    entry.type = record.type;
+    if (entry.type == TYPE_DIRECTORY) init_dir_entry(&entry.dir);
+    else init_file_entry(&entry.file);
+    hash_put(dir, path_pieces[0], &entry);
+  }
+  free(path_pieces);
+  if (entry.type != record.type) return B2FS_ERROR;
+  else if (entry.type == TYPE_DIRECTORY) *entry.dir.hidden = record.hidden;
+
+  for (uint32_t i = 0; i < record.versions && entry.type == TYPE_FILE; i++) {
+    b2fs_file_version_t version;
+    size_t timestamp;
+    int retval = read_snapshot_version(cursor, end, &version, &timestamp);
+    if (retval != B2FS_SUCCESS) return retval;
+    if (keytree_insert(entry.file.versions, &timestamp, &version) == KEYTREE_DUPLICATE) destroy_file_version(&version);
+  }
+
+  return B2FS_SUCCESS;
+}
+
+// Function reads the version at cursor, along with its chunks, and moves cursor past it.
+int read_snapshot_version(char **cursor, char *end, b2fs_file_version_t *version, size_t *timestamp) {
+  b2fs_snapshot_version_t snap;
+
+  if ((size_t) (end - *cursor) < sizeof(b2fs_snapshot_version_t)) return B2FS_ERROR;
+  memcpy(&snap, *cursor, sizeof(b2fs_snapshot_version_t));
+  *cursor += sizeof(b2fs_snapshot_version_t);
+  if (snap.id_len >= B2FS_SMALL_GENERIC_BUFFER || (size_t) (end - *cursor) < snap.id_len) return B2FS_ERROR;
+  else if (snap.sha1[SHA1_HEX_LEN - 1]) return B2FS_ERROR;
+
+  if (init_file_version(version) != B2FS_SUCCESS) return B2FS_NOMEM_ERROR;
+  memcpy(version->version_id, *cursor, snap.id_len);
+  *cursor += snap.id_len;
+  strcpy(version->content_sha1, snap.sha1);
+  version->size = snap.size;
+  version->pack_offset = snap.pack_offset;
+  version->packed = !!(snap.flags & B2FS_SNAPSHOT_PACKED);
+  *version->hidden = !!(snap.flags & B2FS_SNAPSHOT_HIDDEN);
+  *version->synced = !!(snap.flags & B2FS_SNAPSHOT_SYNCED);
+  *version->live = 1;
+  *timestamp = snap.timestamp;
+  if (!(snap.flags & B2FS_SNAPSHOT_MANIFEST)) return B2FS_SUCCESS;
+
+  // Chunks have to add up to the size of the file, just like they do in the manifest object.
+  b2fs_manifest_t *manifest = calloc(1, sizeof(b2fs_manifest_t));
+  if (manifest) manifest->chunks = calloc(snap.chunks + 1, sizeof(b2fs_manifest_chunk_t));
+  if (!manifest || !manifest->chunks) {
+    free(manifest);
+    destroy_file_version(version);
+    return B2FS_NOMEM_ERROR;
+  }
+  manifest->refs = 1;
+  version->manifest = manifest;
+
+  size_t offset = 0;
+  for (uint32_t i = 0; i < snap.chunks; i++) {
+    b2fs_snapshot_chunk_t snap_chunk;
+    b2fs_manifest_chunk_t *chunk = &manifest->chunks[i];
+    if ((size_t) (end - *cursor) < sizeof(b2fs_snapshot_chunk_t)) break;
+    memcpy(&snap_chunk, *cursor, sizeof(b2fs_snapshot_chunk_t));
+    *cursor += sizeof(b2fs_snapshot_chunk_t);
+    if (snap_chunk.id_len >= B2FS_SMALL_GENERIC_BUFFER || (size_t) (end - *cursor) < snap_chunk.id_len) break;
+    else if (snap_chunk.sha1[SHA1_HEX_LEN - 1]) break;
+
+    chunk->offset = offset;
+    chunk->length = snap_chunk.length;
+    strcpy(chunk->sha1, snap_chunk.sha1);
+    chunk->file_id = calloc(snap_chunk.id_len + 1, sizeof(char));
+    if (!chunk->file_id) break;
+    memcpy(chunk->file_id, *cursor, snap_chunk.id_len);
+    *cursor += snap_chunk.id_len;
+    offset += chunk->length;
+    manifest->count++;
+  }
+  if (manifest->count != (int) snap.chunks || offset != version->size) {
+    destroy_file_version(version);
+    return B2FS_ERROR;
+  }
+
+  return B2FS_SUCCESS;
+}
+
+// Function brings a cache loaded from a snapshot back in line with the bucket. Versions B2 has
+// that the snapshot doesn't are added, and plain versions B2 no longer has are dropped. Nothing
+// newer than the listing, give or take B2FS_RECONCILE_SLACK seconds of clock skew, is dropped,
+// and files that have been touched since the mount are left to their own syncing.
+// Packs and manifests that other clients wrote after the snapshot was taken only show up in
+// full on the next mount that lists the bucket.
+void reconcile_cache(b2fs_state_t *state) {
+  char path[B2FS_LARGE_GENERIC_BUFFER];
+  size_t before = current_timestamp() - B2FS_RECONCILE_SLACK * 1000;
+
+  hash_t *listing = create_hash(sizeof(b2fs_hash_entry_t), destroy_hash_entry);
+  if (!listing) return;
+  if (list_bucket(state, listing) == B2FS_SUCCESS) {
+    *path = '\0';
+    reconcile_additions(state, listing, path, 0);
+    reconcile_removals(state, state->fs_cache, listing, path, 0, before);
+  } else {
+    write_log(LEVEL_ERROR, "B2FS: Failed to list the bucket, the cache is as of the last snapshot.\n");
+  }
+  hash_destroy(listing);
+}
+
+// Function copies every version in the listing that the cache doesn't have into the cache.
+void reconcile_additions(b2fs_state_t *state, hash_t *listing, char *path, size_t path_len) {
+  b2fs_hash_entry_t listed, entry;
+  b2fs_file_version_t version;
+  size_t timestamp;
+  int count;
+
+  char **names = hash_keys(listing, &count);
+  for (int i = 0; i < count; i++) {
+    size_t len = path_len + strlen(names[i]) + 1;
+    if (len >= B2FS_LARGE_GENERIC_BUFFER || hash_get(listing, names[i], &listed) != HASH_SUCCESS) continue;
+    path[path_len] = '/';
+    strcpy(path + path_len + 1, names[i]);
+    if (listed.type == TYPE_DIRECTORY) {
+      reconcile_additions(state, listed.dir.directory, path, len);
+      path[path_len] = '\0';
+      continue;
+    }
+
+    // Make all intermediate directories and grab the parent.
+    b2fs_dir_entry_t parent = {NULL, NULL, NULL};
+    char *path_copy = malloc(sizeof(char) * (len + 1));
+    strcpy(path_copy, path);
+    char **path_pieces = split_path(path_copy);
+    hash_t *dir = make_path(path_pieces, state->fs_cache, &parent);
+    if (dir && hash_get(dir, path_pieces[0], &entry) != HASH_SUCCESS) {
+      // Put it in the directory. If someone beat us to it, use theirs.
+      entry.type = TYPE_FILE;
+      init_file_entry(&entry.file);
+      if (hash_put(dir, path_pieces[0], &entry) != HASH_SUCCESS) {
+        destroy_file_entry(&entry.file);
+        hash_get(dir, path_pieces[0], &entry);
+      } else {
+        forget_missing(state, path);
+      }
+    }
+    int hidefile = !strcmp(path_pieces[0], ".b2fs_hidefile");
+    free(path_pieces);
+    free(path_copy);
+    if (!dir || entry.type != TYPE_FILE || entry.file.buffer->loaded) {
+      path[path_len] = '\0';
+      continue;
+    }
+
+    int num_iterations = keytree_size(listed.file.versions);
+    keytree_iterator_t *it = keytree_iterate_start(listed.file.versions, NULL);
+    while (num_iterations-- && keytree_iterate_next(it, &timestamp, &version) == KEYTREE_SUCCESS) {
+      if (has_version(entry.file.versions, version.version_id)) continue;
+
+      b2fs_file_version_t copy;
+      init_file_version(&copy);
+      strcpy(copy.version_id, version.version_id);
+      strcpy(copy.content_sha1, version.content_sha1);
+      copy.size = version.size;
+      *copy.hidden = *version.hidden;
+      *copy.live = 1;
+      *copy.synced = 1;
+      if (keytree_insert(entry.file.versions, &timestamp, &copy) == KEYTREE_DUPLICATE) {
+        destroy_file_version(&copy);
+        continue;
+      }
+      map_file_id(state, version.version_id, path);
+      __sync_fetch_and_add(&state->stats.versions_reconciled, 1);
+      if (hidefile && parent.hidden) {
+        *parent.hidden = 1;
+        invalidate_dentries(state);
+      }
+    }
+    keytree_iterate_stop(it);
+    path[path_len] = '\0';
+  }
+  free(names);
+}
+
+// Function drops every plain version under dir that's older than before, and missing from the
+// matching directory of the listing. Files left without any versions are dropped entirely.
+void reconcile_removals(b2fs_state_t *state, hash_t *dir, hash_t *listing, char *path, size_t path_len, size_t before) {
+  b2fs_hash_entry_t entry, listed;
+  b2fs_file_version_t version;
+  size_t timestamp;
+  int count;
+
+  char **names = hash_keys(dir, &count);
+  for (int i = 0; i < count; i++) {
+    size_t len = path_len + strlen(names[i]) + 1;
+    if (len >= B2FS_LARGE_GENERIC_BUFFER || hash_get(dir, names[i], &entry) != HASH_SUCCESS) continue;
+    int found = listing && hash_get(listing, names[i], &listed) == HASH_SUCCESS && listed.type == entry.type;
+
+    if (entry.type == TYPE_DIRECTORY) {
+      path[path_len] = '/';
+      strcpy(path + path_len + 1, names[i]);
+      reconcile_removals(state, entry.dir.directory, found ? listed.dir.directory : NULL, path, len, before);
+      path[path_len] = '\0';
+      continue;
+    } else if (entry.file.buffer->loaded) {
+      continue;
+    }
+
+    stack_t *stale = create_stack(NULL, sizeof(size_t));
+    int num_iterations = keytree_size(entry.file.versions), total = num_iterations, dropped = 0;
+    keytree_iterator_t *it = keytree_iterate_start(entry.file.versions, NULL);
+    while (num_iterations-- && keytree_iterate_next(it, &timestamp, &version) == KEYTREE_SUCCESS) {
+      if (!*version.live || version.packed || version.manifest || timestamp >= before) continue;
+      else if (found && has_version(listed.file.versions, version.version_id)) continue;
+      stack_push(stale, &timestamp);
+      dropped++;
+    }
+    keytree_iterate_stop(it);
+
+    while (stack_pop(stale, &timestamp) == STACK_SUCCESS) {
+      if (keytree_find(entry.file.versions, &timestamp, &version) != KEYTREE_SUCCESS) continue;
+      hash_drop(state->id_mappings, version.version_id);
+      if (dropped < total) keytree_remove(entry.file.versions, &timestamp, NULL);
+    }
+    destroy_stack(stale);
+    if (dropped && dropped == total) {
+      hash_drop(dir, names[i]);
+      invalidate_dentries(state);
+    }
+    __sync_fetch_and_add(&state->stats.versions_pruned, dropped);
+  }
+  free(names);
+}
+
+// Function checks whether a version tree holds the version with the given id.
+int has_version(keytree_t *versions, const char *version_id) {
+  b2fs_file_version_t version;
+  int found = 0;
+
+  int num_iterations = keytree_size(versions);
+  keytree_iterator_t *it = keytree_iterate_start(versions, NULL);
+  while (!found && num_iterations-- && keytree_iterate_next(it, NULL, &version) == KEYTREE_SUCCESS) {
+    found = !strcmp(version.version_id, version_id);
+  }
+  keytree_iterate_stop(it);
+
+  return found;
+}
+
+// Function uploads everything under a local directory to prefix in the bucket, without going
+// through a mount. Files and the parts of large files are spread across upload_threads
+// workers, and each is read straight out of a mapping of the local file.
+int ingest_tree(b2fs_state_t *state, const char *local, const char *prefix) {
+  b2fs_ingest_t ingest;
+  char root[B2FS_LARGE_GENERIC_BUFFER];
+  size_t start = current_timestamp();
+
+  // Remote paths are absolute, like everything in the filesystem cache.
+  while (*prefix == '/') prefix++;
+  snprintf(root, B2FS_LARGE_GENERIC_BUFFER, "/%s", prefix);
+  while (strlen(root) > 1 && root[strlen(root) - 1] == '/') root[strlen(root) - 1] = '\0';
+  if (!strcmp(root, "/")) *root = '\0';
+
+  memset(&ingest, 0, sizeof(b2fs_ingest_t));
+  ingest.state = state;
+  ingest.files = create_array(sizeof(b2fs_ingest_file_t *), NULL);
+  ingest.tasks = create_array(sizeof(b2fs_ingest_task_t), NULL);
+  pthread_mutex_init(&ingest.lock, NULL);
+  state->fs_cache = create_hash(sizeof(b2fs_hash_entry_t), destroy_hash_entry);
+  state->id_mappings = create_hash(sizeof(char *), dereference_and_free);
+
+  int retval = B2FS_NOMEM_ERROR;
+  if (!ingest.files || !ingest.tasks || !state->fs_cache || !state->id_mappings) {
+    write_log(LEVEL_ERROR, "B2FS: Could not allocate enough memory to ingest.\n");
+  } else if ((retval = collect_ingest_files(&ingest, local, root)) != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to read %s.\n", local);
+  }
+  if (retval != B2FS_SUCCESS) {
+    destroy_ingest(&ingest);
+    hash_destroy(state->fs_cache);
+    hash_destroy(state->id_mappings);
+    state->fs_cache = NULL;
+    state->id_mappings = NULL;
+    return retval;
+  }
+
+  int workers = MAX(MIN(state->config.upload_threads, array_count(ingest.tasks)), 1);
+  pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+  for (int i = 0; i < workers; i++) {
+    if (pthread_create(&threads[i], NULL, ingest_worker, &ingest)) workers = i;
+  }
+  if (!workers) ingest_worker(&ingest);
+  for (int i = 0; i < workers; i++) pthread_join(threads[i], NULL);
+  free(threads);
+  destroy_ingest(&ingest);
+
+  size_t elapsed = MAX(current_timestamp() - start, 1);
+  write_log(LEVEL_ERROR, "B2FS: Ingested %d files, %lu bytes, in %.1f seconds (%.1f MB/s).\n",
+      ingest.ingested, state->stats.bytes_uploaded, elapsed / 1000.0,
+      state->stats.bytes_uploaded / 1048576.0 / (elapsed / 1000.0));
+  if (ingest.failed) write_log(LEVEL_ERROR, "B2FS: %d files failed to ingest.\n", ingest.failed);
+  return ingest.failed ? B2FS_ERROR : B2FS_SUCCESS;
+}
+
+// Function frees every file an ingest collected, along with its task list.
+void destroy_ingest(b2fs_ingest_t *ingest) {
+  for (int i = 0; ingest->files && i < array_count(ingest->files); i++) {
+    b2fs_ingest_file_t *file;
+    array_retrieve(ingest->files, i, &file);
+    pthread_mutex_destroy(&file->lock);
+    free(file->local);
+    free(file->remote);
+    free(file->sha1s);
+    free(file);
+  }
+  if (ingest->files) array_destroy(ingest->files);
+  if (ingest->tasks) array_destroy(ingest->tasks);
+  pthread_mutex_destroy(&ingest->lock);
+}
+
+// Function walks a local directory tree and queues up every regular file in it. Large files
+// get a task per part, sized so they stay under B2's part count.
+int collect_ingest_files(b2fs_ingest_t *ingest, const char *local, const char *prefix) {
+  array_t *dirs = create_array(sizeof(char *), NULL), *remotes = create_array(sizeof(char *), NULL);
+  char *dir_path = malloc(sizeof(char) * (strlen(local) + 1)), *remote_path = malloc(sizeof(char) * (strlen(prefix) + 1));
+  strcpy(dir_path, local);
+  strcpy(remote_path, prefix);
+  array_push(dirs, &dir_path);
+  array_push(remotes, &remote_path);
+
+  int retval = B2FS_SUCCESS;
+  for (int i = 0; i < array_count(dirs); i++) {
+    array_retrieve(dirs, i, &dir_path);
+    array_retrieve(remotes, i, &remote_path);
+
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+      retval = B2FS_ERROR;
+      break;
+    }
+    for (struct dirent *child = readdir(dir); child; child = readdir(dir)) {
+      struct stat info;
+      if (!strcmp(child->d_name, ".") || !strcmp(child->d_name, "..")) continue;
+
+      char *child_local = malloc(sizeof(char) * (strlen(dir_path) + strlen(child->d_name) + 2));
+      char *child_remote = malloc(sizeof(char) * (strlen(remote_path) + strlen(child->d_name) + 2));
+      sprintf(child_local, "%s/%s", dir_path, child->d_name);
+      sprintf(child_remote, "%s/%s", remote_path, child->d_name);
+
+      // Links and special files have nothing B2 could hold.
+      if (lstat(child_local, &info) == 0 && S_ISDIR(info.st_mode)) {
+        array_push(dirs, &child_local);
+        array_push(remotes, &child_remote);
+        continue;
+      } else if (lstat(child_local, &info) || !S_ISREG(info.st_mode)) {
+        free(child_local);
+        free(child_remote);
+        continue;
+      }
+
+      b2fs_ingest_file_t *file = calloc(1, sizeof(b2fs_ingest_file_t));
+      file->local = child_local;
+      file->remote = child_remote;
+      file->size = info.st_size;
+      file->parts = 1;
+      if (file->size > B2FS_INGEST_PART_SIZE) {
+        size_t per = (file->size + B2FS_MAX_PARTS - 1) / B2FS_MAX_PARTS;
+        file->part_size = MIN(MAX(per, (size_t) B2FS_INGEST_PART_SIZE), (size_t) B2FS_MAX_PART_SIZE);
+        file->parts = (file->size + file->part_size - 1) / file->part_size;
+        file->sha1s = malloc(sizeof(*file->sha1s) * file->parts);
+      }
+      file->remaining = file->parts;
+      pthread_mutex_init(&file->lock, NULL);
+      array_push(ingest->files, &file);
+
+      // Single files are numbered as part zero, parts from one.
+      for (int part = file->sha1s ? 1 : 0; part <= (file->sha1s ? file->parts : 0); part++) {
+        b2fs_ingest_task_t task = {file, part};
+        array_push(ingest->tasks, &task);
+      }
+    }
+    closedir(dir);
+  }
+
+  for (int i = 0; i < array_count(dirs); i++) {
+    array_retrieve(dirs, i, &dir_path);
+    array_retrieve(remotes, i, &remote_path);
+    free(dir_path);
+    free(remote_path);
+  }
+  array_destroy(dirs);
+  array_destroy(remotes);
+
+  return retval;
+}
+
+// Function runs ingest tasks until there are none left. Every worker keeps its own upload URL,
+// and its own part URL for whichever large file it touched last.
+void *ingest_worker(void *voidarg) {
+  b2fs_ingest_t *ingest = voidarg;
+  b2fs_upload_url_t upload_url, part_url;
+  char part_for[B2FS_SMALL_GENERIC_BUFFER] = "";
+  b2fs_ingest_task_t task;
+  memset(&upload_url, 0, sizeof(b2fs_upload_url_t));
+  memset(&part_url, 0, sizeof(b2fs_upload_url_t));
+
+  while (1) {
+    pthread_mutex_lock(&ingest->lock);
+    int index = ingest->next++;
+    pthread_mutex_unlock(&ingest->lock);
+    if (index >= array_count(ingest->tasks)) break;
+
+    array_retrieve(ingest->tasks, index, &task);
+    int retval = ingest_task(ingest, &task, &upload_url, &part_url, part_for);
+    if (retval != B2FS_SUCCESS) write_log(LEVEL_ERROR, "B2FS: Failed to ingest %s.\n", task.file->local);
+  }
+
+  return NULL;
+}
+
+// Function uploads a whole file, or one part of a large file. Whoever sends the last part of a
+// large file finishes it.
+int ingest_task(b2fs_ingest_t *ingest, b2fs_ingest_task_t *task, b2fs_upload_url_t *upload_url, b2fs_upload_url_t *part_url, char *part_for) {
+  b2fs_state_t *state = ingest->state;
+  b2fs_ingest_file_t *file = task->file;
+  b2fs_file_info_t info;
+  sha1_state_t sha;
+  unsigned char digest[SHA1_DIGEST_LEN];
+  char sha1[SHA1_HEX_LEN];
+
+  pthread_mutex_lock(&file->lock);
+  int retval = file->failed ? B2FS_ERROR : B2FS_SUCCESS;
+  if (retval == B2FS_SUCCESS && !file->opened) {
+    // The other parts of the file mustn't go looking for a map that was never made.
+    retval = open_ingest_file(state, file);
+    if (retval != B2FS_SUCCESS) file->failed = 1;
+  }
+  pthread_mutex_unlock(&file->lock);
+
+  size_t start = task->part ? (task->part - 1) * file->part_size : 0;
+  size_t len = task->part ? MIN(file->part_size, file->size - start) : file->size;
+  if (retval == B2FS_SUCCESS) {
+    sha1_init(&sha);
+    sha1_update(&sha, file->map ? file->map + start : "", len);
+    sha1_final(&sha, digest);
+    sha1_hex(digest, sha1);
+  }
+
+  if (retval == B2FS_SUCCESS && !task->part) {
+    b2fs_upload_stream_t stream = {NULL, file->map ? file->map : "", 0, 0, len};
+    retval = upload_stream(state, upload_url, file->remote, &stream, sha1, &info);
+  } else if (retval == B2FS_SUCCESS) {
+    for (int i = 0; i < B2FS_UPLOAD_RETRIES; i++) {
+      if (strcmp(part_for, file->large_id)) {
+        retval = b2_get_upload_part_url(state, file->large_id, part_url);
+        if (retval == B2FS_SUCCESS) strcpy(part_for, file->large_id);
+      }
+      if (retval == B2FS_SUCCESS) {
+        b2fs_upload_stream_t stream = {NULL, file->map + start, 0, 0, len};
+        retval = b2_upload_part(state, part_url, task->part, &stream, sha1);
+      }
+      if (retval == B2FS_SUCCESS) break;
+
+      *part_for = '\0';
+      if (retval != B2FS_NETWORK_ERROR) break;
+      else if (i < B2FS_UPLOAD_RETRIES - 1) retval = B2FS_SUCCESS;
+    }
+    strcpy(file->sha1s[task->part - 1], sha1);
+  }
+  if (retval == B2FS_SUCCESS) __sync_fetch_and_add(&state->stats.bytes_uploaded, len);
+
+  pthread_mutex_lock(&file->lock);
+  if (retval != B2FS_SUCCESS) file->failed = 1;
+  int last = !--file->remaining;
+  pthread_mutex_unlock(&file->lock);
+  if (!last) return retval;
+
+  if (file->sha1s && !file->failed) {
+    retval = b2_finish_large_file(state, file->large_id, file->sha1s, file->parts, &info);
+  } else if (file->sha1s && strlen(file->large_id)) {
+    b2_cancel_large_file(state, file->large_id);
+  }
+  if (file->map) munmap(file->map, file->size);
+  file->map = NULL;
+
+  if (!file->failed && retval == B2FS_SUCCESS) {
+    cache_ingested(ingest, file, &info);
+  } else {
+    __sync_fetch_and_add(&ingest->failed, 1);
+    retval = B2FS_ERROR;
+  }
+  return retval;
+}
+
+// Function maps a local file for ingest, and starts its large file if it needs one. The file
+// only counts as opened once all of that has worked. Expects to be called with the file lock
+// held.
+int open_ingest_file(b2fs_state_t *state, b2fs_ingest_file_t *file) {
+  if (file->size) {
+    int fd = open(file->local, O_RDONLY);
+    if (fd < 0) return B2FS_ERROR;
+    file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file->map == MAP_FAILED) {
+      file->map = NULL;
+      return B2FS_ERROR;
+    }
+    madvise(file->map, file->size, MADV_SEQUENTIAL);
+  }
+  if (file->sha1s) {
+    int retval = b2_start_large_file(state, file->remote, file->large_id);
+    if (retval != B2FS_SUCCESS) return retval;
+  }
+  file->opened = 1;
+  return B2FS_SUCCESS;
+}
+
+// Function adds a file we just ingested to the filesystem cache, the same way a listing would.
+void cache_ingested(b2fs_ingest_t *ingest, b2fs_ingest_file_t *file, b2fs_file_info_t *info) {
+  b2fs_state_t *state = ingest->state;
+  b2fs_hash_entry_t entry;
+
+  // make_path isn't safe against itself.
+  pthread_mutex_lock(&ingest->lock);
+  char *path_copy = malloc(sizeof(char) * (strlen(file->remote) + 1));
+  strcpy(path_copy, file->remote);
+  char **path_pieces = split_path(path_copy);
+  hash_t *dir = make_path(path_pieces, state->fs_cache, NULL);
+  if (dir && hash_get(dir, path_pieces[0], &entry) != HASH_SUCCESS) {
+    entry.type = TYPE_FILE;
+    init_file_entry(&entry.file);
+    hash_put(dir, path_pieces[0], &entry);
+  }
+  if (dir && entry.type == TYPE_FILE) record_upload(state, file->remote, &entry.file, file->size, info);
+  ingest->ingested++;
+  pthread_mutex_unlock(&ingest->lock);
 
-  // Big, dirty, macro to handle all of the boilerplate cURL initialization stuff.
-  // Note that we do not acquire the read-lock here, because this function will always either be
-  // called with the write-lock held, or in a context where contention is impossible.
-  INITIALIZE_LIBCURL(
-      curl,
-      "https://api.backblaze.com",
-      "b2api/v1/b2_authorize_account",
-      based,
-      state->lock,
-      "Authorization: Basic %s",
-      data,
-      receive_string,
-      0);
+  free(path_pieces);
+  free(path_copy);
+}
 
-  // Attempt authentication.
-  if ((res = curl_easy_perform(curl)) == CURLE_OK) {
-    // No cURL errors occured, time to check for HTTP errors...
-    long code;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-    curl_easy_cleanup(curl);
+// Function downloads everything under prefix in the bucket into a local directory, without
+// going through a mount. Files are split into ranges that upload_threads workers fetch at
+// once, each written straight to its place in a preallocated file. Files that already match
+// in size and modification time are skipped, so an interrupted export can just be rerun.
+int export_tree(b2fs_state_t *state, const char *prefix, const char *local) {
+  b2fs_export_t export;
+  b2fs_hash_entry_t root;
+  size_t start = current_timestamp();
 
-    if (code == 200) {
-      int token_count = 0;
-      jsmn_parser parser;
-      jsmntok_t tokens[B2FS_SMALL_GENERIC_BUFFER];
+  // Export sees the bucket the same way a mount does, packed and deduplicated files included.
+  state->fs_cache = create_hash(sizeof(b2fs_hash_entry_t), destroy_hash_entry);
+  state->id_mappings = create_hash(sizeof(char *), dereference_and_free);
+  if (!state->fs_cache || !state->id_mappings) {
+    write_log(LEVEL_ERROR, "B2FS: Could not allocate enough memory to export.\n");
+    return B2FS_NOMEM_ERROR;
+  }
+  int retval = list_bucket(state, state->fs_cache);
+  if (retval == B2FS_SUCCESS) retval = expand_packs(state);
+  if (retval == B2FS_SUCCESS) retval = start_dedup(state, 1);
+  if (retval != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: Failed to list the bucket.\n");
+    return retval;
+  }
 
-      // Our authentication request went through. Time to JSON parse.
-      jsmn_init(&parser);
-      token_count = jsmn_parse(&parser, data.str, strlen(data.str), tokens, B2FS_SMALL_GENERIC_BUFFER);
-      if (token_count == JSMN_ERROR_NOMEM || tokens[0].type != JSMN_OBJECT) {
-        free(data.str);
-        return B2FS_NETWORK_API_ERROR;
-      }
+  char *path_copy = malloc(sizeof(char) * (strlen(prefix) + 2));
+  sprintf(path_copy, "/%s", prefix);
+  if (strspn(path_copy, "/") == strlen(path_copy)) {
+    root.type = TYPE_DIRECTORY;
+    root.dir.directory = state->fs_cache;
+  } else if (find_path(path_copy, state->fs_cache, &root, 1) != B2FS_SUCCESS) {
+    write_log(LEVEL_ERROR, "B2FS: %s doesn't exist in the bucket.\n", prefix);
+    free(path_copy);
+    return B2FS_FS_NOENT_ERROR;
+  }
+  free(path_copy);
+
+  memset(&export, 0, sizeof(b2fs_export_t));
+  export.state = state;
+  export.files = create_array(sizeof(b2fs_export_file_t *), NULL);
+  export.tasks = create_array(sizeof(b2fs_export_task_t), NULL);
+  pthread_mutex_init(&export.lock, NULL);
+  retval = collect_export_files(&export, &root, local);
+  if (retval != B2FS_SUCCESS) write_log(LEVEL_ERROR, "B2FS: Failed to create directories under %s.\n", local);
+
+  int workers = MAX(MIN(state->config.upload_threads, array_count(export.tasks)), 1);
+  pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+  for (int i = 0; i < workers && retval == B2FS_SUCCESS; i++) {
+    if (pthread_create(&threads[i], NULL, export_worker, &export)) workers = i;
+  }
+  if (!workers && retval == B2FS_SUCCESS) export_worker(&export);
+  for (int i = 0; i < workers && retval == B2FS_SUCCESS; i++) pthread_join(threads[i], NULL);
+  free(threads);
+
+  for (int i = 0; i < array_count(export.files); i++) {
+    b2fs_export_file_t *file;
+    array_retrieve(export.files, i, &file);
+    pthread_mutex_destroy(&file->lock);
+    free(file->local);
+    free(file);
+  }
+  array_destroy(export.files);
+  array_destroy(export.tasks);
+  pthread_mutex_destroy(&export.lock);
+  stop_dedup(state);
+  if (retval != B2FS_SUCCESS) return retval;
+
+  size_t elapsed = MAX(current_timestamp() - start, 1);
+  write_log(LEVEL_ERROR, "B2FS: Exported %d files, %lu bytes, in %.1f seconds (%.1f MB/s). %d already matched.\n",
+      export.exported, export.bytes, elapsed / 1000.0, export.bytes / 1048576.0 / (elapsed / 1000.0), export.skipped);
+  if (export.failed) write_log(LEVEL_ERROR, "B2FS: %d files failed to export.\n", export.failed);
+  return export.failed ? B2FS_ERROR : B2FS_SUCCESS;
+}
 
-      // Iterate over returned tokens and extract the needed info.
-      for (int i = 1; i < token_count; i++) {
-        jsmntok_t *key = &tokens[i++], *value = &tokens[i];
-        int len = value->end - value->start;
+// Function walks a directory in the filesystem cache, making its directories locally and
+// queueing a task for every range of every file that isn't already there.
+int collect_export_files(b2fs_export_t *export, b2fs_hash_entry_t *root, const char *local) {
+  array_t *dirs = create_array(sizeof(b2fs_hash_entry_t), NULL), *paths = create_array(sizeof(char *), NULL);
+  char *dir_path = malloc(sizeof(char) * (strlen(local) + 1));
+  strcpy(dir_path, local);
+  array_push(dirs, root);
+  array_push(paths, &dir_path);
+
+  int retval = B2FS_SUCCESS;
+  for (int i = 0; i < array_count(dirs) && retval == B2FS_SUCCESS; i++) {
+    b2fs_hash_entry_t dir, child;
+    array_retrieve(dirs, i, &dir);
+    array_retrieve(paths, i, &dir_path);
+    if (mkdir(dir_path, 0755) && errno != EEXIST) {
+      retval = B2FS_ERROR;
+      break;
+    }
 
-        if (jsmn_iskey(data.str, key, "authorizationToken")) {
-          memset(state->token, 0, sizeof(char) * B2FS_TOKEN_LEN);
-          memcpy(state->token, data.str + value->start, len);
-        } else if (jsmn_iskey(data.str, key, "apiUrl")) {
-          memset(state->api_url, 0, sizeof(char) * B2FS_TOKEN_LEN);
-          memcpy(state->api_url, data.str + value->start, len);
-        } else if (jsmn_iskey(data.str, key, "downloadUrl")) {
-          memset(state->down_url, 0, sizeof(char) * B2FS_TOKEN_LEN);
-          memcpy(state->down_url, data.str + value->start, len);
-        } else if (!jsmn_iskey(data.str, key, "accountId")) {
-          LOG_KEY(data.str, key, "authentication");
-        }
+    int count;
+    char **names = hash_keys(dir.dir.directory, &count);
+    for (int j = 0; j < count; j++) {
+      b2fs_file_version_t version;
+      size_t timestamp;
+
+      // Pack and dedup bookkeeping lives in hidden directories, and is skipped with them.
+      if (hash_get(dir.dir.directory, names[j], &child) != HASH_SUCCESS) continue;
+      char *child_path = malloc(sizeof(char) * (strlen(dir_path) + strlen(names[j]) + 2));
+      sprintf(child_path, "%s/%s", dir_path, names[j]);
+
+      if (child.type == TYPE_DIRECTORY && !*child.dir.hidden) {
+        array_push(dirs, &child);
+        array_push(paths, &child_path);
+        continue;
+      } else if (child.type != TYPE_FILE || get_head_version(&child.file, &timestamp, &version) != KEYTREE_SUCCESS) {
+        free(child_path);
+        continue;
+      } else if (*version.hidden || !*version.live) {
+        free(child_path);
+        continue;
       }
-      free(data.str);
 
-      // Validate and return!
-      if (strlen(state->token) && strlen(state->api_url) && strlen(state->down_url)) {
-        return B2FS_SUCCESS;
-      } else {
-        return B2FS_NETWORK_API_ERROR;
+      b2fs_export_file_t *file = calloc(1, sizeof(b2fs_export_file_t));
+      file->local = child_path;
+      file->version = version;
+      file->timestamp = timestamp;
+      file->fd = -1;
+      file->ranges = MAX((version.size + B2FS_EXPORT_RANGE_SIZE - 1) / B2FS_EXPORT_RANGE_SIZE, 1);
+      file->remaining = file->ranges;
+      pthread_mutex_init(&file->lock, NULL);
+      array_push(export->files, &file);
+
+      if (export_current(file)) {
+        export->skipped++;
+        continue;
+      }
+      for (int range = 0; range < file->ranges; range++) {
+        b2fs_export_task_t task = {file, range};
+        array_push(export->tasks, &task);
       }
-    } else if (code == 401) {
-      // Our authentication request was rejected due to bad auth info.
-      free(data.str);
-      return B2FS_NETWORK_ACCESS_ERROR;
-    } else {
-      // Request was badly formatted. Denotes an internal error.
-      strncpy(state->token, data.str, B2FS_TOKEN_LEN - 1);
-      state->token[B2FS_TOKEN_LEN - 1] = '\0';
-      free(data.str);
-      return B2FS_NETWORK_INTERN_ERROR;
     }
-    return B2FS_SUCCESS;
-  } else {
-    // cURL error encountered. Don't know enough about this to predict why.
-    // FIXME: Maybe add more detailed error handling here.
-    strncpy(state->token, curl_easy_strerror(res), B2FS_TOKEN_LEN - 1);
-    state->token[B2FS_TOKEN_LEN - 1] = '\0';
-    curl_easy_cleanup(curl);
-    return B2FS_NETWORK_ERROR;
+    free(names);
+  }
+
+  for (int i = 0; i < array_count(paths); i++) {
+    array_retrieve(paths, i, &dir_path);
+    free(dir_path);
+  }
+  array_destroy(dirs);
+  array_destroy(paths);
+
+  return retval;
+}
+
+// Function runs export tasks until there are none left.
+void *export_worker(void *voidarg) {
+  b2fs_export_t *export = voidarg;
+  b2fs_export_task_t task;
+
+  char *buf = malloc(sizeof(char) * B2FS_EXPORT_RANGE_SIZE);
+  while (buf) {
+    pthread_mutex_lock(&export->lock);
+    int index = export->next++;
+    pthread_mutex_unlock(&export->lock);
+    if (index >= array_count(export->tasks)) break;
+
+    array_retrieve(export->tasks, index, &task);
+    if (export_task(export, &task, buf) != B2FS_SUCCESS) {
+      write_log(LEVEL_ERROR, "B2FS: Failed to export %s.\n", task.file->local);
+    }
+  }
+  free(buf);
+
+  return NULL;
+}
+
+// Function fetches one range of a file and writes it into place. The local file only takes on
+// the upload time of its version once every range is in, so a file that was cut off partway
+// never looks finished.
+int export_task(b2fs_export_t *export, b2fs_export_task_t *task, char *buf) {
+  b2fs_export_file_t *file = task->file;
+  int retval = B2FS_SUCCESS;
+
+  pthread_mutex_lock(&file->lock);
+  if (file->failed) {
+    retval = B2FS_ERROR;
+  } else if (file->fd < 0) {
+    file->fd = open(file->local, O_WRONLY | O_CREAT, 0644);
+    if (file->fd < 0 || ftruncate(file->fd, file->version.size)) retval = B2FS_ERROR;
+    else if (file->version.size) posix_fallocate(file->fd, 0, file->version.size);
+  }
+  pthread_mutex_unlock(&file->lock);
+
+  size_t offset = (size_t) task->range * B2FS_EXPORT_RANGE_SIZE;
+  size_t len = MIN((size_t) B2FS_EXPORT_RANGE_SIZE, file->version.size - offset);
+  if (retval == B2FS_SUCCESS && len) {
+    for (int i = 0; i < B2FS_UPLOAD_RETRIES; i++) {
+      retval = download_version_range(export->state, &file->version, offset, len, buf);
+      if (retval != B2FS_NETWORK_ERROR) break;
+    }
+    for (size_t written = 0; retval == B2FS_SUCCESS && written < len;) {
+      ssize_t count = pwrite(file->fd, buf + written, len - written, offset + written);
+      if (count <= 0) retval = B2FS_ERROR;
+      else written += count;
+    }
+    if (retval == B2FS_SUCCESS) __sync_fetch_and_add(&export->bytes, len);
+  }
+
+  pthread_mutex_lock(&file->lock);
+  if (retval != B2FS_SUCCESS) file->failed = 1;
+  int last = !--file->remaining;
+  pthread_mutex_unlock(&file->lock);
+  if (!last) return retval;
+
+  if (!file->failed) {
+    struct timespec times[2];
+    times[0].tv_sec = times[1].tv_sec = file->timestamp / 1000;
+    times[0].tv_nsec = times[1].tv_nsec = (file->timestamp % 1000) * 1000000;
+    if (futimens(file->fd, times)) file->failed = 1;
   }
+  if (file->fd >= 0) close(file->fd);
+  file->fd = -1;
+
+  if (file->failed) __sync_fetch_and_add(&export->failed, 1);
+  else __sync_fetch_and_add(&export->exported, 1);
+  return file->failed ? B2FS_ERROR : retval;
+}
+
+// Function checks whether a file was already exported by an earlier run.
+int export_current(b2fs_export_file_t *file) {
+  struct stat info;
+  if (stat(file->local, &info) || !S_ISREG(info.st_mode)) return 0;
+  return (size_t) info.st_size == file->version.size
+    && (size_t) info.st_mtim.tv_sec * 1000 + info.st_mtim.tv_nsec / 1000000 == file->timestamp;
 }
 
 int init_file_entry(b2fs_file_entry_t *entry) {
@@ -1462,13 +7092,20 @@ int init_file_entry(b2fs_file_entry_t *entry) {
 
   memset(entry, 0, sizeof(b2fs_file_entry_t));
   entry->chunkmap = create_bitmap();
-  entry->chunks = create_keytree(NULL, NULL, intcmp, sizeof(int), sizeof(b2fs_file_chunk_t));
-  entry->versions = create_keytree(NULL, destroy_file_version, rev_intcmp, sizeof(size_t), sizeof(b2fs_file_version_t));
-  if (!entry->chunkmap || !entry->chunks) {
+  entry->chunks = create_keytree(NULL, destroy_chunk, intcmp, sizeof(int), sizeof(b2fs_file_chunk_t *));
+  entry->versions = create_keytree(NULL, destroy_file_version, rev_timecmp, sizeof(size_t), sizeof(b2fs_file_version_t));
+  entry->buffer = calloc(1, sizeof(b2fs_file_buffer_t));
+  if (!entry->chunkmap || !entry->chunks || !entry->buffer) {
     if (entry->chunkmap) free(entry->chunkmap);
     if (entry->chunks) free(entry->chunks);
+    if (entry->buffer) free(entry->buffer);
     return B2FS_NOMEM_ERROR;
   }
+  entry->buffer->trimmed = SIZE_MAX;
+  entry->buffer->refs = 1;
+  sha1_init(&entry->buffer->digest);
+  pthread_mutex_init(&entry->buffer->lock, NULL);
+  pthread_cond_init(&entry->buffer->flushed, NULL);
 
   return B2FS_SUCCESS;
 }
@@ -1496,110 +7133,78 @@ int init_file_version(b2fs_file_version_t *version) {
   }
 }
 
+// Function makes a copy of a version that owns its own flags, so that it can go in another
+// version tree. It's never marked for deletion, whatever the original was.
+int clone_file_version(b2fs_file_version_t *copy, b2fs_file_version_t *version) {
+  if (init_file_version(copy) != B2FS_SUCCESS) return B2FS_NOMEM_ERROR;
+  strcpy(copy->version_id, version->version_id);
+  strcpy(copy->content_sha1, version->content_sha1);
+  copy->size = version->size;
+  copy->pack_offset = version->pack_offset;
+  copy->packed = version->packed;
+  copy->manifest = version->manifest ? retain_manifest(version->manifest) : NULL;
+  *copy->hidden = *version->hidden;
+  *copy->live = *version->live;
+  *copy->synced = *version->synced;
+
+  return B2FS_SUCCESS;
+}
+
 int init_dir_entry(b2fs_dir_entry_t *entry) {
   if (!entry) return B2FS_INVAL_ERROR;
 
   memset(entry, 0, sizeof(b2fs_dir_entry_t));
   entry->directory = create_hash(sizeof(b2fs_hash_entry_t), destroy_hash_entry);
   entry->hidden = malloc(MEMBER_PTR_SIZE(b2fs_dir_entry_t, hidden));
-  *entry->hidden = 0;
-
-  if (entry->hidden && entry->directory) {
+  entry->listing = malloc(MEMBER_PTR_SIZE(b2fs_dir_entry_t, listing));
+
+  if (entry->hidden && entry->directory && entry->listing) {
+    // Directories made on a lazy mount might have more in them in B2 than we know about yet.
+    b2fs_state_t *state = fuse_get_context()->private_data;
+    *entry->hidden = 0;
+    entry->listing->listed = !state || !state->config.lazy;
+    pthread_mutex_init(&entry->listing->lock, NULL);
     return B2FS_SUCCESS;
   } else {
     if (entry->directory) hash_destroy(entry->directory);
     if (entry->hidden) free(entry->hidden);
+    if (entry->listing) free(entry->listing);
     return B2FS_NOMEM_ERROR;
   }
 }
 
+b2fs_file_entry_t *retain_file_entry(b2fs_file_entry_t *entry) {
+  __sync_fetch_and_add(&entry->buffer->refs, 1);
+  return entry;
+}
+
+// Function lets go of one reference to a file entry, and frees it if that was the last one.
 void destroy_file_entry(void *voidarg) {
   b2fs_file_entry_t *entry = voidarg;
+  if (__sync_sub_and_fetch(&entry->buffer->refs, 1)) return;
   keytree_destroy(entry->chunks);
   keytree_destroy(entry->versions);
   destroy_bitmap(entry->chunkmap);
+  pthread_cond_destroy(&entry->buffer->flushed);
+  pthread_mutex_destroy(&entry->buffer->lock);
+  free(entry->buffer);
 }
 
 void destroy_file_version(void *voidarg) {
   b2fs_state_t *state = fuse_get_context()->private_data;
   b2fs_file_version_t *version = voidarg;
 
-  if (version->should_delete && version->live) {
-    // Do-While loop works as a conditional retry-loop if our auth token is expired.
-    int do_again;
-    do {
-      CURL *curl = curl_easy_init();
-      CURLcode res;
-      char body[B2FS_SMALL_GENERIC_BUFFER];
-      b2fs_string_t response;
-      do_again = 0;
-      memset(&response, 0, sizeof(b2fs_string_t));
-
-      // Big, dirty, macro to handle all of the boilerplate cURL initialization stuff.
-      // Acquire the read-lock to make sure we're using the right auth token and stuff.
-      pthread_rwlock_rdlock(&state->lock);
-      INITIALIZE_LIBCURL(
-          curl,
-          state->api_url,
-          "b2api/v1/b2_delete_file_version",
-          state->token,
-          state->lock,
-          "Authorization: %s",
-          response,
-          receive_string,
-          1);
-      pthread_rwlock_unlock(&state->lock);
-
-      // Get file name.
-      char *filename;
-      assert(hash_get(state->id_mappings, version->version_id, &filename) == HASH_SUCCESS);
-
-      // Set POST body.
-      sprintf(body, "{\"fileName\":\"%s\",\"fileId\":\"%s\"}", filename + 1, version->version_id);
-      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
-
-      // Remove the file version from the version map.
-      hash_drop(state->id_mappings, version->version_id);
-
-      // Perform the request.
-      if ((res = curl_easy_perform(curl)) == CURLE_OK) {
-        long code;
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-
-        if (code == 200) {
-          // No need to check response. Delete API just returns the sent data, and the API docs state that a 200 is sufficient
-          // to know the file has been deleted.
-          free(response.str);
-        } else {
-          // B2 returned an error.
-          write_log(LEVEL_DEBUG, "B2FS: B2 returned an error code %ld with message: %s\n", code, response.str);
-
-          // Attempt to handle the returned error.
-          int retval = handle_b2_error(state, response.str, tok);
-
-          // Clean up resources.
-          if (response.str) free(response.str);
-          memset(&response, 0, sizeof(b2fs_string_t));
+  if (*version->should_delete && *version->live && !version->packed && !version->manifest) {
+    // Get file name, and hand the version off to the delete workers before it's forgotten.
+    char *filename;
+    assert(hash_get(state->id_mappings, version->version_id, &filename) == HASH_SUCCESS);
+    enqueue_delete(state, filename, version->version_id, 0);
 
-          // Take necessary action based on error handling results.
-          if (retval == B2FS_NETWORK_TOKEN_ERROR) do_again = 1;
-          else write_log(LEVEL_DEBUG, "B2FS: B2 error went unhandled during version destructor.\n");
-        }
-      } else {
-        // FIXME: This performs no error handling at the moment. Revisit this to decide what to do here.
-        // Hate putting calls on multiple lines, but this is too long.
-        write_log(LEVEL_DEBUG,
-            "B2FS: cURL failed with error %s during destruction of file %s.\n",
-            curl_easy_strerror(res), filename);
-        write_log(LEVEL_ERROR, "B2FS: An unexpected network error was encountered during the deletion of file %s.\n", filename);
-      }
-
-      // We either succeeded or failed. Cleanup and return.
-      curl_slist_free_all(headers);
-      curl_easy_cleanup(curl);
-    } while (do_again);
+    // Remove the file version from the version map.
+    hash_drop(state->id_mappings, version->version_id);
   }
 
+  if (version->manifest) release_manifest(version->manifest);
   free(version->should_delete);
   free(version->hidden);
   free(version->live);
@@ -1608,14 +7213,16 @@ void destroy_file_version(void *voidarg) {
 
 void destroy_dir_entry(b2fs_dir_entry_t *entry) {
   hash_destroy(entry->directory);
+  pthread_mutex_destroy(&entry->listing->lock);
   free(entry->hidden);
+  free(entry->listing);
 }
 
 void destroy_hash_entry(void *voidarg) {
   b2fs_hash_entry_t *entry = voidarg;
 
   // Identify entry type and destroy.
-  if (entry->type == TYPE_DIRECTORY) hash_destroy(entry->dir.directory);
+  if (entry->type == TYPE_DIRECTORY) destroy_dir_entry(&entry->dir);
   else destroy_file_entry(&entry->file);
 }
 
@@ -1655,8 +7262,8 @@ hash_t *make_path(char **path_pieces, hash_t *base, b2fs_dir_entry_t *output) {
       new_entry.type = TYPE_DIRECTORY;
       init_dir_entry(&new_entry.dir);
 
-      // Put it in the previous directory.
-      hash_put(current, piece, &new_entry);
+      // Put it in the previous directory. If someone beat us to it, use theirs.
+      if (hash_put(current, piece, &new_entry) != HASH_SUCCESS) destroy_dir_entry(&new_entry.dir);
       hash_get(current, piece, &entry);
     } else if (entry.type != TYPE_DIRECTORY) {
       // An intermediate piece was not a directory. Give up and return.
@@ -1675,18 +7282,31 @@ hash_t *make_path(char **path_pieces, hash_t *base, b2fs_dir_entry_t *output) {
 }
 
 int find_path(char *path, hash_t *base, b2fs_hash_entry_t *buf, int honor_hidden) {
-  char **path_pieces = split_path(path);
-  int i = 0;
+  b2fs_state_t *state = fuse_get_context()->private_data;
+  char **path_pieces = split_path(path), prefix[B2FS_LARGE_GENERIC_BUFFER];
+  int i = 0, lazy = state && state->config.lazy && base == state->fs_cache;
+  size_t prefix_len = 0;
   hash_t *current = base;
 
+  // Lazy mounts list directories as the lookup reaches them.
+  if (lazy) list_root(state);
+
   b2fs_hash_entry_t entry;
   for (char *piece = path_pieces[i++]; path_pieces[i - 1]; piece = path_pieces[i++]) {
     // Get the entry and perform basic validation.
     int retval = hash_get(current, piece, &entry);
     if (retval != HASH_SUCCESS) return B2FS_FS_NOENT_ERROR;
-    else if (honor_hidden && entry.type == TYPE_DIRECTORY && *entry.dir.hidden) return B2FS_FS_NOENT_ERROR;
     else if (entry.type == TYPE_FILE && path_pieces[i]) return B2FS_FS_NOTDIR_ERROR;
 
+    // Only its own listing can say whether a directory is hidden, so the last directory on the
+    // path is listed too if that matters.
+    if (lazy && entry.type == TYPE_DIRECTORY && (path_pieces[i] || honor_hidden)) {
+      prefix_len += snprintf(prefix + prefix_len, B2FS_LARGE_GENERIC_BUFFER - prefix_len, "%s/", piece);
+      if (prefix_len >= B2FS_LARGE_GENERIC_BUFFER) return B2FS_FS_NOENT_ERROR;
+      list_directory(state, &entry.dir, prefix);
+    }
+    if (honor_hidden && entry.type == TYPE_DIRECTORY && *entry.dir.hidden) return B2FS_FS_NOENT_ERROR;
+
     if (entry.type == TYPE_DIRECTORY) current = entry.dir.directory;
   }
 
@@ -1695,6 +7315,122 @@ int find_path(char *path, hash_t *base, b2fs_hash_entry_t *buf, int honor_hidden
   return B2FS_SUCCESS;
 }
 
+// Function resolves a path in the filesystem cache the same way find_path does, with hidden
+// directories honored, but checks the dentry cache first. A hit takes one probe, and doesn't
+// have to copy or split the path. Paths that don't exist are remembered too, which on a lazy
+// mount also saves asking B2 about them again.
+int lookup_path(b2fs_state_t *state, const char *path, b2fs_hash_entry_t *buf) {
+  b2fs_dentry_cache_t *dentries = &state->dentries;
+  size_t len = strlen(path);
+  unsigned long long hash = XXH64(path, len, 0);
+
+  // The counters have to be read before the walk, so that anything dropped or added during it
+  // invalidates what we're about to remember.
+  size_t generation = dentries->generation, created = dentries->created, unlisted = dentries->unlisted;
+  int retval = probe_dentry(dentries, path, len, hash, buf);
+  if (retval != B2FS_ERROR) {
+    if (retval == B2FS_SUCCESS) __sync_fetch_and_add(&state->stats.dentry_hits, 1);
+    else __sync_fetch_and_add(&state->stats.negative_hits, 1);
+    return retval;
+  }
+  __sync_fetch_and_add(&state->stats.dentry_misses, 1);
+
+  char *path_copy = malloc(sizeof(char) * (len + 1));
+  strcpy(path_copy, path);
+  retval = find_path(path_copy, state->fs_cache, buf, 1);
+  free(path_copy);
+  if (retval == B2FS_SUCCESS) {
+    remember_dentry(dentries, path, len, hash, generation, buf);
+  } else if (retval == B2FS_FS_NOENT_ERROR && dentries->unlisted == unlisted) {
+    // If something was added while we were looking, it might have been this path, and
+    // forget_missing might have come and gone before the miss was written. If a listing
+    // failed, the path might well exist, and the next lookup has to list it again.
+    remember_dentry(dentries, path, len, hash, generation, NULL);
+    __sync_synchronize();
+    if (dentries->created != created) forget_dentry(dentries, path, len, hash);
+  }
+
+  return retval;
+}
+
+// Function copies out the entry remembered for path, if there is one and it's still good.
+// Returns B2FS_FS_NOENT_ERROR for a remembered miss, and B2FS_ERROR if there's nothing to go on.
+int probe_dentry(b2fs_dentry_cache_t *dentries, const char *path, size_t len, unsigned long long hash, b2fs_hash_entry_t *buf) {
+  if (!dentries->slots || len >= B2FS_SMALL_GENERIC_BUFFER) return B2FS_ERROR;
+  b2fs_dentry_t *slot = &dentries->slots[hash & (B2FS_DENTRY_SLOTS - 1)];
+
+  unsigned int seq = slot->seq;
+  __sync_synchronize();
+  if (seq & 1) return B2FS_ERROR;
+  int hit = slot->hash == hash && slot->len == len && slot->generation == dentries->generation;
+  int negative = slot->negative;
+  if (hit && !memcmp(slot->path, path, len)) memcpy(buf, &slot->entry, sizeof(b2fs_hash_entry_t));
+  else hit = 0;
+  __sync_synchronize();
+  if (!hit || slot->seq != seq) return B2FS_ERROR;
+  else if (negative) return B2FS_FS_NOENT_ERROR;
+
+  // Hiding a directory invalidates its descendants, but the flag on the directory itself
+  // is cheap enough to just check.
+  return buf->type != TYPE_DIRECTORY || !*buf->dir.hidden ? B2FS_SUCCESS : B2FS_ERROR;
+}
+
+// Function remembers a lookup, or a miss if entry is NULL, unless another thread is already
+// writing the slot, in which case it isn't worth waiting for.
+void remember_dentry(b2fs_dentry_cache_t *dentries, const char *path, size_t len, unsigned long long hash, size_t generation, b2fs_hash_entry_t *entry) {
+  if (!dentries->slots || len >= B2FS_SMALL_GENERIC_BUFFER) return;
+  b2fs_dentry_t *slot = &dentries->slots[hash & (B2FS_DENTRY_SLOTS - 1)];
+
+  unsigned int seq = slot->seq;
+  if (seq & 1 || !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1)) return;
+  slot->generation = generation;
+  slot->hash = hash;
+  slot->len = len;
+  slot->negative = !entry;
+  if (entry) memcpy(&slot->entry, entry, sizeof(b2fs_hash_entry_t));
+  memcpy(slot->path, path, len);
+  __sync_synchronize();
+  slot->seq = seq + 2;
+}
+
+// Function drops whatever is remembered for path. Unlike remember_dentry, this has to happen,
+// so it waits out anyone else writing the slot.
+void forget_dentry(b2fs_dentry_cache_t *dentries, const char *path, size_t len, unsigned long long hash) {
+  if (!dentries->slots || len >= B2FS_SMALL_GENERIC_BUFFER) return;
+  b2fs_dentry_t *slot = &dentries->slots[hash & (B2FS_DENTRY_SLOTS - 1)];
+
+  unsigned int seq;
+  do {
+    seq = slot->seq;
+  } while (seq & 1 || !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1));
+
+  // Generations start at one, so zero never matches.
+  if (slot->hash == hash && slot->len == len && !memcmp(slot->path, path, len)) slot->generation = 0;
+  __sync_synchronize();
+  slot->seq = seq + 2;
+}
+
+void invalidate_dentries(b2fs_state_t *state) {
+  __sync_fetch_and_add(&state->dentries.generation, 1);
+}
+
+// Function is called once path has been added to the filesystem cache, and drops any misses
+// remembered for it, or for the directories above it, which may have been made along the way.
+void forget_missing(b2fs_state_t *state, const char *path) {
+  b2fs_dentry_cache_t *dentries = &state->dentries;
+  char full[B2FS_SMALL_GENERIC_BUFFER];
+
+  __sync_fetch_and_add(&dentries->created, 1);
+  if (!dentries->slots) return;
+
+  // Lookups always start with a slash, but B2 file names don't. Anything too long to fit here
+  // was too long to remember in the first place.
+  int len = snprintf(full, B2FS_SMALL_GENERIC_BUFFER, "%s%s", *path == '/' ? "" : "/", path);
+  for (int i = 1; i <= len && i < B2FS_SMALL_GENERIC_BUFFER; i++) {
+    if (i == len || full[i] == '/') forget_dentry(dentries, full, i, XXH64(full, i, 0));
+  }
+}
+
 int internal_make(const char *path, hash_t *base, b2fs_entry_type_t type) {
   // We are being asked to create a normal file. Ensure that the parent directory exists.
   char *end, *child_path;
@@ -1708,7 +7444,7 @@ int internal_make(const char *path, hash_t *base, b2fs_entry_type_t type) {
 
   if (path_len) {
     // We're creating a file somewhere other than the root.
-    char *parent_path = malloc(sizeof(char) * path_len);
+    char *parent_path = malloc(sizeof(char) * (path_len + 1));
     memcpy(parent_path, path, path_len);
     parent_path[path_len] = '\0';
 
@@ -1726,6 +7462,8 @@ int internal_make(const char *path, hash_t *base, b2fs_entry_type_t type) {
     parent = entry.dir.directory;
   } else {
     // We're inserting into the root directory.
+    b2fs_state_t *state = fuse_get_context()->private_data;
+    if (state && base == state->fs_cache) list_root(state);
     parent = base;
   }
 
@@ -1754,14 +7492,22 @@ int internal_make(const char *path, hash_t *base, b2fs_entry_type_t type) {
       assert(keytree_iterate_next(it, NULL, &version) == KEYTREE_SUCCESS);
       keytree_iterate_stop(it);
 
-      if (!*entry.dir.hidden) {
+      if (!*version.hidden) {
         destroy_file_entry(&created.file);
+        free(child_path);
         return -EEXIST;
       }
+
+      // We're recreating a hidden file. Whatever is still buffered belongs to the old file.
+      wait_for_durable(fuse_get_context()->private_data, &entry.file);
+      drop_chunks(&entry.file);
+      destroy_file_entry(&created.file);
     } else {
       if (*entry.dir.hidden) {
         // Mark directory as no longer hidden and delete .b2fs_hidefile on B2 to persist.
+        // Everything under it was a miss until now.
         *entry.dir.hidden = 0;
+        invalidate_dentries(fuse_get_context()->private_data);
 
         b2fs_hash_entry_t hide_entry;
         b2fs_file_version_t hide_version;
@@ -1771,7 +7517,7 @@ int internal_make(const char *path, hash_t *base, b2fs_entry_type_t type) {
         // FIXME: Visit this in the future when b2_sync_versions has been written.
         // Currently ignores return value of b2_sync_versions, but we need to verify
         // that this won't leave us in an unacceptable state.
-        b2_sync_versions(&hide_entry.file, path, 0);
+        b2_sync_versions(fuse_get_context()->private_data, &hide_entry.file, path, 0);
 
         // There should only be one version of this file, but just iterate over them
         // and set each deletion flag to make sure the destructor will actually delete them.
@@ -1810,13 +7556,322 @@ int internal_make(const char *path, hash_t *base, b2fs_entry_type_t type) {
     init_file_version(&version);
     hash_get(parent, child_path, &entry);
 
-    size_t timestamp = (size_t) time(NULL);
+    // Keep the placeholder ahead of any hidden versions we might be recreating over.
+    size_t timestamp, head;
+    timestamp = current_timestamp();
+    if (get_head_version(&entry.file, &head, NULL) == KEYTREE_SUCCESS) timestamp = MAX(timestamp, head + 1);
     keytree_insert(entry.file.versions, &timestamp, &version);
+
+    // The file is empty until somebody writes to it.
+    pthread_mutex_lock(&entry.file.buffer->lock);
+    entry.file.buffer->size = 0;
+    entry.file.buffer->head_limit = 0;
+    entry.file.buffer->remote_known = 0;
+    entry.file.buffer->loaded = 1;
+    pthread_mutex_unlock(&entry.file.buffer->lock);
+  }
+  free(child_path);
+
+  // Anyone who looked for it before now was told it didn't exist.
+  b2fs_state_t *state = fuse_get_context()->private_data;
+  if (state && base == state->fs_cache) forget_missing(state, path);
+
+  return B2FS_SUCCESS;
+}
+
+// Function grabs the most recent version of a file.
+int get_head_version(b2fs_file_entry_t *entry, size_t *timestamp, b2fs_file_version_t *version) {
+  keytree_iterator_t *it = keytree_iterate_start(entry->versions, NULL);
+  int retval = keytree_iterate_next(it, timestamp, version);
+  keytree_iterate_stop(it);
+  return retval;
+}
+
+// Function returns the current size of a file. Once a file has been written locally, its
+// buffered size wins over whatever B2 last told us.
+size_t file_size(b2fs_file_entry_t *entry) {
+  size_t size = 0;
+  b2fs_file_version_t version;
+
+  pthread_mutex_lock(&entry->buffer->lock);
+  if (entry->buffer->loaded) size = entry->buffer->size;
+  else if (get_head_version(entry, NULL, &version) == KEYTREE_SUCCESS && *version.live) size = version.size;
+  pthread_mutex_unlock(&entry->buffer->lock);
+
+  return size;
+}
+
+// Function makes the buffered size of a file authoritative, which it becomes as soon as the
+// file is written or truncated. Until then, sizes come from the head version.
+void load_buffer_state(b2fs_file_entry_t *entry) {
+  b2fs_file_version_t version;
+  assert(get_head_version(entry, NULL, &version) == KEYTREE_SUCCESS);
+
+  pthread_mutex_lock(&entry->buffer->lock);
+  if (!entry->buffer->loaded) {
+    entry->buffer->size = *version.live ? version.size : 0;
+    entry->buffer->head_limit = entry->buffer->size;
+    entry->buffer->loaded = 1;
+
+    // Remember what B2 has so that rewriting identical contents doesn't cost an upload.
+    if (*version.live && !*version.hidden && strlen(version.version_id)) {
+      entry->buffer->remote_size = version.size;
+      strcpy(entry->buffer->remote_sha1, version.content_sha1);
+      entry->buffer->remote_known = 1;
+    }
+  }
+  pthread_mutex_unlock(&entry->buffer->lock);
+}
+
+// Function truncates or extends a file in its buffers. Chunks past the new end are dropped,
+// and the tail of the new last chunk is zeroed so that growing the file again reads zeroes.
+void resize_file(b2fs_file_entry_t *entry, size_t size) {
+  b2fs_file_chunk_t *chunk;
+  int chunk_num, last = size / B2FS_CHUNK_SIZE;
+  stack_t *evictions = create_stack(NULL, sizeof(int));
+
+  load_buffer_state(entry);
+  pthread_mutex_lock(&entry->buffer->lock);
+  if (size == entry->buffer->size) {
+    pthread_mutex_unlock(&entry->buffer->lock);
+    destroy_stack(evictions);
+    return;
+  }
+
+  if (size < entry->buffer->size) {
+    entry->buffer->head_limit = MIN(entry->buffer->head_limit, size);
+    if (size < entry->buffer->digest.length) sha1_init(&entry->buffer->digest);
+    entry->buffer->trimmed = MIN(entry->buffer->trimmed, size);
+
+    int num_iterations = keytree_size(entry->chunks);
+    keytree_iterator_t *it = keytree_iterate_start(entry->chunks, NULL);
+    while (num_iterations-- && keytree_iterate_next(it, &chunk_num, &chunk) == KEYTREE_SUCCESS) {
+      if (chunk_num > last || (chunk_num == last && !(size % B2FS_CHUNK_SIZE))) {
+        stack_push(evictions, &chunk_num);
+      } else if (chunk_num == last) {
+        memset(chunk->data + size % B2FS_CHUNK_SIZE, 0, B2FS_CHUNK_SIZE - size % B2FS_CHUNK_SIZE);
+        chunk->size = MIN(chunk->size, (int) (size % B2FS_CHUNK_SIZE));
+      }
+    }
+    keytree_iterate_stop(it);
+
+    while (stack_pop(evictions, &chunk_num) == STACK_SUCCESS) {
+      keytree_remove(entry->chunks, &chunk_num, NULL);
+      clear_bit(entry->chunkmap, chunk_num);
+    }
+  }
+  entry->buffer->size = size;
+  entry->buffer->dirty = 1;
+  pthread_mutex_unlock(&entry->buffer->lock);
+  destroy_stack(evictions);
+}
+
+// Function returns the requested chunk of a file, creating it if it isn't resident.
+// If fetch is set, and the head version in B2 covers the chunk, its contents are downloaded.
+// Otherwise the blocks the head version covers are left to be filled in by fill_chunk, and
+// the rest of the chunk reads as zeroes.
+b2fs_file_chunk_t *load_chunk(b2fs_state_t *state, b2fs_file_entry_t *entry, int chunk_num, int fetch) {
+  b2fs_file_chunk_t *chunk;
+  if (keytree_find(entry->chunks, &chunk_num, &chunk) == KEYTREE_SUCCESS) {
+    if (fetch && fill_chunk(state, entry, chunk, 0, B2FS_CHUNK_BLOCKS) != B2FS_SUCCESS) return NULL;
+    return chunk;
+  }
+
+  chunk = calloc(1, sizeof(b2fs_file_chunk_t));
+  if (!chunk) return NULL;
+  chunk->chunk_num = chunk_num;
+
+  // Download without holding any locks. Concurrent loads of the same chunk are resolved below.
+  // Anything past head_limit was truncated away locally, and reads back as zeroes.
+  b2fs_file_version_t version;
+  size_t start = (size_t) chunk_num * B2FS_CHUNK_SIZE, limit = 0;
+  int found = get_head_version(entry, NULL, &version) == KEYTREE_SUCCESS;
+  if (found && *version.live && !*version.hidden && strlen(version.version_id)) {
+    pthread_mutex_lock(&entry->buffer->lock);
+    limit = entry->buffer->loaded ? MIN(version.size, entry->buffer->head_limit) : version.size;
+    pthread_mutex_unlock(&entry->buffer->lock);
+  }
+  if (fetch && start < limit) {
+    size_t len = MIN((size_t) B2FS_CHUNK_SIZE, limit - start);
+    if (download_version_range(state, &version, start, len, chunk->data) != B2FS_SUCCESS) {
+      free(chunk);
+      return NULL;
+    }
+    chunk->size = len;
+    chunk->fingerprint = XXH64(chunk->data, B2FS_CHUNK_SIZE, 0);
+    chunk->fingerprinted = 1;
+  } else if (start < limit) {
+    chunk->missing = (MIN((size_t) B2FS_CHUNK_SIZE, limit - start) + B2FS_BLOCK_SIZE - 1) / B2FS_BLOCK_SIZE;
+    chunk->resident = create_bitmap();
+    for (int i = chunk->missing; i < B2FS_CHUNK_BLOCKS; i++) set_bit(chunk->resident, i);
+  }
+
+  // If somebody else beat us to it, the keytree destructor frees our copy and we use theirs.
+  if (keytree_insert(entry->chunks, &chunk_num, &chunk) == KEYTREE_DUPLICATE) {
+    keytree_find(entry->chunks, &chunk_num, &chunk);
+    if (fetch && fill_chunk(state, entry, chunk, 0, B2FS_CHUNK_BLOCKS) != B2FS_SUCCESS) return NULL;
+  } else {
+    set_bit(entry->chunkmap, chunk_num);
+  }
+
+  return chunk;
+}
+
+// Function downloads whichever blocks in [first, last) of a chunk were never fetched. Each
+// contiguous run of missing blocks is a single ranged download, and blocks that were written
+// while it was in flight keep their new contents.
+int fill_chunk(b2fs_state_t *state, b2fs_file_entry_t *entry, b2fs_file_chunk_t *chunk, int first, int last) {
+  b2fs_file_version_t version;
+  size_t base = (size_t) chunk->chunk_num * B2FS_CHUNK_SIZE, limit = 0;
+
+  pthread_mutex_lock(&entry->buffer->lock);
+  int missing = chunk->missing;
+  pthread_mutex_unlock(&entry->buffer->lock);
+  if (!missing) return B2FS_SUCCESS;
+
+  // Anything the head version doesn't cover anymore was truncated away, and stays zeroed.
+  int found = get_head_version(entry, NULL, &version) == KEYTREE_SUCCESS;
+  if (found && *version.live && !*version.hidden && strlen(version.version_id)) {
+    pthread_mutex_lock(&entry->buffer->lock);
+    limit = MIN(version.size, entry->buffer->head_limit);
+    pthread_mutex_unlock(&entry->buffer->lock);
+  }
+
+  char *data = NULL;
+  for (int block = first; block < last;) {
+    if (check_bit(chunk->resident, block)) {
+      block++;
+      continue;
+    }
+    int end = block + 1;
+    while (end < last && !check_bit(chunk->resident, end)) end++;
+
+    size_t start = base + (size_t) block * B2FS_BLOCK_SIZE;
+    size_t len = start < limit ? MIN((size_t) (end - block) * B2FS_BLOCK_SIZE, limit - start) : 0;
+    if (len) {
+      if (!data) data = malloc(B2FS_CHUNK_SIZE);
+      if (!data || download_version_range(state, &version, start, len, data) != B2FS_SUCCESS) {
+        free(data);
+        return B2FS_NETWORK_ERROR;
+      }
+    }
+
+    pthread_mutex_lock(&entry->buffer->lock);
+    for (int i = block; i < end; i++) {
+      size_t copied = (size_t) (i - block) * B2FS_BLOCK_SIZE;
+      if (check_bit(chunk->resident, i)) continue;
+      else if (copied < len) memcpy(chunk->data + (size_t) i * B2FS_BLOCK_SIZE, data + copied, MIN((size_t) B2FS_BLOCK_SIZE, len - copied));
+      mark_blocks_resident(chunk, i, i + 1);
+    }
+    chunk->size = MAX(chunk->size, (int) MIN(start - base + len, (size_t) B2FS_CHUNK_SIZE));
+    pthread_mutex_unlock(&entry->buffer->lock);
+    block = end;
   }
+  free(data);
 
   return B2FS_SUCCESS;
 }
 
+// Function records that blocks [first, last) of a chunk hold their current contents.
+// Expects to be called with the buffer lock held.
+void mark_blocks_resident(b2fs_file_chunk_t *chunk, int first, int last) {
+  if (!chunk->resident) return;
+  for (int i = first; i < last; i++) {
+    if (set_bit(chunk->resident, i) == BITMAP_SUCCESS) chunk->missing--;
+  }
+}
+
+// Function evicts every buffered chunk of a file.
+void drop_chunks(b2fs_file_entry_t *entry) {
+  int chunk_num;
+  stack_t *evictions = create_stack(NULL, sizeof(int));
+
+  int num_iterations = keytree_size(entry->chunks);
+  keytree_iterator_t *it = keytree_iterate_start(entry->chunks, NULL);
+  while (num_iterations-- && keytree_iterate_next(it, &chunk_num, NULL) == KEYTREE_SUCCESS) {
+    stack_push(evictions, &chunk_num);
+  }
+  keytree_iterate_stop(it);
+
+  while (stack_pop(evictions, &chunk_num) == STACK_SUCCESS) {
+    keytree_remove(entry->chunks, &chunk_num, NULL);
+    clear_bit(entry->chunkmap, chunk_num);
+  }
+  destroy_stack(evictions);
+  sha1_init(&entry->buffer->digest);
+}
+
+// Function is the keytree destructor for buffered chunks.
+void destroy_chunk(void *destroyed) {
+  b2fs_file_chunk_t *chunk = *(b2fs_file_chunk_t **) destroyed;
+  if (chunk->resident) destroy_bitmap(chunk->resident);
+  free(chunk);
+}
+
+// Function renders the contents of the stats file into buf. Returns the rendered length.
+int render_stats(b2fs_state_t *state, char *buf, int len) {
+  b2fs_upload_queue_t *uploads = &state->uploads;
+  b2fs_mutation_queue_t *mutations = &state->mutations;
+  int queued = 0, in_flight = 0, mutations_queued = 0, mutations_in_flight = 0;
+
+  if (uploads->workers) {
+    pthread_mutex_lock(&uploads->lock);
+    queued = uploads->queued;
+    in_flight = uploads->in_flight;
+    pthread_mutex_unlock(&uploads->lock);
+  }
+  if (mutations->workers) {
+    pthread_mutex_lock(&mutations->lock);
+    mutations_queued = mutations->queued;
+    mutations_in_flight = mutations->in_flight;
+    pthread_mutex_unlock(&mutations->lock);
+  }
+
+  int written = snprintf(buf, len,
+      "uploads_queued: %d\n"
+      "uploads_in_flight: %d\n"
+      "uploads_completed: %lu\n"
+      "uploads_failed: %lu\n"
+      "uploads_skipped: %lu\n"
+      "bytes_uploaded: %lu\n"
+      "bytes_copied: %lu\n"
+      "packs_uploaded: %lu\n"
+      "files_packed: %lu\n"
+      "journal_bytes: %zu\n"
+      "journal_checkpoints: %lu\n"
+      "dedup_chunks_uploaded: %lu\n"
+      "dedup_chunks_reused: %lu\n"
+      "bytes_deduped: %lu\n"
+      "files_renamed: %lu\n"
+      "mutations_queued: %d\n"
+      "mutations_in_flight: %d\n"
+      "mutations_retried: %lu\n"
+      "hides_completed: %lu\n"
+      "hides_failed: %lu\n"
+      "deletes_completed: %lu\n"
+      "deletes_failed: %lu\n"
+      "snapshots_written: %lu\n"
+      "versions_reconciled: %lu\n"
+      "versions_pruned: %lu\n"
+      "dirs_listed: %lu\n"
+      "dentry_hits: %lu\n"
+      "dentry_misses: %lu\n"
+      "negative_hits: %lu\n"
+      "sha1_implementation: %s\n",
+      queued, in_flight,
+      state->stats.uploads_completed, state->stats.uploads_failed, state->stats.uploads_skipped,
+      state->stats.bytes_uploaded, state->stats.bytes_copied, state->stats.packs_uploaded, state->stats.files_packed,
+      state->journal.length, state->stats.journal_checkpoints,
+      state->stats.dedup_chunks_uploaded, state->stats.dedup_chunks_reused, state->stats.bytes_deduped,
+      state->stats.files_renamed, mutations_queued, mutations_in_flight, state->stats.mutations_retried,
+      state->stats.hides_completed, state->stats.hides_failed, state->stats.deletes_completed, state->stats.deletes_failed,
+      state->stats.snapshots_written, state->stats.versions_reconciled, state->stats.versions_pruned, state->stats.dirs_listed,
+      state->stats.dentry_hits, state->stats.dentry_misses, state->stats.negative_hits,
+      sha1_impl_name(sha1_selected()));
+
+  return MIN(written, len - 1);
+}
+
 int jsmn_iskey(const char *json, jsmntok_t *tok, const char *s) {
   if (tok->type != JSMN_STRING) return 0;
   if (((int) strlen(s)) != (tok->end - tok->start)) return 0;
@@ -1824,6 +7879,26 @@ int jsmn_iskey(const char *json, jsmntok_t *tok, const char *s) {
   return 1;
 }
 
+// Function copies the string value of a top level key out of a JSON object.
+int jsmn_find_string(const char *json, const char *key, char *out, int len) {
+  jsmn_parser parser;
+  jsmntok_t tokens[B2FS_SMALL_GENERIC_BUFFER];
+  if (!json) return B2FS_NETWORK_API_ERROR;
+
+  jsmn_init(&parser);
+  int token_count = jsmn_parse(&parser, json, strlen(json), tokens, B2FS_SMALL_GENERIC_BUFFER);
+  for (int i = 1; i < token_count - 1; i++) {
+    int value_len = tokens[i + 1].end - tokens[i + 1].start;
+    if (tokens[i].parent || !jsmn_iskey(json, &tokens[i], key) || value_len >= len) continue;
+
+    memcpy(out, json + tokens[i + 1].start, value_len);
+    out[value_len] = '\0';
+    return B2FS_SUCCESS;
+  }
+
+  return B2FS_NETWORK_API_ERROR;
+}
+
 void cache_auth(b2fs_state_t *b2_info) {
   char *tmpdir, path[B2FS_SMALL_GENERIC_BUFFER];
 
@@ -1870,7 +7945,7 @@ int parse_config(b2fs_config_t *config, char *config_filename) {
   char keybuf[B2FS_SMALL_GENERIC_BUFFER], valbuf[B2FS_SMALL_GENERIC_BUFFER];
 
   if (config_file) {
-    for (int i = 0; i < 5; i++) {
+    while (1) {
       int retval = fscanf(config_file, "%s %s\n", keybuf, valbuf);
       if (retval != 2) break;
 
@@ -1887,6 +7962,37 @@ int parse_config(b2fs_config_t *config, char *config_filename) {
         else if (!strcmp(valbuf, "delete")) config->policy = POLICY_DELETE_ONE;
         else if (!strcmp(valbuf, "delete_all")) config->policy = POLICY_DELETE_ALL;
         else return B2FS_ERROR;
+      } else if (!strcmp(keybuf, "upload_threads:")) {
+        // Command line takes precedence.
+        int threads = atoi(valbuf);
+        if (threads < 1 || threads > B2FS_MAX_UPLOAD_THREADS) return B2FS_ERROR;
+        if (!config->upload_threads) config->upload_threads = threads;
+      } else if (!strcmp(keybuf, "pack_threshold:")) {
+        size_t threshold = strtoul(valbuf, NULL, 10);
+        if (!threshold || threshold > B2FS_CHUNK_SIZE) return B2FS_ERROR;
+        if (!config->pack_threshold) config->pack_threshold = threshold;
+      } else if (!strcmp(keybuf, "pack_window:")) {
+        int window = atoi(valbuf);
+        if (window < 1) return B2FS_ERROR;
+        if (!config->pack_window) config->pack_window = window;
+      } else if (!strcmp(keybuf, "journal:")) {
+        if (!strlen(config->journal_path)) strcpy(config->journal_path, valbuf);
+      } else if (!strcmp(keybuf, "snapshot:")) {
+        if (!strlen(config->snapshot_path)) strcpy(config->snapshot_path, valbuf);
+      } else if (!strcmp(keybuf, "durability:") && config->durability == DURABILITY_INVAL) {
+        if (!strcmp(valbuf, "remote")) config->durability = DURABILITY_REMOTE;
+        else if (!strcmp(valbuf, "local")) config->durability = DURABILITY_LOCAL;
+        else return B2FS_ERROR;
+      } else if (!strcmp(keybuf, "dedup:")) {
+        if (!strcmp(valbuf, "true")) config->dedup = 1;
+        else if (strcmp(valbuf, "false")) return B2FS_ERROR;
+      } else if (!strcmp(keybuf, "lazy:")) {
+        if (!strcmp(valbuf, "true")) config->lazy = 1;
+        else if (strcmp(valbuf, "false")) return B2FS_ERROR;
+      } else if (!strcmp(keybuf, "negative_timeout:")) {
+        int timeout = atoi(valbuf);
+        if (timeout < 0) return B2FS_ERROR;
+        if (config->negative_timeout < 0) config->negative_timeout = timeout;
       } else {
         return B2FS_ERROR;
       }
@@ -1922,11 +8028,49 @@ int rev_intcmp(void *int_one, void *int_two) {
   return *((int *) int_two) - *((int *) int_one);
 }
 
+// Version keys are B2 upload timestamps, which don't fit in an int.
+int rev_timecmp(void *time_one, void *time_two) {
+  size_t one = *((size_t *) time_one), two = *((size_t *) time_two);
+  return one < two ? 1 : one > two ? -1 : 0;
+}
+
+// qsort comparator for arrays of strings.
+int strcmp_indirect(const void *str_one, const void *str_two) {
+  return strcmp(*(char * const *) str_one, *(char * const *) str_two);
+}
+
+// Function makes the directory entry for path durable by syncing the directory it's in. A file
+// renamed into place can come back as whatever it replaced after a crash until this is done.
+int sync_parent(const char *path) {
+  char dir[B2FS_LARGE_GENERIC_BUFFER];
+  const char *slash = strrchr(path, '/');
+
+  if (!slash) strcpy(dir, ".");
+  else if (slash == path) strcpy(dir, "/");
+  else snprintf(dir, MIN((size_t) (slash - path) + 1, sizeof(dir)), "%s", path);
+
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) return B2FS_ERROR;
+  int retval = fsync(fd) ? B2FS_ERROR : B2FS_SUCCESS;
+  close(fd);
+
+  return retval;
+}
+
+// Function returns the current time in milliseconds, matching B2's uploadTimestamp.
+size_t current_timestamp() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (size_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 void dereference_and_free(void *destroyed) {
   free(*(char **) destroyed);
 }
 
 void print_usage(int intentional) {
   puts("./b2fs <--config | YAML file to read config from> <--mount | Mount point>");
+  puts("./b2fs <--config | YAML file to read config from> <--ingest | Local directory> <Bucket prefix>");
+  puts("./b2fs <--config | YAML file to read config from> <--export | Bucket prefix> <Local directory>");
   exit(intentional ? EXIT_SUCCESS : EXIT_FAILURE);
 }
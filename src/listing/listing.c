@@ -0,0 +1,192 @@
+/*----- Includes -----*/
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "listing.h"
+
+/*----- Local Function Definitions -----*/
+
+const char *find_quote(const char *p, const char *end);
+const char *find_structural(const char *p, const char *end);
+const char *skip_space(const char *p, const char *end);
+const char *skip_string(const char *p, const char *end);
+const char *skip_nested(const char *p, const char *end);
+size_t parse_digits(const char *p, const char *end);
+void store_field(listing_record_t *record, const char *key, size_t key_len, const char *value, size_t value_len, int quoted);
+
+/*----- Function Implementations -----*/
+
+// Function pulls the fields in listing_record_t out of a single object from the files array of
+// a b2_list_file_versions response, without tokenizing the rest of it. Only top level keys are
+// looked at. Anything nested, like fileInfo, is skipped over whole, by scanning for the
+// characters that matter sixteen bytes at a time where SSE2 is available.
+int extract_listing_record(const char *json, size_t len, listing_record_t *record) {
+  const char *p = json, *end = json + len;
+  memset(record, 0, sizeof(listing_record_t));
+
+  p = skip_space(p, end);
+  if (p >= end || *p != '{') return LISTING_INVALID_ERROR;
+  p = skip_space(p + 1, end);
+  if (p < end && *p == '}') return LISTING_SUCCESS;
+
+  while (p < end) {
+    // Grab the key.
+    if (*p != '"') return LISTING_INVALID_ERROR;
+    const char *key = p + 1, *key_end = skip_string(key, end);
+    if (!key_end) return LISTING_INVALID_ERROR;
+    p = skip_space(key_end + 1, end);
+    if (p >= end || *p != ':') return LISTING_INVALID_ERROR;
+    p = skip_space(p + 1, end);
+    if (p >= end) return LISTING_INVALID_ERROR;
+
+    // Find the end of the value, whatever it is.
+    const char *value = p, *value_end;
+    int quoted = *p == '"';
+    if (quoted) {
+      value = p + 1;
+      value_end = skip_string(value, end);
+      if (!value_end) return LISTING_INVALID_ERROR;
+      p = value_end + 1;
+    } else if (*p == '{' || *p == '[') {
+      p = value_end = skip_nested(p, end);
+      if (!p) return LISTING_INVALID_ERROR;
+    } else {
+      while (p < end && *p != ',' && *p != '}' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+      value_end = p;
+    }
+    store_field(record, key, key_end - key, value, value_end - value, quoted);
+
+    // Move on to the next pair, or finish.
+    p = skip_space(p, end);
+    if (p >= end) return LISTING_INVALID_ERROR;
+    else if (*p == '}') return LISTING_SUCCESS;
+    else if (*p != ',') return LISTING_INVALID_ERROR;
+    p = skip_space(p + 1, end);
+  }
+
+  return LISTING_INVALID_ERROR;
+}
+
+// Function returns the first quote or backslash at or after p, or end if there isn't one.
+const char *find_quote(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+  while (end - p >= 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) p);
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, backslash)));
+    if (mask) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  while (p < end && *p != '"' && *p != '\\') p++;
+  return p;
+}
+
+// Function returns the first quote, brace, or bracket at or after p, or end if there isn't one.
+// Setting the 0x20 bit folds '[' into '{' and ']' into '}', and nothing else lands on either.
+const char *find_structural(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"'), open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}');
+  const __m128i fold = _mm_set1_epi8(0x20);
+  while (end - p >= 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) p), folded = _mm_or_si128(block, fold);
+    __m128i braces = _mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close));
+    int mask = _mm_movemask_epi8(_mm_or_si128(braces, _mm_cmpeq_epi8(block, quote)));
+    if (mask) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  while (p < end && *p != '"' && (*p | 0x20) != '{' && (*p | 0x20) != '}') p++;
+  return p;
+}
+
+const char *skip_space(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+  return p;
+}
+
+// Function takes the first character inside of a string, and returns its closing quote, or
+// NULL if the string never ends.
+const char *skip_string(const char *p, const char *end) {
+  while (1) {
+    p = find_quote(p, end);
+    if (p >= end) return NULL;
+    else if (*p == '"') return p;
+
+    // Backslash, so whatever comes next is escaped.
+    p += 2;
+  }
+}
+
+// Function takes an opening brace or bracket, and returns whatever follows its match, or NULL
+// if it's never closed.
+const char *skip_nested(const char *p, const char *end) {
+  int depth = 0;
+  while (1) {
+    p = find_structural(p, end);
+    if (p >= end) return NULL;
+
+    if (*p == '"') {
+      p = skip_string(p + 1, end);
+      if (!p) return NULL;
+    } else if ((*p | 0x20) == '{') {
+      depth++;
+    } else if (--depth == 0) {
+      return p + 1;
+    }
+    p++;
+  }
+}
+
+size_t parse_digits(const char *p, const char *end) {
+  size_t value = 0;
+  while (p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+  return value;
+}
+
+// Function fills in the record if key is one we want. Keys are told apart by length first, so
+// most of them are ruled out without looking at a single character.
+void store_field(listing_record_t *record, const char *key, size_t key_len, const char *value, size_t value_len, int quoted) {
+  const char **field = NULL;
+  size_t *field_len = NULL;
+
+  switch (key_len) {
+    case 4:
+      if (!quoted && !memcmp(key, "size", 4)) record->size = parse_digits(value, value + value_len);
+      return;
+    case 6:
+      if (!memcmp(key, "action", 6)) {
+        field = &record->action;
+        field_len = &record->action_len;
+      } else if (!memcmp(key, "fileId", 6)) {
+        field = &record->file_id;
+        field_len = &record->file_id_len;
+      }
+      break;
+    case 8:
+      if (!memcmp(key, "fileName", 8)) {
+        field = &record->file_name;
+        field_len = &record->file_name_len;
+      }
+      break;
+    case 11:
+      if (!memcmp(key, "contentSha1", 11)) {
+        field = &record->content_sha1;
+        field_len = &record->content_sha1_len;
+      }
+      break;
+    case 15:
+      if (!quoted && !memcmp(key, "uploadTimestamp", 15)) {
+        record->upload_timestamp = parse_digits(value, value + value_len);
+      }
+      return;
+  }
+
+  // Only strings are kept, so a null ends up looking the same as a missing key.
+  if (field && quoted) {
+    *field = value;
+    *field_len = value_len;
+  }
+}
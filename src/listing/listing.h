@@ -0,0 +1,30 @@
+#ifndef B2FS_LISTING_H
+#define B2FS_LISTING_H
+
+/*----- System Includes -----*/
+
+#include <stddef.h>
+
+/*----- Numerical Constants -----*/
+
+#define LISTING_SUCCESS 0x00
+#define LISTING_INVALID_ERROR -0x01
+
+/*----- Type Declarations -----*/
+
+// The fields b2fs cares about from one entry in the files array of a b2_list_file_versions
+// response. Strings point into the record they were extracted from, and aren't terminated.
+// They're left exactly as they appear on the wire, escapes and all. Fields missing from the
+// record have a NULL pointer and a length of zero.
+typedef struct listing_record {
+  const char *file_name, *file_id, *action, *content_sha1;
+  size_t file_name_len, file_id_len, action_len, content_sha1_len;
+  long size;
+  size_t upload_timestamp;
+} listing_record_t;
+
+/*----- Function Declaractions -----*/
+
+int extract_listing_record(const char *json, size_t len, listing_record_t *record);
+
+#endif
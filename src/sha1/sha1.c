@@ -0,0 +1,251 @@
+/*----- Includes -----*/
+
+#include <string.h>
+#include "sha1.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA1_HAVE_SHANI
+#endif
+
+/*----- Macro Definitions -----*/
+
+#define ROTL(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+/*----- Type Declarations -----*/
+
+typedef void (*sha1_compress_t)(uint32_t *h, const unsigned char *blocks, size_t count);
+
+/*----- Local Function Declarations -----*/
+
+void sha1_compress(uint32_t *h, const unsigned char *blocks, size_t count);
+#ifdef SHA1_HAVE_SHANI
+void sha1_compress_shani(uint32_t *h, const unsigned char *blocks, size_t count);
+#endif
+void sha1_pick_impl();
+
+/*----- Globals -----*/
+
+sha1_impl_t sha1_impl = SHA1_IMPL_SCALAR;
+sha1_compress_t sha1_compressors[SHA1_IMPL_COUNT] = {
+  sha1_compress,
+#ifdef SHA1_HAVE_SHANI
+  sha1_compress_shani
+#else
+  NULL
+#endif
+};
+
+/*----- Function Implementations -----*/
+
+void sha1_init(sha1_state_t *state) {
+  state->h[0] = 0x67452301;
+  state->h[1] = 0xEFCDAB89;
+  state->h[2] = 0x98BADCFE;
+  state->h[3] = 0x10325476;
+  state->h[4] = 0xC3D2E1F0;
+  state->length = 0;
+  state->used = 0;
+}
+
+// Function feeds more data into a running digest. Full blocks are compressed straight
+// out of the caller's buffer, and only the leftovers are copied.
+void sha1_update(sha1_state_t *state, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  state->length += len;
+
+  // Top off a partially filled block first.
+  if (state->used) {
+    size_t needed = SHA1_BLOCK_LEN - state->used;
+    if (len < needed) {
+      memcpy(state->block + state->used, bytes, len);
+      state->used += len;
+      return;
+    }
+    memcpy(state->block + state->used, bytes, needed);
+    sha1_compressors[sha1_impl](state->h, state->block, 1);
+    bytes += needed;
+    len -= needed;
+    state->used = 0;
+  }
+
+  size_t count = len / SHA1_BLOCK_LEN;
+  if (count) sha1_compressors[sha1_impl](state->h, bytes, count);
+  bytes += count * SHA1_BLOCK_LEN;
+  len -= count * SHA1_BLOCK_LEN;
+
+  memcpy(state->block, bytes, len);
+  state->used = len;
+}
+
+// Function pads the message and writes out the 20 byte digest.
+void sha1_final(sha1_state_t *state, unsigned char *digest) {
+  uint64_t bits = state->length * 8;
+
+  state->block[state->used++] = 0x80;
+  if (state->used > SHA1_BLOCK_LEN - 8) {
+    memset(state->block + state->used, 0, SHA1_BLOCK_LEN - state->used);
+    sha1_compressors[sha1_impl](state->h, state->block, 1);
+    state->used = 0;
+  }
+  memset(state->block + state->used, 0, SHA1_BLOCK_LEN - 8 - state->used);
+  for (int i = 0; i < 8; i++) state->block[SHA1_BLOCK_LEN - 1 - i] = bits >> (i * 8);
+  sha1_compressors[sha1_impl](state->h, state->block, 1);
+
+  for (int i = 0; i < 5; i++) {
+    digest[i * 4] = state->h[i] >> 24;
+    digest[i * 4 + 1] = state->h[i] >> 16;
+    digest[i * 4 + 2] = state->h[i] >> 8;
+    digest[i * 4 + 3] = state->h[i];
+  }
+}
+
+// Function converts a digest into the lowercase hex form B2 uses. hex must hold SHA1_HEX_LEN bytes.
+void sha1_hex(const unsigned char *digest, char *hex) {
+  static const char alpha[] = "0123456789abcdef";
+
+  for (int i = 0; i < SHA1_DIGEST_LEN; i++) {
+    hex[i * 2] = alpha[digest[i] >> 4];
+    hex[i * 2 + 1] = alpha[digest[i] & 0x0F];
+  }
+  hex[SHA1_HEX_LEN - 1] = '\0';
+}
+
+// Function reports whether the CPU we're running on can use an implementation.
+int sha1_supported(sha1_impl_t impl) {
+  if (impl == SHA1_IMPL_SCALAR) return 1;
+#ifdef SHA1_HAVE_SHANI
+  unsigned int eax, ebx, ecx, edx;
+  if (impl == SHA1_IMPL_SHANI) {
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) return 0;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+  }
+#endif
+  return 0;
+}
+
+// Function switches every digest over to an implementation. Returns -1 if the CPU can't run
+// it. Meant for startup and benchmarks, not for switching underneath running digests.
+int sha1_select(sha1_impl_t impl) {
+  if (impl >= SHA1_IMPL_COUNT || !sha1_supported(impl)) return -1;
+  sha1_impl = impl;
+  return 0;
+}
+
+sha1_impl_t sha1_selected() {
+  return sha1_impl;
+}
+
+const char *sha1_impl_name(sha1_impl_t impl) {
+  static const char *names[SHA1_IMPL_COUNT] = {"scalar", "shani"};
+  return impl < SHA1_IMPL_COUNT ? names[impl] : "unknown";
+}
+
+// Function picks the fastest implementation the CPU supports before anybody hashes anything.
+__attribute__((constructor)) void sha1_pick_impl() {
+  for (int impl = SHA1_IMPL_COUNT - 1; impl > SHA1_IMPL_SCALAR; impl--) {
+    if (!sha1_select(impl)) return;
+  }
+}
+
+void sha1_compress(uint32_t *h, const unsigned char *blocks, size_t count) {
+  for (; count; count--, blocks += SHA1_BLOCK_LEN) {
+    const unsigned char *block = blocks;
+    uint32_t w[80], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+    // Expand the message schedule.
+    for (int i = 0; i < 16; i++) {
+      w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 | (uint32_t) block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++) w[i] = ROTL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+
+      uint32_t tmp = ROTL(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = ROTL(b, 30);
+      b = a;
+      a = tmp;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+}
+
+#ifdef SHA1_HAVE_SHANI
+
+// Four rounds of SHA-1 on the SHA extensions. Each step finishes the schedule word the next
+// step needs, and starts on the ones after that, so w only ever holds four words. i is always
+// a constant, so the conditions fold away.
+#define SHANI_STEP(i, cur, next) \
+  do { \
+    if ((i) < 4) w[(i) % 4] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (blocks + (i) * 16)), swap); \
+    if ((i) == 0) cur = _mm_add_epi32(cur, w[0]); \
+    else cur = _mm_sha1nexte_epu32(cur, w[(i) % 4]); \
+    next = abcd; \
+    if ((i) >= 3 && (i) <= 18) w[((i) + 1) % 4] = _mm_sha1msg2_epu32(w[((i) + 1) % 4], w[(i) % 4]); \
+    abcd = _mm_sha1rnds4_epu32(abcd, cur, (i) / 5); \
+    if ((i) >= 1 && (i) <= 16) w[((i) + 3) % 4] = _mm_sha1msg1_epu32(w[((i) + 3) % 4], w[(i) % 4]); \
+    if ((i) >= 2 && (i) <= 17) w[((i) + 2) % 4] = _mm_xor_si128(w[((i) + 2) % 4], w[(i) % 4]); \
+  } while (0)
+
+__attribute__((target("sha,ssse3,sse4.1")))
+void sha1_compress_shani(uint32_t *h, const unsigned char *blocks, size_t count) {
+  const __m128i swap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) h), 0x1B);
+  __m128i e0 = _mm_set_epi32(h[4], 0, 0, 0), e1, w[4];
+
+  // The state stays in registers across the whole run of blocks.
+  for (; count; count--, blocks += SHA1_BLOCK_LEN) {
+    __m128i abcd_save = abcd, e0_save = e0;
+
+    SHANI_STEP(0, e0, e1);
+    SHANI_STEP(1, e1, e0);
+    SHANI_STEP(2, e0, e1);
+    SHANI_STEP(3, e1, e0);
+    SHANI_STEP(4, e0, e1);
+    SHANI_STEP(5, e1, e0);
+    SHANI_STEP(6, e0, e1);
+    SHANI_STEP(7, e1, e0);
+    SHANI_STEP(8, e0, e1);
+    SHANI_STEP(9, e1, e0);
+    SHANI_STEP(10, e0, e1);
+    SHANI_STEP(11, e1, e0);
+    SHANI_STEP(12, e0, e1);
+    SHANI_STEP(13, e1, e0);
+    SHANI_STEP(14, e0, e1);
+    SHANI_STEP(15, e1, e0);
+    SHANI_STEP(16, e0, e1);
+    SHANI_STEP(17, e1, e0);
+    SHANI_STEP(18, e0, e1);
+    SHANI_STEP(19, e1, e0);
+
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *) h, _mm_shuffle_epi32(abcd, 0x1B));
+  h[4] = _mm_extract_epi32(e0, 3);
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef B2FS_SHA1_H
+#define B2FS_SHA1_H
+
+/*----- Includes -----*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*----- Numerical Constants -----*/
+
+#define SHA1_BLOCK_LEN 64
+#define SHA1_DIGEST_LEN 20
+#define SHA1_HEX_LEN 41
+
+/*----- Type Declarations -----*/
+
+typedef struct sha1_state {
+  uint32_t h[5];
+  uint64_t length;
+  unsigned char block[SHA1_BLOCK_LEN];
+  int used;
+} sha1_state_t;
+
+// Compression functions the digest can run on. The fastest one the CPU supports is picked
+// at startup.
+typedef enum sha1_impl {
+  SHA1_IMPL_SCALAR,
+  SHA1_IMPL_SHANI,
+  SHA1_IMPL_COUNT
+} sha1_impl_t;
+
+/*----- Function Declarations -----*/
+
+void sha1_init(sha1_state_t *state);
+void sha1_update(sha1_state_t *state, const void *data, size_t len);
+void sha1_final(sha1_state_t *state, unsigned char *digest);
+void sha1_hex(const unsigned char *digest, char *hex);
+int sha1_supported(sha1_impl_t impl);
+int sha1_select(sha1_impl_t impl);
+sha1_impl_t sha1_selected();
+const char *sha1_impl_name(sha1_impl_t impl);
+
+#endif
@@ -61,7 +61,7 @@ int array_insert(array_t *arr, int index, void *data) {
       while (newsize <= index) newsize <<= 1;
 
       // Reallocate.
-      void *tmp = realloc(arr->storage, sizeof(arr->elem_size) * newsize);
+      void *tmp = realloc(arr->storage, arr->elem_size * newsize);
       if (tmp) {
         // Memory allocation succeeded.
         arr->storage = tmp;
@@ -3,57 +3,131 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "hash.h"
 #include "../xxhash/xxhash.h"
 
 /*----- Numerical Constants -----*/
 
-#define HASH_START_SIZE 10
+#define HASH_START_SIZE 16
+#define HASH_GROUP_SIZE 16
+#define HASH_INLINE_KEY 24
+#define HASH_MIN_KEY_BUFFER 32
+#define HASH_FIRST_BLOCK 4
+#define HASH_MAX_BLOCKS 30
+#define HASH_READER_STRIPES 64
+#define HASH_CACHE_LINE 64
+#define HASH_CTRL_EMPTY ((unsigned char) 0x80)
+#define HASH_CTRL_DELETED ((unsigned char) 0xFE)
+#define HASH_MISSING -1
+#define HASH_RETRY -2
 
 /*----- Type Definitions -----*/
 
-// Node struct used for chaining hash collision resolution.
-typedef struct hash_node {
-  char *key;
-  void *data;
-  struct hash_node *next;
-} hash_node_t;
-
+// Header of every entry, which is followed directly by elem_size bytes of data. The full hash
+// is kept so that nothing ever has to be hashed twice, and keys that fit in HASH_INLINE_KEY
+// bytes along with their terminator, so up to 23 characters, are kept in the entry itself
+// rather than in their own allocation. Once an entry has had a
+// long key it keeps the buffer, of size capacity, for every key it holds after that, so a
+// reader can't be left comparing against a buffer that's been freed. Dropped entries are
+// chained together through hash, and reused by the next put.
+typedef struct hash_entry {
+  unsigned long long hash;
+  unsigned int len, capacity;
+  union {
+    char inline_key[HASH_INLINE_KEY];
+    char *key;
+  };
+} hash_entry_t;
+
+// Control bytes and entry indices for one size of table, in a single allocation, so that a
+// reader gets a consistent view by loading one pointer. Slots are split into groups of
+// HASH_GROUP_SIZE. Each one has a control byte, which is either empty, deleted, or the low
+// seven bits of its entry's hash, so a whole group can be checked for a key at once, and the
+// index of its entry. The first group of control bytes is repeated past the end so that a
+// group can start at any slot. Replaced slots are chained through retired until it's safe to
+// free them.
+typedef struct hash_slots {
+  struct hash_slots *retired;
+  unsigned int *index;
+  int size;
+  unsigned char ctrl[];
+} hash_slots_t;
+
+// Open addressed table. Entries live in blocks that double in size, starting from
+// HASH_FIRST_BLOCK, and never move, so growing the table only rebuilds its slots. used counts
+// deleted slots as well as live ones, since both make probes longer.
+// Writers serialize on lock, but readers never take it. They look keys up optimistically, and
+// start over if generation changed underneath them, which happens whenever a key is dropped,
+// since its entry can then be handed to another key. Anything a reader might still be looking
+// at is retired rather than freed, until wait_for_readers says nobody is.
 typedef struct hash {
-  hash_node_t **data;
+  hash_slots_t *volatile slots;
+  char *volatile blocks[HASH_MAX_BLOCKS];
+  char *retired;
   void (*destruct) (void *);
-  int count, size, frozen, elem_size;
-  pthread_rwlock_t lock;
+  volatile unsigned int generation;
+  volatile int count;
+  int used, frozen, elem_size, stride, entries, vacant;
+  pthread_mutex_t lock;
 } hash_t;
 
+// Count of readers on one stripe, padded out to its own cache line so that threads on
+// different stripes don't fight over it.
+typedef struct hash_readers {
+  volatile int count;
+  char padding[HASH_CACHE_LINE - sizeof(int)];
+} hash_readers_t;
+
+/*----- Globals -----*/
+
+// Readers are counted for every table at once, by phase, and then spread across stripes by
+// thread. Waiting for readers flips the phase and waits for the old one to empty out, so new
+// readers coming in can't hold it off forever.
+static hash_readers_t readers[2][HASH_READER_STRIPES] __attribute__((aligned(HASH_CACHE_LINE)));
+static volatile int reader_phase = 0, next_stripe = 0;
+static pthread_mutex_t phase_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*----- Internal Function Declarations -----*/
 
-hash_node_t *create_hash_node(char *key, void *data, int elem_size);
-hash_node_t *insert_hash_node(hash_node_t *head, hash_node_t *insert);
-hash_node_t *find_hash_node(hash_node_t *head, char *key);
-hash_node_t *remove_hash_node(hash_node_t *head, char *key, void (*destruct) (void *));
-void destroy_hash_chain(hash_node_t *head, void (*destruct) (void *));
-void destroy_hash_node(hash_node_t *node, void (*destruct) (void *));
+int rehash(hash_t *table);
+hash_slots_t *allocate_slots(int size);
+int find_slot(hash_t *table, hash_slots_t *slots, char *key, size_t len, unsigned long long hash, unsigned int generation);
+int find_vacancy(hash_slots_t *slots, unsigned long long hash);
+unsigned int match_group(unsigned char *group, unsigned char value);
+void set_ctrl(hash_slots_t *slots, int slot, unsigned char value);
+hash_entry_t *get_entry(hash_t *table, unsigned int index);
+int claim_entry(hash_t *table, unsigned int *index);
+void release_entry(hash_t *table, unsigned int index);
+int fill_entry(hash_t *table, hash_entry_t *entry, char *key, size_t len, unsigned long long hash, void *data);
+char *entry_key(hash_entry_t *entry);
+volatile int *begin_read();
+void end_read(volatile int *count);
+void wait_for_readers();
+void free_retired(hash_t *table);
 
 /*----- Hash Functions -----*/
 
 // Function handles creation of a hash struct.
 hash_t *create_hash(int elem_size, void (*destruct) (void *)) {
-  hash_t *table = malloc(sizeof(hash_t));
+  hash_t *table = calloc(1, sizeof(hash_t));
 
   if (table) {
-    int retval = pthread_rwlock_init(&table->lock, NULL);
-    table->data = calloc(HASH_START_SIZE, sizeof(hash_node_t *));
-    if (table->data && !retval) {
-      table->destruct = destruct;
-      table->count = 0;
-      table->size = HASH_START_SIZE;
-      table->frozen = 0;
-      table->elem_size = elem_size;
-    } else {
+    int retval = pthread_mutex_init(&table->lock, NULL);
+    table->destruct = destruct;
+    table->elem_size = elem_size;
+    table->vacant = -1;
+
+    // Entries are padded out to keep the next header aligned.
+    table->stride = sizeof(hash_entry_t) + ((elem_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1));
+    table->slots = allocate_slots(HASH_START_SIZE);
+    if (retval || !table->slots) {
       // Initialization of a member variable failed.
-      if (table->data) free(table->data);
-      if (!retval) pthread_rwlock_destroy(&table->lock);
+      if (!retval) pthread_mutex_destroy(&table->lock);
+      free(table->slots);
       free(table);
       table = NULL;
     }
@@ -62,41 +136,32 @@ hash_t *create_hash(int elem_size, void (*destruct) (void *)) {
   return table;
 }
 
-// Function handles the rehash process encountered when a hash reaches
-// 80% capacity. Hate locking the entire function, but we're rehashing, so it's
-// pretty much unavoidable.
-void rehash(hash_t *table) {
-  // Acquire write-lock for hash.
-  pthread_rwlock_wrlock(&table->lock);
-
-  // Abort rehash if we're frozen.
-  if (table->frozen) {
-    pthread_rwlock_unlock(&table->lock);
-    return;
+// Function handles the rehash process encountered when live and deleted slots reach 7/8 of
+// the table. The table only grows if live slots are at least 7/16 of it, otherwise it's
+// rebuilt at the same size to clear out deleted slots. Entries stay where they are, and their
+// stored hashes mean nothing is hashed again. Readers carry on with the old slots while the
+// new ones are built, so this only holds up other writers. Expects the lock to be held.
+int rehash(hash_t *table) {
+  hash_slots_t *old_slots = table->slots;
+  int size = table->count * 16 >= old_slots->size * 7 ? old_slots->size * 2 : old_slots->size;
+  hash_slots_t *slots = allocate_slots(size);
+  if (!slots) return HASH_NOMEM_ERROR;
+
+  for (int i = 0; i < old_slots->size; i++) {
+    if (old_slots->ctrl[i] & 0x80) continue;
+    int slot = find_vacancy(slots, get_entry(table, old_slots->index[i])->hash);
+    set_ctrl(slots, slot, old_slots->ctrl[i]);
+    slots->index[slot] = old_slots->index[i];
   }
+  table->used = table->count;
 
-  // Allocate new table with calloc to allow for NULL checks.
-  hash_node_t **new_data = calloc(table->size * 2, sizeof(hash_node_t *));
-
-  // Copy all previous data into new, larger, hash.
-  hash_node_t **old_data = table->data;
-  for(int i = 0; i < table->size; i++) {
-    hash_node_t *current = old_data[i];
-    while (current) {
-      hash_node_t *tmp = current->next;
-      current->next = NULL;
-
-      // Calculate new hash value and insert.
-      unsigned int hash = (unsigned int) XXH64(current->key, strlen(current->key), 0) % (table->size * 2);
-      new_data[hash] = insert_hash_node(new_data[hash], current);
-      current = tmp;
-    }
-  }
+  // Publish the new slots, and then get rid of everything nobody can reach anymore.
+  slots->retired = old_slots;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  table->slots = slots;
+  free_retired(table);
 
-  // Update hash struct with changes.
-  table->data = new_data;
-  table->size *= 2;
-  free(old_data);
+  return HASH_SUCCESS;
 }
 
 // Insert data into a hash for a specific key.
@@ -104,92 +169,77 @@ int hash_put(hash_t *table, char *key, void *data) {
   // Verify parameters.
   if (!table || !key || !data) return HASH_INVAL_ERROR;
 
-  // Check if table needs a rehash.
-  int rehashed = 0;
-  if (table->count / (float) table->size > 0.8) {
-    rehash(table);
-    rehashed = 1;
-  }
-
-  // Acquire read lock if we didn't rehash the table.
-  if (!rehashed) pthread_rwlock_rdlock(&table->lock);
+  // Hash outside of the lock.
+  size_t len = strlen(key);
+  unsigned long long hash = XXH64(key, len, 0);
 
-  // Cache the table size so that we can detect rehashes in the future.
-  int orig_size = table->size;
-
-  // Generate hash value and insert.
-  unsigned int hash = (unsigned int) XXH64(key, strlen(key), 0) % table->size;
-
-  // Abort if we're frozen.
+  // Acquire lock, and abort if we're frozen.
+  pthread_mutex_lock(&table->lock);
   if (table->frozen) {
-    pthread_rwlock_unlock(&table->lock);
+    pthread_mutex_unlock(&table->lock);
     return HASH_FROZEN_ERROR;
   }
 
   // Verify that table does not already contain given key.
-  // Check if we're dealing with a hash collision, or a repeat key.
-  if (!find_hash_node(table->data[hash], key)) {
-    // If we didn't need to rehash the table, grab the write-lock now.
-    // If we didn't rehash, means that we've gotten to this point with only a read-lock.
-    // Possible for two threads to attempt to insert the same key at the same time and
-    // both make it here. After acquiring the write-lock, double check that the key
-    // doesn't exist in the list.
-    if (!rehashed) {
-      pthread_rwlock_unlock(&table->lock);
-      pthread_rwlock_wrlock(&table->lock);
-
-      // It's possible, since read-locks can't be converted to write-locks atomically,
-      // that someone rehashed the table while we were unlocked. Update the hash value
-      // if this happened.
-      if (table->size != orig_size) hash = (unsigned int) XXH64(key, strlen(key), 0) % table->size;
-
-      // Recheck for the key.
-      if (find_hash_node(table->data[hash], key)) {
-        // Contention on duplicate key insert.
-        pthread_rwlock_unlock(&table->lock);
-        return HASH_EXISTS_ERROR;
-      }
-    }
-
-    // Data is new.
-    hash_node_t *node = create_hash_node(key, data, table->elem_size);
-
-    // We have exclusive write access to the hash, and are the only thread attempting to insert this
-    // key. Do the deed.
-    table->data[hash] = insert_hash_node(table->data[hash], node);
-    table->count++;
-    pthread_rwlock_unlock(&table->lock);
-    return HASH_SUCCESS;
-  } else {
-    // Key already exists in table.
-    pthread_rwlock_unlock(&table->lock);
+  if (find_slot(table, table->slots, key, len, hash, table->generation) >= 0) {
+    pthread_mutex_unlock(&table->lock);
     return HASH_EXISTS_ERROR;
   }
+
+  // Make room if we need to.
+  unsigned int index;
+  if ((table->used + 1 > table->slots->size / 8 * 7 && rehash(table) != HASH_SUCCESS) || claim_entry(table, &index)) {
+    pthread_mutex_unlock(&table->lock);
+    return HASH_NOMEM_ERROR;
+  }
+  if (fill_entry(table, get_entry(table, index), key, len, hash, data)) {
+    release_entry(table, index);
+    pthread_mutex_unlock(&table->lock);
+    return HASH_NOMEM_ERROR;
+  }
+
+  // Data is new. Readers have to be able to see all of the entry as soon as they can see its
+  // slot, so the slot goes in last.
+  hash_slots_t *slots = table->slots;
+  int slot = find_vacancy(slots, hash);
+  if (slots->ctrl[slot] == HASH_CTRL_EMPTY) table->used++;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slots->index[slot] = index;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  set_ctrl(slots, slot, hash & 0x7F);
+  table->count++;
+  pthread_mutex_unlock(&table->lock);
+
+  return HASH_SUCCESS;
 }
 
-// Function handles getting data out of a hash for a specific key.
+// Function handles getting data out of a hash for a specific key. Never takes the lock, so a
+// lookup can't be held up by writers, even ones in the middle of a rehash. If a key is dropped
+// anywhere in the table while we're looking, what we found can't be trusted, so we look again.
 int hash_get(hash_t *table, char *key, void *buf) {
   // Verify parameters.
   if (!table || !table->count || !key || !buf) return HASH_INVAL_ERROR;
 
-  // Acquire read-lock.
-  pthread_rwlock_rdlock(&table->lock);
-
-  // Generate hash value.
-  unsigned int hash = (unsigned int) XXH64(key, strlen(key), 0) % table->size;
-
-  // Find it.
-  hash_node_t *found = find_hash_node(table->data[hash], key);
-
-  // Return the data if it was found.
-  if (found) {
-    memcpy(buf, found->data, table->elem_size);
-    pthread_rwlock_unlock(&table->lock);
-    return HASH_SUCCESS;
-  } else {
-    pthread_rwlock_unlock(&table->lock);
-    return HASH_NOTFOUND_ERROR;
-  }
+  // Hash before we start reading.
+  size_t len = strlen(key);
+  unsigned long long hash = XXH64(key, len, 0);
+
+  volatile int *reading = begin_read();
+  unsigned int generation;
+  int slot;
+  do {
+    generation = table->generation;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    hash_slots_t *slots = table->slots;
+    slot = find_slot(table, slots, key, len, hash, generation);
+
+    // Copy the data out if it was found.
+    if (slot >= 0) memcpy(buf, get_entry(table, slots->index[slot]) + 1, table->elem_size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (slot == HASH_RETRY || table->generation != generation);
+  end_read(reading);
+
+  return slot >= 0 ? HASH_SUCCESS : HASH_NOTFOUND_ERROR;
 }
 
 // Handle removal of a key from hash.
@@ -197,43 +247,50 @@ int hash_drop(hash_t *table, char *key) {
   // Verify parameters.
   if (!table || table->count == 0 || !key) return HASH_INVAL_ERROR;
 
-  // Acquire read lock for searching.
-  pthread_rwlock_rdlock(&table->lock);
+  // Hash outside of the lock.
+  size_t len = strlen(key);
+  unsigned long long hash = XXH64(key, len, 0);
 
-  // Generate hash value and find data.
-  unsigned int hash = (unsigned int) XXH64(key, strlen(key), 0) % table->size;
-
-  // Abort if we're frozen.
+  // Acquire lock, and abort if we're frozen.
+  pthread_mutex_lock(&table->lock);
   if (table->frozen) {
-    pthread_rwlock_unlock(&table->lock);
+    pthread_mutex_unlock(&table->lock);
     return HASH_FROZEN_ERROR;
   }
 
-  if (find_hash_node(table->data[hash], key)) {
-    // We found it. Switch locks for writing.
-    // Since we've only used a read-lock up to this point, it's possible for
-    // multiple threads to attempt to delete the same key and all make it to this
-    // point. Ensure that we're the first one here, and the only one to do the work
-    // by checking for the key again.
-    pthread_rwlock_unlock(&table->lock);
-    pthread_rwlock_wrlock(&table->lock);
-    if (!find_hash_node(table->data[hash], key)) {
-      // Contention on key removal.
-      pthread_rwlock_unlock(&table->lock);
-      return HASH_NOTFOUND_ERROR;
-    }
-
-    // We have exclusive write access to the hash, and have verified that we're
-    // either the first, or the only, thread trying to delete this key.
-    table->data[hash] = remove_hash_node(table->data[hash], key, table->destruct);
-    table->count--;
-    pthread_rwlock_unlock(&table->lock);
-    return HASH_SUCCESS;
-  } else {
+  hash_slots_t *slots = table->slots;
+  int slot = find_slot(table, slots, key, len, hash, table->generation);
+  if (slot < 0) {
     // Key does not exist in table.
-    pthread_rwlock_unlock(&table->lock);
+    pthread_mutex_unlock(&table->lock);
     return HASH_NOTFOUND_ERROR;
   }
+
+  // If the slot doesn't sit in a run of at least a group's worth of occupied slots, every
+  // group it's part of has an empty slot, so no probe has ever gone past it and it can go
+  // straight back to empty. Otherwise it has to stay as a tombstone.
+  int mask = slots->size - 1;
+  unsigned int after = match_group(&slots->ctrl[slot], HASH_CTRL_EMPTY);
+  unsigned int before = match_group(&slots->ctrl[(slot - HASH_GROUP_SIZE) & mask], HASH_CTRL_EMPTY);
+  int run = (after ? __builtin_ctz(after) : HASH_GROUP_SIZE) + (before ? __builtin_clz(before << 16) : HASH_GROUP_SIZE);
+  if (run < HASH_GROUP_SIZE) {
+    set_ctrl(slots, slot, HASH_CTRL_EMPTY);
+    table->used--;
+  } else {
+    set_ctrl(slots, slot, HASH_CTRL_DELETED);
+  }
+  table->count--;
+
+  // Anyone who might have found the entry has to start over before it can be reused.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  table->generation++;
+
+  // Destroy the entry and put it up for reuse.
+  if (table->destruct) table->destruct(get_entry(table, slots->index[slot]) + 1);
+  release_entry(table, slots->index[slot]);
+  pthread_mutex_unlock(&table->lock);
+
+  return HASH_SUCCESS;
 }
 
 int hash_count(hash_t *table) {
@@ -244,29 +301,41 @@ int hash_count(hash_t *table) {
 // Function handles the enumeration of all keys currently stored in hash.
 // Returns said keys in any order.
 // Uses the count arg as a out-var to "atomically" return the current count of keys.
-// When retrieving values for these keys, should always check return value as another
-// thread could have removed them in the intervening time.
+// Keys are copied into the same allocation as the array, so they stay valid until it's freed,
+// even if they're dropped from the hash in the meantime. When retrieving values for these keys,
+// should always check return value as another thread could have removed them.
 char **hash_keys(hash_t *table, int *count) {
   if (!table) return NULL;
 
-  // Allocate key array if the hash contains elements. If not, we should never
-  // reference it during the loop, so it should be ok to leave it as NULL.
-  int current = 0;
-  char **keys = NULL;
-  if (table->count) keys = malloc(sizeof(char *) * table->count);
-
-  // Iterate across each array index, and each hash_node chain.
-  pthread_rwlock_rdlock(&table->lock);
+  pthread_mutex_lock(&table->lock);
   if (count) *count = table->count;
-  for (int i = 0; i < table->size; i++) {
-    if (table->data[i]) {
-      for (hash_node_t *tmp = table->data[i]; tmp; tmp = tmp->next) {
-        keys[current] = tmp->key;
-        current++;
-      }
+  if (!table->count) {
+    pthread_mutex_unlock(&table->lock);
+    return NULL;
+  }
+
+  // Work out how much room the keys need.
+  hash_slots_t *slots = table->slots;
+  size_t bytes = sizeof(char *) * table->count;
+  for (int i = 0; i < slots->size; i++) {
+    if (!(slots->ctrl[i] & 0x80)) bytes += get_entry(table, slots->index[i])->len + 1;
+  }
+
+  // Copy each one in after the array.
+  char **keys = malloc(bytes);
+  if (keys) {
+    char *current = (char *) (keys + table->count);
+    for (int i = 0, j = 0; i < slots->size; i++) {
+      if (slots->ctrl[i] & 0x80) continue;
+      hash_entry_t *entry = get_entry(table, slots->index[i]);
+      keys[j++] = current;
+      memcpy(current, entry_key(entry), entry->len + 1);
+      current += entry->len + 1;
     }
+  } else if (count) {
+    *count = 0;
   }
-  pthread_rwlock_unlock(&table->lock);
+  pthread_mutex_unlock(&table->lock);
 
   return keys;
 }
@@ -274,139 +343,236 @@ char **hash_keys(hash_t *table, int *count) {
 void hash_freeze(hash_t *table) {
   if (!table) return;
 
-  pthread_rwlock_wrlock(&table->lock);
+  pthread_mutex_lock(&table->lock);
   table->frozen = 1;
-  pthread_rwlock_unlock(&table->lock);
+  pthread_mutex_unlock(&table->lock);
 }
 
-// Function handles the destruction of hash struct.
+// Function handles the destruction of hash struct. Nobody can be reading anymore, so anything
+// retired can go straight away.
 void hash_destroy(hash_t *table) {
   // Verify parameters.
   if (!table) return;
 
-  // Get the write lock, just in case some poor soul is still trying to read data out.
-  pthread_rwlock_wrlock(&table->lock);
-  if (table->count > 0) {
-    // Destroy all necessary data.
-    for (int i = 0; i < table->size; i++) {
-      hash_node_t *node = table->data[i];
-      if (node) destroy_hash_chain(node, table->destruct);
-    }
+  // Get the lock, just in case some poor soul is still trying to write data in.
+  pthread_mutex_lock(&table->lock);
+  hash_slots_t *slots = table->slots;
+  for (int i = 0; i < slots->size && table->destruct; i++) {
+    if (!(slots->ctrl[i] & 0x80)) table->destruct(get_entry(table, slots->index[i]) + 1);
+  }
+  for (int i = 0; i < table->entries; i++) {
+    hash_entry_t *entry = get_entry(table, i);
+    if (entry->capacity) free(entry->key);
+  }
+  for (int i = 0; i < HASH_MAX_BLOCKS; i++) free(table->blocks[i]);
+  while (slots) {
+    hash_slots_t *retired = slots->retired;
+    free(slots);
+    slots = retired;
+  }
+  while (table->retired) {
+    char *retired = *(char **) table->retired;
+    free(table->retired);
+    table->retired = retired;
   }
-  free(table->data);
 
   // Finish the job.
-  pthread_rwlock_unlock(&table->lock);
-  pthread_rwlock_destroy(&table->lock);
+  pthread_mutex_unlock(&table->lock);
+  pthread_mutex_destroy(&table->lock);
   free(table);
 }
 
-/*---- Hash Node Functions ----*/
-
-// Function handles the creation of a hash_node struct.
-hash_node_t *create_hash_node(char *key, void *data, int elem_size) {
-  hash_node_t *node = malloc(sizeof(hash_node_t));
-
-  if (node) {
-    // Copy given string so it can't be freed out from under us.
-    node->key = malloc(sizeof(char) * (strlen(key) + 1));
-    node->data = malloc(elem_size);
-    if (node->key && node->data) {
-      strcpy(node->key, key);
-      memcpy(node->data, data, elem_size);
-      node->next = NULL;
-    } else {
-      // Key could not be copied. Continued initialization impossible.
-      if (node->key) free(node->key);
-      if (node->data) free(node->data);
-      free(node);
-      node = NULL;
+/*---- Slot Functions ----*/
+
+// Function allocates empty slots for a table of the given size, which has to be a power of two
+// no smaller than a group. Indices go after the control bytes, which keeps them aligned.
+hash_slots_t *allocate_slots(int size) {
+  hash_slots_t *slots = malloc(sizeof(hash_slots_t) + size + HASH_GROUP_SIZE + sizeof(unsigned int) * size);
+  if (!slots) return NULL;
+
+  memset(slots->ctrl, HASH_CTRL_EMPTY, size + HASH_GROUP_SIZE);
+  slots->retired = NULL;
+  slots->index = (unsigned int *) (slots->ctrl + size + HASH_GROUP_SIZE);
+  slots->size = size;
+  return slots;
+}
+
+// Function returns the slot for key, HASH_MISSING if it isn't there, or HASH_RETRY if a key
+// was dropped since generation, in which case the entry we were about to compare could belong
+// to another key by now. Groups are probed in triangular order, which visits every group once
+// the table size is a power of two, and the first group with an empty slot ends the search.
+int find_slot(hash_t *table, hash_slots_t *slots, char *key, size_t len, unsigned long long hash, unsigned int generation) {
+  int mask = slots->size - 1, pos = (hash >> 7) & mask;
+  for (int step = HASH_GROUP_SIZE; ; pos = (pos + step) & mask, step += HASH_GROUP_SIZE) {
+    unsigned char *group = &slots->ctrl[pos];
+    unsigned int matches = match_group(group, hash & 0x7F);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    for (; matches; matches &= matches - 1) {
+      int slot = (pos + __builtin_ctz(matches)) & mask;
+      hash_entry_t *entry = get_entry(table, slots->index[slot]);
+      if (entry->hash != hash || entry->len != len) continue;
+
+      // The key's length and where it lives have to agree before we look at it.
+      char *stored = entry_key(entry);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (table->generation != generation) return HASH_RETRY;
+      else if (!memcmp(stored, key, len)) return slot;
     }
+    if (match_group(group, HASH_CTRL_EMPTY) || step > slots->size) return HASH_MISSING;
   }
+}
 
-  return node;
+// Function returns the first empty or deleted slot along hash's probe sequence. There's
+// always one, since the table never fills.
+int find_vacancy(hash_slots_t *slots, unsigned long long hash) {
+  int mask = slots->size - 1, pos = (hash >> 7) & mask;
+  for (int step = HASH_GROUP_SIZE; ; pos = (pos + step) & mask, step += HASH_GROUP_SIZE) {
+    unsigned int matches = match_group(&slots->ctrl[pos], HASH_CTRL_EMPTY) | match_group(&slots->ctrl[pos], HASH_CTRL_DELETED);
+    if (matches) return (pos + __builtin_ctz(matches)) & mask;
+  }
 }
 
-// Function handles inserting a hash node into a linked list of hash nodes.
-hash_node_t *insert_hash_node(hash_node_t *head, hash_node_t *insert) {
-  // Validate paramaters and insert if the list doesn't already contain
-  // the given node.
-  if (head && insert) {
-    for (hash_node_t *current = head; current; current = current->next) {
-      if (!strcmp(insert->key, current->key)) {
-        return head;
-      } else if(!current->next) {
-        current->next = insert;
-        return head;
-      }
-    }
-    return 0;
-  } else if (insert) {
-    return insert;
+// Function returns a bitmask of which control bytes in the group starting at group are value.
+unsigned int match_group(unsigned char *group, unsigned char value) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value)));
+#else
+  unsigned int matches = 0;
+  for (int i = 0; i < HASH_GROUP_SIZE; i++) {
+    if (group[i] == value) matches |= 1 << i;
   }
-  return head;
+  return matches;
+#endif
 }
 
-// Function handles finding hash_node with a specific key in a linked list
-// of nodes.
-hash_node_t *find_hash_node(hash_node_t *head, char *key) {
-  // Validate parameters and search.
-  if (head && key) {
-    for (hash_node_t *current = head; current; current = current->next) {
-      if (!strcmp(current->key, key)) {
-        // Found it.
-        return current;
-      }
-    }
+// Function sets a control byte, along with its copy past the end if it has one.
+void set_ctrl(hash_slots_t *slots, int slot, unsigned char value) {
+  slots->ctrl[slot] = value;
+  if (slot < HASH_GROUP_SIZE) slots->ctrl[slots->size + slot] = value;
+}
 
-    // Didn't find it.
-    return NULL;
-  } else {
-    return NULL;
+/*---- Entry Functions ----*/
+
+// Function finds an entry by index. Block n holds HASH_FIRST_BLOCK << n entries, so offsetting
+// the index by HASH_FIRST_BLOCK puts the block number in its highest set bit.
+hash_entry_t *get_entry(hash_t *table, unsigned int index) {
+  unsigned int biased = index + HASH_FIRST_BLOCK;
+  int block = 31 - __builtin_clz(biased) - __builtin_ctz(HASH_FIRST_BLOCK);
+  size_t offset = biased - ((size_t) HASH_FIRST_BLOCK << block);
+  return (hash_entry_t *) (table->blocks[block] + offset * table->stride);
+}
+
+// Function finds room for a new entry, preferring one that was dropped, and allocating a new
+// block once the current ones are full.
+int claim_entry(hash_t *table, unsigned int *index) {
+  if (table->vacant >= 0) {
+    *index = table->vacant;
+    table->vacant = get_entry(table, *index)->hash;
+    return HASH_SUCCESS;
   }
+
+  unsigned int biased = table->entries + HASH_FIRST_BLOCK;
+  int block = 31 - __builtin_clz(biased) - __builtin_ctz(HASH_FIRST_BLOCK);
+  if (block >= HASH_MAX_BLOCKS) return HASH_NOMEM_ERROR;
+  if (!table->blocks[block]) {
+    table->blocks[block] = malloc(((size_t) HASH_FIRST_BLOCK << block) * table->stride);
+    if (!table->blocks[block]) return HASH_NOMEM_ERROR;
+  }
+  *index = table->entries++;
+  get_entry(table, *index)->capacity = 0;
+  return HASH_SUCCESS;
 }
 
-// Function handles removing a hash_node specified by key from a linked
-// list of nodes.
-hash_node_t *remove_hash_node(hash_node_t *head, char *key, void (*destruct) (void *)) {
-  // Validate parameters and search.
-  if (head && key && destruct) {
-    hash_node_t *prev = NULL;
-    for (hash_node_t *current = head; current; current = current->next) {
-      if (!strcmp(current->key, key)) {
-        // Found it.
-        if (prev) {
-          // Normal case.
-          hash_node_t *tmp = current->next;
-          destroy_hash_node(current, destruct);
-          prev->next = tmp;
-          return head;
-        } else {
-          // We need to remove the head.
-          destroy_hash_node(head, destruct);
-          return head->next;
-        }
-      }
-      prev = current;
+void release_entry(hash_t *table, unsigned int index) {
+  get_entry(table, index)->hash = table->vacant;
+  table->vacant = index;
+}
+
+// Function writes a key and its data into a claimed entry. A key that doesn't fit where the
+// entry keeps its keys gets a buffer at least twice the size of the old one, so an entry only
+// ever goes through a few of them. The old one is retired, as a reader could still be
+// comparing against it.
+int fill_entry(hash_t *table, hash_entry_t *entry, char *key, size_t len, unsigned long long hash, void *data) {
+  if (len >= (entry->capacity ? entry->capacity : HASH_INLINE_KEY)) {
+    unsigned int capacity = entry->capacity ? entry->capacity * 2 : HASH_MIN_KEY_BUFFER;
+    while (capacity <= len) capacity *= 2;
+    char *buffer = malloc(sizeof(char) * capacity);
+    if (!buffer) return HASH_NOMEM_ERROR;
+
+    if (entry->capacity) {
+      *(char **) entry->key = table->retired;
+      table->retired = entry->key;
     }
+    entry->key = buffer;
+    entry->capacity = capacity;
   }
-  return head;
+
+  entry->hash = hash;
+  entry->len = len;
+  memcpy(entry_key(entry), key, len + 1);
+  memcpy(entry + 1, data, table->elem_size);
+  return HASH_SUCCESS;
 }
 
-// Function handles the destruction of an entire linked list of hash_nodes.
-void destroy_hash_chain(hash_node_t *head, void (*destruct) (void *)) {
-  // Iterate across list and destroy each node we come to.
-  while (head) {
-    hash_node_t *tmp = head;
-    head = head->next;
-    destroy_hash_node(tmp, destruct);
+char *entry_key(hash_entry_t *entry) {
+  return entry->capacity ? entry->key : entry->inline_key;
+}
+
+/*---- Reader Functions ----*/
+
+// Function counts the calling thread as reading, and returns the counter to hand to end_read.
+// Each thread sticks to one stripe. If the phase flips between reading it and counting
+// ourselves in, whoever flipped it might have missed us, so we go again with the new one.
+volatile int *begin_read() {
+  static __thread int stripe = -1;
+  if (stripe < 0) stripe = __sync_fetch_and_add(&next_stripe, 1) % HASH_READER_STRIPES;
+
+  while (1) {
+    int phase = reader_phase;
+    volatile int *count = &readers[phase][stripe].count;
+    __sync_fetch_and_add(count, 1);
+    if (reader_phase == phase) return count;
+    __sync_fetch_and_sub(count, 1);
   }
 }
 
-// Function handles the destruction of a specific hash_node struct.
-void destroy_hash_node(hash_node_t *node, void (*destruct) (void *)) {
-  free(node->key);
-  if (destruct) destruct(node->data);
-  free(node->data);
-  free(node);
+void end_read(volatile int *count) {
+  __sync_fetch_and_sub(count, 1);
+}
+
+// Function waits until every read that was underway when it was called has finished, after
+// which nothing unpublished beforehand can still be in use.
+void wait_for_readers() {
+  pthread_mutex_lock(&phase_lock);
+  __sync_synchronize();
+  int phase = reader_phase;
+  reader_phase = !phase;
+  __sync_synchronize();
+  for (int i = 0; i < HASH_READER_STRIPES; i++) {
+    while (readers[phase][i].count) sched_yield();
+  }
+  pthread_mutex_unlock(&phase_lock);
+}
+
+// Function frees the slots and key buffers the table has stopped using, once readers are done
+// with them. Only happens on a rehash, which keeps the waiting rare. Expects the lock to be
+// held.
+void free_retired(hash_t *table) {
+  hash_slots_t *slots = table->slots->retired;
+  char *keys = table->retired;
+  table->slots->retired = NULL;
+  table->retired = NULL;
+  wait_for_readers();
+
+  while (slots) {
+    hash_slots_t *retired = slots->retired;
+    free(slots);
+    slots = retired;
+  }
+  while (keys) {
+    char *retired = *(char **) keys;
+    free(keys);
+    keys = retired;
+  }
 }
@@ -0,0 +1,236 @@
+/*----- System Includes -----*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <time.h>
+
+/*----- Local Includes -----*/
+
+#include "../src/structures/hash.h"
+#include "../src/xxhash/xxhash.h"
+
+/*----- Numerical Constants -----*/
+
+#define KEY_BUFFER 64
+#define DATA_BUFFER 256
+
+/*----- Type Declarations -----*/
+
+// The chained table hash_t used to be, kept here to measure against. Every entry is a node,
+// a key and a data allocation, and the key is hashed again on every operation.
+typedef struct chain_node {
+  char *key;
+  void *data;
+  struct chain_node *next;
+} chain_node_t;
+
+typedef struct chain {
+  chain_node_t **data;
+  int count, size, elem_size;
+  pthread_rwlock_t lock;
+} chain_t;
+
+/*----- Function Declarations -----*/
+
+chain_t *create_chain(int elem_size);
+int chain_put(chain_t *table, char *key, void *data);
+int chain_get(chain_t *table, char *key, void *buf);
+void chain_destroy(chain_t *table);
+void make_keys(char **keys, int count, int offset);
+size_t heap_used();
+double now();
+
+/*----- Function Implementations -----*/
+
+// Compares hash_t against the chained table it replaced. Both are filled with the same keys,
+// which look like file names, and then probed for every key in a shuffled order, and for as
+// many keys that aren't there. Memory is what the allocator has handed out for the table.
+int main(int argc, char **argv) {
+  int c, index, num_entries = 1000000, elem_size = 40;
+  struct option long_options[] = {
+    {"num-entries", required_argument, 0, 'n'},
+    {"elem-size", required_argument, 0, 'e'},
+    {0, 0, 0, 0}
+  };
+
+  // Get CLI options.
+  while ((c = getopt_long(argc, argv, "e:n:", long_options, &index)) != -1) {
+    switch (c) {
+      case 'e':
+        elem_size = atoi(optarg);
+        break;
+      case 'n':
+        num_entries = atoi(optarg);
+    }
+  }
+  assert(elem_size > (int) sizeof(int) && elem_size <= DATA_BUFFER);
+
+  // Make the keys, and shuffle a copy to look them up by.
+  char **keys = malloc(sizeof(char *) * num_entries), **lookups = malloc(sizeof(char *) * num_entries);
+  char **misses = malloc(sizeof(char *) * num_entries);
+  make_keys(keys, num_entries, 0);
+  make_keys(misses, num_entries, num_entries);
+  memcpy(lookups, keys, sizeof(char *) * num_entries);
+  unsigned int seed = 1;
+  for (int i = num_entries - 1; i > 0; i--) {
+    int j = rand_r(&seed) % (i + 1);
+    char *tmp = lookups[i];
+    lookups[i] = lookups[j];
+    lookups[j] = tmp;
+  }
+
+  char data[DATA_BUFFER], buf[DATA_BUFFER];
+  memset(data, 0, DATA_BUFFER);
+  for (int pass = 0; pass < 2; pass++) {
+    hash_t *hash = NULL;
+    chain_t *chain = NULL;
+
+    // Fill it.
+    size_t before = heap_used();
+    double start = now();
+    if (pass) chain = create_chain(elem_size);
+    else hash = create_hash(elem_size, NULL);
+    for (int i = 0; i < num_entries; i++) {
+      memcpy(data, &i, sizeof(int));
+      int retval = pass ? chain_put(chain, keys[i], data) : hash_put(hash, keys[i], data);
+      assert(retval == HASH_SUCCESS);
+    }
+    double insert_time = now() - start;
+    size_t memory = heap_used() - before;
+
+    // Find everything.
+    start = now();
+    for (int i = 0; i < num_entries; i++) {
+      int retval = pass ? chain_get(chain, lookups[i], buf) : hash_get(hash, lookups[i], buf);
+      assert(retval == HASH_SUCCESS);
+    }
+    double hit_time = now() - start;
+
+    // Find nothing.
+    start = now();
+    for (int i = 0; i < num_entries; i++) {
+      int retval = pass ? chain_get(chain, misses[i], buf) : hash_get(hash, misses[i], buf);
+      assert(retval == HASH_NOTFOUND_ERROR);
+    }
+    double miss_time = now() - start;
+
+    printf("%-8s %d entries: %7.1f MB, %5.1f bytes per entry, insert %6.1f ns, hit %6.1f ns, miss %6.1f ns\n",
+        pass ? "chained" : "hash_t", num_entries, memory / (double) (1 << 20), memory / (double) num_entries,
+        insert_time * 1e9 / num_entries, hit_time * 1e9 / num_entries, miss_time * 1e9 / num_entries);
+    if (pass) chain_destroy(chain);
+    else hash_destroy(hash);
+  }
+
+  // Cleanup and exit.
+  for (int i = 0; i < num_entries; i++) {
+    free(keys[i]);
+    free(misses[i]);
+  }
+  free(keys);
+  free(lookups);
+  free(misses);
+  return EXIT_SUCCESS;
+}
+
+chain_t *create_chain(int elem_size) {
+  chain_t *table = calloc(1, sizeof(chain_t));
+  table->size = 10;
+  table->elem_size = elem_size;
+  table->data = calloc(table->size, sizeof(chain_node_t *));
+  pthread_rwlock_init(&table->lock, NULL);
+  return table;
+}
+
+int chain_put(chain_t *table, char *key, void *data) {
+  pthread_rwlock_wrlock(&table->lock);
+
+  // Double in size past 80% full, rehashing every key.
+  if (table->count / (float) table->size > 0.8) {
+    chain_node_t **data = calloc(table->size * 2, sizeof(chain_node_t *));
+    for (int i = 0; i < table->size; i++) {
+      for (chain_node_t *node = table->data[i], *next; node; node = next) {
+        next = node->next;
+        unsigned int hash = (unsigned int) XXH64(node->key, strlen(node->key), 0) % (table->size * 2);
+        node->next = data[hash];
+        data[hash] = node;
+      }
+    }
+    free(table->data);
+    table->data = data;
+    table->size *= 2;
+  }
+
+  unsigned int hash = (unsigned int) XXH64(key, strlen(key), 0) % table->size;
+  for (chain_node_t *node = table->data[hash]; node; node = node->next) {
+    if (!strcmp(node->key, key)) {
+      pthread_rwlock_unlock(&table->lock);
+      return HASH_EXISTS_ERROR;
+    }
+  }
+
+  chain_node_t *node = malloc(sizeof(chain_node_t));
+  node->key = malloc(strlen(key) + 1);
+  node->data = malloc(table->elem_size);
+  strcpy(node->key, key);
+  memcpy(node->data, data, table->elem_size);
+  node->next = table->data[hash];
+  table->data[hash] = node;
+  table->count++;
+  pthread_rwlock_unlock(&table->lock);
+  return HASH_SUCCESS;
+}
+
+int chain_get(chain_t *table, char *key, void *buf) {
+  pthread_rwlock_rdlock(&table->lock);
+  unsigned int hash = (unsigned int) XXH64(key, strlen(key), 0) % table->size;
+  for (chain_node_t *node = table->data[hash]; node; node = node->next) {
+    if (!strcmp(node->key, key)) {
+      memcpy(buf, node->data, table->elem_size);
+      pthread_rwlock_unlock(&table->lock);
+      return HASH_SUCCESS;
+    }
+  }
+  pthread_rwlock_unlock(&table->lock);
+  return HASH_NOTFOUND_ERROR;
+}
+
+void chain_destroy(chain_t *table) {
+  for (int i = 0; i < table->size; i++) {
+    for (chain_node_t *node = table->data[i], *next; node; node = next) {
+      next = node->next;
+      free(node->key);
+      free(node->data);
+      free(node);
+    }
+  }
+  free(table->data);
+  pthread_rwlock_destroy(&table->lock);
+  free(table);
+}
+
+// Function makes keys shaped like the names in a directory. Most of them are short enough to
+// be kept inline, but some aren't.
+void make_keys(char **keys, int count, int offset) {
+  for (int i = 0; i < count; i++) {
+    keys[i] = malloc(sizeof(char) * KEY_BUFFER);
+    if ((i + offset) % 8) sprintf(keys[i], "IMG_%08d.jpg", i + offset);
+    else sprintf(keys[i], "export-%08d-final-revision.tar.gz", i + offset);
+  }
+}
+
+// Big tables are mapped rather than carved out of the heap, so both have to be counted.
+size_t heap_used() {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
@@ -1,16 +1,24 @@
 /*----- System Includes -----*/
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <getopt.h>
 #include <math.h>
 #include <pthread.h>
+#include <time.h>
 
 /*----- Local Includes -----*/
 
 #include "../src/structures/hash.h"
 
+/*----- Numerical Constants -----*/
+
+#define KEY_BUFFER 64
+#define BENCH_KEYS (1 << 16)
+#define BENCH_WRITER_KEYS 64
+
 /*----- Type Declarations -----*/
 
 typedef struct voidargs {
@@ -20,6 +28,13 @@ typedef struct voidargs {
   unsigned int seed;
 } voidargs_t;
 
+typedef struct readargs {
+  hash_t *hash;
+  int num_keys, num_ops, writer, write_percent;
+  volatile int *stop;
+  unsigned int seed;
+} readargs_t;
+
 /*----- Globals -----*/
 
 int insertion_count = 0;
@@ -29,21 +44,42 @@ char alpha[] = {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h','i', 'j', 'k', 'l', 'm',
 
 void *perform_insertions(void *voidargs);
 void destroy_and_decrement(void *voidarg);
+void check_churn(int num_keys);
+void check_readers(int num_keys, int num_threads);
+void *perform_lookups(void *voidargs);
+void *perform_churn(void *voidargs);
+void benchmark(int max_threads, int num_ops, int write_percent);
+void *perform_mixed(void *voidargs);
+void make_key(char *buf, int i);
+double now();
 
 /*----- Function Implementations -----*/
 
 int main(int argc, char **argv) {
   int c, index, num_threads = 4, num_insertions = 1024, strlen = 10;
+  int bench_threads = 0, bench_ops = 1000000, write_percent = 1;
   struct option long_options[] = {
+    {"bench-threads", required_argument, 0, 'b'},
     {"num-insertions", required_argument, 0, 'n'},
+    {"bench-ops", required_argument, 0, 'o'},
     {"string-length", required_argument, 0, 's'},
     {"num-threads", required_argument, 0, 't'},
+    {"write-percent", required_argument, 0, 'w'},
     {0, 0, 0, 0}
   };
 
   // Get CLI options.
-  while ((c = getopt_long(argc, argv, "n:s:t:", long_options, &index)) != -1) {
+  while ((c = getopt_long(argc, argv, "b:n:o:s:t:w:", long_options, &index)) != -1) {
     switch (c) {
+      case 'b':
+        bench_threads = atoi(optarg);
+        break;
+      case 'o':
+        bench_ops = atoi(optarg);
+        break;
+      case 'w':
+        write_percent = atoi(optarg);
+        break;
       case 'n':
         num_insertions = atoi(optarg);
         break;
@@ -86,6 +122,15 @@ int main(int argc, char **argv) {
   hash_destroy(hash);
   assert(!insertion_count);
 
+  // Reused slots and long keys.
+  check_churn(num_insertions * num_threads);
+
+  // Lookups racing with drops and rehashes.
+  check_readers(num_insertions * num_threads, num_threads);
+
+  // Throughput against thread count, if asked for.
+  if (bench_threads > 0) benchmark(bench_threads, bench_ops, write_percent);
+
   // Hash works. Clean up and return.
   for (int i = 0; i < num_threads; i++) free(thread_keys[i]);
   free(thread_keys);
@@ -127,3 +172,166 @@ void destroy_and_decrement(void *voidarg) {
   (void) voidarg;
   __sync_fetch_and_sub(&insertion_count, 1);
 }
+
+// Function drops and reinserts half of a table a few times over, mixing keys short enough to
+// be stored inline with ones that aren't, so that deleted slots get reused and the table gets
+// rebuilt along the way.
+void check_churn(int num_keys) {
+  char key[KEY_BUFFER];
+  hash_t *hash = create_hash(sizeof(int), NULL);
+
+  for (int i = 0; i < num_keys; i++) {
+    make_key(key, i);
+    assert(hash_put(hash, key, &i) == HASH_SUCCESS);
+    assert(hash_put(hash, key, &i) == HASH_EXISTS_ERROR);
+  }
+  for (int round = 0; round < 4; round++) {
+    for (int i = round % 2; i < num_keys; i += 2) {
+      make_key(key, i);
+      assert(hash_drop(hash, key) == HASH_SUCCESS);
+      assert(hash_drop(hash, key) == HASH_NOTFOUND_ERROR);
+    }
+    assert(hash_count(hash) == num_keys - (num_keys + 1 - round % 2) / 2);
+    for (int i = round % 2; i < num_keys; i += 2) {
+      make_key(key, i);
+      assert(hash_put(hash, key, &i) == HASH_SUCCESS);
+    }
+  }
+
+  // Every key should be there exactly once, with its own value.
+  int count, value;
+  char **keys = hash_keys(hash, &count);
+  assert(count == num_keys);
+  for (int i = 0; i < count; i++) {
+    assert(hash_get(hash, keys[i], &value) == HASH_SUCCESS);
+    make_key(key, value);
+    assert(!strcmp(key, keys[i]));
+    assert(hash_drop(hash, keys[i]) == HASH_SUCCESS);
+  }
+  assert(!hash_count(hash));
+  free(keys);
+  hash_destroy(hash);
+}
+
+// Function has readers look up a set of keys that never changes while a writer keeps dropping
+// and putting back another set, growing the table a few times over along the way. Readers have
+// to find every stable key, and whatever they find for the others has to be its own value.
+void check_readers(int num_keys, int num_threads) {
+  char key[KEY_BUFFER];
+  volatile int stop = 0;
+  hash_t *hash = create_hash(sizeof(int), NULL);
+  readargs_t *args = malloc(sizeof(readargs_t) * (num_threads + 1));
+  pthread_t *threads = malloc(sizeof(pthread_t) * (num_threads + 1));
+
+  for (int i = 0; i < num_keys; i += 2) {
+    make_key(key, i);
+    assert(hash_put(hash, key, &i) == HASH_SUCCESS);
+  }
+  for (int i = 0; i <= num_threads; i++) {
+    args[i] = (readargs_t) {hash, num_keys, 0, i == num_threads, 0, &stop, rand()};
+    pthread_create(&threads[i], NULL, i == num_threads ? perform_churn : perform_lookups, &args[i]);
+  }
+
+  // The writer stops everyone once it's done.
+  for (int i = num_threads; i >= 0; i--) pthread_join(threads[i], NULL);
+  hash_destroy(hash);
+  free(args);
+  free(threads);
+}
+
+void *perform_lookups(void *voidargs) {
+  readargs_t *args = voidargs;
+  char key[KEY_BUFFER];
+  unsigned int seed = args->seed;
+
+  while (!*args->stop) {
+    int i = rand_r(&seed) % args->num_keys, value;
+    make_key(key, i);
+    int retval = hash_get(args->hash, key, &value);
+    if (i % 2 == 0) assert(retval == HASH_SUCCESS);
+    assert(retval == HASH_NOTFOUND_ERROR || value == i);
+  }
+  return NULL;
+}
+
+void *perform_churn(void *voidargs) {
+  readargs_t *args = voidargs;
+  char key[KEY_BUFFER];
+
+  for (int round = 0; round < 8; round++) {
+    for (int i = 1; i < args->num_keys; i += 2) {
+      make_key(key, i);
+      assert(hash_put(args->hash, key, &i) == HASH_SUCCESS);
+    }
+    for (int i = 1; i < args->num_keys; i += 2) {
+      make_key(key, i);
+      assert(hash_drop(args->hash, key) == HASH_SUCCESS);
+    }
+  }
+  *args->stop = 1;
+  return NULL;
+}
+
+// Function measures lookups per second against the number of threads doing them, doubling up
+// to max_threads. A write_percent share of operations instead drop and put back a key owned by
+// the thread doing them.
+void benchmark(int max_threads, int num_ops, int write_percent) {
+  char key[KEY_BUFFER];
+  hash_t *hash = create_hash(sizeof(int), NULL);
+  readargs_t *args = malloc(sizeof(readargs_t) * max_threads);
+  pthread_t *threads = malloc(sizeof(pthread_t) * max_threads);
+
+  // Every thread gets its own keys to write, after the ones everybody reads.
+  for (int i = 0; i < BENCH_KEYS + max_threads * BENCH_WRITER_KEYS; i++) {
+    make_key(key, i);
+    assert(hash_put(hash, key, &i) == HASH_SUCCESS);
+  }
+
+  printf("threads %14s %14s\n", "ops/sec", "per thread");
+  for (int num_threads = 1; num_threads; num_threads = num_threads < max_threads ? (num_threads * 2 < max_threads ? num_threads * 2 : max_threads) : 0) {
+    double start = now();
+    for (int i = 0; i < num_threads; i++) {
+      args[i] = (readargs_t) {hash, BENCH_KEYS, num_ops, i, write_percent, NULL, rand()};
+      pthread_create(&threads[i], NULL, perform_mixed, &args[i]);
+    }
+    for (int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+    double rate = num_ops * (double) num_threads / (now() - start);
+    printf("%7d %14.0f %14.0f\n", num_threads, rate, rate / num_threads);
+  }
+
+  hash_destroy(hash);
+  free(args);
+  free(threads);
+}
+
+void *perform_mixed(void *voidargs) {
+  readargs_t *args = voidargs;
+  char key[KEY_BUFFER];
+  unsigned int seed = args->seed;
+
+  for (int i = 0; i < args->num_ops; i++) {
+    int value;
+    if ((int) (rand_r(&seed) % 100) < args->write_percent) {
+      int owned = args->num_keys + args->writer * BENCH_WRITER_KEYS + i % BENCH_WRITER_KEYS;
+      make_key(key, owned);
+      assert(hash_drop(args->hash, key) == HASH_SUCCESS);
+      assert(hash_put(args->hash, key, &owned) == HASH_SUCCESS);
+    } else {
+      int j = rand_r(&seed) % args->num_keys;
+      make_key(key, j);
+      assert(hash_get(args->hash, key, &value) == HASH_SUCCESS && value == j);
+    }
+  }
+  return NULL;
+}
+
+void make_key(char *buf, int i) {
+  if (i % 3) sprintf(buf, "short-%d", i);
+  else sprintf(buf, "a-key-long-enough-to-need-its-own-allocation-%d", i);
+}
+
+double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
@@ -0,0 +1,250 @@
+/*----- System Includes -----*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <getopt.h>
+#include <time.h>
+
+/*----- Local Includes -----*/
+
+#include "../src/jsmn/jsmn.h"
+#include "../src/listing/listing.h"
+
+/*----- Numerical Constants -----*/
+
+#define PAGE_BUFFER (1 << 20)
+#define RECORD_TOKENS 64
+
+/*----- Type Declaractions -----*/
+
+typedef struct page {
+  char *json;
+  size_t len, *starts, *lens;
+  int count;
+} page_t;
+
+/*----- Function Declarations -----*/
+
+void make_page(page_t *page, int entries);
+int load_page(page_t *page, const char *path);
+void split_page(page_t *page);
+int jsmn_extract(const char *json, size_t len, listing_record_t *record);
+int jsmn_iskey(const char *json, jsmntok_t *tok, const char *s);
+double now();
+
+/*----- Function Implementations -----*/
+
+// Checks that extract_listing_record agrees with jsmn on every record of a b2_list_file_versions
+// page, and then times the two against each other. Without a recorded page, a synthetic one
+// shaped like B2's is used.
+int main(int argc, char **argv) {
+  int c, index, entries = 1000, iterations = 200;
+  char *path = NULL;
+  page_t page;
+  struct option long_options[] = {
+    {"entries", required_argument, 0, 'n'},
+    {"iterations", required_argument, 0, 'i'},
+    {"page", required_argument, 0, 'f'},
+    {0, 0, 0, 0}
+  };
+
+  // Get CLI options.
+  while ((c = getopt_long(argc, argv, "f:i:n:", long_options, &index)) != -1) {
+    switch (c) {
+      case 'f':
+        path = optarg;
+        break;
+      case 'i':
+        iterations = atoi(optarg);
+        break;
+      case 'n':
+        entries = atoi(optarg);
+    }
+  }
+
+  // Get a page, and find where each of its records are.
+  memset(&page, 0, sizeof(page_t));
+  if (path) assert(load_page(&page, path) == 0);
+  else make_page(&page, entries);
+  split_page(&page);
+  assert(page.count > 0);
+
+  // Both extractors have to agree on every record.
+  for (int i = 0; i < page.count; i++) {
+    listing_record_t fast, slow;
+    const char *json = page.json + page.starts[i];
+    assert(extract_listing_record(json, page.lens[i], &fast) == LISTING_SUCCESS);
+    assert(jsmn_extract(json, page.lens[i], &slow) == LISTING_SUCCESS);
+    assert(fast.file_name_len == slow.file_name_len && !memcmp(fast.file_name, slow.file_name, fast.file_name_len));
+    assert(fast.file_id_len == slow.file_id_len && !memcmp(fast.file_id, slow.file_id, fast.file_id_len));
+    assert(fast.action_len == slow.action_len && !memcmp(fast.action, slow.action, fast.action_len));
+    assert(fast.content_sha1_len == slow.content_sha1_len);
+    assert(!memcmp(fast.content_sha1, slow.content_sha1, fast.content_sha1_len));
+    assert(fast.size == slow.size);
+    assert(fast.upload_timestamp == slow.upload_timestamp);
+  }
+
+  // Truncated records have to be rejected, not read past.
+  for (size_t i = 0; i < page.lens[0]; i++) {
+    listing_record_t record;
+    assert(extract_listing_record(page.json + page.starts[0], i, &record) == LISTING_INVALID_ERROR);
+  }
+
+  // Time them.
+  double start = now();
+  for (int i = 0; i < iterations; i++) {
+    for (int j = 0; j < page.count; j++) {
+      listing_record_t record;
+      jsmn_extract(page.json + page.starts[j], page.lens[j], &record);
+    }
+  }
+  double slow_time = now() - start;
+  start = now();
+  for (int i = 0; i < iterations; i++) {
+    for (int j = 0; j < page.count; j++) {
+      listing_record_t record;
+      extract_listing_record(page.json + page.starts[j], page.lens[j], &record);
+    }
+  }
+  double fast_time = now() - start;
+
+  double megabytes = page.len * (double) iterations / (1 << 20);
+  printf("%d records, %zu bytes per page, %d pages.\n", page.count, page.len, iterations);
+  printf("jsmn:      %8.3f ms, %8.1f MB/s\n", slow_time * 1000, megabytes / slow_time);
+  printf("extractor: %8.3f ms, %8.1f MB/s\n", fast_time * 1000, megabytes / fast_time);
+
+  // Cleanup and exit.
+  free(page.json);
+  free(page.starts);
+  free(page.lens);
+  return EXIT_SUCCESS;
+}
+
+// Function builds a page the way B2 lays them out, with a mix of uploads and hide markers, and
+// some fileInfo to skip over.
+void make_page(page_t *page, int entries) {
+  page->json = malloc(sizeof(char) * PAGE_BUFFER);
+  assert(page->json);
+
+  size_t len = sprintf(page->json, "{\n  \"files\": [\n");
+  for (int i = 0; i < entries; i++) {
+    int hide = i % 7 == 3;
+    assert(len + 1024 < PAGE_BUFFER);
+    len += sprintf(page->json + len,
+        "    {\n"
+        "      \"accountId\": \"a30f20426f0b\",\n"
+        "      \"action\": \"%s\",\n"
+        "      \"bucketId\": \"4a48fe8875c6214145260818\",\n"
+        "      \"contentLength\": %d,\n"
+        "      \"contentSha1\": \"%s\",\n"
+        "      \"contentType\": \"%s\",\n"
+        "      \"fileId\": \"4_z4a48fe8875c6214145260818_f1%011d_d20161205_m2130%05d_c001_v0001037_t%04d\",\n"
+        "      \"fileInfo\": {%s},\n"
+        "      \"fileName\": \"photos/2016/12/\\\"album %d\\\"/IMG_%05d.jpg\",\n"
+        "      \"size\": %d,\n"
+        "      \"uploadTimestamp\": %lld\n"
+        "    }%s\n",
+        hide ? "hide" : "upload", hide ? 0 : i * 37 + 11,
+        hide ? "none" : "2ae6ad45b5bb3e0dfb13c5b3ab2de50a0e2c6c2a",
+        hide ? "application/x-bzempty" : "image/jpeg", i, i, i % 10000,
+        hide ? "" : "\"src_last_modified_millis\": \"1480972800000\", \"tags\": \"{[x]}\"",
+        i / 50, i, hide ? 0 : i * 37 + 11, 1480972800000LL + i, i + 1 < entries ? "," : "");
+  }
+  len += sprintf(page->json + len,
+      "  ],\n  \"nextFileId\": \"4_z4a48fe8875c6214145260818_f100000000000_d20161205_m213000000_c001_v0001037_t0000\",\n"
+      "  \"nextFileName\": \"photos/2016/12/zzz.jpg\"\n}\n");
+  page->len = len;
+}
+
+int load_page(page_t *page, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) return -1;
+
+  page->json = malloc(sizeof(char) * PAGE_BUFFER);
+  assert(page->json);
+  page->len = fread(page->json, sizeof(char), PAGE_BUFFER - 1, file);
+  page->json[page->len] = '\0';
+  fclose(file);
+  return 0;
+}
+
+// Function finds every object inside the files array, the same way b2fs cuts them out of a
+// listing as it arrives.
+void split_page(page_t *page) {
+  int depth = 0, in_string = 0, escaped = 0, capacity = 16;
+  page->starts = malloc(sizeof(size_t) * capacity);
+  page->lens = malloc(sizeof(size_t) * capacity);
+  assert(page->starts && page->lens);
+
+  for (size_t i = 0; i < page->len; i++) {
+    char c = page->json[i];
+    if (escaped) escaped = 0;
+    else if (in_string && c == '\\') escaped = 1;
+    else if (c == '"') in_string = !in_string;
+    else if (!in_string && (c == '{' || c == '[')) {
+      if (++depth == 3) page->starts[page->count] = i;
+    } else if (!in_string && (c == '}' || c == ']')) {
+      if (depth-- == 3) {
+        page->lens[page->count] = i + 1 - page->starts[page->count];
+        if (++page->count == capacity) {
+          capacity *= 2;
+          page->starts = realloc(page->starts, sizeof(size_t) * capacity);
+          page->lens = realloc(page->lens, sizeof(size_t) * capacity);
+          assert(page->starts && page->lens);
+        }
+      }
+    }
+  }
+}
+
+// Function does what b2fs used to do for each record. Tokenize all of it, then compare each
+// top level key against every field we want.
+int jsmn_extract(const char *json, size_t len, listing_record_t *record) {
+  jsmntok_t tokens[RECORD_TOKENS];
+  jsmn_parser parser;
+  memset(record, 0, sizeof(listing_record_t));
+
+  jsmn_init(&parser);
+  int token_count = jsmn_parse(&parser, json, len, tokens, RECORD_TOKENS);
+  if (token_count < 1 || tokens[0].type != JSMN_OBJECT) return LISTING_INVALID_ERROR;
+
+  for (int i = 1; i < token_count - 1; i++) {
+    jsmntok_t *key = &tokens[i], *value = &tokens[i + 1];
+    size_t value_len = value->end - value->start;
+    if (key->parent != 0 || key->type != JSMN_STRING) continue;
+
+    if (jsmn_iskey(json, key, "fileName")) {
+      record->file_name = json + value->start;
+      record->file_name_len = value_len;
+    } else if (jsmn_iskey(json, key, "size")) {
+      record->size = strtol(json + value->start, NULL, 10);
+    } else if (jsmn_iskey(json, key, "uploadTimestamp")) {
+      record->upload_timestamp = strtoll(json + value->start, NULL, 10);
+    } else if (jsmn_iskey(json, key, "fileId")) {
+      record->file_id = json + value->start;
+      record->file_id_len = value_len;
+    } else if (jsmn_iskey(json, key, "contentSha1")) {
+      record->content_sha1 = json + value->start;
+      record->content_sha1_len = value_len;
+    } else if (jsmn_iskey(json, key, "action")) {
+      record->action = json + value->start;
+      record->action_len = value_len;
+    }
+  }
+  return LISTING_SUCCESS;
+}
+
+int jsmn_iskey(const char *json, jsmntok_t *tok, const char *s) {
+  if (tok->type == JSMN_STRING && (int) strlen(s) == tok->end - tok->start && !strncmp(json + tok->start, s, tok->end - tok->start)) {
+    return 1;
+  }
+  return 0;
+}
+
+double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
@@ -0,0 +1,123 @@
+/*----- System Includes -----*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <time.h>
+
+/*----- Local Includes -----*/
+
+#include "../src/sha1/sha1.h"
+
+/*----- Type Declarations -----*/
+
+typedef struct test_vector {
+  char *input, *digest;
+} test_vector_t;
+
+/*----- Globals -----*/
+
+// Vectors from FIPS 180-1 plus a couple of padding edge cases.
+test_vector_t vectors[] = {
+  {"", "da39a3ee5e6b4b0d3255bfef95601890afd80709"},
+  {"abc", "a9993e364706816aba3e25717850c26c9cd0d89d"},
+  {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", "84983e441c3bd26ebaae4aa1f95129e5e54670f1"},
+  {"The quick brown fox jumps over the lazy dog", "2fd4e1c67a2d28fced849ee1bb76e7391b93eb12"}
+};
+
+/*----- Function Declarations -----*/
+
+void check_vectors(int max_piece);
+void run_benchmark(sha1_impl_t impl, size_t megabytes);
+void digest_in_pieces(const char *data, size_t len, size_t piece, char *hex);
+
+/*----- Function Implementations -----*/
+
+int main(int argc, char **argv) {
+  int c, index, max_piece = 67, bench = 0;
+  struct option long_options[] = {
+    {"bench", required_argument, 0, 'b'},
+    {"max-piece", required_argument, 0, 'p'},
+    {0, 0, 0, 0}
+  };
+
+  // Get CLI options.
+  while ((c = getopt_long(argc, argv, "b:p:", long_options, &index)) != -1) {
+    switch (c) {
+      case 'b':
+        bench = atoi(optarg);
+        break;
+      case 'p':
+        max_piece = atoi(optarg);
+    }
+  }
+
+  // Every implementation this CPU can run has to agree with the vectors.
+  sha1_impl_t picked = sha1_selected();
+  for (int impl = 0; impl < SHA1_IMPL_COUNT; impl++) {
+    if (!sha1_supported(impl)) {
+      assert(sha1_select(impl) == -1);
+      continue;
+    }
+    assert(!sha1_select(impl));
+    check_vectors(max_piece);
+    if (bench) run_benchmark(impl, bench);
+  }
+  assert(!sha1_select(picked));
+
+  return EXIT_SUCCESS;
+}
+
+void check_vectors(int max_piece) {
+  // Check the known vectors, fed in every piece size, so block boundaries get exercised.
+  char hex[SHA1_HEX_LEN];
+  for (unsigned int i = 0; i < sizeof(vectors) / sizeof(test_vector_t); i++) {
+    for (int piece = 1; piece <= max_piece; piece++) {
+      digest_in_pieces(vectors[i].input, strlen(vectors[i].input), piece, hex);
+      assert(!strcmp(hex, vectors[i].digest));
+    }
+  }
+
+  // One million repetitions of 'a'.
+  char *million = malloc(sizeof(char) * 1000000);
+  memset(million, 'a', 1000000);
+  digest_in_pieces(million, 1000000, 4096, hex);
+  assert(!strcmp(hex, "34aa973cd4c4daa4f61eeb2bdbad27316534016f"));
+  digest_in_pieces(million, 1000000, 1000000, hex);
+  assert(!strcmp(hex, "34aa973cd4c4daa4f61eeb2bdbad27316534016f"));
+  free(million);
+}
+
+// Function hashes megabytes of data in 4MB pieces, the way uploads do, and reports GB/s.
+void run_benchmark(sha1_impl_t impl, size_t megabytes) {
+  size_t piece = 1024 * 1024 * 4, len = megabytes * 1024 * 1024;
+  char hex[SHA1_HEX_LEN], *data = malloc(sizeof(char) * piece);
+  struct timespec start, end;
+
+  for (size_t i = 0; i < piece; i++) data[i] = i * 2654435761U >> 24;
+
+  sha1_state_t state;
+  unsigned char digest[SHA1_DIGEST_LEN];
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  sha1_init(&state);
+  for (size_t pos = 0; pos < len; pos += piece) sha1_update(&state, data, len - pos < piece ? len - pos : piece);
+  sha1_final(&state, digest);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  sha1_hex(digest, hex);
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%-8s %6zu MB in %7.3fs: %6.2f GB/s (%s)\n", sha1_impl_name(impl), megabytes, seconds, len / seconds / 1e9, hex);
+  free(data);
+}
+
+void digest_in_pieces(const char *data, size_t len, size_t piece, char *hex) {
+  sha1_state_t state;
+  unsigned char digest[SHA1_DIGEST_LEN];
+
+  sha1_init(&state);
+  for (size_t pos = 0; pos < len; pos += piece) sha1_update(&state, data + pos, len - pos < piece ? len - pos : piece);
+  sha1_final(&state, digest);
+  sha1_hex(digest, hex);
+}